@@ -60,6 +60,7 @@ main (int argc, char *argv[])
 	double period_error;
 	long double offset;
 	double offset_error;
+	double error_bound;
 
 	/* Time data structure */
 	long double currtime;
@@ -68,6 +69,9 @@ main (int argc, char *argv[])
 	/* Raw vcounter timestamps */
 	vcounter_t vcount1, vcount2, vcount3;   //
 
+	/* Clock snapshot */
+	struct radclock_snapshot snap;
+
 	int j;
 	int err = 0;
 
@@ -232,6 +236,26 @@ main (int argc, char *argv[])
 	err = radclock_duration(clock, &vcount1, &vcount2, &currtime);
 	printf(" - radclock_duration says we have been sleeping for %12.20Lf [ms]\n", 1000*currtime);
 
+
+	/* radclock_snapshot
+	 *   - one counter read and one copy of the clock data, then the time, an
+	 *     interval, the quality and the error bound are computed from the copy
+	 */
+	printf("----------------------------------------------------------------\n");
+	err = radclock_snapshot(clock, &snap);
+	if (err)
+		printf("Could not take a snapshot of the clock\n");
+	else {
+		err = radclock_snapshot_abstime(&snap, NULL, &currtime);
+		printf("Snapshot at vcount %llu: %12.20Lf (quality %d)\n",
+				(long long unsigned)snap.vcount, currtime, err);
+		radclock_snapshot_duration(&snap, &vcount1, &vcount2, &currtime);
+		printf(" - same 200 ms interval from the snapshot: %12.20Lf [ms]\n",
+				1000*currtime);
+		if (radclock_snapshot_error_bound(&snap, NULL, &error_bound) == 0)
+			printf(" - error bound at snapshot: %12.9g [s]\n", error_bound);
+	}
+
 	return (0);
 }
 
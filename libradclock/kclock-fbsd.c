@@ -98,6 +98,12 @@ init_kernel_clock(struct radclock *clock)
 }
 
 
+void
+close_kernel_clock(struct radclock *clock)
+{
+}
+
+
 /* Error code:  err = 1    was called for wrong kernel
  *                   -1    failed to recover FFdata
  *                    0    success
@@ -167,6 +173,20 @@ set_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
 //#endif
 
 
+/* Set the FFdata then read back the kernel's, kcdat may point to cdat */
+int
+setget_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat,
+		struct ffclock_data *kcdat)
+{
+	int err;
+
+	err = set_kernel_ffclock(clock, cdat);
+	if (err)
+		return (err);
+	return (get_kernel_ffclock(clock, kcdat));
+}
+
+
 /* XXX Deprecated
  * Old kernel patches for feed-forward support versions 0 and 1.
  * Used to add more IOCTL to the BPF device. The actual IOCTL number depends on
@@ -30,6 +30,8 @@
 #include <asm/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 
@@ -38,6 +40,7 @@
 
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -78,41 +81,6 @@ static struct nla_policy radclock_attr_policy[RADCLOCK_ATTR_MAX+1] = {
 };
 
 
-/* Obtain and record the genl ID of the FFclock protocol family */
-int
-init_kernel_clock(struct radclock *clock)
-{
-	struct nl_sock *sk;
-	int id;
-
-	/* Ask the kernel for the numerical id of the RADclock protocol family */
-	sk = nl_socket_alloc();		// allocate a new netlink socket for the request
-	if (sk) {
-		genl_connect(sk);			// just calls:  nl_connect(sk, NETLINK_GENERIC);
-		id = genl_ctrl_resolve(sk, FFCLOCK_NAME);
-		nl_socket_free(sk);		// this also closes the socket
-	} else {
-		logger(RADLOG_ERR, "Cannot allocate netlink socket\n");
-		return (1);
-	}
-
-	if (id < 0) {
-		logger(RADLOG_ERR, "Couldn't get the FFclock netlink ID:  %s", nl_geterror(id));
-		return (1);
-	}
-
-	logger(RADLOG_NOTICE, "FFclock netlink is up, with genl ID = %d", id);
-//	logger(RADLOG_NOTICE, "RADCLOCK_ATTR_DATA (%d) set to size %d (actual is %d)",
-//									RADCLOCK_ATTR_DATA,
-//									radclock_attr_policy[RADCLOCK_ATTR_DATA].minlen,
-//									sizeof(struct ffclock_data));
-	PRIV_DATA(clock)->radclock_gnl_id = id;
-
-	return (0);
-}
-
-
-
 /* Workhorse fn for radclock_gnl_get_attr handling attributes.
  * Extracts and checks all attributes for a single nl message.
  * There is no request for a particular attribute, one simply picks up all available.
@@ -183,7 +151,8 @@ radclock_gnl_receive(int id, struct nlmsghdr *h, int attrib_id, void *into)
 }
 
 
-/* Construct and send a netlink message pulling data from the kernel
+/* Construct and send a netlink message pulling data from the kernel, on a
+ * socket of its own. Used when there is no persistent channel.
  * All available atribute data will be accessed, but only attribute attrib_id is sought.
  */
 static int radclock_gnl_get_attr(int radclock_gnl_id, int attrib_id, void *into)
@@ -319,7 +288,7 @@ radclock_gnl_set_attr(int radclock_gnl_id, int attrib_id, void *data)
 //	nl_msg_dump(msg,fd);		// Dump message in human readable format
 
 	/* Complete and send the message, wait for ACK */
-	if (ret = nl_send_auto(sk, msg) < 0) {
+	if ((ret = nl_send_auto(sk, msg)) < 0) {
 		logger(RADLOG_ERR, "Error sending to generic netlink socket, ret = %d (%s)",
 								ret, nl_geterror(-ret));
 		goto close_errout;
@@ -341,6 +310,319 @@ errout:
 }
 
 
+/* Persistent generic netlink channel to the FFclock family.
+ * The socket is connected once, and the GETATTR and SETATTR requests are built
+ * once and resent with a fresh sequence number, the SETATTR payload being
+ * rewritten in place. Replies are read into a reusable buffer and matched on
+ * sequence number, anything else (eg late replies to an exchange that timed
+ * out) is dropped. A set and a get can share a single datagram, the kernel
+ * processes them in order and answers with an ACK then the attribute reply.
+ * The channel may be used by several threads of the daemon, hence the lock.
+ */
+#define GNL_RBUF_SIZE	8192
+#define GNL_RCVTIMEO	1		// [s] before declaring a reply lost
+
+struct radclock_gnl {
+	pthread_mutex_t lock;
+	struct nl_sock *sk;
+	struct sockaddr_nl peer;			// the kernel
+	int fd;
+	int id;								// genl ID of the FFclock family
+	struct nl_msg *get_msg;
+	struct nl_msg *set_msg[RADCLOCK_ATTR_MAX+1];
+	void *set_payload[RADCLOCK_ATTR_MAX+1];
+	size_t set_len[RADCLOCK_ATTR_MAX+1];
+	unsigned char *rbuf;
+};
+
+
+static struct nl_msg *
+gnl_build_msg(int id, int flags, uint8_t cmd)
+{
+	struct nl_msg *msg;
+	struct genlmsghdr generic_header = {
+		.cmd = cmd,
+		.version = 0,
+		.reserved = 0,
+	};
+
+	msg = nlmsg_alloc_simple(id, flags);
+	if (!msg)
+		return (NULL);
+	if (nlmsg_append(msg, &generic_header, GENL_HDRLEN, 0) < 0) {
+		nlmsg_free(msg);
+		return (NULL);
+	}
+	return (msg);
+}
+
+
+/* Drop the socket and messages, keeping the channel itself */
+static void
+gnl_disconnect(struct radclock_gnl *gnl)
+{
+	int i;
+
+	for (i = 0; i <= RADCLOCK_ATTR_MAX; i++) {
+		if (gnl->set_msg[i])
+			nlmsg_free(gnl->set_msg[i]);
+		gnl->set_msg[i] = NULL;
+	}
+	if (gnl->get_msg)
+		nlmsg_free(gnl->get_msg);
+	gnl->get_msg = NULL;
+	if (gnl->sk)
+		nl_socket_free(gnl->sk);	// this also closes the socket
+	gnl->sk = NULL;
+}
+
+
+/* Connect, resolve the FFclock family and prebuild the request messages */
+static int
+gnl_connect(struct radclock_gnl *gnl)
+{
+	struct timeval tv;
+	struct nlattr *attr;
+	int attrib_id, err;
+
+	gnl->sk = nl_socket_alloc();
+	if (gnl->sk == NULL) {
+		logger(RADLOG_ERR, "Cannot allocate netlink socket");
+		return (1);
+	}
+	if ((err = nl_connect(gnl->sk, NETLINK_GENERIC)) < 0) {	// equivalent to genl_connect(sk);
+		logger(RADLOG_ERR, "Error connecting to generic netlink socket: %s",
+				nl_geterror(err));
+		goto errout;
+	}
+	gnl->fd = nl_socket_get_fd(gnl->sk);
+
+	/* Ask the kernel for the numerical id of the RADclock protocol family */
+	gnl->id = genl_ctrl_resolve(gnl->sk, FFCLOCK_NAME);
+	if (gnl->id < 0) {
+		logger(RADLOG_ERR, "Couldn't get the FFclock netlink ID:  %s",
+				nl_geterror(gnl->id));
+		goto errout;
+	}
+
+	/* Don't block forever if a reply never comes */
+	tv.tv_sec = GNL_RCVTIMEO;
+	tv.tv_usec = 0;
+	setsockopt(gnl->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* GETATTR needs no ACK, the reply or an error is the answer */
+	gnl->get_msg = gnl_build_msg(gnl->id, NLM_F_REQUEST, RADCLOCK_CMD_GETATTR);
+	if (gnl->get_msg == NULL)
+		goto msg_errout;
+
+	/* One ACK'd SETATTR per attribute, with room for its payload */
+	for (attrib_id = RADCLOCK_ATTR_DATA; attrib_id <= RADCLOCK_ATTR_MAX; attrib_id++) {
+		gnl->set_msg[attrib_id] = gnl_build_msg(gnl->id, NLM_F_REQUEST | NLM_F_ACK,
+				RADCLOCK_CMD_SETATTR);
+		if (gnl->set_msg[attrib_id] == NULL)
+			goto msg_errout;
+		attr = nla_reserve(gnl->set_msg[attrib_id], attrib_id, gnl->set_len[attrib_id]);
+		if (attr == NULL)
+			goto msg_errout;
+		gnl->set_payload[attrib_id] = nla_data(attr);
+	}
+
+	return (0);
+
+msg_errout:
+	logger(RADLOG_ERR, "Error allocating FFclock netlink messages");
+errout:
+	gnl_disconnect(gnl);
+	return (1);
+}
+
+
+static void
+gnl_stamp_msg(struct radclock_gnl *gnl, struct nl_msg *msg, struct iovec *iov)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+
+	hdr->nlmsg_seq = nl_socket_use_seq(gnl->sk);
+	hdr->nlmsg_pid = nl_socket_get_local_port(gnl->sk);
+	iov->iov_base = hdr;
+	iov->iov_len = hdr->nlmsg_len;
+}
+
+
+/* Send a SETATTR of *data for attribute set_id (if set_id > 0) followed by a
+ * GETATTR for attribute get_id (if get_id > 0) in a single datagram, and
+ * wait for both answers. Caller holds the lock.
+ * Error code:  -1   request rejected by the kernel or bad reply
+ *              -2   channel failure (send, receive, timeout)
+ */
+static int
+gnl_exchange(struct radclock_gnl *gnl, int set_id, const void *data, int get_id,
+		void *into)
+{
+	struct iovec iov[2];
+	struct msghdr mh;
+	struct nlmsghdr *hdr;
+	struct nlmsgerr *nlerr;
+	uint32_t set_seq = 0, get_seq = 0;
+	int want_set = 0, want_get = 0;
+	int ret = 0;
+	int niov = 0;
+	int len;
+
+	if (set_id > 0) {
+		memcpy(gnl->set_payload[set_id], data, gnl->set_len[set_id]);
+		gnl_stamp_msg(gnl, gnl->set_msg[set_id], &iov[niov++]);
+		set_seq = nlmsg_hdr(gnl->set_msg[set_id])->nlmsg_seq;
+		want_set = 1;
+	}
+	if (get_id > 0) {
+		gnl_stamp_msg(gnl, gnl->get_msg, &iov[niov++]);
+		get_seq = nlmsg_hdr(gnl->get_msg)->nlmsg_seq;
+		want_get = 1;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &gnl->peer;
+	mh.msg_namelen = sizeof(gnl->peer);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = niov;
+	if (sendmsg(gnl->fd, &mh, 0) < 0) {
+		logger(RADLOG_ERR, "Error sending to generic netlink socket: %s",
+				strerror(errno));
+		return (-2);
+	}
+
+	while (want_set || want_get) {
+		len = recv(gnl->fd, gnl->rbuf, GNL_RBUF_SIZE, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(RADLOG_ERR, "Error on FFclock netlink read: %s", strerror(errno));
+			return (-2);
+		}
+
+		for (hdr = (struct nlmsghdr *) gnl->rbuf; nlmsg_ok(hdr, len);
+				hdr = nlmsg_next(hdr, &len)) {
+			if (want_set && hdr->nlmsg_seq == set_seq) {
+				want_set = 0;
+				nlerr = nlmsg_data(hdr);
+				if (hdr->nlmsg_type != NLMSG_ERROR || nlerr->error != 0) {
+					logger(RADLOG_ERR, "FFclock netlink set request failed: %s",
+							hdr->nlmsg_type == NLMSG_ERROR ? strerror(-nlerr->error) :
+							"no ACK");
+					ret = -1;
+				}
+			} else if (want_get && hdr->nlmsg_seq == get_seq) {
+				want_get = 0;
+				if (hdr->nlmsg_type == NLMSG_ERROR) {
+					nlerr = nlmsg_data(hdr);
+					logger(RADLOG_ERR, "FFclock netlink get request failed: %s",
+							strerror(-nlerr->error));
+					ret = -1;
+				} else if (radclock_gnl_receive(gnl->id, hdr, get_id, into) < 0) {
+					logger(RADLOG_ERR, "Error extracting attribute from netlink message");
+					ret = -1;
+				}
+			}
+			/* Anything else is stale, drop it */
+		}
+	}
+
+	return (ret);
+}
+
+
+/* Run a set and/or get over the persistent channel, reconnecting once if it
+ * has failed. Falls back on one-shot sockets when there is no channel.
+ */
+static int
+radclock_gnl_call(struct radclock *clock, int set_id, void *data, int get_id,
+		void *into)
+{
+	struct radclock_impl_linux *priv = PRIV_DATA(clock);
+	struct radclock_gnl *gnl = priv->gnl;
+	int err;
+
+	if (gnl == NULL) {
+		if (set_id > 0 && radclock_gnl_set_attr(priv->radclock_gnl_id, set_id, data) < 0)
+			return (-1);
+		if (get_id > 0 && radclock_gnl_get_attr(priv->radclock_gnl_id, get_id, into) < 0)
+			return (-1);
+		return (0);
+	}
+
+	pthread_mutex_lock(&gnl->lock);
+	err = -2;
+	if (gnl->sk)
+		err = gnl_exchange(gnl, set_id, data, get_id, into);
+
+	/* Channel is broken (or a previous reconnect failed), the FFclock module
+	 * may even have been reloaded under a new ID. Reconnect and retry once. */
+	if (err == -2) {
+		if (gnl->sk) {
+			logger(RADLOG_WARNING, "Reconnecting FFclock netlink channel");
+			gnl_disconnect(gnl);
+		}
+		err = -1;
+		if (gnl_connect(gnl) == 0) {
+			priv->radclock_gnl_id = gnl->id;
+			err = gnl_exchange(gnl, set_id, data, get_id, into);
+		}
+	}
+	pthread_mutex_unlock(&gnl->lock);
+
+	return (err < 0 ? -1 : 0);
+}
+
+
+/* Open the persistent netlink channel to the FFclock, recording its genl ID */
+int
+init_kernel_clock(struct radclock *clock)
+{
+	struct radclock_gnl *gnl;
+
+	gnl = calloc(1, sizeof(struct radclock_gnl));
+	if (gnl == NULL) {
+		logger(RADLOG_ERR, "Cannot allocate FFclock netlink channel");
+		return (1);
+	}
+	gnl->peer.nl_family = AF_NETLINK;
+	gnl->set_len[RADCLOCK_ATTR_DATA] = sizeof(struct ffclock_data);
+	gnl->set_len[RADCLOCK_ATTR_FIXEDPOINT] = sizeof(struct radclock_fixedpoint);
+	gnl->rbuf = malloc(GNL_RBUF_SIZE);
+	if (gnl->rbuf == NULL || gnl_connect(gnl)) {
+		free(gnl->rbuf);
+		free(gnl);
+		return (1);
+	}
+	pthread_mutex_init(&gnl->lock, NULL);
+
+	logger(RADLOG_NOTICE, "FFclock netlink is up, with genl ID = %d", gnl->id);
+	PRIV_DATA(clock)->gnl = gnl;
+	PRIV_DATA(clock)->radclock_gnl_id = gnl->id;
+
+	return (0);
+}
+
+
+/* Release the netlink channel. The genl ID is kept, later calls fall back on
+ * one-shot sockets.
+ */
+void
+close_kernel_clock(struct radclock *clock)
+{
+	struct radclock_gnl *gnl = PRIV_DATA(clock)->gnl;
+
+	if (gnl == NULL)
+		return;
+	gnl_disconnect(gnl);
+	pthread_mutex_destroy(&gnl->lock);
+	free(gnl->rbuf);
+	free(gnl);
+	PRIV_DATA(clock)->gnl = NULL;
+}
+
+
 /* Get the current FFdata from the kernel via netlink */
 int
 get_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
@@ -352,7 +634,7 @@ get_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
 		return (1);
 	}
 
-	err = radclock_gnl_get_attr(PRIV_DATA(clock)->radclock_gnl_id, RADCLOCK_ATTR_DATA, cdat);
+	err = radclock_gnl_call(clock, 0, NULL, RADCLOCK_ATTR_DATA, cdat);
 	if (err < 0) {
 		logger(RADLOG_ERR, "Failed to recover FFdata from kernel");
 		return (-1);
@@ -373,7 +655,7 @@ set_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
 	case 1:
 		return (0);		// do nothing, fixedpt thread does this job
 	case 2:
-		err = radclock_gnl_set_attr(PRIV_DATA(clock)->radclock_gnl_id, RADCLOCK_ATTR_DATA, cdat);
+		err = radclock_gnl_call(clock, RADCLOCK_ATTR_DATA, cdat, 0, NULL);
 		break;
 	default:
 		logger(RADLOG_ERR, "Unknown kernel version");
@@ -390,13 +672,40 @@ set_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
 
 
 
+/* Send the passed value of FFdata to the kernel and read back the kernel's
+ * FFdata, in a single netlink round trip. kcdat may point to cdat.
+ */
+int
+setget_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat,
+		struct ffclock_data *kcdat)
+{
+	int err;
+
+	if (clock->kernel_version != 2) {
+		err = set_kernel_ffclock(clock, cdat);
+		if (err)
+			return (err);
+		return (get_kernel_ffclock(clock, kcdat));
+	}
+
+	err = radclock_gnl_call(clock, RADCLOCK_ATTR_DATA, cdat, RADCLOCK_ATTR_DATA, kcdat);
+	if (err < 0) {
+		logger(RADLOG_ERR, "Error when exchanging FFdata with kernel");
+		return (-1);
+	}
+
+	return (0);
+}
+
+
+
 /* Pushes old fixedpoint format which is updated by fixedpoint thread.
  * Only relevant for KV<2 kernels
  */
 inline int
 set_kernel_fixedpoint(struct radclock *clock, struct radclock_fixedpoint *fpdata)
 {
-	int err, err_get;
+	int err;
 	struct radclock_fixedpoint kernfpdata;
 
 //	struct radclock_data kernraddata;
@@ -414,10 +723,11 @@ set_kernel_fixedpoint(struct radclock *clock, struct radclock_fixedpoint *fpdata
 	{
 	case 0:
 	case 1:
-		err     = radclock_gnl_set_attr(PRIV_DATA(clock)->radclock_gnl_id, RADCLOCK_ATTR_FIXEDPOINT, fpdata);
-	 	err_get = radclock_gnl_get_attr(PRIV_DATA(clock)->radclock_gnl_id, RADCLOCK_ATTR_FIXEDPOINT, &kernfpdata);
-		if ( memcmp(fpdata,  &kernfpdata,sizeof(struct radclock_fixedpoint)) != 0 )
-			logger(RADLOG_ERR, "netlink inversion test for fp data failed, err_get = %d", err_get);
+		/* Set and read back in a single round trip */
+		err = radclock_gnl_call(clock, RADCLOCK_ATTR_FIXEDPOINT, fpdata,
+				RADCLOCK_ATTR_FIXEDPOINT, &kernfpdata);
+		if (err == 0 && memcmp(fpdata, &kernfpdata, sizeof(struct radclock_fixedpoint)) != 0)
+			logger(RADLOG_ERR, "netlink inversion test for fp data failed");
 
 //		err     = radclock_gnl_set_attr(PRIV_DATA(clock)->radclock_gnl_id, RADCLOCK_ATTR_DATA, &cdat);
 //		err_get = radclock_gnl_get_attr(PRIV_DATA(clock)->radclock_gnl_id, RADCLOCK_ATTR_DATA, &kernraddata);
@@ -41,6 +41,12 @@ init_kernel_clock(struct radclock *clock)
 }
 
 
+void
+close_kernel_clock(struct radclock *clock)
+{
+}
+
+
 int
 get_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
 {
@@ -55,6 +61,14 @@ set_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat)
 }
 
 
+int
+setget_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat,
+		struct ffclock_data *kcdat)
+{
+	return (1);
+}
+
+
 /*
  * XXX Deprecated
  * Old way of pushing clock updates to the kernel.
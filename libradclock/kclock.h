@@ -75,6 +75,8 @@ struct ffclock_data {
 
 int get_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat);
 int set_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat);
+int setget_kernel_ffclock(struct radclock *clock, struct ffclock_data *cdat,
+		struct ffclock_data *kcdat);
 
 void fill_ffclock_data(struct radclock_data *rad_data,
 		struct radclock_error *rad_err, struct ffclock_data *cdat);
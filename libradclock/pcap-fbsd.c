@@ -958,6 +958,22 @@ extract_vcount_stamp(struct radclock *clock, pcap_t *p_handle,
 }
 
 
+/* There is no capture ring on BPF, see pcap-ring.c */
+int
+descriptor_set_tsmode_fd(struct radclock *clock, int fd, int *mode, u_int custom)
+{
+	return (1);
+}
+
+
+int
+extract_vcount_ring(struct radclock *clock, const unsigned char *frame,
+		vcounter_t *vcount)
+{
+	return (1);
+}
+
+
 /* This routine interprets the contents of the timeval-typed ts field from
  * the pcap header according to the BPF_T_FORMAT options, and converts the
  * timestamp to a long double.
@@ -190,8 +190,9 @@ decode_bpf_tsflags_KV2(long bd_tstamp)
 }
 
 
+/* The capture descriptor may come from libpcap or be a capture ring socket */
 int
-descriptor_set_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode, u_int custom)
+descriptor_set_tsmode_fd(struct radclock *handle, int fd, int *mode, u_int custom)
 {
 	long bd_tstamp = 0;
 	long override_mode = *mode;		// record input mode
@@ -234,7 +235,7 @@ descriptor_set_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode, u_in
 		}
 		*mode = override_mode;	// inform caller of final mode
 
-		if (ioctl(pcap_fileno(p_handle), SIOCSRADCLOCKTSMODE, (caddr_t)(&bd_tstamp)) == -1) {
+		if (ioctl(fd, SIOCSRADCLOCKTSMODE, (caddr_t)(&bd_tstamp)) == -1) {
 			logger(RADLOG_ERR, "Setting timestamping mode failed: %s", strerror(errno));
 			return (1);
 		}
@@ -243,7 +244,7 @@ descriptor_set_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode, u_in
 	case 2:
 		/* Initial test of value of tsmode */
 		logger(RADLOG_NOTICE, "Checking current tsmode before setting it :");
-		if (ioctl(pcap_fileno(p_handle), SIOCGRADCLOCKTSMODE, (caddr_t)(&bd_tstamp)) == -1)
+		if (ioctl(fd, SIOCGRADCLOCKTSMODE, (caddr_t)(&bd_tstamp)) == -1)
 			logger(RADLOG_ERR, "Getting initial timestamping mode failed: %s", strerror(errno));
 		decode_bpf_tsflags_KV2(bd_tstamp);
 
@@ -280,7 +281,7 @@ descriptor_set_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode, u_in
 		}
 		*mode = override_mode;	// inform caller of final mode
 
-		if (ioctl(pcap_fileno(p_handle), SIOCSRADCLOCKTSMODE, (caddr_t)(&bd_tstamp)) == -1) {
+		if (ioctl(fd, SIOCSRADCLOCKTSMODE, (caddr_t)(&bd_tstamp)) == -1) {
 			logger(RADLOG_ERR, "Setting timestamping mode failed: %s", strerror(errno));
 			return (1);
 		}
@@ -296,6 +297,13 @@ descriptor_set_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode, u_in
 }
 
 
+int
+descriptor_set_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode, u_int custom)
+{
+	return (descriptor_set_tsmode_fd(handle, pcap_fileno(p_handle), mode, custom));
+}
+
+
 int
 descriptor_get_tsmode(struct radclock *handle, pcap_t *p_handle, int *mode)
 {
@@ -469,6 +477,26 @@ extract_vcount_stamp(struct radclock *clock, pcap_t *p_handle,
 
 
 
+/* Frames read from a capture ring have the vcount just before the frame data,
+ * as in the memory mapped libpcap case.
+ */
+int
+extract_vcount_ring(struct radclock *clock, const unsigned char *frame,
+		vcounter_t *vcount)
+{
+	switch (clock->kernel_version) {
+	case 0:
+	case 1:
+	case 2:
+		memcpy(vcount, frame - sizeof(vcounter_t), sizeof(vcounter_t));
+		return (0);
+	default:
+		return (1);
+	}
+}
+
+
+
 /* This routine interprets the contents of the timeval-typed ts field from
  * the pcap header according to the linux kernel timestamping options,
  * and converts the timestamp to a long double.
@@ -55,6 +55,21 @@ extract_vcount_stamp(struct radclock *clock, pcap_t *p_handle,
 }
 
 
+int
+descriptor_set_tsmode_fd(struct radclock *clock, int fd, int *mode, u_int custom)
+{
+	return (1);
+}
+
+
+int
+extract_vcount_ring(struct radclock *clock, const unsigned char *frame,
+		vcounter_t *vcount)
+{
+	return (1);
+}
+
+
 void
 ts_format_to_double(struct timeval *pcapts, int tstype, long double *timestamp)
 {
@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef linux
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <poll.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "logger.h"
+
+
+#if defined(linux) && defined(TPACKET3_HDRLEN)
+
+/*
+ * Ring geometry. TPACKET_V3 packs variable size frames back to back within a
+ * block, so a 64kB block holds a few hundred NTP frames once truncated to the
+ * filter snaplen. The frame size only matters to the kernel sanity checks.
+ */
+#define RING_BLOCK_SIZE		(1 << 16)
+#define RING_BLOCK_NR		32
+#define RING_FRAME_SIZE		2048
+
+
+/*
+ * Open a packet socket on interface ifname and map its receive ring. The
+ * optional filter is attached before the socket is bound, so that no frame
+ * gets through unfiltered. The kernel retires a partially filled block after
+ * timeout_ms, which bounds the delivery delay when traffic is low.
+ */
+int
+pktcap_ring_open(const char *ifname, struct bpf_program *fp, int timeout_ms,
+		struct pktcap_ring **ringp)
+{
+	struct pktcap_ring *ring;
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	int version;
+
+	ring = (struct pktcap_ring *) calloc(1, sizeof(struct pktcap_ring));
+	if (ring == NULL) {
+		logger(RADLOG_ERR, "Cannot allocate capture ring");
+		return (1);
+	}
+	ring->map = MAP_FAILED;
+
+	/* Not bound to any protocol yet, the socket receives nothing */
+	ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (ring->fd < 0) {
+		logger(RADLOG_ERR, "Cannot open packet socket: %s", strerror(errno));
+		free(ring);
+		return (1);
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+	if (ioctl(ring->fd, SIOCGIFINDEX, &ifr) < 0) {
+		logger(RADLOG_ERR, "Unknown interface %s: %s", ifname, strerror(errno));
+		goto errout;
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifr.ifr_ifindex;
+
+	/* Only Ethernet framing (which the loopback fakes) is handled */
+	if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) < 0) {
+		logger(RADLOG_ERR, "Cannot get link type of %s: %s", ifname,
+				strerror(errno));
+		goto errout;
+	}
+	switch (ifr.ifr_hwaddr.sa_family) {
+	case ARPHRD_LOOPBACK:
+		/* Each frame is seen leaving and coming back, keep one, as libpcap */
+		ring->skip_outgoing = 1;
+		/* Fall through */
+	case ARPHRD_ETHER:
+		ring->linktype = DLT_EN10MB;
+		break;
+	default:
+		logger(RADLOG_ERR, "Link type %d of %s not supported by the capture "
+				"ring", ifr.ifr_hwaddr.sa_family, ifname);
+		goto errout;
+	}
+
+	version = TPACKET_V3;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+			sizeof(version)) < 0) {
+		logger(RADLOG_ERR, "TPACKET_V3 not supported: %s", strerror(errno));
+		goto errout;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = RING_BLOCK_NR;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_NR;
+	req.tp_retire_blk_tov = timeout_ms;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		logger(RADLOG_ERR, "Cannot set up receive ring: %s", strerror(errno));
+		goto errout;
+	}
+	ring->block_size = req.tp_block_size;
+	ring->block_nr = req.tp_block_nr;
+	ring->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring->owned = (unsigned char *) calloc(ring->block_nr, 1);
+	if (ring->owned == NULL) {
+		logger(RADLOG_ERR, "Cannot allocate capture ring");
+		goto errout;
+	}
+
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		logger(RADLOG_ERR, "Cannot map receive ring: %s", strerror(errno));
+		goto errout;
+	}
+
+	if (fp && pktcap_ring_setfilter(ring, fp))
+		goto errout;
+
+	if (bind(ring->fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		logger(RADLOG_ERR, "Cannot bind packet socket to %s: %s", ifname,
+				strerror(errno));
+		goto errout;
+	}
+
+	logger(RADLOG_NOTICE, "Capture ring on %s: %u blocks of %u bytes",
+			ifname, ring->block_nr, ring->block_size);
+	*ringp = ring;
+	return (0);
+
+errout:
+	pktcap_ring_close(ring);
+	return (1);
+}
+
+
+void
+pktcap_ring_close(struct pktcap_ring *ring)
+{
+	if (ring == NULL)
+		return;
+	if (ring->map != MAP_FAILED)
+		munmap(ring->map, ring->map_len);
+	close(ring->fd);
+	free(ring->owned);
+	free(ring);
+}
+
+
+/* The BPF programs compiled by libpcap are what the kernel expects */
+int
+pktcap_ring_setfilter(struct pktcap_ring *ring, struct bpf_program *fp)
+{
+	struct sock_fprog prog;
+
+	prog.len = fp->bf_len;
+	prog.filter = (struct sock_filter *) fp->bf_insns;
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			sizeof(prog)) < 0) {
+		logger(RADLOG_ERR, "Cannot attach filter to capture ring: %s",
+				strerror(errno));
+		return (1);
+	}
+	return (0);
+}
+
+
+/*
+ * Wait up to timeout_ms for the next block to be handed over by the kernel.
+ * Returns 0 and the block, 1 on timeout, -1 on error and -2 if
+ * pktcap_ring_breakloop() was called, mirroring pcap_loop().
+ * The next block may still be owned by the reader, a whole ring behind. Its
+ * status says it is userland's but it has not been walked again: wait for it
+ * to be given back, the kernel keeps it meanwhile.
+ */
+int
+pktcap_ring_next_block(struct pktcap_ring *ring, int timeout_ms, void **block)
+{
+	struct tpacket_block_desc *bd;
+	struct pollfd pfd;
+	int n, waited;
+
+	bd = (struct tpacket_block_desc *) ((char *)ring->map +
+			(size_t)ring->next * ring->block_size);
+
+	waited = 0;
+	for (;;) {
+		if (__atomic_load_n(&ring->breakloop, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&ring->breakloop, 0, __ATOMIC_RELAXED);
+			return (-2);
+		}
+
+		/* Acquire pairs with the block given back */
+		if (__atomic_load_n(&ring->owned[ring->next], __ATOMIC_ACQUIRE)) {
+			if (waited >= timeout_ms)
+				return (1);
+			poll(NULL, 0, 1);
+			waited++;
+			continue;
+		}
+
+		/* Acquire pairs with the kernel filling the block */
+		if (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+				TP_STATUS_USER)
+			break;
+
+		pfd.fd = ring->fd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		n = poll(&pfd, 1, timeout_ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(RADLOG_ERR, "Poll on capture ring failed: %s", strerror(errno));
+			return (-1);
+		}
+		if (n == 0)
+			return (1);
+	}
+
+	__atomic_store_n(&ring->owned[ring->next], 1, __ATOMIC_RELAXED);
+	ring->next = (ring->next + 1) % ring->block_nr;
+	*block = bd;
+	return (0);
+}
+
+
+/*
+ * Hand a block back to the kernel, no frame of it may be used afterwards. May
+ * be called from another thread than pktcap_ring_next_block().
+ */
+void
+pktcap_ring_release_block(struct pktcap_ring *ring, void *block)
+{
+	struct tpacket_block_desc *bd = (struct tpacket_block_desc *) block;
+	size_t i;
+
+	i = ((char *)block - (char *)ring->map) / ring->block_size;
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			__ATOMIC_RELEASE);
+	__atomic_store_n(&ring->owned[i], 0, __ATOMIC_RELEASE);
+}
+
+
+/* Make pktcap_ring_next_block() return, safe from a signal handler */
+void
+pktcap_ring_breakloop(struct pktcap_ring *ring)
+{
+	__atomic_store_n(&ring->breakloop, 1, __ATOMIC_RELAXED);
+}
+
+
+void
+pktcap_ring_cursor_init(struct pktcap_ring *ring, struct pktcap_ring_cursor *cur,
+		void *block)
+{
+	struct tpacket_block_desc *bd = (struct tpacket_block_desc *) block;
+
+	cur->block = block;
+	cur->skip_outgoing = ring->skip_outgoing;
+	cur->left = bd->hdr.bh1.num_pkts;
+	cur->frame = (char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+}
+
+
+/*
+ * Next frame of the block, or NULL once the block has been walked. The frame
+ * points into the ring, hdr is filled as libpcap would.
+ */
+unsigned char *
+pktcap_ring_next_frame(struct pktcap_ring_cursor *cur, struct pcap_pkthdr *hdr)
+{
+	struct tpacket3_hdr *tp;
+	struct sockaddr_ll *sll;
+
+	do {
+		if (cur->left == 0)
+			return (NULL);
+		tp = (struct tpacket3_hdr *) cur->frame;
+		cur->left--;
+		cur->frame = (char *)tp + tp->tp_next_offset;
+
+		/* The link layer address follows the frame header */
+		sll = (struct sockaddr_ll *) ((char *)tp +
+				TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+	} while (cur->skip_outgoing && sll->sll_pkttype == PACKET_OUTGOING);
+
+	hdr->ts.tv_sec = tp->tp_sec;
+	hdr->ts.tv_usec = tp->tp_nsec / 1000;
+	hdr->caplen = tp->tp_snaplen;
+	hdr->len = tp->tp_len;
+
+	return ((unsigned char *)tp + tp->tp_mac);
+}
+
+
+#else	/* No TPACKET_V3, libpcap only */
+
+int
+pktcap_ring_open(const char *ifname, struct bpf_program *fp, int timeout_ms,
+		struct pktcap_ring **ringp)
+{
+	logger(RADLOG_ERR, "Capture ring not supported on this system");
+	return (1);
+}
+
+void
+pktcap_ring_close(struct pktcap_ring *ring)
+{
+}
+
+int
+pktcap_ring_setfilter(struct pktcap_ring *ring, struct bpf_program *fp)
+{
+	return (1);
+}
+
+int
+pktcap_ring_next_block(struct pktcap_ring *ring, int timeout_ms, void **block)
+{
+	return (-1);
+}
+
+void
+pktcap_ring_release_block(struct pktcap_ring *ring, void *block)
+{
+}
+
+void
+pktcap_ring_breakloop(struct pktcap_ring *ring)
+{
+}
+
+void
+pktcap_ring_cursor_init(struct pktcap_ring *ring, struct pktcap_ring_cursor *cur,
+		void *block)
+{
+	cur->block = block;
+	cur->left = 0;
+}
+
+unsigned char *
+pktcap_ring_next_frame(struct pktcap_ring_cursor *cur, struct pcap_pkthdr *hdr)
+{
+	return (NULL);
+}
+
+#endif
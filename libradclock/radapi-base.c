@@ -33,6 +33,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -63,6 +64,7 @@ radclock_create(void)
 	/* SMS stuff */
 	clock->ipc_sms_id = 0;
 	clock->ipc_sms = NULL;
+	clock->ipc_sms_version = 0;
 
 	clock->hw_counter[0] = '\0';
 
@@ -74,6 +76,10 @@ radclock_create(void)
 
 	/* PCAP */
 	clock->pcap_handle 	= NULL;
+	clock->pcap_ring 	= NULL;
+
+	/* Kernel clock link, set up by init_kernel_clock */
+	memset(PRIV_DATA(clock), 0, sizeof(*PRIV_DATA(clock)));
 
 	return (clock);
 }
@@ -97,7 +103,27 @@ sms_init_reader(struct radclock *clock)
 		return (1);
 	}
 
+	return (sms_attach_reader(clock, sms_key));
+}
+
+
+/* The v1 part must stay as laid out by a version 1 daemon */
+_Static_assert(offsetof(struct radclock_sms, buferr) ==
+		offsetof(struct radclock_sms_v1, buferr), "SMS v1 layout changed");
+_Static_assert(offsetof(struct radclock_sms, buferr) +
+		sizeof(((struct radclock_sms *)0)->buferr) == SMS_V1_SIZE,
+		"SMS v1 size changed");
+
+int
+sms_attach_reader(struct radclock *clock, key_t sms_key)
+{
+	/* A segment created by a version 1 daemon is too small for v2 */
+	clock->ipc_sms_version = RADCLOCK_SMS_VERSION;
 	clock->ipc_sms_id = shmget(sms_key, sizeof(struct radclock_sms), 0);
+	if (clock->ipc_sms_id < 0 && errno == EINVAL) {
+		clock->ipc_sms_version = 1;
+		clock->ipc_sms_id = shmget(sms_key, SMS_V1_SIZE, 0);
+	}
 	if (clock->ipc_sms_id < 0) {
 		logger(RADLOG_ERR, "shmget: %s", strerror(errno));
 		return (1);
@@ -121,12 +147,9 @@ sms_init_reader(struct radclock *clock)
 int
 sms_init_writer(struct radclock *clock)
 {
-	struct shmid_ds sms_ctl;
-	struct radclock_sms *sms;
 	struct stat sb;
 	key_t sms_key;
-	unsigned int perm_flags;
-	int sms_fd, is_new_sms;
+	int sms_fd;
 
 	if (stat(RADCLOCK_RUN_DIRECTORY, &sb) < 0) {
 		if (mkdir(RADCLOCK_RUN_DIRECTORY, 0755) < 0) {
@@ -147,6 +170,18 @@ sms_init_writer(struct radclock *clock)
 		return (1);
 	}
 
+	return (sms_create_writer(clock, sms_key));
+}
+
+
+int
+sms_create_writer(struct radclock *clock, key_t sms_key)
+{
+	struct shmid_ds sms_ctl;
+	struct radclock_sms *sms;
+	unsigned int perm_flags;
+	int is_new_sms;
+
 	/*
 	 * Create shared memory segment. IPC_EXCL will make this call fail if the
 	 * memory segment already exists.
@@ -159,6 +194,16 @@ sms_init_writer(struct radclock *clock)
 	perm_flags = SHM_R | SHM_W | (SHM_R>>3) | (SHM_R>>6);
 	clock->ipc_sms_id = shmget(sms_key, sizeof(struct radclock_sms),
 			IPC_CREAT | IPC_EXCL | perm_flags);
+	if (clock->ipc_sms_id < 0 && errno == EEXIST &&
+			shmget(sms_key, sizeof(struct radclock_sms), 0) < 0 && errno == EINVAL) {
+		/* Segment left by a version 1 daemon, too small for v2. Replace it,
+		 * clients still attached to it must be restarted to see updates. */
+		logger(RADLOG_WARNING, "IPC Shared Memory is from an older RADclock, "
+				"replacing it");
+		shmctl(shmget(sms_key, 0, 0), IPC_RMID, NULL);
+		clock->ipc_sms_id = shmget(sms_key, sizeof(struct radclock_sms),
+				IPC_CREAT | IPC_EXCL | perm_flags);
+	}
 	if (clock->ipc_sms_id < 0) {
 		switch(errno) {
 		case (EEXIST):
@@ -198,13 +243,204 @@ sms_init_writer(struct radclock *clock)
 		sms->gen = 1;
 	}
 
-	// TODO: need to init version number, clockid, valid / invalid status.
-	sms->version = 1;
+	// TODO: need to init clockid, valid / invalid status.
+	sms->version = RADCLOCK_SMS_VERSION;
+	clock->ipc_sms_version = RADCLOCK_SMS_VERSION;
 
 	return (0);
 }
 
 
+/*
+ * Fixed-point form of the UTC clock, see struct radclock_sms_fp. The origin
+ * time is computed in long double as by read_RADabs_UTC, which bounds the
+ * precision of the whole ns and fraction to about 0.1 ns at current dates.
+ */
+static void
+sms_fill_fp(struct radclock_sms_fp *fp, struct radclock_data *rad_data)
+{
+	long double time, ns, pmax;
+	uint32_t shift;
+
+	if (rad_data->phat <= 0 || rad_data->phat_local <= 0) {
+		fp->valid = 0;
+		return;
+	}
+
+	pmax = rad_data->phat > rad_data->phat_local ? rad_data->phat : rad_data->phat_local;
+	pmax *= 1e9L;
+	for (shift = 64; shift > 0 && ldexpl(pmax, shift) >= ldexpl(1, 64); shift--)
+		;
+
+	time = rad_data->last_changed * (long double)rad_data->phat + rad_data->ca;
+	time -= rad_data->leapsec_total;
+	ns = floorl(time * 1e9L);
+
+	fp->ref = rad_data->last_changed;
+	fp->ns = (int64_t) ns;
+	fp->frac = (uint64_t) ldexpl(time * 1e9L - ns, shift);
+	fp->mult[0] = (uint64_t) ldexpl(rad_data->phat * 1e9L, shift);
+	fp->mult[1] = (uint64_t) ldexpl(rad_data->phat_local * 1e9L, shift);
+	if (rad_data->leapsec_expected != 0) {
+		fp->leap_at = rad_data->leapsec_expected;
+		fp->leap_ns = (int64_t) rad_data->leapsec_next * 1000000000;
+	} else {
+		fp->leap_at = ~(vcounter_t)0;
+		fp->leap_ns = 0;
+	}
+	fp->shift = shift;
+	fp->valid = 1;
+}
+
+
+/*
+ * Update the SMS, both the v1 double buffer and the v2 seqlock copy.
+ * Single writer, never waits on readers.
+ */
+void
+sms_write(struct radclock *clock, struct radclock_data *rad_data,
+		struct radclock_error *rad_err)
+{
+	struct radclock_sms *sms;
+	struct radclock_sms_v2 *v2;
+	size_t offset_tmp;
+	unsigned int generation;
+	uint32_t seq;
+
+	sms = (struct radclock_sms *) clock->ipc_sms;
+
+	/* Version 1: fill the old buffers and swap them in while gen is 0. A
+	 * reader still on the old buffer from the previous update sees gen move. */
+	generation = sms->gen;
+	__atomic_store_n(&sms->gen, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((void *)sms + sms->data_off_old, rad_data, sizeof(struct radclock_data));
+	memcpy((void *)sms + sms->error_off_old, rad_err, sizeof(struct radclock_error));
+
+	/* Swap current and old buffer offsets in the mapped SMS */
+	offset_tmp = sms->data_off;
+	sms->data_off = sms->data_off_old;
+	sms->data_off_old = offset_tmp;
+
+	offset_tmp = sms->error_off;
+	sms->error_off = sms->error_off_old;
+	sms->error_off_old = offset_tmp;
+
+	if (generation++ == 0)
+		generation = 1;
+	__atomic_store_n(&sms->gen, generation, __ATOMIC_RELEASE);
+
+	/* Version 2 seqlock */
+	/* seq is left odd if a previous daemon died while updating */
+	v2 = &sms->v2;
+	seq = v2->seq & ~1U;
+	__atomic_store_n(&v2->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	v2->status				= rad_data->status;
+	v2->phat					= rad_data->phat;
+	v2->ca					= rad_data->ca;
+	v2->phat_local			= rad_data->phat_local;
+	v2->last_changed		= rad_data->last_changed;
+	v2->leapsec_expected	= rad_data->leapsec_expected;
+	v2->leapsec_total		= rad_data->leapsec_total;
+	v2->leapsec_next		= rad_data->leapsec_next;
+	v2->next_expected		= rad_data->next_expected;
+	v2->phat_err			= rad_data->phat_err;
+	v2->phat_local_err	= rad_data->phat_local_err;
+	v2->ca_err				= rad_data->ca_err;
+	v2->error				= *rad_err;
+	sms_fill_fp(&v2->fp, rad_data);
+
+	__atomic_store_n(&v2->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Consistent copy of the SMS clock data, through the v2 seqlock if the daemon
+ * publishes it, or the v1 generation otherwise. Returns the sequence number
+ * (generation) the copy was taken at.
+ */
+uint32_t
+sms_read(struct radclock *clock, struct radclock_data *rad_data,
+		struct radclock_error *rad_err)
+{
+	struct radclock_sms *sms;
+	struct radclock_sms_v2 *v2;
+	unsigned int generation;
+	uint32_t seq;
+
+	sms = (struct radclock_sms *) clock->ipc_sms;
+
+	if (clock->ipc_sms_version < 2 || sms->version < 2) {
+		do {
+			generation = __atomic_load_n(&sms->gen, __ATOMIC_ACQUIRE);
+			if (rad_data)
+				*rad_data = *SMS_DATA(sms);
+			if (rad_err)
+				*rad_err = *SMS_ERROR(sms);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (generation == 0 ||
+				generation != __atomic_load_n(&sms->gen, __ATOMIC_RELAXED));
+		return (generation);
+	}
+
+	v2 = &sms->v2;
+	do {
+		seq = __atomic_load_n(&v2->seq, __ATOMIC_ACQUIRE);
+		if (rad_data) {
+			rad_data->status				= v2->status;
+			rad_data->phat					= v2->phat;
+			rad_data->ca					= v2->ca;
+			rad_data->phat_local			= v2->phat_local;
+			rad_data->last_changed		= v2->last_changed;
+			rad_data->leapsec_expected	= v2->leapsec_expected;
+			rad_data->leapsec_total		= v2->leapsec_total;
+			rad_data->leapsec_next		= v2->leapsec_next;
+			rad_data->next_expected		= v2->next_expected;
+			rad_data->phat_err			= v2->phat_err;
+			rad_data->phat_local_err	= v2->phat_local_err;
+			rad_data->ca_err				= v2->ca_err;
+		}
+		if (rad_err)
+			*rad_err = v2->error;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&v2->seq, __ATOMIC_RELAXED));
+
+	return (seq);
+}
+
+
+/*
+ * Consistent copy of the fixed-point clock, with the next update expected and
+ * phat for the quality check. Returns 1 if the SMS does not publish it.
+ */
+int
+sms_read_fp(struct radclock *clock, struct radclock_sms_fp *fp,
+		vcounter_t *next_expected, double *phat)
+{
+	struct radclock_sms *sms;
+	struct radclock_sms_v2 *v2;
+	uint32_t seq;
+
+	sms = (struct radclock_sms *) clock->ipc_sms;
+	if (sms == NULL || clock->ipc_sms_version < 2 || sms->version < 2)
+		return (1);
+
+	v2 = &sms->v2;
+	do {
+		seq = __atomic_load_n(&v2->seq, __ATOMIC_ACQUIRE);
+		*fp = v2->fp;
+		*next_expected = v2->next_expected;
+		*phat = v2->phat;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&v2->seq, __ATOMIC_RELAXED));
+
+	return (fp->valid ? 0 : 1);
+}
+
+
 /*
  * Do not issue an IPC_RMID. Looked like a good idea, but it is not.
  * Processes still running will be attached to old shared memory segment
@@ -278,6 +514,9 @@ radclock_destroy(struct radclock *clock)
 	/* Detach IPC shared memory */
 	sms_detach(clock);
 
+	/* Release the link to the kernel clock */
+	close_kernel_clock(clock);
+
 	/* Free the clock and set to NULL, useful for partner software */
 	free(clock);
 	clock = NULL;
@@ -81,18 +81,13 @@ radclock_get_last_changed(struct radclock *clock, vcounter_t *last_vcount)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !last_vcount)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*last_vcount = SMS_DATA(sms)->last_changed;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*last_vcount = rad_data.last_changed;
 	} else {
 		if (get_kernel_ffclock(clock, &cdat))
 			return (1);
@@ -109,18 +104,13 @@ radclock_get_next_expected(struct radclock *clock, vcounter_t *till_vcount)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !till_vcount)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*till_vcount = SMS_DATA(sms)->next_expected;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*till_vcount = rad_data.next_expected;
 	} else {
 		if (get_kernel_ffclock(clock, &cdat))
 			return (1);
@@ -137,18 +127,13 @@ radclock_get_period(struct radclock *clock, double *period)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !period)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*period = SMS_DATA(sms)->phat;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*period = rad_data.phat;
 	} else {
 		logger(RADLOG_NOTICE, "radclock_get_period: sms down, using kernel copy");
 		if (get_kernel_ffclock(clock, &cdat))
@@ -166,18 +151,13 @@ radclock_get_bootoffset(struct radclock *clock, long double *offset)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !offset)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*offset = SMS_DATA(sms)->ca;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*offset = rad_data.ca;
 	} else {
 		if (get_kernel_ffclock(clock, &cdat))
 			return (1);
@@ -194,18 +174,13 @@ radclock_get_period_error(struct radclock *clock, double *err_period)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !err_period)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*err_period = SMS_DATA(sms)->phat_err;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*err_period = rad_data.phat_err;
 	} else {
 		if (get_kernel_ffclock(clock, &cdat))
 			return (1);
@@ -222,18 +197,13 @@ radclock_get_bootoffset_error(struct radclock *clock, double *err_offset)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !err_offset)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*err_offset = SMS_DATA(sms)->ca_err;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*err_offset = rad_data.ca_err;
 	} else {
 		if (get_kernel_ffclock(clock, &cdat))
 			return (1);
@@ -250,18 +220,13 @@ radclock_get_status(struct radclock *clock, unsigned int *status)
 {
 	struct ffclock_data cdat; 
 	struct radclock_data rad_data;
-	struct radclock_sms *sms;
-	int generation;
 
 	if (!clock || !status)
 		return (1);
 
 	if (clock->ipc_sms) {
-		sms = (struct radclock_sms *) clock->ipc_sms;
-		do {
-			generation = sms->gen;
-			*status = SMS_DATA(sms)->status;
-		} while (generation != sms->gen || !sms->gen);
+		sms_read(clock, &rad_data, NULL);
+		*status = rad_data.status;
 	} else {
 		if (get_kernel_ffclock(clock, &cdat))
 			return (1);
@@ -278,8 +243,7 @@ radclock_get_status(struct radclock *clock, unsigned int *status)
 int
 radclock_get_clockerror_bound(struct radclock *clock, double *error_bound)
 {
-	struct radclock_sms *sms;
-	int generation;
+	struct radclock_error rad_err;
 
 	if (!clock || !error_bound)
 		return (1);
@@ -287,11 +251,8 @@ radclock_get_clockerror_bound(struct radclock *clock, double *error_bound)
 	if (!clock->ipc_sms)
 		return (1);
 
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	do {
-		generation = sms->gen;
-		*error_bound = SMS_ERROR(sms)->error_bound;
-	} while (generation != sms->gen || !sms->gen);
+	sms_read(clock, NULL, &rad_err);
+	*error_bound = rad_err.error_bound;
 
 	return (0);
 }
@@ -300,8 +261,7 @@ radclock_get_clockerror_bound(struct radclock *clock, double *error_bound)
 int
 radclock_get_clockerror_bound_avg(struct radclock *clock, double *error_bound_avg)
 {
-	struct radclock_sms *sms;
-	int generation;
+	struct radclock_error rad_err;
 
 	if (!clock || !error_bound_avg)
 		return (1);
@@ -309,11 +269,8 @@ radclock_get_clockerror_bound_avg(struct radclock *clock, double *error_bound_av
 	if (!clock->ipc_sms)
 		return (1);
 
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	do {
-		generation = sms->gen;
-		*error_bound_avg = SMS_ERROR(sms)->error_bound_avg;
-	} while (generation != sms->gen || !sms->gen);
+	sms_read(clock, NULL, &rad_err);
+	*error_bound_avg = rad_err.error_bound_avg;
 
 	return (0);
 }
@@ -322,8 +279,7 @@ radclock_get_clockerror_bound_avg(struct radclock *clock, double *error_bound_av
 int
 radclock_get_clockerror_bound_std(struct radclock *clock, double *error_bound_std)
 {
-	struct radclock_sms *sms;
-	int generation;
+	struct radclock_error rad_err;
 
 	if (!clock || !error_bound_std)
 		return (1);
@@ -331,11 +287,8 @@ radclock_get_clockerror_bound_std(struct radclock *clock, double *error_bound_st
 	if (!clock->ipc_sms)
 		return (1);
 
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	do {
-		generation = sms->gen;
-		*error_bound_std = SMS_ERROR(sms)->error_bound_std;
-	} while (generation != sms->gen || !sms->gen);
+	sms_read(clock, NULL, &rad_err);
+	*error_bound_std = rad_err.error_bound_std;
 
 	return (0);
 }
@@ -343,8 +296,7 @@ radclock_get_clockerror_bound_std(struct radclock *clock, double *error_bound_st
 int
 radclock_get_min_RTT(struct radclock *clock, double *min_RTT)
 {
-	struct radclock_sms *sms;
-	int generation;
+	struct radclock_error rad_err;
 
 	if (!clock || !min_RTT)
 		return (1);
@@ -352,11 +304,8 @@ radclock_get_min_RTT(struct radclock *clock, double *min_RTT)
 	if (!clock->ipc_sms)
 		return (1);
 
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	do {
-		generation = sms->gen;
-		*min_RTT = SMS_ERROR(sms)->min_RTT;
-	} while (generation != sms->gen || !sms->gen);
+	sms_read(clock, NULL, &rad_err);
+	*min_RTT = rad_err.min_RTT;
 
 	return (0);
 }
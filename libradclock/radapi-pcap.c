@@ -93,6 +93,26 @@ pktcap_set_tsmode(struct radclock *clock, pcap_t *p_handle, pktcap_tsmode_t mode
 
 
 
+/* Same as pktcap_set_tsmode() for a capture ring */
+int
+pktcap_ring_set_tsmode(struct radclock *clock, struct pktcap_ring *ring,
+		pktcap_tsmode_t mode, u_int custom)
+{
+	if (clock == NULL) {
+		logger(RADLOG_ERR, "Clock handle is null, can't set mode");
+		return (-1);
+	}
+
+	if (descriptor_set_tsmode_fd(clock, ring->fd, (int *)&mode, custom))
+		return (-1);
+
+	clock->tsmode = mode;
+
+	return (0);
+}
+
+
+
 int
 pktcap_get_tsmode(struct radclock *clock, pcap_t *p_handle, pktcap_tsmode_t *mode)
 {
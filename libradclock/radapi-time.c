@@ -29,7 +29,11 @@
 #include <sys/types.h>
 #include <sys/time.h>
 
+#include <math.h>
+#include <strings.h>
+
 #include "radclock.h"
+#include "radclock_fast.h"
 #include "radclock-private.h"
 #include "kclock.h"
 #include "logger.h"
@@ -113,33 +117,24 @@ static inline int
 ffcounter_to_abstime_sms(struct radclock *clock, vcounter_t vcount,
 		long double *time)
 {
-	struct radclock_sms *sms;
-	vcounter_t valid, last;
-	double phat;
-	int generation;
+	struct radclock_data rad_data;
 
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	do {
-		/* Quality ingredients */
-		generation = sms->gen;
-		valid = SMS_DATA(sms)->next_expected;
-		last  = SMS_DATA(sms)->last_changed;
-		phat  = SMS_DATA(sms)->phat;
-
-		if ( clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON )
-			read_RADabs_UTC(SMS_DATA(sms), &vcount, time, 1);
-		else
-			read_RADabs_UTC(SMS_DATA(sms), &vcount, time, 0);
+	sms_read(clock, &rad_data, NULL);
+
+	if ( clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON )
+		read_RADabs_UTC(&rad_data, &vcount, time, 1);
+	else
+		read_RADabs_UTC(&rad_data, &vcount, time, 0);
 
-//		if ((clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON)
-//			&& ((SMS_DATA(sms)->status & STARAD_WARMUP) != STARAD_WARMUP))
-//		{
-//			*time += (vcount - last) *
-//				(long double)(SMS_DATA(sms)->phat_local - phat);
-//		}
-	} while (generation != sms->gen || !sms->gen);
+//	if ((clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON)
+//		&& ((rad_data.status & STARAD_WARMUP) != STARAD_WARMUP))
+//	{
+//		*time += (vcount - rad_data.last_changed) *
+//			(long double)(rad_data.phat_local - rad_data.phat);
+//	}
 
-	return raddata_quality(vcount, last, valid, phat);
+	return raddata_quality(vcount, rad_data.last_changed, rad_data.next_expected,
+			rad_data.phat);
 }
 
 
@@ -164,35 +159,6 @@ ffcounter_to_abstime_kernel(struct radclock *clock, vcounter_t vcount,
  * Build a delay using the difference clock.
  * This function does not fail, SKM model should be checked before call
  */
-static inline int
-ffcounter_to_difftime_sms(struct radclock *clock, vcounter_t from_vcount,
-		vcounter_t till_vcount, long double *time)
-{
-	struct radclock_sms *sms;
-	vcounter_t now, valid, last;
-	double phat;
-	int generation;
-
-	// TODO Stupid performance penalty, but needs more thought
-	if (radclock_get_vcounter(clock, &now))
-		return (1);
-
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	do {
-		generation = sms->gen;
-		valid = SMS_DATA(sms)->next_expected;
-		last  = SMS_DATA(sms)->last_changed;
-		phat  = SMS_DATA(sms)->phat;
-		if ( clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON )
-			*time = (till_vcount - from_vcount) * (long double)SMS_DATA(sms)->phat_local;
-		else
-			*time = (till_vcount - from_vcount) * (long double)SMS_DATA(sms)->phat;
-	} while (generation != sms->gen || !sms->gen);
-
-	return raddata_quality(now, last, valid, phat);
-}
-
-
 static inline int
 ffcounter_to_difftime_kernel(struct radclock *clock, vcounter_t from_vcount,
 		vcounter_t till_vcount, long double *time)
@@ -214,36 +180,6 @@ ffcounter_to_difftime_kernel(struct radclock *clock, vcounter_t from_vcount,
 }
 
 
-/*
- * Check if we are in the SKM model bounds or not
- * Need to know if we are in SKM world. If not, can't use the difference clock,
- * need to substract two absolute timestamps. Testing should always be done
- * using the 'current' vcount value since we use the current global data !!!
- * Use phat for this comparison but using plocal should be fine as well
- */
-// XXX  quite a few issues here
-// 		- the value of the SKM scale is hard coded ... but otherwise?
-// 		- Validity of the global data
-// 		- error code(s) to return
-static inline int
-in_SKMwin(struct radclock *clock, const vcounter_t *past_count, const vcounter_t *vc)
-{
-	struct radclock_sms *sms;
-	vcounter_t now;
-
-	if (!vc)		// if counter not passed, read it here
-		radclock_get_vcounter(clock, &now);
-	else
-		now = *vc;
-
-	sms = (struct radclock_sms *) clock->ipc_sms;
-	if ((now - *past_count) * SMS_DATA(sms)->phat < 1024)
-		return (1);	// is within SKMwin
-	else
-		return (0);
-}
-
-
 int
 radclock_gettime(struct radclock *clock, long double *abstime)
 {
@@ -292,6 +228,7 @@ int
 radclock_elapsed(struct radclock *clock, const vcounter_t *from_vcount,
 		long double *duration)
 {
+	struct radclock_snapshot snap;
 	vcounter_t vcount;
 	int quality = 0;
 
@@ -299,17 +236,19 @@ radclock_elapsed(struct radclock *clock, const vcounter_t *from_vcount,
 	if (!clock || !from_vcount || !duration)
 		return (1);
 
+	/* A single counter read and SMS copy for the duration and SKM check */
+	if (clock->ipc_sms) {
+		if (radclock_snapshot(clock, &snap))
+			return (1);
+		return (radclock_snapshot_elapsed(&snap, from_vcount, duration));
+	}
+
 	/* Make sure we can get a raw timestamp */
 	if (radclock_get_vcounter(clock, &vcount) < 0)
 		return (1);
 	
 	/* Retrieve clock data */
-	if (clock->ipc_sms) {
-		quality = ffcounter_to_difftime_sms(clock, *from_vcount, vcount, duration);
-		if (!in_SKMwin(clock, from_vcount, &vcount))
-			return (1);
-	} else
-		quality = ffcounter_to_difftime_kernel(clock, *from_vcount, vcount, duration);
+	quality = ffcounter_to_difftime_kernel(clock, *from_vcount, vcount, duration);
 
 // TODO is this the  good behaviour, we should request the clock data associated
 // to from_vcount? maybe not
@@ -324,6 +263,7 @@ int
 radclock_duration(struct radclock *clock, const vcounter_t *from_vcount,
 		const vcounter_t *till_vcount, long double *duration)
 {
+	struct radclock_snapshot snap;
 	vcounter_t vcount;
 	int quality = 0;
 
@@ -331,19 +271,18 @@ radclock_duration(struct radclock *clock, const vcounter_t *from_vcount,
 	if (!clock || !from_vcount || !till_vcount || !duration)
 		return (1);
 
+	if (clock->ipc_sms) {
+		if (radclock_snapshot(clock, &snap))
+			return (1);
+		return (radclock_snapshot_duration(&snap, from_vcount, till_vcount, duration));
+	}
+
 	/* Make sure we can get a raw timestamp */
 	if (radclock_get_vcounter(clock, &vcount) < 0)
 		return (1);
 	
 	/* Retrieve clock data */
-	if (clock->ipc_sms) {
-		quality = ffcounter_to_difftime_sms(clock, *from_vcount, *till_vcount, duration);
-		if (!in_SKMwin(clock, from_vcount, &vcount)) {
-			fprintf(stdout, "radclock_duration: inside \n");
-			return (1);
-		}
-	} else
-		quality = ffcounter_to_difftime_kernel(clock, *from_vcount, *till_vcount, duration);
+	quality = ffcounter_to_difftime_kernel(clock, *from_vcount, *till_vcount, duration);
 
 // TODO is this the  good behaviour, we should request the clock data associated
 // to from_vcount? maybe not
@@ -353,3 +292,512 @@ radclock_duration(struct radclock *clock, const vcounter_t *from_vcount,
 	return (quality);
 }
 
+
+/*
+ * Batch conversions.
+ * A single rad_data snapshot is applied to the whole array, so that all
+ * results of a batch are consistent with each other whatever the daemon does
+ * meanwhile. The absolute clock is rewritten relative to last_changed:
+ *
+ *   T(v) = last_changed*phat + ca - leapsec_total + (v - last_changed)*period
+ *
+ * which is the clock of read_RADabs_UTC, period being phat_local when the
+ * local period mode is on, and the next leap second is removed past
+ * leapsec_expected. The per element work is then a multiply-add and a select,
+ * and the loops are kept branch free so that the compiler can vectorize them
+ * (the int64 ns variants, long double stays on the x87 unit).
+ */
+static int
+batch_snapshot(struct radclock *clock, struct radclock_data *rad_data,
+		int kernel_plocal, double *period)
+{
+	struct ffclock_data cdat;
+
+	if (clock->ipc_sms) {
+		sms_read(clock, rad_data, NULL);
+		if (clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON)
+			*period = rad_data->phat_local;
+		else
+			*period = rad_data->phat;
+	} else {
+		if (get_kernel_ffclock(clock, &cdat))
+			return (1);
+		fill_radclock_data(&cdat, rad_data);
+		*period = kernel_plocal ? rad_data->phat_local : rad_data->phat;
+	}
+	return (0);
+}
+
+
+/* Worst quality over the batch, given its smallest and largest counter */
+static int
+batch_quality(struct radclock_data *rad_data, vcounter_t vmin, vcounter_t vmax)
+{
+	int qmin, qmax;
+
+	qmin = raddata_quality(vmin, rad_data->last_changed, rad_data->next_expected,
+			rad_data->phat);
+	qmax = raddata_quality(vmax, rad_data->last_changed, rad_data->next_expected,
+			rad_data->phat);
+	return (qmin > qmax ? qmin : qmax);
+}
+
+
+static void
+batch_minmax(const vcounter_t *vcount, size_t n, vcounter_t *vmin, vcounter_t *vmax)
+{
+	vcounter_t lo, hi;
+	size_t i;
+
+	lo = vcount[0];
+	hi = vcount[0];
+	for (i = 1; i < n; i++) {
+		lo = vcount[i] < lo ? vcount[i] : lo;
+		hi = vcount[i] > hi ? vcount[i] : hi;
+	}
+	*vmin = lo;
+	*vmax = hi;
+}
+
+
+int
+radclock_vcount_to_abstime_batch(struct radclock *clock, const vcounter_t *vcount,
+		long double *abstime, size_t n)
+{
+	struct radclock_data rad_data;
+	vcounter_t last, leap_at, vmin, vmax;
+	long double base, period;
+	double leap, p;
+	size_t i;
+
+	if (!clock || !vcount || !abstime)
+		return (1);
+	if (n == 0)
+		return (0);
+
+	if (batch_snapshot(clock, &rad_data, 0, &p))
+		return (1);
+
+	last = rad_data.last_changed;
+	base = last * (long double)rad_data.phat + rad_data.ca - rad_data.leapsec_total;
+	period = p;
+	leap_at = rad_data.leapsec_expected ? rad_data.leapsec_expected : ~(vcounter_t)0;
+	leap = rad_data.leapsec_expected ? rad_data.leapsec_next : 0;
+
+	for (i = 0; i < n; i++) {
+		abstime[i] = base + (int64_t)(vcount[i] - last) * period;
+		abstime[i] -= vcount[i] > leap_at ? leap : 0;
+	}
+
+	batch_minmax(vcount, n, &vmin, &vmax);
+	return (batch_quality(&rad_data, vmin, vmax));
+}
+
+
+int
+radclock_vcount_to_abstime_ns_batch(struct radclock *clock, const vcounter_t *vcount,
+		int64_t *abstime_ns, size_t n)
+{
+	struct radclock_data rad_data;
+	vcounter_t last, leap_at, vmin, vmax;
+	long double base;
+	int64_t base_ns, leap_ns;
+	double base_frac, period_ns, p;
+	size_t i;
+
+	if (!clock || !vcount || !abstime_ns)
+		return (1);
+	if (n == 0)
+		return (0);
+
+	if (batch_snapshot(clock, &rad_data, 0, &p))
+		return (1);
+
+	/* Integer ns at last_changed, the fraction is carried in the double part.
+	 * Relative to last_changed, a double keeps well below 1 ns over any SKM
+	 * scale, results are rounded down to the ns as by the single value calls. */
+	last = rad_data.last_changed;
+	base = (last * (long double)rad_data.phat + rad_data.ca - rad_data.leapsec_total)
+		* 1e9L;
+	base_ns = (int64_t) floorl(base);
+	base_frac = (double) (base - base_ns);
+	period_ns = p * 1e9;
+	leap_at = rad_data.leapsec_expected ? rad_data.leapsec_expected : ~(vcounter_t)0;
+	leap_ns = rad_data.leapsec_expected ? (int64_t) rad_data.leapsec_next * 1000000000 : 0;
+
+	for (i = 0; i < n; i++) {
+		abstime_ns[i] = base_ns + (int64_t)
+			floor(base_frac + (double)(int64_t)(vcount[i] - last) * period_ns);
+		abstime_ns[i] -= vcount[i] > leap_at ? leap_ns : 0;
+	}
+
+	batch_minmax(vcount, n, &vmin, &vmax);
+	return (batch_quality(&rad_data, vmin, vmax));
+}
+
+
+int
+radclock_duration_batch(struct radclock *clock, const vcounter_t *from_vcount,
+		const vcounter_t *till_vcount, long double *duration, size_t n)
+{
+	struct radclock_data rad_data;
+	vcounter_t now, oldest, newest;
+	long double period;
+	double p;
+	size_t i;
+
+	if (!clock || !from_vcount || !till_vcount || !duration)
+		return (1);
+	if (n == 0)
+		return (0);
+
+	// Same penalty as radclock_duration, quality is relative to now
+	if (radclock_get_vcounter(clock, &now))
+		return (1);
+
+	if (batch_snapshot(clock, &rad_data, 1, &p))
+		return (1);
+
+	period = p;
+	for (i = 0; i < n; i++)
+		duration[i] = (int64_t)(till_vcount[i] - from_vcount[i]) * period;
+
+	/* Difference clock only holds within the SKM scale of the oldest event */
+	if (clock->ipc_sms) {
+		batch_minmax(from_vcount, n, &oldest, &newest);
+		if ((now - oldest) * rad_data.phat >= OUT_SKM)
+			return (1);
+	}
+
+	return (raddata_quality(now, rad_data.last_changed, rad_data.next_expected,
+			rad_data.phat));
+}
+
+
+/*
+ * Fixed-point reads, see struct radclock_sms_fp.
+ * The conversion from the origin is floor((delta * mult + frac) >> shift) after
+ * it, and the mirror ceiling before it. mult carries 63 bits of the period or
+ * more, so the arithmetic error is well below 0.1 ns over a day from the
+ * update, about the rounding of the long double path itself at current
+ * dates. Results agree with the long double time truncated to whole ns to
+ * within 1 ns.
+ */
+static inline int64_t
+fp_vcount_to_ns(const struct radclock_sms_fp *fp, vcounter_t vcount, int plocal)
+{
+	uint64_t round;
+	int64_t ns;
+
+	if (vcount >= fp->ref)
+		ns = fp->ns + (int64_t) fp_mulshift(vcount - fp->ref, fp->mult[plocal],
+				fp->frac, 0, fp->shift);
+	else {
+		round = fp->shift == 64 ? ~(uint64_t)0 : ((uint64_t)1 << fp->shift) - 1;
+		ns = fp->ns - (int64_t) fp_mulshift(fp->ref - vcount, fp->mult[plocal],
+				round, fp->frac, fp->shift);
+	}
+	if (vcount > fp->leap_at)
+		ns -= fp->leap_ns;
+	return (ns);
+}
+
+
+int
+radclock_vcount_to_abstime_ns(struct radclock *clock, const vcounter_t *vcount,
+		int64_t *abstime_ns)
+{
+	struct radclock_sms_fp fp;
+	vcounter_t next_expected;
+	long double time;
+	double phat;
+	int quality;
+
+	if (!clock || !vcount || !abstime_ns)
+		return (1);
+
+	if (clock->ipc_sms && sms_read_fp(clock, &fp, &next_expected, &phat) == 0) {
+		*abstime_ns = fp_vcount_to_ns(&fp, *vcount,
+				clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON);
+		return (raddata_quality(*vcount, fp.ref, next_expected, phat));
+	}
+
+	/* No fixed-point clock published, old daemon or kernel data */
+	quality = radclock_vcount_to_abstime(clock, vcount, &time);
+	if (quality != 1)
+		*abstime_ns = (int64_t) floorl(time * 1e9L);
+	return (quality);
+}
+
+
+int
+radclock_gettime_ns(struct radclock *clock, int64_t *abstime_ns)
+{
+	vcounter_t vcount;
+
+	if (!clock || !abstime_ns)
+		return (1);
+
+	if (radclock_get_vcounter(clock, &vcount) < 0)
+		return (1);
+
+	return (radclock_vcount_to_abstime_ns(clock, &vcount, abstime_ns));
+}
+
+
+int
+radclock_gettime_timespec(struct radclock *clock, struct timespec *abstime_ts)
+{
+	int64_t ns;
+	int quality;
+
+	if (!abstime_ts)
+		return (1);
+
+	quality = radclock_gettime_ns(clock, &ns);
+	if (quality == 1)
+		return (1);
+
+	abstime_ts->tv_sec = ns / 1000000000;
+	abstime_ts->tv_nsec = ns % 1000000000;
+	if (abstime_ts->tv_nsec < 0) {
+		abstime_ts->tv_sec--;
+		abstime_ts->tv_nsec += 1000000000;
+	}
+	return (quality);
+}
+
+
+/*
+ * Clock snapshot.
+ * One counter read and one copy of the clock data, the radclock_snapshot_*
+ * functions then never touch the SMS or the kernel again. With kernel data
+ * there are no error metrics and the local period is not used, as for
+ * ffcounter_to_abstime_kernel.
+ */
+int
+radclock_snapshot(struct radclock *clock, struct radclock_snapshot *snap)
+{
+	struct ffclock_data cdat;
+	struct radclock_data rad_data;
+	struct radclock_error rad_err;
+
+	if (!clock || !snap)
+		return (1);
+
+	if (radclock_get_vcounter(clock, &snap->vcount))
+		return (1);
+
+	if (clock->ipc_sms) {
+		sms_read(clock, &rad_data, &rad_err);
+		snap->local_period = (clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON);
+		snap->has_error = 1;
+		snap->error_bound = rad_err.error_bound;
+		snap->error_bound_avg = rad_err.error_bound_avg;
+		snap->error_bound_std = rad_err.error_bound_std;
+		snap->min_RTT = rad_err.min_RTT;
+	} else {
+		if (get_kernel_ffclock(clock, &cdat))
+			return (1);
+		fill_radclock_data(&cdat, &rad_data);
+		snap->local_period = 0;
+		snap->has_error = 0;
+		snap->error_bound = 0;
+		snap->error_bound_avg = 0;
+		snap->error_bound_std = 0;
+		snap->min_RTT = 0;
+	}
+
+	snap->phat = rad_data.phat;
+	snap->phat_err = rad_data.phat_err;
+	snap->phat_local = rad_data.phat_local;
+	snap->phat_local_err = rad_data.phat_local_err;
+	snap->ca = rad_data.ca;
+	snap->ca_err = rad_data.ca_err;
+	snap->status = rad_data.status;
+	snap->last_changed = rad_data.last_changed;
+	snap->next_expected = rad_data.next_expected;
+	snap->leapsec_expected = rad_data.leapsec_expected;
+	snap->leapsec_total = rad_data.leapsec_total;
+	snap->leapsec_next = rad_data.leapsec_next;
+
+	return (0);
+}
+
+
+/* Same arithmetic as read_RADabs_UTC */
+int
+radclock_snapshot_abstime(const struct radclock_snapshot *snap,
+		const vcounter_t *vcount, long double *abstime)
+{
+	vcounter_t vc;
+	long double time;
+
+	if (!snap || !abstime)
+		return (1);
+
+	vc = vcount ? *vcount : snap->vcount;
+	time = vc * (long double)snap->phat + snap->ca;
+	if (snap->local_period && snap->phat != snap->phat_local)
+		time += ((long double)vc - (long double)snap->last_changed) *
+			(long double)(snap->phat_local - snap->phat);
+	time -= snap->leapsec_total;
+	if (snap->leapsec_expected != 0 && vc > snap->leapsec_expected)
+		time -= snap->leapsec_next;
+	*abstime = time;
+
+	return (raddata_quality(vc, snap->last_changed, snap->next_expected,
+			snap->phat));
+}
+
+
+int
+radclock_snapshot_duration(const struct radclock_snapshot *snap,
+		const vcounter_t *from_vcount, const vcounter_t *till_vcount,
+		long double *duration)
+{
+	if (!snap || !from_vcount || !till_vcount || !duration)
+		return (1);
+
+	if (snap->local_period)
+		*duration = (*till_vcount - *from_vcount) * (long double)snap->phat_local;
+	else
+		*duration = (*till_vcount - *from_vcount) * (long double)snap->phat;
+
+	/* Difference clock only holds within the SKM scale. Testing is done on the
+	 * snapshot counter since the snapshot data is current at that time. */
+	if ((snap->vcount - *from_vcount) * snap->phat >= OUT_SKM)
+		return (1);
+
+	return (radclock_snapshot_quality(snap));
+}
+
+
+int
+radclock_snapshot_elapsed(const struct radclock_snapshot *snap,
+		const vcounter_t *from_vcount, long double *duration)
+{
+	if (!snap)
+		return (1);
+	return (radclock_snapshot_duration(snap, from_vcount, &snap->vcount, duration));
+}
+
+
+int
+radclock_snapshot_quality(const struct radclock_snapshot *snap)
+{
+	if (!snap)
+		return (1);
+	return (raddata_quality(snap->vcount, snap->last_changed,
+			snap->next_expected, snap->phat));
+}
+
+
+int
+radclock_snapshot_error_bound(const struct radclock_snapshot *snap,
+		const vcounter_t *vcount, double *error_bound)
+{
+	vcounter_t vc;
+	double age;
+
+	if (!snap || !error_bound || !snap->has_error)
+		return (1);
+
+	vc = vcount ? *vcount : snap->vcount;
+	if (vc > snap->last_changed)
+		age = (vc - snap->last_changed) * snap->phat;
+	else
+		age = (snap->last_changed - vc) * snap->phat;
+	*error_bound = snap->error_bound + age * snap->phat_err;
+
+	return (0);
+}
+
+
+/*
+ * Fast reader, see radclock_fast.h
+ */
+int
+radclock_fast_init(struct radclock *clock, struct radclock_fast *fast)
+{
+#ifdef RADCLOCK_FAST_SUPPORTED
+	struct radclock_sms *sms;
+
+	if (!clock || !fast)
+		return (1);
+
+	sms = (struct radclock_sms *) clock->ipc_sms;
+	if (sms == NULL || clock->ipc_sms_version < 2 || sms->version < 2) {
+		logger(RADLOG_ERR, "Fast read needs the SMS version 2 of the daemon");
+		return (1);
+	}
+	if (strcasecmp(clock->hw_counter, "tsc") != 0) {
+		logger(RADLOG_ERR, "Fast read needs the TSC as counter, not %s",
+				clock->hw_counter);
+		return (1);
+	}
+
+	fast->clock = clock;
+	fast->seq = &sms->v2.seq;
+	return (radclock_fast_refresh(fast));
+#else
+	logger(RADLOG_ERR, "Fast read not supported on this platform");
+	return (1);
+#endif
+}
+
+
+int
+radclock_fast_refresh(struct radclock_fast *fast)
+{
+#ifdef RADCLOCK_FAST_SUPPORTED
+	struct radclock_sms *sms;
+	struct radclock_data rad_data;
+	long double time, period;
+	uint32_t seq;
+
+	sms = (struct radclock_sms *) fast->clock->ipc_sms;
+	if (sms->version < 2)
+		return (1);
+
+	seq = sms_read(fast->clock, &rad_data, NULL);
+
+	/* Nothing published yet */
+	if (rad_data.phat <= 0)
+		return (1);
+
+	/* UTC time at last update, expected leap second applied by the reader */
+	time = rad_data.last_changed * (long double)rad_data.phat + rad_data.ca;
+	time -= rad_data.leapsec_total;
+	fast->ref_sec = (int64_t) time;
+	if (time < fast->ref_sec)
+		fast->ref_sec--;
+	/* A fraction just below 1 may round up to 2^64 */
+	time = (time - fast->ref_sec) * TWO32 * TWO32;
+	fast->ref_frac = time < TWO32 * TWO32 ? (uint64_t) time : UINT64_MAX;
+
+	/* Same period as read_RADabs_UTC from last_changed, normalised in [1/2, 1)
+	 * so that the mantissa keeps 64 bits whatever the counter frequency */
+	if (fast->clock->local_period_mode == RADCLOCK_LOCAL_PERIOD_ON)
+		period = rad_data.phat_local;
+	else
+		period = rad_data.phat;
+	fast->period_shift = 0;
+	while (period < 0.5 && fast->period_shift < 63) {
+		period *= 2;
+		fast->period_shift++;
+	}
+	fast->period_mult = (uint64_t) (period * TWO32 * TWO32);
+
+	fast->ref = rad_data.last_changed;
+	fast->valid = rad_data.next_expected;
+	fast->skm = (vcounter_t) (OUT_SKM / rad_data.phat);
+	fast->leapsec_expected = rad_data.leapsec_expected;
+	fast->leapsec_next = rad_data.leapsec_next;
+	fast->seq_seen = seq;
+
+	return (0);
+#else
+	return (1);
+#endif
+}
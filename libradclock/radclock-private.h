@@ -38,8 +38,11 @@ struct radclock_impl_bsd
 	int dev_fd;
 };
 
+struct radclock_gnl;		// persistent netlink channel, see kclock-linux.c
+
 struct radclock_impl_linux {
 	int radclock_gnl_id;
+	struct radclock_gnl *gnl;
 };
 
 
@@ -73,10 +76,108 @@ struct radclock_error
 	double min_RTT;
 };
 
+/*
+ * Fixed-point form of the UTC clock, computed by the writer on each update so
+ * that readers convert a counter value with an integer multiply-shift only:
+ *
+ *   T(v) [ns] = ns + ((v - ref) * mult[p] + frac) >> shift
+ *
+ * and leap_ns less past leap_at, with p = 1 for the local period. The origin
+ * is last_changed so this is the clock of read_RADabs_UTC. shift is the
+ * largest (up to 64) that keeps both mult in 64 bits, so the period has 63
+ * significant bits or more and the product needs 128 bits.
+ */
+struct radclock_sms_fp {
+	vcounter_t ref;				// origin, last_changed [counter]
+	int64_t ns;						// UTC time at ref, whole ns
+	uint64_t frac;					// fraction of ns at ref [2^-shift ns]
+	uint64_t mult[2];				// phat, phat_local [2^-shift ns]
+	vcounter_t leap_at;			// leap second applied past this value, or ~0
+	int64_t leap_ns;				// value of the expected leap second [ns]
+	uint32_t shift;
+	uint32_t valid;				// 0 until a clock with a period is published
+};
+
+/*
+ * (a * b + add - sub) >> shift, with a 128 bit intermediate. The fixed-point
+ * clock conversions of the library and of the daemon's NTP server use it.
+ */
+static inline uint64_t
+fp_mulshift(uint64_t a, uint64_t b, uint64_t add, uint64_t sub, uint32_t shift)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 x;
+
+	x = (unsigned __int128) a * b + add - sub;
+	return ((uint64_t) (x >> shift));
+#else
+	uint64_t a0, a1, b0, b1, p00, p01, p10, p11, mid, lo, hi;
+
+	a0 = (uint32_t) a;
+	a1 = a >> 32;
+	b0 = (uint32_t) b;
+	b1 = b >> 32;
+	p00 = a0 * b0;
+	p01 = a0 * b1;
+	p10 = a1 * b0;
+	p11 = a1 * b1;
+	mid = (p00 >> 32) + (uint32_t) p01 + (uint32_t) p10;
+	lo = (mid << 32) | (uint32_t) p00;
+	hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+
+	lo += add;
+	hi += (lo < add);
+	hi -= (lo < sub);
+	lo -= sub;
+
+	if (shift == 0)
+		return (lo);
+	if (shift == 64)
+		return (hi);
+	return ((hi << (64 - shift)) | (lo >> shift));
+#endif
+}
+
+/*
+ * SMS version 2.
+ * A seqlock protected copy of the clock data. The writer makes seq odd, updates
+ * the fields and makes seq even again, fenced so that a reader which saw seq
+ * unchanged and even around its copy has a consistent one. The writer never
+ * waits, readers retry only across an update.
+ * Fields are grouped by cache line on how often they are read: the first line
+ * holds all a time read needs, the second the quality check inputs and error
+ * estimates read by the getters, the third the fixed-point form of the clock.
+ */
+struct radclock_sms_v2 {
+	uint32_t seq;					// odd while an update is in progress
+	unsigned int status;
+	double phat;
+	long double ca;
+	double phat_local;
+	vcounter_t last_changed;
+	vcounter_t leapsec_expected;
+	int leapsec_total;
+	int leapsec_next;
+
+	vcounter_t next_expected __attribute__((aligned(64)));
+	double phat_err;
+	double phat_local_err;
+	double ca_err;
+	struct radclock_error error;
+
+	struct radclock_sms_fp fp __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
 /*
  * Structure representing radclock data and exposed to system processes via IPC
  * shared memory.
+ * The version 1 part is double buffered, with gen zeroed during an update. It
+ * is kept unchanged at the head of the segment for old clients, the daemon
+ * updates both. The v2 part follows on its own cache lines, away from the v1
+ * buffers.
  */
+#define RADCLOCK_SMS_VERSION	2
+
 struct radclock_sms {
 	int version;
 	int status;
@@ -88,8 +189,29 @@ struct radclock_sms {
 	size_t error_off_old;
 	struct radclock_data bufdata[2];
 	struct radclock_error buferr[2];
+
+	struct radclock_sms_v2 v2;
 };
 
+/*
+ * Segment as created by a version 1 daemon, the head of struct radclock_sms.
+ * The v2 part is cache line aligned, so the v1 size is not its offset.
+ */
+struct radclock_sms_v1 {
+	int version;
+	int status;
+	int clockid;
+	unsigned int gen;
+	size_t data_off;
+	size_t data_off_old;
+	size_t error_off;
+	size_t error_off_old;
+	struct radclock_data bufdata[2];
+	struct radclock_error buferr[2];
+};
+
+#define SMS_V1_SIZE		sizeof(struct radclock_sms_v1)
+
 #define SMS_DATA(x)		((struct radclock_data *)((void *)x + x->data_off))
 #define SMS_DATAold(x)		((struct radclock_data *)((void *)x + x->data_off_old))
 #define SMS_ERROR(x)		((struct radclock_error *)((void *)x + x->error_off))
@@ -106,6 +228,7 @@ struct radclock {
 	/* IPC shared memory */
 	int ipc_sms_id;
 	void *ipc_sms;
+	int ipc_sms_version;		// highest SMS version the mapped segment can hold
 
 	/* Description of current counter */
 	char hw_counter[32];
@@ -115,6 +238,7 @@ struct radclock {
 
 	/* Pcap handler for the RADclock only */
 	pcap_t *pcap_handle;
+	struct pktcap_ring *pcap_ring;	// capture ring, replaces pcap_loop() if set
 	pktcap_tsmode_t tsmode;
 
 	/* Syscalls */
@@ -170,6 +294,63 @@ int extract_vcount_stamp(
 		vcounter_t *vcount,
 		struct pcap_pkthdr *rdhdr);
 
+
+/*
+ * Memory mapped capture ring (Linux AF_PACKET, TPACKET_V3), an alternative to
+ * libpcap for the daemon's live input. The kernel fills whole blocks of frames
+ * and hands them over in one go. A block is owned by userland from the time it
+ * is returned by pktcap_ring_next_block() until it is given back with
+ * pktcap_ring_release_block(), frames can be read and modified in place in the
+ * meantime. Blocks are handed over in ring order and may be given back in any
+ * order, the ring stops at a block that has not been given back yet.
+ * The ring itself does not need FFclock support, the system specific bits
+ * (vcount location, timestamping mode) are in pcap-<os>.c
+ */
+struct pktcap_ring {
+	int fd;
+	void *map;					// the whole ring
+	size_t map_len;
+	unsigned int block_size;
+	unsigned int block_nr;
+	unsigned int next;			// next block expected from the kernel
+	unsigned char *owned;		// per block, handed over and not given back
+	int linktype;				// DLT of the interface
+	int skip_outgoing;			// loopback, frames are seen twice
+	int breakloop;				// set from a signal handler
+};
+
+/* Position within a block owned by the reader */
+struct pktcap_ring_cursor {
+	void *block;
+	void *frame;				// next frame header
+	unsigned int left;			// frames not walked yet
+	int skip_outgoing;
+};
+
+int pktcap_ring_open(const char *ifname, struct bpf_program *fp,
+		int timeout_ms, struct pktcap_ring **ring);
+void pktcap_ring_close(struct pktcap_ring *ring);
+int pktcap_ring_setfilter(struct pktcap_ring *ring, struct bpf_program *fp);
+int pktcap_ring_set_tsmode(struct radclock *clock, struct pktcap_ring *ring,
+		pktcap_tsmode_t mode, u_int custom);
+int pktcap_ring_next_block(struct pktcap_ring *ring, int timeout_ms,
+		void **block);
+void pktcap_ring_release_block(struct pktcap_ring *ring, void *block);
+void pktcap_ring_breakloop(struct pktcap_ring *ring);
+void pktcap_ring_cursor_init(struct pktcap_ring *ring,
+		struct pktcap_ring_cursor *cur, void *block);
+unsigned char *pktcap_ring_next_frame(struct pktcap_ring_cursor *cur,
+		struct pcap_pkthdr *hdr);
+
+/**
+ * System specific calls for the timestamping mode and vcount of frames read
+ * from a capture ring.
+ */
+int descriptor_set_tsmode_fd(struct radclock *clock, int fd, int *mode,
+		u_int custom);
+int extract_vcount_ring(struct radclock *clock, const unsigned char *frame,
+		vcounter_t *vcount);
+
 int radclock_init_vcounter_syscall(struct radclock *clock);
 int radclock_init_vcounter(struct radclock *clock);
 int radclock_get_vcounter_syscall(struct radclock *clock, vcounter_t *vcount);
@@ -177,10 +358,23 @@ int radclock_get_vcounter_rdtsc(struct radclock *clock, vcounter_t *vcount);
 
 int has_vm_vcounter(struct radclock *clock);
 int init_kernel_clock(struct radclock *clock_handle);
+void close_kernel_clock(struct radclock *clock_handle);
 
 int sms_init_writer(struct radclock *clock);
+/* As sms_init_reader and sms_init_writer, on the segment of a given key */
+int sms_attach_reader(struct radclock *clock, key_t sms_key);
+int sms_create_writer(struct radclock *clock, key_t sms_key);
 int sms_detach(struct radclock *clock);
 
+/* Consistent copy of the clock data in and out of the SMS. Either of the
+ * reader's arguments may be NULL, it returns the sequence number read at. */
+void sms_write(struct radclock *clock, struct radclock_data *rad_data,
+		struct radclock_error *rad_err);
+uint32_t sms_read(struct radclock *clock, struct radclock_data *rad_data,
+		struct radclock_error *rad_err);
+int sms_read_fp(struct radclock *clock, struct radclock_sms_fp *fp,
+		vcounter_t *next_expected, double *phat);
+
 
 
 /* Read the RADclock absolute clock within the daemon or user radclock.
@@ -28,6 +28,7 @@
 #define _RADCLOCK_H
 
 #include <sys/time.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <pcap.h>
 
@@ -203,6 +204,191 @@ int radclock_duration(struct radclock *clock, const vcounter_t *start_vcount,
 		const vcounter_t *end_vcount, long double *duration);
 
 
+/**
+ * Convert an array of vcounter values to absolute time. A single snapshot of
+ * the clock parameters is used for the whole array, honoring the local period
+ * mode and the leap second fields. Cheaper and more consistent than calling
+ * radclock_vcount_to_abstime in a loop.
+ * @param  clock Access to the private RADclock
+ * @param  vcount The n vcounter values to convert
+ * @param  abstime The n long double times to be filled
+ * @param  n Number of values
+ * @return 0 on success
+ * @return 1 on error
+ * @return 2 on possibly poor quality timestamps (worst over the array)
+ * @return 3 on very poor quality timestamps (worst over the array)
+ */
+int radclock_vcount_to_abstime_batch(struct radclock *clock,
+		const vcounter_t *vcount, long double *abstime, size_t n);
+
+
+/**
+ * Same as radclock_vcount_to_abstime_batch, with times as int64 nanoseconds
+ * since the epoch (truncated).
+ * @param  clock Access to the private RADclock
+ * @param  vcount The n vcounter values to convert
+ * @param  abstime_ns The n times to be filled [ns]
+ * @param  n Number of values
+ * @return as radclock_vcount_to_abstime_batch
+ */
+int radclock_vcount_to_abstime_ns_batch(struct radclock *clock,
+		const vcounter_t *vcount, int64_t *abstime_ns, size_t n);
+
+
+/**
+ * Get the durations between n pairs of vcount events from the difference
+ * clock, using a single snapshot of the clock parameters.
+ * @param  clock Access to the private RADclock
+ * @param  start_vcount The n vcount values of the start events
+ * @param  end_vcount The n vcount values of the ending events
+ * @param  duration The n long double time intervals to be filled
+ * @param  n Number of pairs
+ * @return 0 on success
+ * @return 1 on error, or if the oldest start event is out of the SKM scale
+ * @return 2 on possibly poor quality durations
+ * @return 3 on very poor quality durations
+ */
+int radclock_duration_batch(struct radclock *clock,
+		const vcounter_t *start_vcount, const vcounter_t *end_vcount,
+		long double *duration, size_t n);
+
+
+/**
+ * Convert a vcounter value to absolute time in nanoseconds since the epoch,
+ * using the fixed-point form of the clock published by the daemon: integer
+ * multiply and shift only, no floating point. The result is the long double
+ * time of radclock_vcount_to_abstime truncated to the nanosecond, within
+ * 1 ns. Falls back on the long double path if the daemon does not publish it.
+ * @param  clock Access to the private RADclock
+ * @param  vcount A reference to the vcounter value to convert
+ * @param  abstime_ns A reference to the time to be filled [ns]
+ * @return as radclock_vcount_to_abstime
+ */
+int radclock_vcount_to_abstime_ns(struct radclock *clock, const vcounter_t *vcount,
+		int64_t *abstime_ns);
+
+
+/**
+ * Get the time from the radclock in nanoseconds since the epoch, see
+ * radclock_vcount_to_abstime_ns.
+ * @param  clock Access to the private RADclock
+ * @param  abstime_ns A reference to the time to be filled [ns]
+ * @return as radclock_gettime
+ */
+int radclock_gettime_ns(struct radclock *clock, int64_t *abstime_ns);
+
+
+/**
+ * Get the time from the radclock in a timespec, see
+ * radclock_vcount_to_abstime_ns.
+ * @param  clock Access to the private RADclock
+ * @param  abstime_ts A reference to the timespec to be filled
+ * @return as radclock_gettime
+ */
+int radclock_gettime_timespec(struct radclock *clock, struct timespec *abstime_ts);
+
+
+/**
+ * Clock snapshot.
+ * A consistent copy of the clock parameters and error estimates together with
+ * a counter value, taken in one call. The radclock_snapshot_* functions below
+ * only work on the copy, so a caller needing several values (eg a timestamp,
+ * its quality and error bound) reads the counter and the shared memory once.
+ * Their return codes are those of the equivalent radclock_* functions, with
+ * the snapshot counter standing for the current counter value.
+ */
+struct radclock_snapshot {
+	vcounter_t vcount;			// counter value when the snapshot was taken
+	double phat;
+	double phat_err;
+	double phat_local;
+	double phat_local_err;
+	long double ca;
+	double ca_err;
+	unsigned int status;
+	vcounter_t last_changed;
+	vcounter_t next_expected;
+	vcounter_t leapsec_expected;
+	int leapsec_total;
+	int leapsec_next;
+	int local_period;			// reads use phat_local (local period mode on)
+	int has_error;				// error metrics below are valid (not for kernel data)
+	double error_bound;
+	double error_bound_avg;
+	double error_bound_std;
+	double min_RTT;
+};
+
+
+/**
+ * Take a snapshot of the clock: read the counter and copy the clock data.
+ * @param  clock Access to the private RADclock
+ * @param  snap The snapshot to be filled
+ * @return 0 on success
+ * @return 1 on error
+ */
+int radclock_snapshot(struct radclock *clock, struct radclock_snapshot *snap);
+
+
+/**
+ * Absolute time of a counter value from a snapshot.
+ * @param  snap The snapshot
+ * @param  vcount The counter value to convert, NULL for the snapshot counter
+ * @param  abstime A reference to the long double time to be filled
+ * @return as radclock_vcount_to_abstime
+ */
+int radclock_snapshot_abstime(const struct radclock_snapshot *snap,
+		const vcounter_t *vcount, long double *abstime);
+
+
+/**
+ * Time elapsed between a past event and the snapshot, from the difference
+ * clock.
+ * @param  snap The snapshot
+ * @param  past_vcount The vcount value of the past event
+ * @param  duration A reference to the long double time interval to be filled
+ * @return as radclock_elapsed
+ */
+int radclock_snapshot_elapsed(const struct radclock_snapshot *snap,
+		const vcounter_t *past_vcount, long double *duration);
+
+
+/**
+ * Duration between two events from the difference clock of a snapshot.
+ * @param  snap The snapshot
+ * @param  start_vcount The vcount value of the start event
+ * @param  end_vcount The vcount value of the ending event
+ * @param  duration A reference to the long double time interval to be filled
+ * @return as radclock_duration
+ */
+int radclock_snapshot_duration(const struct radclock_snapshot *snap,
+		const vcounter_t *start_vcount, const vcounter_t *end_vcount,
+		long double *duration);
+
+
+/**
+ * Quality of the clock data of a snapshot, at the snapshot counter.
+ * @param  snap The snapshot
+ * @return 0 if the data is current
+ * @return 2 if the clock has missed its expected update
+ * @return 3 if the data is very old, or the counter went backward
+ */
+int radclock_snapshot_quality(const struct radclock_snapshot *snap);
+
+
+/**
+ * Error bound of the clock at a counter value: the clock error bound at the
+ * last update, plus the drift allowed by the period error since then.
+ * @param  snap The snapshot
+ * @param  vcount The counter value, NULL for the snapshot counter
+ * @param  error_bound A reference to the double error bound to be filled [s]
+ * @return 0 on success
+ * @return 1 if the snapshot has no error metrics
+ */
+int radclock_snapshot_error_bound(const struct radclock_snapshot *snap,
+		const vcounter_t *vcount, double *error_bound);
+
+
 /** 
  * Get instantaneous estimate of the clock error bound in seconds
  * @param  clock Access to the private RADclock
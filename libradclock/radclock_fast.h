@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RADCLOCK_FAST_H
+#define _RADCLOCK_FAST_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "radclock.h"
+
+/*
+ * Inline fast read of the RADclock absolute (UTC) clock.
+ *
+ * A radclock_fast holds a snapshot of the clock data taken from the SMS (v2)
+ * published by the daemon, in integer form: the time at the last update as
+ * seconds and a 2^-64 s fraction, and the counter period as a 64 bit
+ * mantissa and shift, so that it keeps 64 significant bits. A read checks the
+ * SMS sequence number, reads the TSC and does two 64x64 bit multiplies. The
+ * snapshot is only refreshed, out of line, after the daemon has published an
+ * update.
+ * The counter must be the TSC, and the platform x86_64. Each thread should
+ * use its own radclock_fast, reads refresh it in place.
+ * The local period mode of the clock is taken into account at refresh.
+ * Results agree with radclock_gettime to within a nanosecond.
+ */
+#if defined(__x86_64__) && defined(__SIZEOF_INT128__)
+#define RADCLOCK_FAST_SUPPORTED
+#endif
+
+struct radclock_fast {
+	const uint32_t *seq;			// SMS v2 sequence number, in the mapped segment
+	uint32_t seq_seen;			// sequence number of the snapshot
+	int leapsec_next;
+	vcounter_t ref;				// counter at last update
+	int64_t ref_sec;				// UTC time at ref [s]
+	uint64_t ref_frac;			// and its fraction [2^-64 s]
+	uint64_t period_mult;		// counter period [2^-(64+period_shift) s]
+	int period_shift;
+	vcounter_t valid;				// counter value of next expected update
+	vcounter_t skm;				// SKM scale [counter units]
+	vcounter_t leapsec_expected;
+	struct radclock *clock;
+};
+
+/**
+ * Set up a fast reader on an initialised clock.
+ * @return 0 on success, 1 if not possible (no SMS v2, counter not the TSC,
+ * platform not supported), in which case use radclock_gettime.
+ */
+int radclock_fast_init(struct radclock *clock, struct radclock_fast *fast);
+
+/**
+ * Take a new snapshot of the SMS, called by the read functions as needed.
+ * @return 0 on success
+ */
+int radclock_fast_refresh(struct radclock_fast *fast);
+
+
+#ifdef RADCLOCK_FAST_SUPPORTED
+
+static inline vcounter_t
+radclock_fast_readtsc(void)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+	return ((vcounter_t)high << 32 | low);
+}
+
+
+/* Counter value to UTC seconds and 2^-64 fraction, with the snapshot */
+static inline void
+radclock_fast_vcount_to_bintime(const struct radclock_fast *fast,
+		vcounter_t vcount, int64_t *sec, uint64_t *frac)
+{
+	unsigned __int128 delta;		// elapsed time since ref [2^-64 s]
+	uint64_t lo;
+
+	if (vcount >= fast->ref) {
+		delta = ((unsigned __int128)(vcount - fast->ref) * fast->period_mult) >>
+			fast->period_shift;
+		lo = fast->ref_frac + (uint64_t)delta;
+		*sec = fast->ref_sec + (int64_t)(delta >> 64) + (lo < fast->ref_frac);
+	} else {
+		delta = ((unsigned __int128)(fast->ref - vcount) * fast->period_mult) >>
+			fast->period_shift;
+		lo = fast->ref_frac - (uint64_t)delta;
+		*sec = fast->ref_sec - (int64_t)(delta >> 64) - (lo > fast->ref_frac);
+	}
+	*frac = lo;
+
+	/* Include the expected leap second once past it */
+	if (fast->leapsec_expected != 0 && vcount > fast->leapsec_expected)
+		*sec -= fast->leapsec_next;
+}
+
+
+/* Same quality codes as radclock_gettime */
+static inline int
+radclock_fast_quality(const struct radclock_fast *fast, vcounter_t now)
+{
+	if (now < fast->ref)
+		return (3);
+	if (now > fast->valid)
+		return ((now - fast->valid > fast->skm) ? 3 : 2);
+	return (0);
+}
+
+
+static inline int
+radclock_fast_check(struct radclock_fast *fast)
+{
+	if (__atomic_load_n(fast->seq, __ATOMIC_ACQUIRE) != fast->seq_seen)
+		return (radclock_fast_refresh(fast));
+	return (0);
+}
+
+
+/**
+ * Read the clock as a timespec.
+ * @return 1 on error, otherwise the quality code of radclock_gettime
+ */
+static inline int
+radclock_fast_gettime(struct radclock_fast *fast, struct timespec *ts)
+{
+	vcounter_t now;
+	int64_t sec;
+	uint64_t frac;
+
+	if (radclock_fast_check(fast))
+		return (1);
+	now = radclock_fast_readtsc();
+	radclock_fast_vcount_to_bintime(fast, now, &sec, &frac);
+	ts->tv_sec = sec;
+	ts->tv_nsec = (long)(((unsigned __int128)frac * 1000000000) >> 64);
+	return (radclock_fast_quality(fast, now));
+}
+
+
+/**
+ * Read the clock as nanoseconds since the epoch.
+ * @return 1 on error, otherwise the quality code of radclock_gettime
+ */
+static inline int
+radclock_fast_gettime_ns(struct radclock_fast *fast, int64_t *ns)
+{
+	vcounter_t now;
+	int64_t sec;
+	uint64_t frac;
+
+	if (radclock_fast_check(fast))
+		return (1);
+	now = radclock_fast_readtsc();
+	radclock_fast_vcount_to_bintime(fast, now, &sec, &frac);
+	*ns = sec * 1000000000 + (int64_t)(((unsigned __int128)frac * 1000000000) >> 64);
+	return (radclock_fast_quality(fast, now));
+}
+
+#endif	/* RADCLOCK_FAST_SUPPORTED */
+
+#endif	/* _RADCLOCK_FAST_H */
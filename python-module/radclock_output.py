@@ -0,0 +1,166 @@
+# Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+#
+# This file is part of the radclock program.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+# 02110-1301, USA.
+
+"""
+Reader for the binary stamp and clock output files of radclock (-A and -O
+options, sync_output_bin and clock_output_bin configuration keys).
+
+The file is memory mapped. With numpy, columns are views into the mapping
+and nothing is copied or parsed:
+
+	out = radclock_output.OutputFile('clock.bin')
+	phat = out['phat']			# numpy array view, no copy
+	K = out.longdouble('K')		# long double fields are stored as two doubles
+
+Without numpy, columns are read into lists.
+The layout is described in radclock/outputfmt.h.
+"""
+
+import mmap
+import struct
+
+try:
+	import numpy
+except ImportError:
+	numpy = None
+
+
+MAGIC = b'RADCLKB\0'
+VERSION = 1
+KINDS = {1: 'stamp', 2: 'clock'}
+
+# type code: (numpy type, struct format, number of values)
+_TYPES = {
+	1: ('<u8', 'Q', 1),
+	2: ('<f8', 'd', 1),
+	3: ('<f8', 'd', 2),			# long double as (high, low)
+	4: ('<u4', 'I', 1),
+	5: ('<i4', 'i', 1),
+}
+
+_HEADER = struct.Struct('<8sHHHHIIII')
+_FIELD = struct.Struct('<24sBBHI')
+
+
+class OutputFile(object):
+
+	def __init__(self, path):
+		self.path = path
+		f = open(path, 'rb')
+		try:
+			self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+		finally:
+			f.close()
+
+		(magic, self.version, kind, self.nservers, nfields, self.recsize,
+			self.offset, config_len, _) = _HEADER.unpack_from(self._map, 0)
+		if magic != MAGIC:
+			raise ValueError('%s: not a radclock binary output file' % path)
+		if self.version != VERSION:
+			raise ValueError('%s: unsupported version %d' % (path, self.version))
+		self.kind = KINDS.get(kind, kind)
+
+		self._fields = []
+		pos = _HEADER.size
+		for i in range(nfields):
+			name, ftype, size, _, offset = _FIELD.unpack_from(self._map, pos)
+			name = name.rstrip(b'\0').decode('ascii')
+			if ftype not in _TYPES:
+				raise ValueError('%s: unknown type %d of field %s' %
+						(path, ftype, name))
+			self._fields.append((name, ftype, offset))
+			pos += _FIELD.size
+		self.config = self._map[pos:pos + config_len].decode('ascii', 'replace')
+
+		self.nrec = (len(self._map) - self.offset) // self.recsize
+		self.records = None
+		if numpy is not None:
+			dtype = numpy.dtype({
+				'names': [f[0] for f in self._fields],
+				'formats': [(_TYPES[f[1]][0], (2,)) if _TYPES[f[1]][2] == 2 else
+						_TYPES[f[1]][0] for f in self._fields],
+				'offsets': [f[2] for f in self._fields],
+				'itemsize': self.recsize,
+			})
+			self.records = numpy.frombuffer(self._map, dtype=dtype,
+					count=self.nrec, offset=self.offset)
+
+	@property
+	def fields(self):
+		return [f[0] for f in self._fields]
+
+	def __len__(self):
+		return self.nrec
+
+	def _field(self, name):
+		for f in self._fields:
+			if f[0] == name:
+				return f
+		raise KeyError(name)
+
+	def column(self, name):
+		"""
+		Column name. A numpy view of the file if numpy is available, a list
+		otherwise. Long double fields give (high, low) pairs.
+		"""
+		if self.records is not None:
+			return self.records[name]
+		name, ftype, offset = self._field(name)
+		fmt = struct.Struct('<' + _TYPES[ftype][1] * _TYPES[ftype][2])
+		pos = self.offset + offset
+		col = []
+		for i in range(self.nrec):
+			v = fmt.unpack_from(self._map, pos)
+			col.append(v if len(v) > 1 else v[0])
+			pos += self.recsize
+		return col
+
+	__getitem__ = column
+
+	def longdouble(self, name):
+		"""
+		Long double field name rebuilt from its two doubles. This is a copy,
+		numpy.longdouble if numpy is available, floats otherwise (high part
+		only, the low part does not fit a float).
+		"""
+		col = self.column(name)
+		if self.records is not None:
+			if col.ndim != 2:
+				raise TypeError('%s is not a long double field' % name)
+			return col[:, 0].astype(numpy.longdouble) + col[:, 1]
+		return [v[0] for v in col]
+
+	def close(self):
+		"""
+		Unmap the file. Columns obtained before must not be used anymore.
+		"""
+		self.records = None
+		try:
+			self._map.close()
+		except BufferError:
+			pass		# views still alive, unmapped when they are gone
+
+
+if __name__ == '__main__':
+	import sys
+	for path in sys.argv[1:]:
+		out = OutputFile(path)
+		print('%s: %s output, version %d, %d servers, %d records' %
+				(path, out.kind, out.version, out.nservers, len(out)))
+		print('fields: %s' % ' '.join(out.fields))
@@ -301,6 +301,167 @@ pyradclock_get_status ( pyradclock *self )
 
 
 
+/*
+ * Batch conversions
+ * Take a sequence of vcount values and return a list, all values converted
+ * with the same clock parameters.
+ */
+static vcounter_t *
+pyradclock_vcount_array ( PyObject *seq, Py_ssize_t *n )
+{
+	PyObject *fast;
+	vcounter_t *vcount;
+	Py_ssize_t i;
+
+	fast = PySequence_Fast(seq, "Expected a sequence of vcount values");
+	if ( fast == NULL )
+		return NULL;
+
+	*n = PySequence_Fast_GET_SIZE(fast);
+	vcount = PyMem_New(vcounter_t, *n > 0 ? *n : 1);
+	if ( vcount == NULL )
+	{
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for ( i = 0; i < *n; i++ )
+	{
+		vcount[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(fast, i));
+		if ( PyErr_Occurred() )
+		{
+			PyMem_Free(vcount);
+			Py_DECREF(fast);
+			return NULL;
+		}
+	}
+	Py_DECREF(fast);
+	return vcount;
+}
+
+
+static PyObject *
+pyradclock_vcount_to_abstime_batch ( pyradclock *self, PyObject *args )
+{
+	PyObject *seq, *list;
+	vcounter_t *vcount;
+	long double *abstime;
+	Py_ssize_t i, n;
+	int ret;
+
+	if ( !PyArg_ParseTuple(args, "O", &seq) )
+		return NULL;
+	vcount = pyradclock_vcount_array(seq, &n);
+	if ( vcount == NULL )
+		return NULL;
+	abstime = PyMem_New(long double, n > 0 ? n : 1);
+	if ( abstime == NULL )
+	{
+		PyMem_Free(vcount);
+		return PyErr_NoMemory();
+	}
+
+	ret = radclock_vcount_to_abstime_batch((struct radclock *) (self->radclock),
+			vcount, abstime, n);
+	list = NULL;
+	if ( ret == 1 )
+		PyErr_SetString(PyExc_Exception, "RADclock batch conversion failed");
+	else if ( (list = PyList_New(n)) != NULL )
+		for ( i = 0; i < n; i++ )
+			PyList_SET_ITEM(list, i, PyFloat_FromDouble(abstime[i]));
+
+	PyMem_Free(abstime);
+	PyMem_Free(vcount);
+	return list;
+}
+
+
+static PyObject *
+pyradclock_vcount_to_abstime_ns_batch ( pyradclock *self, PyObject *args )
+{
+	PyObject *seq, *list;
+	vcounter_t *vcount;
+	int64_t *abstime_ns;
+	Py_ssize_t i, n;
+	int ret;
+
+	if ( !PyArg_ParseTuple(args, "O", &seq) )
+		return NULL;
+	vcount = pyradclock_vcount_array(seq, &n);
+	if ( vcount == NULL )
+		return NULL;
+	abstime_ns = PyMem_New(int64_t, n > 0 ? n : 1);
+	if ( abstime_ns == NULL )
+	{
+		PyMem_Free(vcount);
+		return PyErr_NoMemory();
+	}
+
+	ret = radclock_vcount_to_abstime_ns_batch((struct radclock *) (self->radclock),
+			vcount, abstime_ns, n);
+	list = NULL;
+	if ( ret == 1 )
+		PyErr_SetString(PyExc_Exception, "RADclock batch conversion failed");
+	else if ( (list = PyList_New(n)) != NULL )
+		for ( i = 0; i < n; i++ )
+			PyList_SET_ITEM(list, i, PyLong_FromLongLong(abstime_ns[i]));
+
+	PyMem_Free(abstime_ns);
+	PyMem_Free(vcount);
+	return list;
+}
+
+
+static PyObject *
+pyradclock_duration_batch ( pyradclock *self, PyObject *args )
+{
+	PyObject *seq_from, *seq_till, *list;
+	vcounter_t *from, *till;
+	long double *duration;
+	Py_ssize_t i, n, n_till;
+	int ret;
+
+	if ( !PyArg_ParseTuple(args, "OO", &seq_from, &seq_till) )
+		return NULL;
+	from = pyradclock_vcount_array(seq_from, &n);
+	if ( from == NULL )
+		return NULL;
+	till = pyradclock_vcount_array(seq_till, &n_till);
+	if ( till == NULL )
+	{
+		PyMem_Free(from);
+		return NULL;
+	}
+	list = NULL;
+	duration = NULL;
+	if ( n != n_till )
+	{
+		PyErr_SetString(PyExc_ValueError, "Sequences of vcount values differ in length");
+		goto out;
+	}
+	duration = PyMem_New(long double, n > 0 ? n : 1);
+	if ( duration == NULL )
+	{
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	ret = radclock_duration_batch((struct radclock *) (self->radclock),
+			from, till, duration, n);
+	if ( ret == 1 )
+		PyErr_SetString(PyExc_Exception, "RADclock batch duration failed");
+	else if ( (list = PyList_New(n)) != NULL )
+		for ( i = 0; i < n; i++ )
+			PyList_SET_ITEM(list, i, PyFloat_FromDouble(duration[i]));
+
+out:
+	PyMem_Free(duration);
+	PyMem_Free(till);
+	PyMem_Free(from);
+	return list;
+}
+
+
 /*
  * List of all implemented object methods
  */
@@ -319,6 +480,9 @@ static PyMethodDef pyradclock_methods[] = {
 	{ "get_period_error", 	(PyCFunction) pyradclock_get_period_error, 	METH_NOARGS, "Get the error on the period estimate.." },
 	{ "get_offset_error", 	(PyCFunction) pyradclock_get_offset_error, 	METH_NOARGS, "Get the error on the offset estimate.." },
 	{ "get_status", 		(PyCFunction) pyradclock_get_status, 		METH_NOARGS, "Get the RADclock status." },
+	{ "vcount_to_abstime_batch", 	(PyCFunction) pyradclock_vcount_to_abstime_batch, 	METH_VARARGS, "Convert a sequence of vcount values to absolute times." },
+	{ "vcount_to_abstime_ns_batch", 	(PyCFunction) pyradclock_vcount_to_abstime_ns_batch, 	METH_VARARGS, "Convert a sequence of vcount values to absolute times in ns." },
+	{ "duration_batch", 	(PyCFunction) pyradclock_duration_batch, 	METH_VARARGS, "Get the durations between two sequences of vcount values." },
 	{ NULL, NULL, 0, NULL }	/* Sentinel to keep last */
 };
 
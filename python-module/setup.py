@@ -65,6 +65,7 @@ created by the radclock.
 It provides all basic functions of the libradclock library: absolute
 clock, difference clock, clock status and system data.
 ''',
-		ext_modules = [module_radclock]
+		ext_modules = [module_radclock],
+		py_modules = ['radclock_output']
 		)
 
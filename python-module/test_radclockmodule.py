@@ -66,3 +66,8 @@ print 'status \t\t= %x' %status
 
 
 
+vcounts = [clock.get_vcounter() for i in range(4)]
+print 'batch abstime \t= %s' %(clock.vcount_to_abstime_batch(vcounts))
+print 'batch abstime ns \t= %s' %(clock.vcount_to_abstime_ns_batch(vcounts))
+print 'batch duration \t= %s' %(clock.duration_batch(vcounts[:-1], vcounts[1:]))
+
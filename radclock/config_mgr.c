@@ -66,6 +66,10 @@ static struct _key keys[] = {
 	{ "synchronization_type",	CONFIG_SYNCHRO_TYPE},
 	{ "ipc_server",				CONFIG_SERVER_IPC},
 	{ "ntp_server",				CONFIG_SERVER_NTP},
+	{ "ntp_server_threads",		CONFIG_NTP_SERVER_THREADS},
+	{ "ntp_server_rate",		CONFIG_NTP_SERVER_RATE},
+	{ "ntp_server_burst",		CONFIG_NTP_SERVER_BURST},
+	{ "ntp_server_kod",			CONFIG_NTP_SERVER_KOD},
 	{ "vm_udp_server",			CONFIG_SERVER_VM_UDP},
 	{ "xen_server",				CONFIG_SERVER_XEN},
 	{ "vmware_server",			CONFIG_SERVER_VMWARE},
@@ -79,17 +83,22 @@ static struct _key keys[] = {
 	{ "best_skm_rate",			CONFIG_BEST_SKM_RATE},
 	{ "offset_ratio",			CONFIG_OFFSET_RATIO},
 	{ "plocal_quality",			CONFIG_PLOCAL_QUALITY},
+	{ "thetahat_fastexp",		CONFIG_THETAHAT_FASTEXP},
 	{ "init_period_estimate",	CONFIG_PHAT_INIT},
 	{ "host_asymmetry",			CONFIG_ASYM_HOST},
 	{ "network_asymmetry",		CONFIG_ASYM_NET},
 	{ "hostname",				CONFIG_HOSTNAME},
 	{ "time_server",			CONFIG_TIME_SERVER},
 	{ "network_device",			CONFIG_NETWORKDEV},
+	{ "capture_backend",		CONFIG_CAPTURE_BACKEND},
 	{ "sync_input_pcap",		CONFIG_SYNC_IN_PCAP},
 	{ "sync_input_ascii",		CONFIG_SYNC_IN_ASCII},
+	{ "sync_input_bin",			CONFIG_SYNC_IN_BIN},
 	{ "sync_output_pcap",		CONFIG_SYNC_OUT_PCAP},
 	{ "sync_output_ascii",		CONFIG_SYNC_OUT_ASCII},
 	{ "clock_output_ascii",		CONFIG_CLOCK_OUT_ASCII},
+	{ "sync_output_bin",		CONFIG_SYNC_OUT_BIN},
+	{ "clock_output_bin",		CONFIG_CLOCK_OUT_BIN},
 	{ "vm_udp_list",			CONFIG_VM_UDP_LIST},
 	{ "",						CONFIG_UNKNOWN} // Must be the last one
 };
@@ -102,6 +111,7 @@ static char* labels_bool[] = { "off", "on" };
 static char* labels_verb[] = { "quiet", "normal", "high" };
 static char* labels_sync[] = { "spy", "piggy", "ntp", "ieee1588", "pps",
 	"vm_udp", "xen", "vmware" };
+static char* labels_capture[] = { "pcap", "ring" };
 
 
 
@@ -136,6 +146,10 @@ config_init(struct radclock_config *conf)
 	conf->server_ipc        = DEFAULT_SERVER_IPC;
 	conf->synchro_type      = DEFAULT_SYNCHRO_TYPE;
 	conf->server_ntp        = DEFAULT_SERVER_NTP;
+	conf->ntp_server_threads = DEFAULT_NTP_SERVER_THREADS;
+	conf->ntp_server_rate   = DEFAULT_NTP_SERVER_RATE;
+	conf->ntp_server_burst  = DEFAULT_NTP_SERVER_BURST;
+	conf->ntp_server_kod    = DEFAULT_NTP_SERVER_KOD;
 	conf->adjust_FFclock    = DEFAULT_ADJUST_FFCLOCK;
 	conf->adjust_FBclock    = DEFAULT_ADJUST_FBCLOCK;
 
@@ -152,6 +166,7 @@ config_init(struct radclock_config *conf)
 	conf->metaparam.BestSKMrate    = BEST_SKM_RATE_GOOD;
 	conf->metaparam.offset_ratio   = OFFSET_RATIO_GOOD;
 	conf->metaparam.plocal_quality = PLOCAL_QUALITY_GOOD;
+	conf->metaparam.thetahat_fastexp = DEFAULT_THETAHAT_FASTEXP;
 	conf->metaparam.path_scale     = DEFAULT_PATH_SCALE;  // in conf, but EXCluded from conf file
 	conf->metaparam.relasym_bound_global = DEFAULT_RELASYM_BOUND_GLOBAL; // "
 	conf->phat_init                = DEFAULT_PHAT_INIT;
@@ -169,11 +184,15 @@ config_init(struct radclock_config *conf)
 	 * conf file or the command line.
 	 */
 	strcpy(conf->network_device, "");
+	conf->capture_backend   = DEFAULT_CAPTURE_BACKEND;
 	strcpy(conf->sync_in_pcap, "");
 	strcpy(conf->sync_in_ascii, "");
+	strcpy(conf->sync_in_bin, "");
 	strcpy(conf->sync_out_pcap, "");
 	strcpy(conf->sync_out_ascii, "");
 	strcpy(conf->clock_out_ascii, "");
+	strcpy(conf->sync_out_bin, "");
+	strcpy(conf->clock_out_bin, "");
 	strcpy(conf->vm_udp_list, "");
 }
 
@@ -395,6 +414,37 @@ write_config_file(FILE *fd, struct _key *keys, struct radclock_config *conf, int
 	else
 		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_SERVER_NTP), labels_bool[conf->server_ntp]);
 
+	/* Number of NTP server threads */
+	fprintf(fd, "# NTP server threads.\n");
+	fprintf(fd, "# Number of threads answering NTP clients, each on its own socket.\n");
+	fprintf(fd, "# Set to 0 for one thread per CPU.\n");
+	if (conf == NULL)
+		fprintf(fd, "%s = %d\n\n", find_key_label(keys, CONFIG_NTP_SERVER_THREADS), DEFAULT_NTP_SERVER_THREADS);
+	else
+		fprintf(fd, "%s = %d\n\n", find_key_label(keys, CONFIG_NTP_SERVER_THREADS), conf->ntp_server_threads);
+
+	/* Per-client rate limiting of the NTP server */
+	fprintf(fd, "# NTP server rate limiting.\n");
+	fprintf(fd, "# Average number of requests per second answered to a client (IPv4 address\n");
+	fprintf(fd, "# or IPv6 /64 prefix), and number of requests it may send in a burst.\n");
+	fprintf(fd, "# The limit is over all server threads. Set the rate to 0 to answer every\n");
+	fprintf(fd, "# request.\n");
+	if (conf == NULL) {
+		fprintf(fd, "%s = %g\n", find_key_label(keys, CONFIG_NTP_SERVER_RATE), DEFAULT_NTP_SERVER_RATE);
+		fprintf(fd, "%s = %d\n\n", find_key_label(keys, CONFIG_NTP_SERVER_BURST), DEFAULT_NTP_SERVER_BURST);
+	} else {
+		fprintf(fd, "%s = %g\n", find_key_label(keys, CONFIG_NTP_SERVER_RATE), conf->ntp_server_rate);
+		fprintf(fd, "%s = %d\n\n", find_key_label(keys, CONFIG_NTP_SERVER_BURST), conf->ntp_server_burst);
+	}
+
+	fprintf(fd, "# Kiss-o'-Death to rate limited clients.\n");
+	fprintf(fd, "#\ton : send a RATE KoD, at most once per second, drop other requests\n");
+	fprintf(fd, "#\toff: silently drop requests over the limit\n");
+	if (conf == NULL)
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_NTP_SERVER_KOD), labels_bool[DEFAULT_NTP_SERVER_KOD]);
+	else
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_NTP_SERVER_KOD), labels_bool[conf->ntp_server_kod]);
+
 
 	/* Adjust the system FFclock */
 	fprintf(fd, "# System FFclock.\n"
@@ -507,6 +557,18 @@ write_config_file(FILE *fd, struct _key *keys, struct radclock_config *conf, int
 	}
 
 
+	/* Thetahat weights */
+	fprintf(fd, "# Thetahat weight computation - EXPERT.\n"
+				"# The weights of the offset window can use a fast approximation of exp\n"
+				"# with relative error below 1e-8, lowering CPU load at small polling periods.\n"
+				"#\ton : use fast approximation\n"
+				"#\toff: use libm exp\n");
+	if (conf == NULL)
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_THETAHAT_FASTEXP), labels_bool[DEFAULT_THETAHAT_FASTEXP]);
+	else
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_THETAHAT_FASTEXP), labels_bool[conf->metaparam.thetahat_fastexp]);
+
+
 	/* Phat init */
 	fprintf(fd, "# For a quick start, the initial value of the period of the counter (in seconds). \n");
 	if (conf == NULL)
@@ -546,6 +608,16 @@ write_config_file(FILE *fd, struct _key *keys, struct radclock_config *conf, int
 	else
 		fprintf(fd, "#%s = %s\n\n", find_key_label(keys, CONFIG_NETWORKDEV), DEFAULT_NETWORKDEV);
 
+	/* Capture backend */
+	fprintf(fd, "# Live packet capture backend.\n"
+				"#\tpcap: libpcap\n"
+				"#\tring: memory mapped AF_PACKET ring (Linux only), frames are processed\n"
+				"#\t      in place. Falls back on libpcap if the ring cannot be set up.\n");
+	if (conf == NULL)
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_CAPTURE_BACKEND), labels_capture[DEFAULT_CAPTURE_BACKEND]);
+	else
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_CAPTURE_BACKEND), labels_capture[conf->capture_backend]);
+
 
 	/* RAW Input */
 	fprintf(fd, "# Synchronization data input file (modified pcap format).\n");
@@ -563,6 +635,13 @@ write_config_file(FILE *fd, struct _key *keys, struct radclock_config *conf, int
 	else
 		fprintf(fd, "#%s = %s\n\n", find_key_label(keys, CONFIG_SYNC_IN_ASCII), DEFAULT_SYNC_IN_ASCII);
 
+	fprintf(fd, "# Synchronization data input file (binary format).\n");
+	fprintf(fd, "# Replay mode, from a binary stamp output or a converted ascii input.\n");
+	if ( (conf) && (strlen(conf->sync_in_bin) > 0) )
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_SYNC_IN_BIN), conf->sync_in_bin);
+	else
+		fprintf(fd, "#%s = %s\n\n", find_key_label(keys, CONFIG_SYNC_IN_BIN), DEFAULT_SYNC_IN_BIN);
+
 	/* RAW Output */
 	fprintf(fd, "# Synchronization data output file (modified pcap format).\n");
 	if ( (conf) && (strlen(conf->sync_out_pcap) > 0) )
@@ -584,6 +663,26 @@ write_config_file(FILE *fd, struct _key *keys, struct radclock_config *conf, int
 	else
 		fprintf(fd, "#%s = %s\n\n", find_key_label(keys, CONFIG_CLOCK_OUT_ASCII), DEFAULT_CLOCK_OUT_ASCII);
 
+	/* Binary outputs */
+	fprintf(fd, "# Synchronization data output file (binary format).\n");
+	if ( (conf) && (strlen(conf->sync_out_bin) > 0) )
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_SYNC_OUT_BIN), conf->sync_out_bin);
+	else
+		fprintf(fd, "#%s = %s\n\n", find_key_label(keys, CONFIG_SYNC_OUT_BIN), DEFAULT_SYNC_OUT_BIN);
+
+	fprintf(fd, "# Internal clock data output file (binary format).\n");
+	if ( (conf) && (strlen(conf->clock_out_bin) > 0) )
+		fprintf(fd, "%s = %s\n\n", find_key_label(keys, CONFIG_CLOCK_OUT_BIN), conf->clock_out_bin);
+	else
+		fprintf(fd, "#%s = %s\n\n", find_key_label(keys, CONFIG_CLOCK_OUT_BIN), DEFAULT_CLOCK_OUT_BIN);
+
+}
+
+
+void
+config_write(FILE *fd, struct radclock_config *conf, int ns)
+{
+	write_config_file(fd, keys, conf, ns);
 }
 
 
@@ -764,6 +863,49 @@ switch (codekey) {
 		else
 			conf->server_ntp = ival;
 		break;
+
+	case CONFIG_NTP_SERVER_THREADS:
+		ival = atoi(value);
+		if ((ival < 0) || (ival > MAX_NTP_SERVER_THREADS)) {
+			verbose(LOG_WARNING, "NTP server threads value out of [0,%d] range (%d). "
+					"Fall back to default.", MAX_NTP_SERVER_THREADS, ival);
+			conf->ntp_server_threads = DEFAULT_NTP_SERVER_THREADS;
+		}
+		else
+			conf->ntp_server_threads = ival;
+		break;
+
+	case CONFIG_NTP_SERVER_RATE:
+		dval = strtod(value, NULL);
+		if (dval < 0) {
+			verbose(LOG_WARNING, "NTP server rate value out of range (%f). "
+					"Fall back to default.", dval);
+			conf->ntp_server_rate = DEFAULT_NTP_SERVER_RATE;
+		}
+		else
+			conf->ntp_server_rate = dval;
+		break;
+
+	case CONFIG_NTP_SERVER_BURST:
+		ival = atoi(value);
+		if (ival < 1) {
+			verbose(LOG_WARNING, "NTP server burst value out of range (%d). "
+					"Fall back to default.", ival);
+			conf->ntp_server_burst = DEFAULT_NTP_SERVER_BURST;
+		}
+		else
+			conf->ntp_server_burst = ival;
+		break;
+
+	case CONFIG_NTP_SERVER_KOD:
+		ival = check_valid_option(value, labels_bool, 2);
+		if (ival < 0) {
+			verbose(LOG_WARNING, "ntp_server_kod parameter incorrect. Fall back to default.");
+			conf->ntp_server_kod = DEFAULT_NTP_SERVER_KOD;
+		}
+		else
+			conf->ntp_server_kod = ival;
+		break;
 	
 	case CONFIG_SERVER_VM_UDP:
 		// If value specified on the command line
@@ -971,6 +1113,18 @@ switch (codekey) {
 		}
 		break;
 
+
+	case CONFIG_THETAHAT_FASTEXP:
+		ival = check_valid_option(value, labels_bool, 2);
+		if (ival < 0) {
+			verbose(LOG_WARNING, "thetahat_fastexp parameter incorrect."
+					"Fall back to default.");
+			conf->metaparam.thetahat_fastexp = DEFAULT_THETAHAT_FASTEXP;
+		}
+		else
+			conf->metaparam.thetahat_fastexp = ival;
+		break;
+
 	
 	case CONFIG_TEMPQUALITY:
 		/* We have an overall environment quality key word */
@@ -1131,6 +1285,18 @@ switch (codekey) {
 		break;
 
 
+	case CONFIG_CAPTURE_BACKEND:
+		ival = check_valid_option(value, labels_capture, 2);
+		if (ival < 0) {
+			verbose(LOG_WARNING, "capture_backend parameter incorrect."
+					"Fall back to default.");
+			conf->capture_backend = DEFAULT_CAPTURE_BACKEND;
+		}
+		else
+			conf->capture_backend = ival;
+		break;
+
+
 	case CONFIG_SYNC_IN_PCAP:
 		// If value specified on the command line
 		if ( HAS_UPDATE(*mask, UPDMASK_SYNC_IN_PCAP) ) 
@@ -1151,6 +1317,16 @@ switch (codekey) {
 		break;
 
 
+	case CONFIG_SYNC_IN_BIN:
+		// If value specified on the command line
+		if ( HAS_UPDATE(*mask, UPDMASK_SYNC_IN_BIN) ) 
+			break;
+		if ( strcmp(conf->sync_in_bin, value) != 0 )
+			SET_UPDATE(*mask, UPDMASK_SYNC_IN_BIN);
+		strcpy(conf->sync_in_bin, value);
+		break;
+
+
 	case CONFIG_SYNC_OUT_PCAP:
 		// If value specified on the command line
 		if ( HAS_UPDATE(*mask, UPDMASK_SYNC_OUT_PCAP) ) 
@@ -1181,6 +1357,26 @@ switch (codekey) {
 		break;
 
 
+	case CONFIG_SYNC_OUT_BIN:
+		// If value specified on the command line
+		if ( HAS_UPDATE(*mask, UPDMASK_SYNC_OUT_BIN) ) 
+			break;
+		if ( strcmp(conf->sync_out_bin, value) != 0 )
+			SET_UPDATE(*mask, UPDMASK_SYNC_OUT_BIN);
+		strcpy(conf->sync_out_bin, value);
+		break;
+
+
+	case CONFIG_CLOCK_OUT_BIN:
+		// If value specified on the command line
+		if ( HAS_UPDATE(*mask, UPDMASK_CLOCK_OUT_BIN) ) 
+			break;
+		if ( strcmp(conf->clock_out_bin, value) != 0 )
+			SET_UPDATE(*mask, UPDMASK_CLOCK_OUT_BIN);
+		strcpy(conf->clock_out_bin, value);
+		break;
+
+
 	case CONFIG_VM_UDP_LIST:
 		// If value specified on the command line
 		if ( HAS_UPDATE(*mask, UPDMASK_VM_UDP_LIST) ) 
@@ -1324,11 +1520,13 @@ int config_parse(struct radclock_config *conf, u_int32_t *mask, int is_daemon, i
 	 * - If running as a daemon, refuse to read input raw or ascii file
 	 */
 	if ( is_daemon ) {
-		if ( (strlen(conf->sync_in_ascii) > 0) || ( strlen(conf->sync_in_pcap) > 0) )
+		if ( (strlen(conf->sync_in_ascii) > 0) || ( strlen(conf->sync_in_pcap) > 0) ||
+				(strlen(conf->sync_in_bin) > 0) )
 			verbose(LOG_WARNING, "Running as a daemon. Live capture only.");
 		// Force the input to be a live device
 		strcpy(conf->sync_in_ascii,"");
 		strcpy(conf->sync_in_pcap,"");
+		strcpy(conf->sync_in_bin,"");
 	}
 
 	return 1;
@@ -1348,6 +1546,10 @@ void config_print(int level, struct radclock_config *conf, int ns)
 	verbose(level, "Client sync          : %s", labels_sync[conf->synchro_type]);
 	verbose(level, "Server IPC           : %s", labels_bool[conf->server_ipc]);
 	verbose(level, "Server NTP           : %s", labels_bool[conf->server_ntp]);
+	verbose(level, "NTP server threads   : %d", conf->ntp_server_threads);
+	verbose(level, "NTP server rate limit: %g req/s, burst %d, KoD %s",
+			conf->ntp_server_rate, conf->ntp_server_burst,
+			labels_bool[conf->ntp_server_kod]);
 	verbose(level, "Server VM_UDP        : %s", labels_bool[conf->server_vm_udp]);
 	verbose(level, "Server XEN           : %s", labels_bool[conf->server_xen]);
 	verbose(level, "Server VMWARE        : %s", labels_bool[conf->server_vmware]);
@@ -1362,6 +1564,7 @@ void config_print(int level, struct radclock_config *conf, int ns)
 	verbose(level, "BestSKMrate          : %.9lf", conf->metaparam.BestSKMrate);
 	verbose(level, "offset_ratio         : %d", conf->metaparam.offset_ratio);
 	verbose(level, "plocal_quality       : %.9lf", conf->metaparam.plocal_quality);
+	verbose(level, "thetahat_fastexp     : %s", labels_bool[conf->metaparam.thetahat_fastexp]);
 	verbose(level, "path_scale           : %.9lf", conf->metaparam.path_scale);
 	verbose(level, "Initial phat         : %lg", conf->phat_init);
 	verbose(level, "Host asymmetry       : %lf", conf->asym_host);
@@ -1373,9 +1576,13 @@ void config_print(int level, struct radclock_config *conf, int ns)
 		for (int s=0; s<ns; s++)
 			verbose(level, "Time server          : %d %s", s, conf->time_server + s*MAXLINE);
 	verbose(level, "Interface            : %s", conf->network_device);
+	verbose(level, "Capture backend      : %s", labels_capture[conf->capture_backend]);
 	verbose(level, "pcap sync input      : %s", conf->sync_in_pcap);
 	verbose(level, "ascii sync input     : %s", conf->sync_in_ascii);
+	verbose(level, "binary sync input    : %s", conf->sync_in_bin);
 	verbose(level, "pcap sync output     : %s", conf->sync_out_pcap);
 	verbose(level, "ascii sync output    : %s", conf->sync_out_ascii);
 	verbose(level, "ascii clock output   : %s", conf->clock_out_ascii);
+	verbose(level, "binary sync output   : %s", conf->sync_out_bin);
+	verbose(level, "binary clock output  : %s", conf->clock_out_bin);
 }
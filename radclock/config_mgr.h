@@ -82,6 +82,11 @@
 #define DEFAULT_SYNCHRO_TYPE     SYNCTYPE_NTP  // Protocol used
 #define DEFAULT_SERVER_IPC       BOOL_ON       // Update the clock
 #define DEFAULT_SERVER_NTP       BOOL_OFF      // Don't act as a server
+#define DEFAULT_NTP_SERVER_THREADS 1           // 0 for one per CPU
+#define MAX_NTP_SERVER_THREADS   64
+#define DEFAULT_NTP_SERVER_RATE  8.0           // requests per second per client, 0 for no limit
+#define DEFAULT_NTP_SERVER_BURST 32            // requests in a burst
+#define DEFAULT_NTP_SERVER_KOD   BOOL_ON       // RATE KoD to limited clients
 #define DEFAULT_SERVER_VM_UDP    BOOL_OFF      // Don't Start VM servers
 #define DEFAULT_SERVER_XEN       BOOL_OFF
 #define DEFAULT_SERVER_VMWARE    BOOL_OFF
@@ -89,6 +94,7 @@
 #define DEFAULT_ADJUST_FBCLOCK   BOOL_OFF    // Not normally a FBclock daemon
 #define DEFAULT_NTP_POLL_PERIOD  16          // 16 NTP pkts every [s]
 #define DEFAULT_PHAT_INIT        1.e-9
+#define DEFAULT_THETAHAT_FASTEXP BOOL_OFF    // exact weights in thetahat
 #define CONFIG_PLOCAL_QUALITY    36
 #define DEFAULT_PATH_SCALE       (5*3600)    // [s] in conf, but EXCluded from conf file
 #define DEFAULT_RELASYM_BOUND_GLOBAL 0.2     //     in conf, but EXCluded from conf file
@@ -97,11 +103,15 @@
 #define DEFAULT_HOSTNAME         "platypus2.tklab.feit.uts.edu.au"
 #define DEFAULT_TIME_SERVER      "tock.une.edu.au"
 #define DEFAULT_NETWORKDEV       "em0"
+#define DEFAULT_CAPTURE_BACKEND  CAPTURE_BACKEND_PCAP
 #define DEFAULT_SYNC_IN_PCAP     "/etc/sync_input.pcap"
 #define DEFAULT_SYNC_IN_ASCII    "/etc/sync_input.ascii"
+#define DEFAULT_SYNC_IN_BIN      "/etc/sync_input.bin"
 #define DEFAULT_SYNC_OUT_PCAP    "/etc/sync_output.pcap"
 #define DEFAULT_SYNC_OUT_ASCII   "/etc/sync_output.ascii"
 #define DEFAULT_CLOCK_OUT_ASCII  "/etc/clock_output.ascii"
+#define DEFAULT_SYNC_OUT_BIN     "/etc/sync_output.bin"
+#define DEFAULT_CLOCK_OUT_BIN    "/etc/clock_output.bin"
 #define DEFAULT_VM_UDP_LIST      "vm_udp_list"
 
 
@@ -132,6 +142,7 @@
 #define CONFIG_BEST_SKM_RATE   34
 #define CONFIG_OFFSET_RATIO    35
 #define CONFIG_PLOCAL_QUALITY  36
+#define CONFIG_THETAHAT_FASTEXP 37
 /* Network Level */
 #define CONFIG_HOSTNAME        40
 #define CONFIG_TIME_SERVER     41
@@ -142,14 +153,30 @@
 #define CONFIG_SYNC_OUT_PCAP   53
 #define CONFIG_SYNC_OUT_ASCII  54
 #define CONFIG_CLOCK_OUT_ASCII 55
+#define CONFIG_CAPTURE_BACKEND 56
+#define CONFIG_SYNC_OUT_BIN    57
+#define CONFIG_CLOCK_OUT_BIN   58
+#define CONFIG_SYNC_IN_BIN     59
 /* Virtual Machine stuff */
 #define CONFIG_SERVER_VM_UDP   60
 #define CONFIG_SERVER_XEN      61
 #define CONFIG_SERVER_VMWARE   62
 #define CONFIG_VM_UDP_LIST     63
+/* NTP server */
+#define CONFIG_NTP_SERVER_THREADS 70
+#define CONFIG_NTP_SERVER_RATE 71
+#define CONFIG_NTP_SERVER_BURST 72
+#define CONFIG_NTP_SERVER_KOD  73
 
 
 
+/*
+ * Live capture backends, libpcap or the memory mapped capture ring (Linux)
+ */
+#define CAPTURE_BACKEND_PCAP   0
+#define CAPTURE_BACKEND_RING   1
+
+
 /*
  * Pre-defined description of temperature environment quality
  * CONFIG_QUALITY_UNKWN has to be defined with the highest values to parse
@@ -191,6 +218,9 @@
 #define UPDMASK_PID_FILE        0x0800000
 #define UPD_NTP_UPSTREAM_PORT   0x1000000
 #define UPD_NTP_DOWNSTREAM_PORT 0x2000000
+#define UPDMASK_SYNC_OUT_BIN    0x4000000
+#define UPDMASK_CLOCK_OUT_BIN   0x8000000
+#define UPDMASK_SYNC_IN_BIN     0x10000000
 
 
 #define HAS_UPDATE(val,mask)   ((val & mask) == mask)
@@ -214,6 +244,10 @@ struct radclock_config {
 	int synchro_type;                  // multi-choice depending on client-side protocol
 	int server_ipc;                    // Boolean
 	int server_ntp;                    // Boolean
+	int ntp_server_threads;            // NTP server workers, 0 for one per CPU
+	double ntp_server_rate;            // Requests per second per client, 0 for no limit
+	int ntp_server_burst;              // Requests per client in a burst
+	int ntp_server_kod;                // Boolean, RATE KoD to limited clients
 	int server_vm_udp;                 // Boolean
 	int server_xen;                    // Boolean
 	int server_vmware;                 // Boolean
@@ -227,11 +261,15 @@ struct radclock_config {
 	char hostname[MAXLINE];            // Client hostname
 	char *time_server;                 // Server names, concatenated in MAXLINE blocks
 	char network_device[MAXLINE];      // physical device string, eg xl0, eth0
+	int capture_backend;               // multi-choice, how live packets are captured
 	char sync_in_pcap[MAXLINE];        // read from stored instead of live input
 	char sync_in_ascii[MAXLINE];       // input is a preprocessed stamp file
+	char sync_in_bin[MAXLINE];         // input is a binary stamp file
 	char sync_out_pcap[MAXLINE];       // raw packet Output file name
 	char sync_out_ascii[MAXLINE];      // output processed stamp file
 	char clock_out_ascii[MAXLINE];     // output matlab requirements
+	char sync_out_bin[MAXLINE];        // output processed stamp file, binary
+	char clock_out_bin[MAXLINE];       // output matlab requirements, binary
 	char vm_udp_list[MAXLINE];         // File containing list of udp VM's
 };
 
@@ -246,5 +284,8 @@ int config_parse(struct radclock_config *conf, u_int32_t *mask, int is_daemon, i
 /* Output the config in config to verbose using level */
 void config_print(int level, struct radclock_config *conf, int ns);
 
+/* Write the configuration out in configuration file format */
+void config_write(FILE *fd, struct radclock_config *conf, int ns);
+
 
 #endif
@@ -53,6 +53,7 @@
 #include "sync_algo.h"
 #include "ntohll.h"
 #include "create_stamp.h"
+#include "stamp_queue.h"
 #include "jdebug.h"
 
 
@@ -61,63 +62,7 @@
 typedef uint32_t useconds_t;
 # endif
 
-struct stq_elt {
-	struct stamp_t stamp;
-	struct stq_elt *prev;
-	struct stq_elt *next;
-};
-
-struct stamp_queue {
-	struct stq_elt *start;
-	struct stq_elt *end;
-	int size;
-};
-
-/* To prevent allocating heaps of memory if stamps are not paired in queue */
-#define MAX_STQ_SIZE	20
-
-
-
-radpcap_packet_t *
-create_radpcap_packet()
-{
-	radpcap_packet_t *pkt;
-
-	JDEBUG
-
-	pkt = (radpcap_packet_t*) malloc(sizeof(radpcap_packet_t));
-	JDEBUG_MEMORY(JDBG_MALLOC, pkt);
-
-	pkt->buffer 	= (void *) malloc(RADPCAP_PACKET_BUFSIZE);
-	JDEBUG_MEMORY(JDBG_MALLOC, pkt->buffer);
-
-	pkt->header = NULL;
-	pkt->payload = NULL;
-	pkt->type = 0;
-	pkt->size = 0;
-
-	return (pkt);
-}
-
-
-void
-destroy_radpcap_packet(radpcap_packet_t *packet)
-{
-	JDEBUG
-
-	packet->header = NULL;
-	packet->payload = NULL;
-
-	if (packet->buffer) {
-		JDEBUG_MEMORY(JDBG_FREE, packet->buffer);
-		free(packet->buffer);
-	}
-	packet->buffer = NULL;
 
-	JDEBUG_MEMORY(JDBG_FREE, packet);
-	free(packet);
-	packet = NULL;
-}
 
 
 int
@@ -165,6 +110,88 @@ check_ipv6(struct ip6_hdr *ip6h, int remaining)
 }
 
 
+/*
+ * Find out what the link layer header of a live frame encapsulates and how
+ * long it is.
+ */
+int
+get_link_layer_info(radpcap_packet_t *packet, uint16_t *ethertype_p,
+		size_t *etherlen_p)
+{
+	struct ether_header *eh;
+	uint16_t ethertype;
+	size_t etherlen;
+
+	switch(packet->type) {
+
+	/* BSD Loopback interface */
+	// TODO a bit ugly, but good enough for now on
+	case DLT_NULL:
+		switch (*(uint32_t *)packet->payload) {
+		case AF_INET:
+			ethertype = ETHERTYPE_IP;
+			break;
+		case AF_INET6:
+			ethertype = ETHERTYPE_IPV6;
+			break;
+		default:
+			fprintf(stderr, "Non IP protocol on DLT_NULL\n");
+			return (1);
+		}
+		etherlen = 4;
+		break;
+
+	/* Linux cooked capture (any interface) */
+	case DLT_LINUX_SLL:
+		ethertype = ntohs(((linux_sll_header_t *)packet->payload)->protocol);
+		etherlen = sizeof(linux_sll_header_t);
+		break;
+
+	case DLT_IEEE802_11:
+	case DLT_EN10MB:
+		eh = (struct ether_header *)packet->payload;
+		ethertype = ntohs(eh->ether_type);
+		etherlen = sizeof(struct ether_header);
+
+		/* Ethernet with 802.2 and maybe SNAP header */
+		if (ethertype < 0x0600) {
+			verbose(LOG_ERR, "Not an ethernet.v2 frame, type not supported.");
+			return (1);
+		}
+
+		/* It is a bit ugly, but easier for cross-platform defs */
+		if (ethertype == ETHERTYPE_VLAN) {
+			ethertype = ntohs(*(uint16_t *)((char *)packet->payload + 16));
+			etherlen = 18;
+		}
+
+		switch (ethertype) {
+		/* IPv4 */
+		case (ETHERTYPE_IP):
+		/* IPv6 */
+		case (ETHERTYPE_IPV6):
+		/* IEEE 1588 over Ethernet */
+		case (0x88F7):
+			break;
+		default:
+			verbose(LOG_ERR,"It seems we are trying to capture encapsulated packets");
+			verbose(LOG_ERR, "Do not support protocol type %u", ethertype);
+			return (1);
+		}
+		break;
+
+	default:
+		/* failed */
+		verbose(LOG_ERR, "Link Layer DLT type not supported yet");
+		return (1);
+	}
+
+	*ethertype_p = ethertype;
+	*etherlen_p = etherlen;
+	return (0);
+}
+
+
 /*
  * Get the IP payload from the radpcap_packet_t packet.  Here also (in addition
  * to get_vcount) we handle backward compatibility since we changed the way the
@@ -174,7 +201,7 @@ check_ipv6(struct ip6_hdr *ip6h, int remaining)
  * 1 - [pcap][ether][IP] : oldest format (vcount in pcap header timeval)
  * 2 - [pcap][sll][ether][IP] : libtrace-3.0-beta3 format, vcount is in sll header
  * 3 - [pcap][sll][IP] : remove link layer header, no libtrace, vcount in sll header
- * In live capture, the ssl header MUST be inserted before calling this function
+ * A live frame is parsed as captured, whatever its link layer.
  * Ideally, we would like to get rid of formats 1 and 2 to simplify the code.
  */
 // TODO and for non NTP packets? (ie 1588)
@@ -191,14 +218,25 @@ get_valid_ntp_payload(radpcap_packet_t *packet, struct ntp_pkt **ntp,
 	struct udphdr *udph;
 	linux_sll_header_t *sllh;
 	uint16_t proto;
+	size_t hdrlen;
+	char *l3;
 	int remaining;
 	int err;
 
 	JDEBUG
 
 	remaining = ((struct pcap_pkthdr *)packet->header)->caplen;
+	l3 = NULL;
+	udph = NULL;
 
-	switch (packet->type) {
+	/* Live frame, skip its link layer header whatever it is */
+	if (packet->live) {
+		if (get_link_layer_info(packet, &proto, &hdrlen))
+			return (1);
+		l3 = (char *)packet->payload + hdrlen;
+		remaining -= hdrlen;
+	}
+	else switch (packet->type) {
 
 	/*
 	 * This is format #1, skip 14 bytes ethernet header. Only NTP packets ever
@@ -208,6 +246,8 @@ get_valid_ntp_payload(radpcap_packet_t *packet, struct ntp_pkt **ntp,
 		iph = (struct ip *)(packet->payload + sizeof(struct ether_header));
 		remaining -= sizeof(struct ether_header);
 		ip6h = NULL;
+		udph = (struct udphdr *)((char *)iph + (iph->ip_hl * 4));
+		remaining -= sizeof(struct ip);
 		break;
 
 	/*
@@ -225,18 +265,31 @@ get_valid_ntp_payload(radpcap_packet_t *packet, struct ntp_pkt **ntp,
 					sizeof(linux_sll_header_t));
 			remaining -= sizeof(struct ether_header);
 			ip6h = NULL;
+			udph = (struct udphdr *)((char *)iph + (iph->ip_hl * 4));
+			remaining -= sizeof(struct ip);
 			break;
 		}
 
 		/* This is format 3 */
 		proto = ntohs(sllh->protocol);
+		l3 = (char *)packet->payload + sizeof(linux_sll_header_t);
+		remaining -= sizeof(linux_sll_header_t);
+		break;
+
+	default:
+		verbose(LOG_ERR, "MAC layer type not supported yet.");
+		return (1);
+		break;
+	}
+
+	/* Format 3 and live frames, l3 is the network header */
+	if (l3) {
 		switch (proto) {
 
 		/* IPv4 */
 		case (ETHERTYPE_IP):
 			ip6h = NULL;
-			iph = (struct ip *)(packet->payload + sizeof(linux_sll_header_t));
-			remaining -= sizeof(linux_sll_header_t);
+			iph = (struct ip *)l3;
 
 			err = check_ipv4(iph, remaining);
 			if (err)
@@ -257,8 +310,7 @@ get_valid_ntp_payload(radpcap_packet_t *packet, struct ntp_pkt **ntp,
 		/* IPv6 */
 		case (ETHERTYPE_IPV6):
 			iph = NULL;
-			ip6h = (struct ip6_hdr *)(packet->payload + sizeof(linux_sll_header_t));
-			remaining -= sizeof(linux_sll_header_t);
+			ip6h = (struct ip6_hdr *)l3;
 
 			err = check_ipv6(ip6h, remaining);
 			if (err)
@@ -282,15 +334,10 @@ get_valid_ntp_payload(radpcap_packet_t *packet, struct ntp_pkt **ntp,
 			return (1);
 
 		default:
-			verbose(LOG_ERR, "Unsupported protocol in SLL header %u", proto);
+			verbose(LOG_ERR, "Unsupported protocol in link layer header %u",
+					proto);
 			return(1);
 		}
-		break;
-
-	default:
-		verbose(LOG_ERR, "MAC layer type not supported yet.");
-		return (1);
-		break;
 	}
 
 	if (remaining < sizeof(struct udphdr)) {
@@ -388,6 +435,12 @@ get_vcount(radpcap_packet_t *packet, vcounter_t *vcount) {
 
 	JDEBUG
 
+	/* Live frames come with their vcount */
+	if (packet->live) {
+		*vcount = packet->vcount;
+		return (0);
+	}
+
 	ret = -1;
 	switch ( packet->type ) {
 	case DLT_EN10MB:
@@ -404,182 +457,6 @@ get_vcount(radpcap_packet_t *packet, vcounter_t *vcount) {
 }
 
 
-/* Routines to create and destroy a stamp queue. The queue is anchored
- * to a pointer within the passed argument, so storage for the
- * queue can be allocated and freed here.
- */
-void
-init_stamp_queue(struct bidir_algodata *algodata)
-{
-	algodata->q = calloc(1, sizeof(struct stamp_queue));
-	algodata->q->start = NULL;
-	algodata->q->end = NULL;
-	algodata->q->size = 0;
-}
-
-void
-destroy_stamp_queue(struct bidir_algodata *algodata)
-{
-	struct stq_elt *elt;
-
-	elt = algodata->q->end;
-	while (algodata->q->size) {
-		if (elt->prev == NULL)
-			break;
-		elt = elt->prev;
-		free(elt);
-		algodata->q->size--;
-	}
-	free(algodata->q->end);
-	free(algodata->q);
-	algodata->q = NULL;
-}
-
-
-/*
- * Insert a client or server halfstamp into the stamp queue, perform duplicate
- * halfstamp detection and client request<-->server reply matching, and trim 
- * excessive queue if needed. 
- * The queue allows many client requests to be buffered while waiting for their
- * replies, and can cope with both reordering, and loss, of both client and
- * server packets.
- *
- * If a matching halfstamp is found in the queue then the existing queue entry
- * will be completed in situ, else a new halfstamp will be inserted at head.
- * Duplicate halfstamps are not a problem, they are simply dropped with warning.
- *
- * The stamp->id field as an (assumed) unique key. Since this is in fact a 
- * timestamp field, inserted c-halfstamps will very likely be in id-order as 
- * well as in true temporal order, but this is NOT assumed or used. A small 
- * exception is in the queue trimming, which drops the tail element.
- * In the very unlikely event that the tail element is not in fact the oldest
- * (most stale), this will not create any problems beyond the loss of a stamp.
- * Other kinds of halfstamp cleaning (based on temporal ordering, not id) are
- * dealt with in get_fullstamp_from_queue_andclean.
- *
- * Stamps from different servers are treated in the same way.
- *
- * The prev direction is toward the queue head/start.
- * Return codes: err = 0 : halfstamp insertion resulted in fullstamp
- *               err = 1 : insertion but no fullstamp, or halfstamp dropped
- */
-int
-insertandmatch_halfstamp(struct stamp_queue *q, struct stamp_t *new, int mode)
-{
-	struct stq_elt *qel;
-	struct stamp_t *stamp;
-	int foundhalfstamptofill;
-
-	if ((mode != MODE_CLIENT) && (mode != MODE_SERVER)) {
-		verbose(LOG_ERR, "Unsupported stamp matching mode: %d", mode);
-		return (-1);
-	}
-
-	/* Scan queue for matching id, determine if duplicate, match, or new */
-	foundhalfstamptofill = 0;
-	qel = q->start;
-	while (qel != NULL) {
-		stamp = &qel->stamp;
-
-		if (stamp->id == new->id) {		// this id in the queue already
-			switch (mode) {
-				case MODE_CLIENT:
-					if (BST(stamp)->Ta != 0) {
-						verbose(LOG_WARNING, "Dropping duplicate NTP client request.");
-						return (1);
-					}
-					break;
-
-				case MODE_SERVER:
-					if (BST(stamp)->Tf != 0) {
-						verbose(LOG_WARNING, "Dropping duplicate NTP server response.");
-						return (1);
-					}
-					break;
-			}
-
-			foundhalfstamptofill = 1;		// qel will point to stamp to fill
-			break;
-		}
-		qel = qel->next;
-	}
-
-	/* If this id is new, then create and insert blank queue element. */
-	if (!foundhalfstamptofill)
-	{
-		/* If queue too long, trim off last element */
-		if (q->size == MAX_STQ_SIZE) {
-			verbose(LOG_WARNING, "Stamp matching queue has hit max size.");
-			q->end = q->end->prev;
-			free(q->end->next);
-			q->end->next = NULL;
-			q->size--;
-		}
-
-      /* Create blank element, *qel, and insert at head */
-		qel = calloc(1, sizeof(struct stq_elt));
-		qel->prev = NULL;
-		qel->next = q->start;		// will be NULL as reqd if queue empty
-		if (q->start == NULL)		// queue was empty
-			q->end = qel;
-		else
-			q->start->prev = qel;
-		q->start = qel;
-		q->size++;
-
-		/* Fill fields common to both halfstamps */
-		switch (mode) {
-			case MODE_CLIENT:
-			case MODE_SERVER:
-			qel->stamp.type = STAMP_NTP;
-		}
-		qel->stamp.id = new->id;
-	}
-
-	/* Selectively copy content of new halfstamp into stamp to fill (*qel). */
-	stamp = &qel->stamp;
-	switch (mode) {
-		case MODE_CLIENT:
-			strncpy(stamp->server_ipaddr, new->server_ipaddr, 16);
-			BST(stamp)->Ta = BST(new)->Ta;
-			break;
-		case MODE_SERVER:
-			stamp->ttl = new->ttl;
-			stamp->refid = new->refid;
-			stamp->stratum = new->stratum;
-			stamp->LI = new->LI;
-			stamp->rootdelay = new->rootdelay;
-			stamp->rootdispersion = new->rootdispersion;
-			BST(stamp)->Tb = BST(new)->Tb;
-			BST(stamp)->Te = BST(new)->Te;
-			BST(stamp)->Tf = BST(new)->Tf;
-	}
-
-	/* Print out queue from head to tail (youngest at top of printout). */
-	if (VERB_LEVEL>1) {
-		qel = q->start;
-
-		while (qel != NULL) {
-			stamp = &qel->stamp;
-			if (stamp->type == STAMP_NTP) {
-				verbose(VERB_DEBUG, "  stamp queue dump: [%llu]   %llu %llu %.6Lf %.6Lf %s",
-				(long long unsigned) stamp->id,
-				(long long unsigned) BST(stamp)->Ta, (long long unsigned) BST(stamp)->Tf,
-				BST(stamp)->Tb, BST(stamp)->Te,
-				stamp->server_ipaddr);
-			}
-
-			qel = qel->next;
-		}
-	}
-
-	if (foundhalfstamptofill)
-		return (0);
-	else
-		return (1);
-}
-
-
 /* Returns {0,1} if {identical,different} */
 int
 compare_sockaddr_storage(struct sockaddr_storage *first,
@@ -832,137 +709,6 @@ update_stamp_queue(struct stamp_queue *q, radpcap_packet_t *packet,
 }
 
 
-/*
- * Remove the oldest full stamp from the queue, and clean dangerous halfstamps
- * (should be exactly one fullstamp, but code allows for 0 or more than 1).
- *
- * Principle is that fullstamps should never be removed out of order.  Here 
- * stamp order is defined by the outgoing raw stamp Ta. This implies that client
- * halfstamps older than the fullstamp should be cleaned out, since should they
- * ever be filled, they would be out of order when removed. This also prevents
- * c-halfstamps which are never matched (missing server replies) from bloating
- * the queue permanently.
- * An alternative ordering based on Tf is possible, but has more disadvantages.
- * Note:  older = in queue longer = smaller value.
- * 
- * Server halfstamps shouldn't normally occur but sometimes do, for example if
- * a c-halfstamp is cleaned, and its matching response arrives later. This can
- * arise when a retry response returns before the (in fact not lost) original
- * response. They are cleaned safely in reasonable time by comparison on Tf
- * against the fullstamp, since Ta is not available for them.
- *
- * This routine makes NO assumptions on element ordering within the queue, and
- * in particular uses the stamp.id field (see insertandmatch_halfstamp)
- * only to match two halfstamps into a fullstamp, not to establish stamp order).
- *
- * To support stamps from multiple servers coexisting in the queue, c-halfstamp
- * cleanout is only performed when the serverID matches that of the full stamp.
- * This check is dropped for s-halfstamps, as they shouldn't be there anyway.
- *
- * The prev direction is toward the queue head/start.
- * Error codes:  err = 0 : success, fullstamp found and returned
- *               err = 1 : failure, couldn't find fullstamp, nothing returned
- */
-int
-get_fullstamp_from_queue_andclean(struct stamp_queue *q, struct stamp_t *stamp)
-{
-	struct stq_elt *qel, *qelcopy;
-	struct stamp_t *st, *full_st;
-	vcounter_t	full_time=0;			// used to record stamp order
-	vcounter_t	Tc;
-	int startsize;
-	int c_halfstamp, s_halfstamp, fullstamp, dangerous;
-	int c_older, s_older;				// records if halfstamps older than full one
-
-	JDEBUG
-
-	if (q->size == 0) {
-		verbose(LOG_WARNING, "Stamp matching queue empty, no stamp returned");
-		return (1);
-	} else
-	  	startsize = q->size;
-
-   /* Scan queue from tail to head to find and pass back oldest full stamp */
-	qel = q->end;
-	while (qel != NULL) {
-		st = &qel->stamp;
-		Tc = BST(st)->Ta;			// client side timestamp
-		fullstamp = (Tc != 0) && (BST(st)->Tf != 0);
-		if (fullstamp) {
-			if (full_time == 0 || Tc < full_time) {		// oldest so far
-				full_st = st;
-				full_time = Tc;
-		   }
-		}
-		qel = qel->prev;
-	}
-
-	if (full_time > 0)
-		memcpy(stamp, full_st, sizeof(struct stamp_t));
-	else {
-		verbose(LOG_WARNING, "Did not find any full stamp in stamp queue");
-		return (1);
-	}
-
-
-   /* Scan queue, removing chosen fullstamp, and dangerous halfstamps */
-	qel = q->end;
-	while (qel != NULL) {
-		st = &qel->stamp;
-
-		/* Determine the scenario posed by this stamp */
-		c_halfstamp = (BST(st)->Ta != 0) && (BST(st)->Tf == 0);
-		s_halfstamp = (BST(st)->Ta == 0) && (BST(st)->Tf != 0);
-		if (s_halfstamp)
-			verbose(LOG_WARNING, "Found server halfstamp in stamp queue");
-		c_older = c_halfstamp && BST(st)->Ta < full_time;
-		s_older = s_halfstamp && BST(st)->Tf < BST(full_st)->Tf;
-		dangerous = s_older ||
-						(c_older && strcmp(st->server_ipaddr,full_st->server_ipaddr) == 0);
-		if (dangerous)
-			verbose(VERB_DEBUG, "Clearing out dangerous halfstamp");
-
-		if (st == full_st || dangerous)
-	   {	/* Remove *qel from queue, reset qel to continue loop */
-			if (qel==q->end) {
-				if (qel==q->start) {			// only 1 stamp in queue
-					free(qel);
-					qel = NULL;					// reached head, will exit while
-					q->start = NULL;
-					q->end = NULL;
-			   } else {
-					qel = qel->prev;			// next target (is the new end)
-					free(qel->next);
-					qel->next = NULL;
-					q->end = qel;
-				}
-			} else {
-				if (qel==q->start) {			// reached head, will exit while
-					q->start = qel->next;
-					qel->next->prev = NULL;
-					free(qel);
-					qel = NULL;
-			   } else {							// generic case, neither start nor end
-					qel->next->prev = qel->prev;
-					qel->prev->next = qel->next;
-		   		qelcopy = qel;
-					qel = qel->prev;			// next target
-					free(qelcopy);
-				}
-			}
-			q->size--;
-		} else
-			qel = qel->prev;
-	}
-	
-	verbose(VERB_DEBUG, "Stamp queue had %d stamps, freed %d, %d left",
-		startsize, startsize - q->size, q->size);
-
-	return (0);
-}
-
- 
- 
 /*
  * Retrieve network packet from live or dead pcap device.
  * The stamp queue infrastructure is used to handle out of order packets (for
@@ -974,6 +720,7 @@ get_network_stamp(struct radclock_handle *handle, void *userdata,
 	struct stamp_t *stamp, struct timeref_stats *stats)
 {
 	struct stamp_queue *q;
+	radpcap_packet_t view;
 	radpcap_packet_t *packet;
 	int attempt, maxattempts;
 	int err;
@@ -983,7 +730,16 @@ get_network_stamp(struct radclock_handle *handle, void *userdata,
 	err = 0;
 	maxattempts = 20;
 	q = ((struct bidir_algodata*)handle->algodata)->q;
-	packet = create_radpcap_packet();
+
+	/* A view on packets owned by the input, only valid until the next read */
+	packet = &view;
+	packet->header = NULL;
+	packet->payload = NULL;
+	packet->buffer = NULL;
+	packet->size = 0;
+	packet->type = 0;
+	packet->live = 0;
+	packet->vcount = 0;
 
 	/*
 	 * Used to have both live and dead PCAP inputs dealt the same way. But extra
@@ -996,10 +752,8 @@ get_network_stamp(struct radclock_handle *handle, void *userdata,
 	/* Read packet from pcap tracefile. */
 	case RADCLOCK_SYNC_DEAD:
 		err = get_packet(handle, userdata, &packet); // 1 = no rbd data or error
-		if (err) {
-			destroy_radpcap_packet(packet);
+		if (err)
 			return (-1);
-		}
 		/* Counts pkts, regardless of content (initialised to 0 in main) */
 		stats->ref_count++;
 
@@ -1063,9 +817,6 @@ get_network_stamp(struct radclock_handle *handle, void *userdata,
 		err = -1;
 		break;
 	}
-	
-	/* Make sure we don't leak memory */
-	destroy_radpcap_packet(packet);
 
 	/* Error, something wrong worth killing everything */
 	if (err == -1)
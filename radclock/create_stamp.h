@@ -52,20 +52,6 @@
 #define BPF_PACKET_SIZE 236
 
 
-/* 
- * The size of the buffer containing the data of interest to us.
- * For timekeeping it has to be as big as BPF_PACKET_SIZE and hold the result of
- * storing the vcounter timestamp in a SLL header. Good news SLL is 16 bytes,
- * just like Ethernet + 802.1Q extension.
- * Also need to hold the extra struct pcap_pkthdr (12 bytes currently using
- * timeval).
- * 
- * However, we provide timestamping function for users who are interested in
- * any kind of traffic. So max that value out.
- */
-#define RADPCAP_PACKET_BUFSIZE 65535
-
-
 /* 
  * store simple stats in incoming reference time information. Extensible.
  */
@@ -89,14 +75,22 @@ typedef struct linux_sll_header_t {
 } linux_sll_header_t;
 
 
+/*
+ * View of a captured packet. Header and payload point to wherever the packet
+ * lives (tracefile read buffer, raw data slot, capture ring), nothing is copied.
+ * Packets read from a tracefile carry the vcount in their link layer header. A
+ * live packet is the frame as captured, its vcount is given alongside.
+ */
 // TODO: not sure we really need the 'size' member anymore. We could get that
 // value from the pcap header. XXX to check!!
 typedef struct radpcap_packet_t {
-	void *header;	/* Modified BPF header with vcount */
-	void *payload;  /* Packet payload (ethernet) */
-	void *buffer;	
+	void *header;	/* BPF header */
+	void *payload;  /* Packet payload (link layer frame) */
+	void *buffer;	/* Backing store of a packet built by copy */
 	size_t size;	/* Captured size */
 	u_int32_t type;	/* rt protocol type */
+	int live;		/* Frame as captured, vcount field below is valid */
+	vcounter_t vcount;	/* Raw timestamp of a live frame */
 	struct sockaddr_storage ss_if;	/* Capture interface IP address */
 } radpcap_packet_t;
 
@@ -109,5 +103,10 @@ int get_network_stamp(struct radclock_handle *handle, void * userdata,
 		struct stamp_t *stamp, struct timeref_stats *stats);
 
 int get_vcount(radpcap_packet_t *packet, vcounter_t *vcount);
+int get_link_layer_info(radpcap_packet_t *packet, uint16_t *ethertype,
+		size_t *etherlen);
+struct stamp_queue;
+int update_stamp_queue(struct stamp_queue *q, radpcap_packet_t *packet,
+		struct timeref_stats *stats);
 
 #endif
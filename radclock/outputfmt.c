@@ -0,0 +1,591 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "outputfmt.h"
+
+
+struct outfmt_field {
+	const char *name;
+	uint8_t type;
+	uint32_t offset;
+};
+
+#define STAMP_FIELD(name, type) { #name, type, offsetof(struct outfmt_stamp_rec, name) }
+#define CLOCK_FIELD(name, type) { #name, type, offsetof(struct outfmt_clock_rec, name) }
+
+/* In the order of the ascii columns */
+static const struct outfmt_field stamp_fields[] = {
+	STAMP_FIELD(Ta, OUTFMT_U64),
+	STAMP_FIELD(Tb, OUTFMT_DD),
+	STAMP_FIELD(Te, OUTFMT_DD),
+	STAMP_FIELD(Tf, OUTFMT_U64),
+	STAMP_FIELD(id, OUTFMT_U64),
+	STAMP_FIELD(sID, OUTFMT_I32),
+};
+
+static const struct outfmt_field clock_fields[] = {
+	CLOCK_FIELD(Tb, OUTFMT_DD),
+	CLOCK_FIELD(Tf, OUTFMT_U64),
+	CLOCK_FIELD(RTT, OUTFMT_U64),
+	CLOCK_FIELD(phat, OUTFMT_F64),
+	CLOCK_FIELD(plocal, OUTFMT_F64),
+	CLOCK_FIELD(K, OUTFMT_DD),
+	CLOCK_FIELD(thetahat, OUTFMT_F64),
+	CLOCK_FIELD(RTThat, OUTFMT_U64),
+	CLOCK_FIELD(RTThat_new, OUTFMT_U64),
+	CLOCK_FIELD(RTThat_shift, OUTFMT_U64),
+	CLOCK_FIELD(th_naive, OUTFMT_F64),
+	CLOCK_FIELD(minET, OUTFMT_F64),
+	CLOCK_FIELD(minET_last, OUTFMT_F64),
+	CLOCK_FIELD(RADclockout, OUTFMT_DD),
+	CLOCK_FIELD(RADclockin, OUTFMT_DD),
+	CLOCK_FIELD(pDf, OUTFMT_F64),
+	CLOCK_FIELD(pDb, OUTFMT_F64),
+	CLOCK_FIELD(perr, OUTFMT_F64),
+	CLOCK_FIELD(plocalerr, OUTFMT_F64),
+	CLOCK_FIELD(wsum, OUTFMT_F64),
+	CLOCK_FIELD(best_Tf, OUTFMT_U64),
+	CLOCK_FIELD(status, OUTFMT_U32),
+	CLOCK_FIELD(pathpenalty, OUTFMT_F64),
+	CLOCK_FIELD(Pchange, OUTFMT_F64),
+	CLOCK_FIELD(Pquality, OUTFMT_F64),
+	CLOCK_FIELD(sID, OUTFMT_I32),
+};
+
+#define NFIELDS(f)	(sizeof(f) / sizeof(struct outfmt_field))
+
+
+static int
+field_size(uint8_t type)
+{
+	switch (type) {
+	case OUTFMT_DD:
+		return (16);
+	case OUTFMT_U32:
+	case OUTFMT_I32:
+		return (4);
+	default:
+		return (8);
+	}
+}
+
+static const struct outfmt_field *
+kind_fields(int kind, int *nfields, size_t *recsize)
+{
+	switch (kind) {
+	case OUTFMT_STAMP:
+		*nfields = NFIELDS(stamp_fields);
+		*recsize = sizeof(struct outfmt_stamp_rec);
+		return (stamp_fields);
+	case OUTFMT_CLOCK:
+		*nfields = NFIELDS(clock_fields);
+		*recsize = sizeof(struct outfmt_clock_rec);
+		return (clock_fields);
+	default:
+		return (NULL);
+	}
+}
+
+
+/* Records are little-endian on file, swap the fields in place if needed */
+static void
+swap_rec(int kind, unsigned char *rec)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	const struct outfmt_field *fields;
+	size_t recsize;
+	uint64_t v64;
+	uint32_t v32;
+	int i, j, n;
+
+	fields = kind_fields(kind, &n, &recsize);
+	for (i = 0; i < n; i++) {
+		if (field_size(fields[i].type) == 4) {
+			memcpy(&v32, rec + fields[i].offset, 4);
+			v32 = __builtin_bswap32(v32);
+			memcpy(rec + fields[i].offset, &v32, 4);
+			continue;
+		}
+		for (j = 0; j < field_size(fields[i].type); j += 8) {
+			memcpy(&v64, rec + fields[i].offset + j, 8);
+			v64 = __builtin_bswap64(v64);
+			memcpy(rec + fields[i].offset + j, &v64, 8);
+		}
+	}
+#endif
+}
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t
+get16(const unsigned char *p)
+{
+	return (p[0] | (p[1] << 8));
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (get16(p) | ((uint32_t)get16(p + 2) << 16));
+}
+
+
+/*
+ * A long double as the unevaluated sum of two doubles. Both conversions and
+ * the subtraction are exact when long double has a 64 bit mantissa. If long
+ * double is a double, the low part is 0.
+ */
+void
+outfmt_split_ld(double dd[2], long double x)
+{
+	dd[0] = (double) x;
+	dd[1] = (double) (x - (long double) dd[0]);
+}
+
+long double
+outfmt_join_ld(const double dd[2])
+{
+	return ((long double) dd[0] + (long double) dd[1]);
+}
+
+
+void
+outfmt_stamp_rec(struct outfmt_stamp_rec *rec, struct stamp_t *stamp, int sID)
+{
+	rec->Ta = BST(stamp)->Ta;
+	outfmt_split_ld(rec->Tb, BST(stamp)->Tb);
+	outfmt_split_ld(rec->Te, BST(stamp)->Te);
+	rec->Tf = BST(stamp)->Tf;
+	rec->id = stamp->id;
+	rec->sID = sID;
+	rec->pad = 0;
+}
+
+void
+outfmt_clock_rec(struct outfmt_clock_rec *rec, struct stamp_t *stamp,
+		struct bidir_algooutput *output, int sID)
+{
+	/* ld since must hold [s] since timescale origin, and at least 1mus precision */
+	long double currtime_out, currtime_in;
+
+	currtime_out = (long double)(BST(stamp)->Ta * output->phat) + output->K;
+	currtime_in  = (long double)(BST(stamp)->Tf * output->phat) + output->K;
+
+	outfmt_split_ld(rec->Tb, BST(stamp)->Tb);
+	rec->Tf = BST(stamp)->Tf;
+	rec->RTT = output->RTT;
+	rec->phat = output->phat;
+	rec->plocal = output->plocal;
+	outfmt_split_ld(rec->K, output->K);
+	rec->thetahat = output->thetahat;
+	rec->RTThat = output->RTThat;
+	rec->RTThat_new = output->RTThat_new;
+	rec->RTThat_shift = output->RTThat_shift;
+	rec->th_naive = output->th_naive;
+	rec->minET = output->minET;
+	rec->minET_last = output->minET_last;
+	outfmt_split_ld(rec->RADclockout, currtime_out);
+	outfmt_split_ld(rec->RADclockin, currtime_in);
+	rec->pDf = output->pDf;
+	rec->pDb = output->pDb;
+	rec->perr = output->perr;
+	rec->plocalerr = output->plocalerr;
+	rec->wsum = output->wsum;
+	rec->best_Tf = output->best_Tf;
+	rec->pathpenalty = output->pathpenalty;
+	rec->Pchange = output->Pchange;
+	rec->Pquality = output->Pquality;
+	rec->status = output->status;
+	rec->sID = sID;
+}
+
+
+void
+outfmt_ascii_header(FILE *fp, int kind)
+{
+	if (kind == OUTFMT_STAMP) {
+		fprintf(fp, "%% BEGIN_HEADER\n");
+		fprintf(fp, "%% description: radclock local vcounter "
+		    "and NTP server stamps\n");
+		fprintf(fp, "%% type: NTP_rad\n");
+		fprintf(fp, "%% version: 4\n");
+		fprintf(fp, "%% fields: Ta Tb Te Tf nonce [sID]\n");
+		fprintf(fp, "%% END_HEADER\n");
+		return;
+	}
+
+	fprintf(fp, "%% NTP packet filtering run with:\n");
+	fprintf(fp, "%%\n");
+	fprintf(fp, "%% column 1 - Tb \n");
+	fprintf(fp, "%% column 2 - Tf \n");
+	fprintf(fp, "%% column 3 - RTT\n");
+	fprintf(fp, "%% column 4 - phat\n");
+	fprintf(fp, "%% column 5 - plocal\n");
+	fprintf(fp, "%% column 6 - K\n");
+	fprintf(fp, "%% column 7 - thetahat\n");
+	fprintf(fp, "%% columns 8--10 - RTThat, RTThat_new, RTThat_sh\n");
+	fprintf(fp, "%% columns 11--17 - th_naive, minET, minET_last,"
+	    " RADclockout, RADclockin, pDf, pDb\n");
+	fprintf(fp, "%% columns 18--22 - perr, plocalerr, wsum, "
+	    "best_Tf, clock status\n");
+	fprintf(fp, "%%\n");
+}
+
+
+int
+outfmt_print_stamp(FILE *fp, const struct outfmt_stamp_rec *rec, int nservers)
+{
+	if (nservers == 1)	// omit last column with serverID
+		return (fprintf(fp, "%llu %.9Lf %.9Lf %llu %llu\n",
+			(long long unsigned)rec->Ta, outfmt_join_ld(rec->Tb),
+			outfmt_join_ld(rec->Te), (long long unsigned)rec->Tf,
+			(long long unsigned)rec->id));
+	else	// include serverID in last column
+		return (fprintf(fp, "%llu %.9Lf %.9Lf %llu %llu %d\n",
+			(long long unsigned)rec->Ta, outfmt_join_ld(rec->Tb),
+			outfmt_join_ld(rec->Te), (long long unsigned)rec->Tf,
+			(long long unsigned)rec->id, rec->sID));
+}
+
+
+int
+outfmt_print_clock(FILE *fp, const struct outfmt_clock_rec *rec, int nservers)
+{
+	int n, err;
+
+	n = fprintf(fp,
+		"%.9Lf %llu %llu %.10lg %.10lg %.11Lf %.10lf "
+		"%llu %llu %llu %.9lg %.9lg %.9lg %.11Lf "
+		"%.11Lf %.10lf %.10lf %.6lg %.6lg %.6lg %llu %u "
+		"%.9lg %.9lg %.9lg",    // pathpenalty metrics
+		outfmt_join_ld(rec->Tb),
+		(unsigned long long)rec->Tf,
+		(unsigned long long)rec->RTT,
+		rec->phat,
+		rec->plocal,
+		outfmt_join_ld(rec->K),
+		rec->thetahat,
+		(unsigned long long)rec->RTThat,
+		(unsigned long long)rec->RTThat_new,
+		(unsigned long long)rec->RTThat_shift,
+		rec->th_naive,
+		rec->minET,
+		rec->minET_last,
+		outfmt_join_ld(rec->RADclockout),
+		outfmt_join_ld(rec->RADclockin),
+		rec->pDf,
+		rec->pDb,
+		rec->perr,
+		rec->plocalerr,
+		rec->wsum,
+		(unsigned long long)rec->best_Tf,
+		rec->status,
+		// pathpenalty metrics
+		rec->pathpenalty,
+		rec->Pchange,
+		rec->Pquality);
+	if (n < 0)
+		return (-1);
+
+	if (nservers > 1)  // add last column with serverID
+		err = fprintf(fp, " %d\n", rec->sID);
+	else
+		err = fprintf(fp, "\n");
+	if (err < 0)
+		return (-1);
+
+	return (n + err);
+}
+
+
+/*
+ * Parse an ascii output line of the given kind into rec. The server ID column
+ * is optional, it is 0 if missing. Returns the number of columns read, -1 if
+ * the line is not of this kind.
+ */
+int
+outfmt_parse_ascii(const char *line, int kind, void *rec)
+{
+	const struct outfmt_field *fields;
+	unsigned char *p = rec;
+	const char *c;
+	char *end;
+	size_t recsize;
+	uint64_t u64;
+	uint32_t u32;
+	int32_t i32;
+	double f64, dd[2];
+	int i, n;
+
+	fields = kind_fields(kind, &n, &recsize);
+	if (fields == NULL)
+		return (-1);
+	memset(rec, 0, recsize);
+
+	c = line;
+	for (i = 0; i < n; i++) {
+		switch (fields[i].type) {
+		case OUTFMT_U64:
+			u64 = strtoull(c, &end, 10);
+			memcpy(p + fields[i].offset, &u64, sizeof(u64));
+			break;
+		case OUTFMT_F64:
+			f64 = strtod(c, &end);
+			memcpy(p + fields[i].offset, &f64, sizeof(f64));
+			break;
+		case OUTFMT_DD:
+			outfmt_split_ld(dd, strtold(c, &end));
+			memcpy(p + fields[i].offset, dd, sizeof(dd));
+			break;
+		case OUTFMT_U32:
+			u32 = strtoul(c, &end, 10);
+			memcpy(p + fields[i].offset, &u32, sizeof(u32));
+			break;
+		case OUTFMT_I32:
+			i32 = strtol(c, &end, 10);
+			memcpy(p + fields[i].offset, &i32, sizeof(i32));
+			break;
+		}
+		if (end == c || (*end != '\0' && !isspace(*end))) {
+			/* Only the server ID may be missing */
+			if (i == n - 1 && fields[i].type == OUTFMT_I32 && end == c)
+				break;
+			return (-1);
+		}
+		c = end;
+	}
+	while (isspace(*c))
+		c++;
+	if (*c != '\0')
+		return (-1);
+
+	return (i);
+}
+
+
+/*
+ * Write the binary file header. The configuration text is recorded as is, it
+ * is meant for people, not for parsing.
+ */
+int
+outfmt_bin_header(FILE *fp, int kind, int nservers, const char *config,
+		size_t config_len)
+{
+	const struct outfmt_field *fields;
+	unsigned char hdr[OUTFMT_HDR_SIZE], fd[OUTFMT_FIELD_SIZE];
+	unsigned char pad[OUTFMT_ALIGN];
+	size_t recsize, len, offset;
+	int i, n;
+
+	fields = kind_fields(kind, &n, &recsize);
+	if (fields == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (config == NULL)
+		config_len = 0;
+
+	len = OUTFMT_HDR_SIZE + n * OUTFMT_FIELD_SIZE + config_len;
+	offset = (len + OUTFMT_ALIGN - 1) / OUTFMT_ALIGN * OUTFMT_ALIGN;
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, OUTFMT_MAGIC, sizeof(OUTFMT_MAGIC));
+	put16(hdr + 8, OUTFMT_VERSION);
+	put16(hdr + 10, kind);
+	put16(hdr + 12, nservers);
+	put16(hdr + 14, n);
+	put32(hdr + 16, recsize);
+	put32(hdr + 20, offset);
+	put32(hdr + 24, config_len);
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		memset(fd, 0, sizeof(fd));
+		strncpy((char *)fd, fields[i].name, OUTFMT_NAME_SIZE - 1);
+		fd[OUTFMT_NAME_SIZE] = fields[i].type;
+		fd[OUTFMT_NAME_SIZE + 1] = field_size(fields[i].type);
+		put32(fd + OUTFMT_NAME_SIZE + 4, fields[i].offset);
+		if (fwrite(fd, sizeof(fd), 1, fp) != 1)
+			return (-1);
+	}
+
+	if (config_len > 0 && fwrite(config, config_len, 1, fp) != 1)
+		return (-1);
+
+	memset(pad, 0, sizeof(pad));
+	if (offset > len && fwrite(pad, offset - len, 1, fp) != 1)
+		return (-1);
+
+	return (offset);
+}
+
+
+int
+outfmt_bin_write(FILE *fp, int kind, const void *rec)
+{
+	union {
+		struct outfmt_stamp_rec stamp;
+		struct outfmt_clock_rec clock;
+	} buf;
+	size_t recsize;
+	int n;
+
+	if (kind_fields(kind, &n, &recsize) == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memcpy(&buf, rec, recsize);
+	swap_rec(kind, (unsigned char *)&buf);
+	if (fwrite(&buf, recsize, 1, fp) != 1)
+		return (-1);
+
+	return (recsize);
+}
+
+
+/*
+ * Map a binary output file. Files written with a different record layout are
+ * rejected, readers that go by the field descriptors are not limited to it.
+ */
+int
+outfmt_bin_open(const char *path, struct outfmt_file *f)
+{
+	const struct outfmt_field *fields;
+	const unsigned char *p, *fd;
+	struct stat st;
+	size_t recsize, offset;
+	int fdesc, i, n;
+
+	memset(f, 0, sizeof(*f));
+	fdesc = open(path, O_RDONLY);
+	if (fdesc < 0)
+		return (-1);
+	if (fstat(fdesc, &st) < 0) {
+		close(fdesc);
+		return (-1);
+	}
+	if (st.st_size < OUTFMT_HDR_SIZE) {
+		close(fdesc);
+		errno = EINVAL;
+		return (-1);
+	}
+	f->maplen = st.st_size;
+	f->map = mmap(NULL, f->maplen, PROT_READ, MAP_SHARED, fdesc, 0);
+	close(fdesc);
+	if (f->map == MAP_FAILED) {
+		f->map = NULL;
+		return (-1);
+	}
+	p = f->map;
+
+	if (memcmp(p, OUTFMT_MAGIC, sizeof(OUTFMT_MAGIC)) != 0)
+		goto badformat;
+	f->version = get16(p + 8);
+	f->kind = get16(p + 10);
+	f->nservers = get16(p + 12);
+	n = get16(p + 14);
+	f->recsize = get32(p + 16);
+	offset = get32(p + 20);
+	f->config_len = get32(p + 24);
+
+	fields = kind_fields(f->kind, &i, &recsize);
+	if (f->version != OUTFMT_VERSION || fields == NULL || n != i ||
+			f->recsize != recsize || offset > f->maplen ||
+			OUTFMT_HDR_SIZE + n * OUTFMT_FIELD_SIZE + f->config_len > offset)
+		goto badformat;
+
+	for (i = 0; i < n; i++) {
+		fd = p + OUTFMT_HDR_SIZE + i * OUTFMT_FIELD_SIZE;
+		if (strncmp((const char *)fd, fields[i].name, OUTFMT_NAME_SIZE) != 0 ||
+				fd[OUTFMT_NAME_SIZE] != fields[i].type ||
+				get32(fd + OUTFMT_NAME_SIZE + 4) != fields[i].offset)
+			goto badformat;
+	}
+
+	f->config = (const char *)p + OUTFMT_HDR_SIZE + n * OUTFMT_FIELD_SIZE;
+	f->data = p + offset;
+	f->nrec = (f->maplen - offset) / f->recsize;
+	madvise(f->map, f->maplen, MADV_SEQUENTIAL);
+	return (0);
+
+badformat:
+	munmap(f->map, f->maplen);
+	f->map = NULL;
+	errno = EINVAL;
+	return (-1);
+}
+
+
+void
+outfmt_bin_get(const struct outfmt_file *f, size_t i, void *rec)
+{
+	memcpy(rec, f->data + i * f->recsize, f->recsize);
+	swap_rec(f->kind, rec);
+}
+
+
+void
+outfmt_bin_close(struct outfmt_file *f)
+{
+	if (f->map)
+		munmap(f->map, f->maplen);
+	f->map = NULL;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _OUTPUTFMT_H
+#define _OUTPUTFMT_H
+
+
+/*
+ * Formats of the stamp (sync_out) and clock (clock_out) output files.
+ *
+ * The ascii format has one line per stamp, with the server ID as the last
+ * column if there is more than one server.
+ *
+ * The binary format is made of a header followed by fixed size records, all
+ * little-endian. The header is self describing:
+ *   0   magic "RADCLKB\0"
+ *   8   u16 version, u16 kind, u16 nservers, u16 nfields
+ *   16  u32 record size, u32 offset of the first record, u32 config length,
+ *       u32 reserved
+ *   32  nfields field descriptors of 32 bytes: name (NUL padded, 24 bytes),
+ *       u8 type, u8 size, u16 reserved, u32 offset in the record
+ *   ..  the daemon configuration (text, config length bytes), zero padded up
+ *       to the first record
+ * Fields are in the order of the ascii columns. The server ID is always
+ * recorded. Long doubles are stored as the unevaluated sum of two doubles,
+ * which is exact for the x86 extended format. The number of records follows
+ * from the file size, a partially written record at the end is ignored.
+ */
+#define OUTFMT_MAGIC		"RADCLKB"
+#define OUTFMT_VERSION		1
+#define OUTFMT_HDR_SIZE		32
+#define OUTFMT_FIELD_SIZE	32
+#define OUTFMT_NAME_SIZE	24
+#define OUTFMT_ALIGN		64			/* Records start on a multiple of */
+
+/* Kind of output */
+#define OUTFMT_STAMP		1
+#define OUTFMT_CLOCK		2
+
+/* Field types */
+#define OUTFMT_U64			1
+#define OUTFMT_F64			2
+#define OUTFMT_DD			3			/* long double as two doubles, high first */
+#define OUTFMT_U32			4
+#define OUTFMT_I32			5
+
+
+/* Stamp output record, in memory and on file */
+struct outfmt_stamp_rec {
+	uint64_t	Ta;
+	double		Tb[2];
+	double		Te[2];
+	uint64_t	Tf;
+	uint64_t	id;			// nonce
+	int32_t		sID;
+	uint32_t	pad;
+};
+
+/* Clock output record, in memory and on file */
+struct outfmt_clock_rec {
+	double		Tb[2];
+	uint64_t	Tf;
+	uint64_t	RTT;
+	double		phat;
+	double		plocal;
+	double		K[2];
+	double		thetahat;
+	uint64_t	RTThat;
+	uint64_t	RTThat_new;
+	uint64_t	RTThat_shift;
+	double		th_naive;
+	double		minET;
+	double		minET_last;
+	double		RADclockout[2];
+	double		RADclockin[2];
+	double		pDf;
+	double		pDb;
+	double		perr;
+	double		plocalerr;
+	double		wsum;
+	uint64_t	best_Tf;
+	double		pathpenalty;
+	double		Pchange;
+	double		Pquality;
+	uint32_t	status;
+	int32_t		sID;
+};
+
+/* A binary output file mapped for reading */
+struct outfmt_file {
+	int kind;
+	int version;
+	int nservers;
+	size_t nrec;
+	size_t recsize;
+	const char *config;			// not NUL terminated
+	size_t config_len;
+	const unsigned char *data;	// first record
+	void *map;
+	size_t maplen;
+};
+
+
+void outfmt_split_ld(double dd[2], long double x);
+long double outfmt_join_ld(const double dd[2]);
+
+void outfmt_stamp_rec(struct outfmt_stamp_rec *rec, struct stamp_t *stamp,
+		int sID);
+void outfmt_clock_rec(struct outfmt_clock_rec *rec, struct stamp_t *stamp,
+		struct bidir_algooutput *output, int sID);
+
+/* ascii, return the number of bytes written or -1 */
+void outfmt_ascii_header(FILE *fp, int kind);
+int outfmt_print_stamp(FILE *fp, const struct outfmt_stamp_rec *rec,
+		int nservers);
+int outfmt_print_clock(FILE *fp, const struct outfmt_clock_rec *rec,
+		int nservers);
+int outfmt_parse_ascii(const char *line, int kind, void *rec);
+
+/* Binary, return the number of bytes written or -1 */
+int outfmt_bin_header(FILE *fp, int kind, int nservers, const char *config,
+		size_t config_len);
+int outfmt_bin_write(FILE *fp, int kind, const void *rec);
+
+/* Binary, return 0 on success or -1 with errno set */
+int outfmt_bin_open(const char *path, struct outfmt_file *f);
+void outfmt_bin_get(const struct outfmt_file *f, size_t i, void *rec);
+void outfmt_bin_close(struct outfmt_file *f);
+
+#endif
@@ -86,39 +86,15 @@ int update_ipc_shared_memory(struct radclock_handle *handle) { return (0); };
 
 /*
  * Update IPC shared memory segment.
- * Swap pointers and bump generation number to ensure consistency.
+ * The v1 buffers are swapped under the generation number, the v2 copy is
+ * updated under its seqlock.
  */
 int
 update_ipc_shared_memory(struct radclock_handle *handle)
 {
-	struct radclock_sms *sms;
-	size_t offset_tmp;
-	unsigned int generation;
-
 	JDEBUG
 
-	sms = (struct radclock_sms *) handle->clock->ipc_sms;
-
-	memcpy((void *)sms + sms->data_off_old, RAD_DATA(handle),
-			sizeof(struct radclock_data));
-	memcpy((void *)sms + sms->error_off_old, RAD_ERROR(handle),
-			sizeof(struct radclock_error));
-	generation = sms->gen;
-
-	sms->gen = 0;
-
-	/* Swap current and old buffer offsets in the mapped SMS */
-	offset_tmp = sms->data_off;
-	sms->data_off = sms->data_off_old;
-	sms->data_off_old = offset_tmp;
-
-	offset_tmp = sms->error_off;
-	sms->error_off = sms->error_off_old;
-	sms->error_off_old = offset_tmp;
-
-	if (generation++ == 0)
-		generation = 1;
-	sms->gen = generation;
+	sms_write(handle->clock, RAD_DATA(handle), RAD_ERROR(handle));
 
 	if ( VERB_LEVEL>2 ) verbose(LOG_NOTICE, "Updated IPC Shared memory");
 	return (0);
@@ -867,6 +843,42 @@ preferred_RADclock(struct radclock_handle *handle, vcounter_t now)
 
 
 
+/*
+ * Publish latency: time from the capture of a server reply (its Tf vcount) to
+ * the end of the SMS and kernel clock updates it triggered. Read on the raw
+ * counter, converted with phat, and summarised with the periodic clock report.
+ */
+static struct publish_latency {
+	long n;
+	double last;
+	double min;
+	double max;
+	double sum;
+} publat;
+
+static void
+record_publish_latency(struct radclock_handle *handle, struct stamp_t *stamp,
+		struct radclock_data *rad_data)
+{
+	vcounter_t now;
+
+	if (radclock_get_vcounter(handle->clock, &now) < 0)
+		return;
+
+	publat.last = (now - BST(stamp)->Tf) * rad_data->phat;
+	if (publat.n == 0 || publat.last < publat.min)
+		publat.min = publat.last;
+	if (publat.n == 0 || publat.last > publat.max)
+		publat.max = publat.last;
+	publat.sum += publat.last;
+	publat.n++;
+
+	verbose(VERB_DEBUG, "Publish latency from reply capture: %.3f [ms]",
+			1000 * publat.last);
+}
+
+
+
 /*
  * This function is the core of the RADclock daemon.
  * It checks to see if any of the maintained RADclocks (one per server) is being
@@ -1141,6 +1153,10 @@ process_stamp(struct radclock_handle *handle)
 			if (sID != handle->pref_sID) pref_updated = 0;
 	}
 
+	/* Answer NTP clients from the updated preferred clock */
+	if (pref_updated)
+		ntpserv_publish(handle);
+
 
 	/*
 	 * RADdata copy actions, only relevant when running Live
@@ -1178,16 +1194,21 @@ process_stamp(struct radclock_handle *handle)
 					printout_FFdata(&cdat);
 				}
 
+				/* Push to the kernel, reading back the FFclock data in the kernel
+				 * now in the same round trip if checking */
 				if (handle->conf->adjust_FFclock == BOOL_ON) {
-					if (!set_kernel_ffclock(handle->clock, &cdat))
+					if ( VERB_LEVEL>2 )
+						err = setget_kernel_ffclock(handle->clock, &cdat, &cdat);
+					else
+						err = set_kernel_ffclock(handle->clock, &cdat);
+					if (!err)
 						//stamp_firstpush = stamp_i;
 						verbose(VERB_DEBUG, "FF kernel data has been updated.");
-				}
+				} else if ( VERB_LEVEL>2 )
+					get_kernel_ffclock(handle->clock, &cdat);
 
-				/* Check FFclock data in the kernel now */
 				if ( VERB_LEVEL>2 ) {
 					verbose(VERB_DEBUG, "Kernel FFdata is now :");
-					get_kernel_ffclock(handle->clock, &cdat);
 					printout_FFdata(&cdat);
 				}
 
@@ -1222,6 +1243,10 @@ process_stamp(struct radclock_handle *handle)
 
 		}  // if !STARAD_UNSYNC
 
+		/* Stamp capture to SMS/kernel publication */
+		if (!HAS_STATUS(RAD_DATA(handle), STARAD_UNSYNC))
+			record_publish_latency(handle, &stamp, RAD_DATA(handle));
+
 		/* Update any virtual machine store if configured */
 		if (VM_MASTER(handle)) {
 			err = push_data_vm(handle);
@@ -1257,6 +1282,12 @@ process_stamp(struct radclock_handle *handle)
 				1000 * rad_error->error_bound,
 				1000 * rad_error->error_bound_avg,
 				1000 * rad_error->error_bound_std);
+
+		if (publat.n > 0)
+			verbose(VERB_CONTROL, "i=%ld: Publish latency (last,min,avg,max) "
+					"%.3f %.3f %.3f %.3f [ms] over %ld stamps", output->n_stamps - 1,
+					1000 * publat.last, 1000 * publat.min,
+					1000 * publat.sum / publat.n, 1000 * publat.max, publat.n);
 	}
 
 	/* Set initial state of 'signals' - important !!
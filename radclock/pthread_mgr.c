@@ -24,14 +24,21 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE		/* sem_clockwait */
+
 #include <arpa/inet.h>
 
 #include <pthread.h>
 #include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -47,11 +54,96 @@
 #include "fixedpoint.h"		// this one can go once fixedpoint thread is removed
 #include "stampinput.h"
 #include "stampoutput.h"
+#include "create_stamp.h"
+#include "rawdata.h"
 #include "pthread_mgr.h"
+#include "semwait.h"
 #include "verbose.h"
 #include "jdebug.h"
 
 
+/*
+ * PROC wakeup.
+ * PROC sleeps on a semaphore, as sem_post() can be called from the spy signal
+ * handler where a condition variable cannot. To keep the capture path cheap
+ * under floods, producers only post when PROC has announced it is going to
+ * sleep. PROC sets `asleep' then checks the raw data queue once more, and
+ * producers publish their data then clear `asleep'. The fences ensure at least
+ * one of the two sides sees the other, so no wakeup is lost.
+ */
+struct proc_wakeup {
+	sem_t sem;
+	int asleep;
+};
+
+
+int
+init_proc_wakeup(struct radclock_handle *handle)
+{
+	struct proc_wakeup *w;
+
+	w = (struct proc_wakeup *) calloc(1, sizeof(struct proc_wakeup));
+	JDEBUG_MEMORY(JDBG_MALLOC, w);
+	if (w == NULL) {
+		verbose(LOG_ERR, "Cannot allocate PROC wakeup");
+		return (1);
+	}
+	if (sem_init(&w->sem, 0, 0) < 0) {
+		verbose(LOG_ERR, "Cannot initialise PROC wakeup semaphore: %s",
+				strerror(errno));
+		JDEBUG_MEMORY(JDBG_FREE, w);
+		free(w);
+		return (1);
+	}
+	handle->proc_wakeup = w;
+	return (0);
+}
+
+
+void
+destroy_proc_wakeup(struct radclock_handle *handle)
+{
+	if (handle->proc_wakeup == NULL)
+		return;
+
+	sem_destroy(&handle->proc_wakeup->sem);
+	JDEBUG_MEMORY(JDBG_FREE, handle->proc_wakeup);
+	free(handle->proc_wakeup);
+	handle->proc_wakeup = NULL;
+}
+
+
+void
+proc_wakeup(struct radclock_handle *handle)
+{
+	struct proc_wakeup *w;
+
+	w = handle->proc_wakeup;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&w->asleep, 0, __ATOMIC_RELAXED))
+		sem_post(&w->sem);
+}
+
+
+/*
+ * Wait for new raw data, or for at most `maxwait' microseconds so the stop
+ * flags are still looked at regularly.
+ */
+static void
+proc_wait(struct radclock_handle *handle, useconds_t maxwait)
+{
+	struct proc_wakeup *w;
+
+	w = handle->proc_wakeup;
+	__atomic_store_n(&w->asleep, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!rawdata_pending(handle->pcap_queue))
+		sem_wait_us(&w->sem, maxwait);
+	__atomic_store_n(&w->asleep, 0, __ATOMIC_RELAXED);
+}
+
+
 
 void
 init_thread_signal_mgt()
@@ -90,9 +182,11 @@ thread_trigger(void *c_handle)
 	if (err)
 		handle->pthread_flag_stop = PTH_STOP_ALL;
 
-	/* Deal with the next grid point */
-	while ((handle->pthread_flag_stop & PTH_TRIGGER_STOP) != PTH_TRIGGER_STOP)
+	/* Deal with the next grid point, and let PROC look at what came back */
+	while ((handle->pthread_flag_stop & PTH_TRIGGER_STOP) != PTH_TRIGGER_STOP) {
 		trigger_work(handle);
+		proc_wakeup(handle);
+	}
 
 	/* Thread exit */
 	verbose(LOG_NOTICE, "Thread trigger is terminating.");
@@ -124,7 +218,8 @@ thread_data_processing(void *c_handle)
 	/* Clock handle to be able to read global data */
 	handle = (struct radclock_handle *) c_handle;
 
-	/* Set wait period for the next grid point (in mus) */
+	/* Set max wait period for the next grid point (in mus), in case no wakeup
+	 * comes from the data producers */
 	pktwait = 1000000 * handle->conf->poll_period / handle->nservers;
 	if (pktwait > maxwait || pktwait == 0)
 		pktwait = maxwait;
@@ -145,7 +240,7 @@ thread_data_processing(void *c_handle)
 		} while (err == 0);
 
 		/* rdb empty, wait for more packets to arrive */
-		usleep(pktwait);
+		proc_wait(handle, pktwait);
 	}
 
 	/* Thread exit */
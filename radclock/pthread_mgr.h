@@ -75,6 +75,38 @@ int trigger_work(struct radclock_handle *handle);
 int process_stamp(struct radclock_handle *handle);
 
 
+/*
+ * Data processing thread wakeup. Raised by the raw data producers when new data
+ * is available, and by the trigger. Safe to call from a signal handler.
+ */
+int init_proc_wakeup(struct radclock_handle *handle);
+void destroy_proc_wakeup(struct radclock_handle *handle);
+void proc_wakeup(struct radclock_handle *handle);
+
+
+/*
+ * NTP server shared state. PROC publishes the preferred clock the server
+ * threads answer from, and the server is woken up to notice its stop flag.
+ * Request counters are kept since init_ntpserv(), and can be read from any
+ * thread.
+ */
+struct ntpserv_stats {
+	uint64_t requests;      // client requests received
+	uint64_t answered;      // with the time
+	uint64_t kod;           // with a RATE Kiss-o'-Death
+	uint64_t dropped;       // rate limited and not answered
+	uint64_t ignored;       // not client requests
+	uint64_t evictions;     // clients forgotten by the rate limiter too early
+};
+
+int init_ntpserv(struct radclock_handle *handle);
+void destroy_ntpserv(struct radclock_handle *handle);
+void ntpserv_publish(struct radclock_handle *handle);
+void ntpserv_wakeup(struct radclock_handle *handle);
+void ntpserv_get_stats(struct radclock_handle *handle,
+		struct ntpserv_stats *stats);
+
+
 /*
  * Threads initialisation
  */
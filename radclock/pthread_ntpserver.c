@@ -24,9 +24,14 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#ifdef linux
+#include <sys/eventfd.h>
+#endif
 
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -37,11 +42,15 @@
 #include <net/ethernet.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../config.h"
@@ -56,265 +65,919 @@
 #include "misc.h"
 #include "jdebug.h"
 #include "config_mgr.h"
+#include "ratelimit.h"
 
 
 /*
- * Integrated thread and thread-work function for NTP_SERV
+ * The NTP server runs conf->ntp_server_threads workers. Each has its own socket
+ * bound to the downstream port with SO_REUSEPORT, and the kernel spreads the
+ * clients over them. Requests are read and answered in batches, with recvmmsg
+ * and sendmmsg where available. The workers answer from a response template
+ * published by PROC under a sequence lock, so that they never wait on PROC nor
+ * on each other. A worker with nothing to do sleeps in poll()
+ * on its socket and on the stop eventfd, raised by ntpserv_wakeup() once
+ * PTH_NTP_SERV_STOP is set.
+ * The workers rate limit clients from a table they share (see ratelimit.h).
+ * The kernel picks the socket from the client address and port, so a client
+ * that changes ports moves between workers and would otherwise get the limit
+ * once per worker.
  */
-void *
-thread_ntp_server(void *c_handle)
-{
+
+/* Maximum number of requests read and answered per system call */
+#define NTPSERV_BATCH		32
+
+/* Workers log rate limiting at most this often [s] */
+#define NTPSERV_REPORT_PERIOD	60
+
+#ifdef MSG_WAITFORONE
+#define HAVE_MMSG
+#endif
+
+
+/*
+ * Response template, built by PROC each time the preferred clock is updated.
+ * Workers copy the header, and fill in org, rec, xmt and the dispersion using
+ * integer arithmetic only. The clock is kept in NTP fixed point, in the way of
+ * struct radclock_sms_fp: the time at the last update in 2^-32 s and a finer
+ * fraction, and the counter period as a multiplier and shift.
+ */
+struct ntpserv_template {
+	struct ntp_pkt pkt;           // response header, stratum to reftime
+	vcounter_t ref;               // last update of the clock [counter]
+	uint64_t ref_ntp;             // NTP time at ref, rounded [2^-32 s]
+	uint64_t ref_frac;            // fraction of ref_ntp [2^-(32+shift) s]
+	uint64_t mult;                // counter period [2^-(32+shift) s]
+	uint32_t shift;
+	vcounter_t leap_at;           // leap second applied past this value, or ~0
+	int64_t leap_ntp;             // value of the expected leap second [2^-32 s]
+	uint64_t disp;                // rootdispersion at ref [2^-16 s]
+	uint64_t disp_mult;           // its growth per counter unit [2^-(16+disp_shift) s]
+	uint32_t disp_shift;
+	double clockerror;            // average error bound, for the debug output
+};
+
+/* Counters of a worker, written by it only */
+struct ntpserv_counters {
+	struct ntpserv_stats s;
+} __attribute__((aligned(64)));
+
+struct ntpserv {
+	uint32_t seq;                    // odd while tmpl is being updated
+	struct ntpserv_template tmpl;
+	int stopfd[2];                   // eventfd twice, or a pipe
+	uint64_t evictions;              // of the rate limiter, already counted
+	struct ntpserv_counters counters[MAX_NTP_SERVER_THREADS];
+};
+
+struct ntpserv_worker {
 	struct radclock_handle *handle;
-	
-	/* RADclock related */
-	struct radclock_data rdata;
-	double clockerror;
-	vcounter_t vcount_rec = 0, vcount_xmt = 0;
+	pthread_t thread;
+	int id;
+	int sock;
+
+	/* Rate limiting, rl is shared by all workers, NULL if disabled */
+	struct ratelimit *rl;
+	uint8_t kod_poll;                // poll interval advertised in KoD [log2 s]
+	struct ntpserv_stats reported;   // counters when last logged
+	uint64_t report_at;              // [ns]
+
+	/* Requests of the current batch, and the responses to the valid ones */
+	int len[NTPSERV_BATCH];
+	struct sockaddr_in addr[NTPSERV_BATCH];
+	char pkt_in[NTPSERV_BATCH][NTP_PKT_MAX_LEN];
+	struct ntp_pkt pkt_out[NTPSERV_BATCH];
+#ifdef HAVE_MMSG
+	struct iovec iov_in[NTPSERV_BATCH];
+	struct iovec iov_out[NTPSERV_BATCH];
+	struct mmsghdr msg_in[NTPSERV_BATCH];
+	struct mmsghdr msg_out[NTPSERV_BATCH];
+#endif
+};
+
+
+
+int
+init_ntpserv(struct radclock_handle *handle)
+{
+	struct ntpserv *ns;
 
-	/* UNIX socket related */
-	int s_server;
-	struct sockaddr_in sin_server, sin_client;
-	socklen_t len;
-	char *pkt_in;
-	int pkt_in_mode;
-	struct ntp_pkt *pkt_out;
-	int n, err;
+	ns = (struct ntpserv *) calloc(1, sizeof(struct ntpserv));
+	JDEBUG_MEMORY(JDBG_MALLOC, ns);
+	if (ns == NULL) {
+		verbose(LOG_ERR, "Cannot allocate NTP server state");
+		return (1);
+	}
+#ifdef linux
+	ns->stopfd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ns->stopfd[1] = ns->stopfd[0];
+	if (ns->stopfd[0] < 0) {
+#else
+	if (pipe(ns->stopfd) < 0 ||
+			fcntl(ns->stopfd[0], F_SETFL, O_NONBLOCK) < 0 ||
+			fcntl(ns->stopfd[1], F_SETFL, O_NONBLOCK) < 0) {
+#endif
+		verbose(LOG_ERR, "Cannot create NTP server wakeup: %s", strerror(errno));
+		JDEBUG_MEMORY(JDBG_FREE, ns);
+		free(ns);
+		return (1);
+	}
+	handle->ntpserv = ns;
 
-	/* NTP packet related */
-	double rootdelay;				// is uint32_t in ntp_pkt structure
-	double rootdispersion;		// is uint32_t in ntp_pkt structure
+	/* Start from the clocks as initialised, the server is unsynchronised */
+	ntpserv_publish(handle);
+	return (0);
+}
 
-	/* Timestamps to send [ NTP format ]
-	 * reftime: last time (this host's) clock was updated (local time)
-	 * org: 		timestamp from the client
-	 * rec: 		timestamp when receiving packet (local time)
-	 * xmt: 		timestamp when sending packet (local time) */
-	l_fp reftime, rec, xmt;
 
+void
+destroy_ntpserv(struct radclock_handle *handle)
+{
+	struct ntpserv *ns;
+
+	ns = handle->ntpserv;
+	if (ns == NULL)
+		return;
+
+	close(ns->stopfd[0]);
+	if (ns->stopfd[1] != ns->stopfd[0])
+		close(ns->stopfd[1]);
+	JDEBUG_MEMORY(JDBG_FREE, ns);
+	free(ns);
+	handle->ntpserv = NULL;
+}
 
-	/* Deal with UNIX signal catching */
-	init_thread_signal_mgt();
 
-	/* Local copy of global data handle */
-	handle = (struct radclock_handle *) c_handle;
+/* Largest shift up to 62 keeping x * 2^shift below 2^64 */
+static uint32_t
+fp_shift(long double x)
+{
+	uint32_t shift;
 
-	/* Create the server socket and initialize to listen to clients */
-	if ((s_server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ) {
-		perror("socket");
-		pthread_exit(NULL);
+	for (shift = 62; shift > 0 && ldexpl(x, shift) >= ldexpl(1, 64); shift--)
+		;
+	return (shift);
+}
+
+
+/* Fixed point conversion with up-down round up, saturated */
+static uint32_t
+to_ufp16(long double x)
+{
+	x = x * 65536. + 0.5;
+	if (x <= 0)
+		return (0);
+	return (x >= 4294967295.0L ? 0xffffffff : (uint32_t) x);
+}
+
+
+static void
+build_template(struct radclock_handle *handle, struct ntpserv_template *t)
+{
+	struct radclock_data *rad_data;
+	struct ntp_pkt *pkt;
+	long double time, period;
+	l_fp reftime;
+
+	rad_data = RAD_DATA(handle);
+	memset(t, 0, sizeof(struct ntpserv_template));
+
+	/* NTP Standard requires special stratum and LI if server not in sync
+	 * NTP_VERSION:  add an abusive value to enable RAD client<-->server testing
+	 */
+	//u_char ntpversion = 5;		// use instead of NTP_VERSION to signal a RADclock server
+	u_char ntpversion = NTP_VERSION;
+	pkt = &t->pkt;
+	if (HAS_STATUS(rad_data, STARAD_UNSYNC)) {
+		pkt->stratum = 0;	// STRATUM_UNSPEC not used in responses, mapped to 0
+		pkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC, ntpversion, MODE_SERVER);
+	} else {
+		pkt->stratum = NTP_SERVER(handle)->stratum + 1;
+		// TODO: pass on per-pkt LI from daemon's server, include in  ntp_server to access?
+		pkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING, ntpversion, MODE_SERVER);
+	}
+	pkt->precision = -18;	/* TODO: should pass min(STA_NANO (or mus), phat) in power of 2 or so */
+	pkt->rootdelay = htonl(to_ufp16(NTP_SERVER(handle)->rootdelay +
+			NTP_SERVER(handle)->minRTT));
+
+	/* refid:  wording in the standard, for daemons with stratum>1, is unclear
+	 *   Examples frequently suggest that the refid of the daemon should replicate
+	 *   that of the daemon's server, ie:
+	 *     		pkt_out->refid	= htonl(NTP_SERVER(handle)->refid);
+	 *   however this recursion would result in the whole tree under a Stratum-1
+	 *   having the Stratum 1's IP address (in fact S1 code string!) as a refid,
+	 *   not useful for loop detection.
+	 *   We implement the other interpretation, that the refid of the daemon be
+	 *   the IP address of its server (whether the server is Stratum-1 or not).
+	 *   It is this refid (the daemon's own) that is inserted into response packets.
+	 *	TODO: add timingloop test: test if refid of this client not the daemon's server IP
+	 * TODO: put in appropriate KISS code (DENY seems only fit) if stratum set to zero above?
+	 */
+	// Note:  no htonl conversion on IP addresss, so don't convert back here !
+	pkt->refid = NTP_CLIENT(handle)->s_to.sin_addr.s_addr;
+
+	/* Reference time (time RADclock was last updated on this server) */
+	read_RADabs_UTC(rad_data, &rad_data->last_changed, &time, PLOCAL_ACTIVE);
+	UTCld_to_NTPtime(&time, &reftime);
+	pkt->reftime.l_int = htonl(reftime.l_int);
+	pkt->reftime.l_fra = htonl(reftime.l_fra);
+
+	/* The clock of read_RADabs_UTC, from the last update. Since the plocal
+	 * correction is anchored there, the period used is the only difference. */
+	period = PLOCAL_ACTIVE ? rad_data->phat_local : rad_data->phat;
+	t->ref = rad_data->last_changed;
+	if (period > 0) {
+		t->shift = fp_shift(ldexpl(period, 32));
+		t->mult = (uint64_t) ldexpl(period, 32 + t->shift);
+	}
+	time = ldexpl(time + JAN_1970, 32) + 0.5;
+	t->ref_ntp = (uint64_t) floorl(time);
+	t->ref_frac = (uint64_t) ldexpl(time - floorl(time), t->shift);
+	if (rad_data->leapsec_expected != 0) {
+		t->leap_at = rad_data->leapsec_expected;
+		t->leap_ntp = (int64_t) rad_data->leapsec_next << 32;
+	} else
+		t->leap_at = ~(vcounter_t)0;
+
+	/* NTP specification "seems" to indicate that the dispersion grows linear
+	 * at worst case rate error set to 15 PPM. The constant component is twice
+	 * the precision +  the filter dispersion which is a weighted sum of the
+	 * (past?) clock offsets.  The value of 15 PPM is somewhat arbitrary, trying
+	 * to reflect the fact that XO are much better than their 500 PPM specs.
+	 * Also precision in here is horrible ntpd linguo meaning "period" for us.
+	 * XXX Here I use the clock error as an equivalent to the filter
+	 * dispersion, I think it is safe to use the handle for that value
+	 * (should be some kind of longer term value anyway)
+	 */
+	t->clockerror = RAD_ERROR(handle)->error_bound_avg;
+	t->disp = to_ufp16(NTP_SERVER(handle)->rootdispersion + t->clockerror +
+			rad_data->phat);
+	period = ldexpl(rad_data->phat_local * 15e-6, 16);
+	if (period > 0) {
+		t->disp_shift = fp_shift(period);
+		t->disp_mult = (uint64_t) ldexpl(period, t->disp_shift);
+	}
+}
+
+
+/*
+ * Publish the response template to the server threads. Called by PROC only,
+ * there is a single writer.
+ */
+void
+ntpserv_publish(struct radclock_handle *handle)
+{
+	struct ntpserv_template tmpl;
+	struct ntpserv *ns;
+	uint32_t seq;
+
+	ns = handle->ntpserv;
+	if (ns == NULL)
+		return;
+
+	/* Build outside of the update, readers only retry across the copy */
+	build_template(handle, &tmpl);
+
+	seq = ns->seq;
+	__atomic_store_n(&ns->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ns->tmpl = tmpl;
+	__atomic_store_n(&ns->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+static void
+ntpserv_read(struct ntpserv *ns, struct ntpserv_template *tmpl)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&ns->seq, __ATOMIC_ACQUIRE);
+		*tmpl = ns->tmpl;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&ns->seq, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * NTP time of a counter value [2^-32 s]. floor((delta * mult + frac) >> shift)
+ * after the last update, the mirror ceiling before it.
+ */
+static inline uint64_t
+tmpl_ntptime(const struct ntpserv_template *t, vcounter_t vcount)
+{
+	uint64_t ntp, round;
+
+	if (vcount >= t->ref)
+		ntp = t->ref_ntp + fp_mulshift(vcount - t->ref, t->mult, t->ref_frac, 0,
+				t->shift);
+	else {
+		round = ((uint64_t)1 << t->shift) - 1;
+		ntp = t->ref_ntp - fp_mulshift(t->ref - vcount, t->mult, round,
+				t->ref_frac, t->shift);
+	}
+	if (vcount > t->leap_at)
+		ntp -= t->leap_ntp;
+	return (ntp);
+}
+
+
+/* Root dispersion at a counter value [2^-16 s] */
+static inline uint32_t
+tmpl_dispersion(const struct ntpserv_template *t, vcounter_t vcount)
+{
+	uint64_t disp;
+
+	disp = t->disp;
+	if (vcount > t->ref)
+		disp += fp_mulshift(vcount - t->ref, t->disp_mult, 0, 0, t->disp_shift);
+	return (disp > 0xffffffff ? 0xffffffff : (uint32_t) disp);
+}
+
+
+/* Sum of the counters of all workers */
+void
+ntpserv_get_stats(struct radclock_handle *handle, struct ntpserv_stats *stats)
+{
+	struct ntpserv_stats *c;
+	int i;
+
+	memset(stats, 0, sizeof(struct ntpserv_stats));
+	if (handle->ntpserv == NULL)
+		return;
+
+	for (i = 0; i < MAX_NTP_SERVER_THREADS; i++) {
+		c = &handle->ntpserv->counters[i].s;
+		stats->requests  += __atomic_load_n(&c->requests, __ATOMIC_RELAXED);
+		stats->answered  += __atomic_load_n(&c->answered, __ATOMIC_RELAXED);
+		stats->kod       += __atomic_load_n(&c->kod, __ATOMIC_RELAXED);
+		stats->dropped   += __atomic_load_n(&c->dropped, __ATOMIC_RELAXED);
+		stats->ignored   += __atomic_load_n(&c->ignored, __ATOMIC_RELAXED);
+		stats->evictions += __atomic_load_n(&c->evictions, __ATOMIC_RELAXED);
+	}
+}
+
+
+/* Add the counts of a batch to the worker's counters */
+static void
+add_stats(struct ntpserv_worker *w, struct ntpserv_stats *b)
+{
+	struct ntpserv *ns;
+	struct ntpserv_stats *c;
+	uint64_t total, seen;
+
+	ns = w->handle->ntpserv;
+	c = &ns->counters[w->id].s;
+	__atomic_store_n(&c->requests, c->requests + b->requests, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->answered, c->answered + b->answered, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->kod, c->kod + b->kod, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->dropped, c->dropped + b->dropped, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->ignored, c->ignored + b->ignored, __ATOMIC_RELAXED);
+	if (w->rl == NULL)
+		return;
+
+	/* Evictions are of the shared table, the worker that sees them first
+	 * takes them on its counters */
+	total = ratelimit_evictions(w->rl);
+	seen = __atomic_load_n(&ns->evictions, __ATOMIC_RELAXED);
+	while (seen < total && !__atomic_compare_exchange_n(&ns->evictions, &seen,
+			total, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	b->evictions = (seen < total) ? total - seen : 0;
+	__atomic_store_n(&c->evictions, c->evictions + b->evictions,
+			__ATOMIC_RELAXED);
+}
+
+
+/*
+ * Log the rate limiting of the last period, if any. The worker's own counters
+ * are compared, other threads only ever read them.
+ */
+static void
+report_stats(struct ntpserv_worker *w, uint64_t now)
+{
+	struct ntpserv_stats *c;
+	uint64_t limited;
+
+	if (now < w->report_at)
+		return;
+	w->report_at = now + NTPSERV_REPORT_PERIOD * 1000000000ULL;
+
+	c = &w->handle->ntpserv->counters[w->id].s;
+	limited = c->kod + c->dropped - w->reported.kod - w->reported.dropped;
+	if (limited > 0 || c->evictions != w->reported.evictions)
+		verbose(LOG_NOTICE, "NTPserver: thread %d rate limited %llu of %llu "
+				"requests in %d s (%llu KoD), %llu clients evicted early",
+				w->id, (long long unsigned) limited,
+				(long long unsigned) (c->requests - w->reported.requests),
+				NTPSERV_REPORT_PERIOD,
+				(long long unsigned) (c->kod - w->reported.kod),
+				(long long unsigned) (c->evictions - w->reported.evictions));
+	w->reported = *c;
+}
+
+
+/* Make the server threads look at their stop flag */
+void
+ntpserv_wakeup(struct radclock_handle *handle)
+{
+	uint64_t one = 1;
+
+	if (handle->ntpserv == NULL)
+		return;
+	if (write(handle->ntpserv->stopfd[1], &one, sizeof(one)) < 0 &&
+			errno != EAGAIN)
+		verbose(LOG_ERR, "Cannot wake up NTP server: %s", strerror(errno));
+}
+
+
+/* Consume pending wakeups, so that the next server run does not see them */
+static void
+ntpserv_drain(struct ntpserv *ns)
+{
+	uint64_t buf[8];
+
+	while (read(ns->stopfd[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+
+
+/*
+ * Socket bound to the downstream port. Workers share the port when there are
+ * several of them.
+ */
+static int
+ntpserv_socket(struct radclock_handle *handle, int shared)
+{
+	struct sockaddr_in sin_server;
+	int s, on;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		verbose(LOG_ERR, "NTPserver: Cannot create socket: %s", strerror(errno));
+		return (-1);
 	}
-	memset((char *) &sin_client, 0, sizeof(struct sockaddr_in));
+
+	if (shared) {
+		on = 1;
+#if defined(SO_REUSEPORT_LB)
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT_LB, &on, sizeof(on)) < 0) {
+#elif defined(SO_REUSEPORT)
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+#else
+		errno = EOPNOTSUPP;
+		{
+#endif
+			verbose(LOG_WARNING, "NTPserver: Cannot share port between "
+					"threads: %s", strerror(errno));
+			close(s);
+			return (-1);
+		}
+	}
+
 	memset((char *) &sin_server, 0, sizeof(struct sockaddr_in));
-	len = sizeof(sin_client);
 	sin_server.sin_family 		= AF_INET;
 	sin_server.sin_addr.s_addr = htonl(INADDR_ANY);
 	sin_server.sin_port = htons((long)handle->conf->ntp_downstream_port);
-
-	/* Set a receive timeout */
-	struct timeval so_timeout;
-	so_timeout.tv_sec 	= 1;
-	so_timeout.tv_usec 	= 0;
-	setsockopt(s_server, SOL_SOCKET, SO_RCVTIMEO, (void*)(&so_timeout),
-			sizeof(struct timeval));
-
-	/* Bind socket */
-	err = bind(s_server, (struct sockaddr *)&sin_server, sizeof(struct sockaddr_in));
-	if (err == -1) {
-		verbose(LOG_ERR, "NTPserver: Socket bind() error. Killing thread: %s",
-				strerror(errno));
-		pthread_exit(NULL);
+	if (bind(s, (struct sockaddr *)&sin_server, sizeof(struct sockaddr_in)) < 0) {
+		verbose(LOG_ERR, "NTPserver: Socket bind() error: %s", strerror(errno));
+		close(s);
+		return (-1);
 	}
+	return (s);
+}
 
-	/* Create incoming and outgoing NTP packet bodies
-	 * We don't know what we are receiving (backward compatibility with exotic
-	 * NTP clients?) so allocate a big buffer for the receiving side. But in all
-	 * cases, reply with minimal packets.
-	 * TODO: security issues?
-	 */
-	pkt_in  = (char*) malloc(sizeof(char)*NTP_PKT_MAX_LEN);
-	JDEBUG_MEMORY(JDBG_MALLOC, pkt_in);
-	pkt_out = (struct ntp_pkt*) malloc(sizeof(struct ntp_pkt)); // why malloc this?
-	JDEBUG_MEMORY(JDBG_MALLOC, pkt_out);
 
-	verbose(LOG_NOTICE, "NTPserver: service begun.");
+static inline uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
 
-	/* Accept packets from clients, process requests, and send back data.
-	 * The socket timeout ensures recvfrom will not block forever, so that the
-	 * while's thread stopping condition can be tested periodically.
-	 * This code currently assumes that the daemon is not a Stratum-1.
-	 */
-	while ((handle->pthread_flag_stop & PTH_NTP_SERV_STOP) != PTH_NTP_SERV_STOP) {
 
-		/* Receive the UDP request using a blocking call with timeout */
-		// This needs to be changed to be non-blocking.
-		n = recvfrom(s_server, (void*) pkt_in, NTP_PKT_MAX_LEN, 0,
-				(struct sockaddr*)&sin_client, &len);
-		if (n < 0) {	// no bytes read after timeout
-			continue;	// enable check if thread should STOP
-		}
+/* Read a batch of requests, returns their number or -1 */
+static int
+recv_batch(struct ntpserv_worker *w)
+{
+#ifdef HAVE_MMSG
+	int i, n;
+
+	for (i = 0; i < NTPSERV_BATCH; i++)
+		w->msg_in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	n = recvmmsg(w->sock, w->msg_in, NTPSERV_BATCH, MSG_DONTWAIT, NULL);
+	for (i = 0; i < n; i++)
+		w->len[i] = w->msg_in[i].msg_len;
+	return (n);
+#else
+	socklen_t len;
+	int n;
+
+	len = sizeof(struct sockaddr_in);
+	n = recvfrom(w->sock, w->pkt_in[0], NTP_PKT_MAX_LEN, MSG_DONTWAIT,
+			(struct sockaddr *)&w->addr[0], &len);
+	if (n < 0)
+		return (-1);
+	w->len[0] = n;
+	return (1);
+#endif
+}
 
-		/* Raw timestamp the request packet arrival: must be done ASAP */
-		err = radclock_get_vcounter(handle->clock, &vcount_rec);
+
+/* Send the first n responses, response i going to w->addr[dst[i]] */
+static void
+send_batch(struct ntpserv_worker *w, int *dst, int n)
+{
+	int i, err;
+
+#ifdef HAVE_MMSG
+	for (i = 0; i < n; i++)
+		w->msg_out[i].msg_hdr.msg_name = &w->addr[dst[i]];
+
+	/* A failure is reported for the first message not sent, skip it */
+	for (i = 0; i < n; ) {
+		err = sendmmsg(w->sock, &w->msg_out[i], n - i, 0);
 		if (err < 0) {
-			verbose(LOG_WARNING, "NTPserver: failed to read raw timestamp of incoming NTP request");
-			continue;			// response will not be sent
+			if (errno == EINTR)
+				continue;
+			verbose(LOG_ERR, "NTPserver: Socket send() error: %s",
+					strerror(errno));
+			err = 1;
 		}
+		i += err;
+	}
+#else
+	for (i = 0; i < n; i++) {
+		err = sendto(w->sock, (char *)&w->pkt_out[i], LEN_PKT_NOMAC, 0,
+				(struct sockaddr *)&w->addr[dst[i]], sizeof(struct sockaddr_in));
+		if (err < 0)
+			verbose(LOG_ERR, "NTPserver: Socket send() error: %s",
+					strerror(errno));
+	}
+#endif
+}
 
-		/* Process according to MODE of incoming packet */
-		pkt_in_mode = PKT_MODE( ((struct ntp_pkt*)pkt_in)->li_vn_mode );
-		switch (pkt_in_mode) {
-		case MODE_UNSPEC:
-		case MODE_ACTIVE:
-		case MODE_PASSIVE:
-		case MODE_SERVER:
-		case MODE_BROADCAST:
-			verbose(VERB_DEBUG, "NTPserver: received bad mode, ignoring.");
-			continue;
 
-		case MODE_PRIVATE:
-		case MODE_CONTROL:
-			/* Who is using ntpq or ntpdc? */
-			verbose(VERB_DEBUG, "NTPserver: received control message, ignoring.");
+/*
+ * RATE Kiss-o'-Death, from the template header. As ntpd does, all timestamps
+ * are the client's, so that the response cannot be used for synchronisation.
+ */
+static void
+fill_kod(struct ntp_pkt *pkt_out, const struct ntp_pkt *pkt_in,
+		const struct ntpserv_template *tmpl, uint8_t poll)
+{
+	memcpy(pkt_out, &tmpl->pkt, LEN_PKT_NOMAC);
+	pkt_out->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC, NTP_VERSION, MODE_SERVER);
+	pkt_out->stratum = 0;
+	pkt_out->ppoll = (pkt_in->ppoll > poll) ? pkt_in->ppoll : poll;
+	memcpy(&pkt_out->refid, "RATE", 4);
+	pkt_out->org = pkt_in->xmt;
+	pkt_out->rec = pkt_in->xmt;
+	pkt_out->xmt = pkt_in->xmt;
+}
+
+
+/* Only client requests are answered */
+static int
+is_client_request(struct ntp_pkt *pkt, int len)
+{
+	if (len < LEN_PKT_NOMAC) {
+		verbose(VERB_DEBUG, "NTPserver: received short packet, ignoring.");
+		return (0);
+	}
+
+	switch (PKT_MODE(pkt->li_vn_mode)) {
+	case MODE_CLIENT:
+		return (1);
+
+	case MODE_PRIVATE:
+	case MODE_CONTROL:
+		/* Who is using ntpq or ntpdc? */
+		verbose(VERB_DEBUG, "NTPserver: received control message, ignoring.");
+		return (0);
+
+	default:
+		verbose(VERB_DEBUG, "NTPserver: received bad mode, ignoring.");
+		return (0);
+	}
+}
+
+
+/*
+ * Serve requests until told to stop.
+ * This code currently assumes that the daemon is not a Stratum-1.
+ */
+static void
+ntpserv_work(struct ntpserv_worker *w)
+{
+	struct radclock_handle *handle;
+	struct ntpserv_template tmpl;
+	struct pollfd pfd[2];
+	struct ntp_pkt *pkt_in, *pkt_out;
+	struct ntpserv_stats b;
+	int dst[NTPSERV_BATCH];
+	char kod[NTPSERV_BATCH];
+	int i, n, nout;
+	char addr[INET_ADDRSTRLEN];
+	uint64_t now;
+
+	/* RADclock related */
+	vcounter_t vcount_rec, vcount_xmt;
+
+	/* Timestamps to send [ NTP format, 2^-32 s ]
+	 * org: 		timestamp from the client
+	 * rec: 		timestamp when receiving packet (local time)
+	 * xmt: 		timestamp when sending packet (local time) */
+	uint64_t rec, xmt;
+	uint32_t rec_int, rec_fra, rootdispersion;
+
+	handle = w->handle;
+	pfd[0].fd = w->sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = handle->ntpserv->stopfd[0];
+	pfd[1].events = POLLIN;
+
+	while ((handle->pthread_flag_stop & PTH_NTP_SERV_STOP) != PTH_NTP_SERV_STOP) {
+
+		/* Sleep only once the socket has been emptied */
+		n = recv_batch(w);
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				verbose(LOG_ERR, "NTPserver: Socket receive error: %s",
+						strerror(errno));
+			if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+				verbose(LOG_ERR, "NTPserver: poll() error: %s", strerror(errno));
+				break;
+			}
 			continue;
+		}
 
-		case MODE_CLIENT:
-			// process_MODEclient(...)    // move to this when process multiple modes
-			break;
+		/* Raw timestamp the arrival of the batch: must be done ASAP. Requests
+		 * queued behind the first one are stamped late, as they would be if
+		 * read one at a time. */
+		if (radclock_get_vcounter(handle->clock, &vcount_rec) < 0) {
+			verbose(LOG_WARNING, "NTPserver: failed to read raw timestamp of incoming NTP request");
+			continue;			// responses will not be sent
 		}
 
-		/* Copy the current raddata, looping to ensure consistency.
-		 * Is needed to compute timestamps and timestamp errors. */
-		do {
-			memcpy(&rdata, RAD_DATA(handle), sizeof(struct radclock_data));
-		} while (memcmp(&rdata, RAD_DATA(handle), sizeof(struct radclock_data)) != 0);
-
-		
-		/* NTP specification "seems" to indicate that the dispersion grows linear
-		 * at worst case rate error set to 15 PPM. The constant component is twice
-		 * the precision +  the filter dispersion which is a weighted sum of the
-		 * (past?) clock offsets.  The value of 15 PPM is somewhat arbitrary, trying
-		 * to reflect the fact that XO are much better than their 500 PPM specs.
-		 * Also precision in here is horrible ntpd linguo meaning "period" for us.
-		 * XXX Here I use the clock error as an equivalent to the filter
-		 * dispersion, I think it is safe to use the handle for that value
-		 * (should be some kind of longer term value anyway)
-		 */
-		clockerror = RAD_ERROR(handle)->error_bound_avg;
-		rootdispersion = NTP_SERVER(handle)->rootdispersion + clockerror +
-			rdata.phat + (vcount_rec - rdata.last_changed) * rdata.phat_local * 15e-6;
-
-		rootdelay = NTP_SERVER(handle)->rootdelay + NTP_SERVER(handle)->minRTT;
-
-
-		/* Fill the outgoing packet
-		 * Fixed point conversion of rootdispersion and rootdelay with up-down round up
-		 * NTP_VERSION:  add an abusive value to enable RAD client<-->server testing
-		 */
-		memset((char *) pkt_out, 0, sizeof(struct ntp_pkt));
-		//u_char ntpversion = 5;		// use instead of NTP_VERSION to signal a RADclock server
-		u_char ntpversion = NTP_VERSION;
-	
-		/* NTP Standard requires special stratum and LI if server not in sync */
-		if (HAS_STATUS(RAD_DATA(handle), STARAD_UNSYNC)) {
-			pkt_out->stratum = 0;	// STRATUM_UNSPEC not used in responses, mapped to 0
-			pkt_out->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC, ntpversion, MODE_SERVER);
-		} else {
-			pkt_out->stratum = NTP_SERVER(handle)->stratum + 1;
-			// TODO: pass on per-pkt LI from daemon's server, include in  ntp_server to access?
-			pkt_out->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING, ntpversion, MODE_SERVER);
+		/* Consistent copy of the template of the current clock */
+		ntpserv_read(handle->ntpserv, &tmpl);
+
+		/* Receive Timestamp (Tb in algo language), and the dispersion grown
+		 * since the last clock update */
+		rec = tmpl_ntptime(&tmpl, vcount_rec);
+		rec_int = htonl((uint32_t)(rec >> 32));
+		rec_fra = htonl((uint32_t)rec);
+		rootdispersion = tmpl_dispersion(&tmpl, vcount_rec);
+
+		now = 0;
+		memset(&b, 0, sizeof(b));
+		nout = 0;
+		for (i = 0; i < n; i++) {
+			pkt_in = (struct ntp_pkt *) w->pkt_in[i];
+			if (!is_client_request(pkt_in, w->len[i])) {
+				b.ignored++;
+				continue;
+			}
+			b.requests++;
+			pkt_out = &w->pkt_out[nout];
+
+			/* Each request is charged at its own time, a batch can hold more
+			 * than a burst of requests from one client */
+			if (w->rl) {
+				now = monotonic_ns();
+				switch (ratelimit_check(w->rl, (struct sockaddr *)&w->addr[i],
+						now)) {
+				case RATELIMIT_DROP:
+					b.dropped++;
+					continue;
+				case RATELIMIT_KOD:
+					fill_kod(pkt_out, pkt_in, &tmpl, w->kod_poll);
+					b.kod++;
+					kod[nout] = 1;
+					dst[nout++] = i;
+					continue;
+				}
+			}
+
+			/* Fill the outgoing packet from the template
+			 * org: copied over from the xmt field of incoming request pkt
+			 */
+			memcpy(pkt_out, &tmpl.pkt, LEN_PKT_NOMAC);
+			pkt_out->ppoll			= pkt_in->ppoll;
+			pkt_out->rootdispersion = htonl(rootdispersion);
+			pkt_out->org			= pkt_in->xmt;
+			pkt_out->rec.l_int		= rec_int;
+			pkt_out->rec.l_fra		= rec_fra;
+
+			if (VERB_LEVEL > 1) {
+				inet_ntop(AF_INET, &w->addr[i].sin_addr, addr, sizeof(addr));
+				verbose(VERB_DEBUG, "Reply to NTP client %s with statum=%d "
+						"rdelay=%.06f rdisp= %.06f clockerror= %.06f "
+						"diff= %"VC_FMT" Tb= %u.%010u", addr, pkt_out->stratum,
+						ntohl(pkt_out->rootdelay) / 65536.,
+						rootdispersion / 65536., tmpl.clockerror,
+						(vcount_rec - tmpl.ref), ntohl(rec_int), ntohl(rec_fra));
+			}
+			b.answered++;
+			kod[nout] = 0;
+			dst[nout++] = i;
 		}
-		
-		pkt_out->ppoll			= ((struct ntp_pkt*)pkt_in)->ppoll;
-		pkt_out->precision		= -18;	/* TODO: should pass min(STA_NANO (or mus), phat) in power of 2 or so */
-		pkt_out->rootdelay 		= htonl( (uint32_t)(rootdelay * 65536. + 0.5));
-		pkt_out->rootdispersion = htonl( (uint32_t)(rootdispersion * 65536. + 0.5));
-	
-		/* refid:  wording in the standard, for daemons with stratum>1, is unclear
-		 *   Examples frequently suggest that the refid of the daemon should replicate
-		 *   that of the daemon's server, ie:
-		 *     		pkt_out->refid	= htonl(NTP_SERVER(handle)->refid);
-		 *   however this recursion would result in the whole tree under a Stratum-1
-		 *   having the Stratum 1's IP address (in fact S1 code string!) as a refid,
-		 *   not useful for loop detection.
-		 *   We implement the other interpretation, that the refid of the daemon be
-		 *   the IP address of its server (whether the server is Stratum-1 or not).
-		 *   It is this refid (the daemon's own) that is inserted into response packets.
-		 *	TODO: add timingloop test: test if refid of this client not the daemon's server IP
-		 * TODO: put in appropriate KISS code (DENY seems only fit) if stratum set to zero above?
-		 */
-		 // Note:  no htonl conversion on IP addresss, so don't convert back here !
-		 pkt_out->refid = NTP_CLIENT(handle)->s_to.sin_addr.s_addr;
-		 
-		 
-      // inet_ntoa(NTP_CLIENT(handle)->s_from.sin_addr)
-
-
-
-		/* Fill the timestamp fields
-		 * reftime, rec:  use rAdclock
-		 * org:           copied over from the xmt field of incoming request pkt
-		 * xmt:           use raDclock (more robust, accurate, faster)
-		 */
-		long double time;
-		//memset((char *) &reftime, 0, sizeof(l_fp));
-		//memset((char *) &org, 0, sizeof(l_fp));
-		//memset((char *) &rec, 0, sizeof(l_fp));
-		//memset((char *) &xmt, 0, sizeof(l_fp));
-		
-		/* Reference time (time RADclock was last updated on this server) */
-		read_RADabs_UTC(RAD_DATA(handle), &rdata.last_changed, &time, PLOCAL_ACTIVE);
-		UTCld_to_NTPtime(&time, &reftime);
-		pkt_out->reftime.l_int = htonl(reftime.l_int);
-		pkt_out->reftime.l_fra = htonl(reftime.l_fra);
-
-		/* Origin Timestamp (Ta in algo language) */
-		pkt_out->org = ((struct ntp_pkt*)pkt_in)->xmt;
-
-		/* Receive Timestamp (Tb in algo language) */
-		read_RADabs_UTC(RAD_DATA(handle), &vcount_rec, &time, PLOCAL_ACTIVE);
-		UTCld_to_NTPtime(&time, &rec);
-		pkt_out->rec.l_int = htonl(rec.l_int);
-		pkt_out->rec.l_fra = htonl(rec.l_fra);
-
-		verbose(VERB_DEBUG, "Reply to NTP client %s with statum=%d rdelay=%.06f "
-				"rdisp= %.06f clockerror= %.06f diff= %"VC_FMT" Tb= %d.%06d",
-				inet_ntoa(sin_client.sin_addr), pkt_out->stratum, rootdelay,
-				rootdispersion, clockerror, (vcount_rec - rdata.last_changed),
-				rec.l_int, rec.l_fra );
+		add_stats(w, &b);
+		if (now > 0)
+			report_stats(w, now);
+		if (nout == 0)
+			continue;
 
 		/* Transmit Timestamp (Te in algo language) */
-		err = radclock_get_vcounter(handle->clock, &vcount_xmt); // send ASAP after this
-		if (err < 0) {
+		if (radclock_get_vcounter(handle->clock, &vcount_xmt) < 0) { // send ASAP after this
 			verbose(LOG_WARNING, "NTPserver: failed to read raw timestamp of outgoing NTP response");
-			continue;			// response will not be sent
+			continue;			// responses will not be sent
 		}
 		/* Use difference clock:  xmt = rec + Cd(vcount_xmt) - Cd(vcount_rec)
-		 * Ignore plocal refinement for greater robustness and simplicity:
-		 * at these timescales, the difference is sub-ns */
-		time += RAD_DATA(handle)->phat*(vcount_xmt - vcount_rec);
-		UTCld_to_NTPtime(&time, &xmt);
-		pkt_out->xmt.l_int = htonl(xmt.l_int);
-		pkt_out->xmt.l_fra = htonl(xmt.l_fra);
-		
-		
-		/* Send data back using the client's address */
+		 * At these timescales, the plocal refinement makes a sub-ns difference
+		 * either way */
+		xmt = rec + fp_mulshift(vcount_xmt - vcount_rec, tmpl.mult, 0, 0,
+				tmpl.shift);
+		for (i = 0; i < nout; i++) {
+			if (kod[i])
+				continue;
+			w->pkt_out[i].xmt.l_int = htonl((uint32_t)(xmt >> 32));
+			w->pkt_out[i].xmt.l_fra = htonl((uint32_t)xmt);
+		}
+
+		/* Send data back using the clients' addresses */
 		// TODO: So far we send the minimum packet size ... we may change that later
-		err = sendto(s_server, (char*)pkt_out, LEN_PKT_NOMAC, 0,
-				(struct sockaddr *)&sin_client, len);
-		if (err < 0)
-			verbose(LOG_ERR, "NTPserver: Socket send() error: %s", strerror(errno));
-			
-	} /* while */
+		send_batch(w, dst, nout);
+	}
+}
+
+
+static void *
+ntpserv_worker(void *arg)
+{
+	/* Deal with UNIX signal catching */
+	init_thread_signal_mgt();
 
+	ntpserv_work((struct ntpserv_worker *) arg);
+	pthread_exit(NULL);
+}
+
+
+static void
+init_worker(struct ntpserv_worker *w, struct radclock_handle *handle, int id,
+		int sock, struct ratelimit *rl)
+{
+	struct radclock_config *conf;
+	int poll;
+#ifdef HAVE_MMSG
+	int i;
+#endif
+
+	w->handle = handle;
+	w->id = id;
+	w->sock = sock;
+	w->rl = rl;
+
+	/* Limited clients are told to poll no faster than the token rate */
+	conf = handle->conf;
+	if (rl) {
+		poll = (int) ceil(-log2(conf->ntp_server_rate));
+		if (poll < NTP_MINPOLL)
+			poll = NTP_MINPOLL;
+		if (poll > NTP_MAXPOLL)
+			poll = NTP_MAXPOLL;
+		w->kod_poll = poll;
+	}
+	w->reported = handle->ntpserv->counters[id].s;
+#ifdef HAVE_MMSG
+	for (i = 0; i < NTPSERV_BATCH; i++) {
+		w->iov_in[i].iov_base = w->pkt_in[i];
+		w->iov_in[i].iov_len = NTP_PKT_MAX_LEN;
+		w->msg_in[i].msg_hdr.msg_name = &w->addr[i];
+		w->msg_in[i].msg_hdr.msg_iov = &w->iov_in[i];
+		w->msg_in[i].msg_hdr.msg_iovlen = 1;
+
+		w->iov_out[i].iov_base = &w->pkt_out[i];
+		w->iov_out[i].iov_len = LEN_PKT_NOMAC;
+		w->msg_out[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		w->msg_out[i].msg_hdr.msg_iov = &w->iov_out[i];
+		w->msg_out[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+}
+
+
+/*
+ * Integrated thread and thread-work function for NTP_SERV
+ * Serves as the first worker, and starts and joins the others.
+ */
+void *
+thread_ntp_server(void *c_handle)
+{
+	struct radclock_handle *handle;
+	struct ntpserv_worker *workers;
+	struct ntpserv_stats stats;
+	struct ratelimit *rl;
+	int nthreads, i, s;
+	long ncpu;
+
+	/* Deal with UNIX signal catching */
+	init_thread_signal_mgt();
+
+	/* Local copy of global data handle */
+	handle = (struct radclock_handle *) c_handle;
+
+	/* Wakeups left over from a previous run */
+	ntpserv_drain(handle->ntpserv);
+
+	nthreads = handle->conf->ntp_server_threads;
+	if (nthreads == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpu < 1) ? 1 : (int)ncpu;
+		if (nthreads > MAX_NTP_SERVER_THREADS)
+			nthreads = MAX_NTP_SERVER_THREADS;
+	}
+
+	workers = (struct ntpserv_worker *) calloc(nthreads,
+			sizeof(struct ntpserv_worker));
+	JDEBUG_MEMORY(JDBG_MALLOC, workers);
+	if (workers == NULL) {
+		verbose(LOG_ERR, "NTPserver: Cannot allocate workers. Killing thread");
+		pthread_exit(NULL);
+	}
+
+	/* One rate limiter for all workers */
+	rl = NULL;
+	if (handle->conf->ntp_server_rate > 0) {
+		rl = ratelimit_create(handle->conf->ntp_server_rate,
+				handle->conf->ntp_server_burst,
+				handle->conf->ntp_server_kod == BOOL_ON);
+		if (rl == NULL)
+			verbose(LOG_ERR, "NTPserver: Cannot allocate rate limiter, "
+					"answering all requests");
+	}
+	__atomic_store_n(&handle->ntpserv->evictions, 0, __ATOMIC_RELAXED);
+
+	/* All sockets are bound before any request is read. If the port cannot be
+	 * shared, run with fewer threads. */
+	for (i = 0; i < nthreads; i++) {
+		s = ntpserv_socket(handle, nthreads > 1);
+		if (s < 0 && i == 0 && nthreads > 1) {
+			nthreads = 1;
+			s = ntpserv_socket(handle, 0);
+		}
+		if (s < 0)
+			break;
+		init_worker(&workers[i], handle, i, s, rl);
+	}
+	if (i == 0) {
+		verbose(LOG_ERR, "NTPserver: No socket to serve from. Killing thread");
+		ratelimit_free(rl);
+		JDEBUG_MEMORY(JDBG_FREE, workers);
+		free(workers);
+		pthread_exit(NULL);
+	}
+	if (i < nthreads) {
+		verbose(LOG_WARNING, "NTPserver: only %d of %d sockets bound", i, nthreads);
+		nthreads = i;
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, ntpserv_worker,
+				&workers[i])) {
+			verbose(LOG_WARNING, "NTPserver: Cannot start worker %d", i);
+			for (s = i; s < nthreads; s++)
+				close(workers[s].sock);
+			nthreads = i;
+			break;
+		}
+	}
+
+	verbose(LOG_NOTICE, "NTPserver: service begun with %d thread%s.", nthreads,
+			nthreads > 1 ? "s" : "");
+
+	ntpserv_work(&workers[0]);
 
 	/* Thread exit */
+	for (i = 1; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < nthreads; i++)
+		close(workers[i].sock);
+	ratelimit_free(rl);
+	ntpserv_drain(handle->ntpserv);
+
+	ntpserv_get_stats(handle, &stats);
+	verbose(LOG_NOTICE, "NTPserver: %llu requests answered, %llu rate limited "
+			"(%llu KoD), %llu ignored since start.",
+			(long long unsigned) stats.answered,
+			(long long unsigned) (stats.kod + stats.dropped),
+			(long long unsigned) stats.kod, (long long unsigned) stats.ignored);
 	verbose(LOG_NOTICE, "NTPserver: thread is terminating.");
-	JDEBUG_MEMORY(JDBG_FREE, pkt_in);
-	free(pkt_in);
-	JDEBUG_MEMORY(JDBG_FREE, pkt_out);
-	free(pkt_out);
-	close(s_server);		// test this
-	
+	JDEBUG_MEMORY(JDBG_FREE, workers);
+	free(workers);
+
 	pthread_exit(NULL);
 }
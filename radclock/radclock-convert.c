@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Conversion of the stamp and clock output files between the ascii and binary
+ * formats (see outputfmt.h). The direction and the kind of output are guessed
+ * from the input file. Converting back and forth gives the original file.
+ * Stamp files converted to binary can be replayed instead of the ascii ones
+ * (-S option), stamp lines are read the same way as the ascii replay does,
+ * so that older formats are accepted. Raw pcap inputs are converted by
+ * replaying them with -A.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "outputfmt.h"
+
+#define LINE_SIZE	1024
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: radclock-convert <infile> <outfile>\n"
+		"\tConvert a radclock stamp or clock output file (-a, -o, -A, -O\n"
+		"\toptions) or stamp input file (-s, -S options) from ascii to\n"
+		"\tbinary format, or from binary to ascii\n"
+		"\tTo convert a raw pcap input: radclock -r <infile> -A <outfile>\n");
+	exit(EXIT_FAILURE);
+}
+
+
+static int
+bin_to_ascii(const char *inpath, FILE *out)
+{
+	struct outfmt_file f;
+	union {
+		struct outfmt_stamp_rec stamp;
+		struct outfmt_clock_rec clock;
+	} rec;
+	size_t i;
+	int err;
+
+	if (outfmt_bin_open(inpath, &f) < 0) {
+		fprintf(stderr, "Cannot read %s: %s\n", inpath, strerror(errno));
+		return (1);
+	}
+
+	outfmt_ascii_header(out, f.kind);
+	err = 0;
+	for (i = 0; i < f.nrec && err >= 0; i++) {
+		outfmt_bin_get(&f, i, &rec);
+		if (f.kind == OUTFMT_STAMP)
+			err = outfmt_print_stamp(out, &rec.stamp, f.nservers);
+		else
+			err = outfmt_print_clock(out, &rec.clock, f.nservers);
+	}
+	outfmt_bin_close(&f);
+
+	fprintf(stderr, "%lu %s records converted to ascii\n", (unsigned long) i,
+			f.kind == OUTFMT_STAMP ? "stamp" : "clock");
+	return (err < 0);
+}
+
+
+/*
+ * Stamp line, as read by the ascii replay: Ta Tb Te Tf [nonce [sID]], anything
+ * after is ignored. Returns the number of columns read, -1 if not a stamp.
+ */
+static int
+parse_stamp(const char *line, struct outfmt_stamp_rec *rec)
+{
+	unsigned long long Ta, Tf, id = 0;
+	long double Tb, Te;
+	int sID = 0;
+	int n;
+
+	n = sscanf(line, "%llu %Lf %Lf %llu %llu %d", &Ta, &Tb, &Te, &Tf, &id, &sID);
+	if (n < 4)
+		return (-1);
+
+	memset(rec, 0, sizeof(*rec));
+	rec->Ta = Ta;
+	outfmt_split_ld(rec->Tb, Tb);
+	outfmt_split_ld(rec->Te, Te);
+	rec->Tf = Tf;
+	rec->id = id;
+	rec->sID = sID;
+	return (n);
+}
+
+
+/*
+ * The kind of output is given by the first data line. The number of servers
+ * is not recorded in ascii files, it is deduced from the server IDs, and
+ * written to the header once known.
+ */
+static int
+ascii_to_bin(const char *inpath, FILE *in, FILE *out)
+{
+	union {
+		struct outfmt_stamp_rec stamp;
+		struct outfmt_clock_rec clock;
+	} rec;
+	char line[LINE_SIZE];
+	char config[LINE_SIZE];
+	unsigned long nline, nrec;
+	int kind, ncol, n, nservers;
+
+	snprintf(config, sizeof(config), "# Converted from %s\n", inpath);
+	kind = 0;
+	ncol = 0;
+	nservers = 1;
+	nline = 0;
+	nrec = 0;
+	while (fgets(line, sizeof(line), in)) {
+		nline++;
+		if (line[0] == '%' || line[0] == '\n')
+			continue;
+
+		if (kind == 0) {
+			kind = OUTFMT_CLOCK;
+			ncol = outfmt_parse_ascii(line, kind, &rec);
+			if (ncol < 0) {
+				kind = OUTFMT_STAMP;
+				ncol = parse_stamp(line, &rec.stamp);
+			}
+			if (ncol < 0) {
+				fprintf(stderr, "%s:%lu: not a stamp or clock output line\n",
+						inpath, nline);
+				return (1);
+			}
+			if (outfmt_bin_header(out, kind, nservers, config,
+					strlen(config)) < 0)
+				goto write_error;
+		}
+
+		if (kind == OUTFMT_CLOCK)
+			n = outfmt_parse_ascii(line, kind, &rec);
+		else
+			n = parse_stamp(line, &rec.stamp);
+		if (n != ncol) {
+			fprintf(stderr, "%s:%lu: malformed line\n", inpath, nline);
+			return (1);
+		}
+		if (kind == OUTFMT_STAMP && rec.stamp.sID >= nservers)
+			nservers = rec.stamp.sID + 1;
+		if (kind == OUTFMT_CLOCK && rec.clock.sID >= nservers)
+			nservers = rec.clock.sID + 1;
+		if (outfmt_bin_write(out, kind, &rec) < 0)
+			goto write_error;
+		nrec++;
+	}
+	if (kind == 0) {
+		fprintf(stderr, "%s: no data\n", inpath);
+		return (1);
+	}
+
+	/* A server ID column means several servers, even if only 0 is seen */
+	if (nservers == 1 && (kind == OUTFMT_STAMP ? ncol == 6 : ncol == 26))
+		nservers = 2;
+	if (fseek(out, 0, SEEK_SET) < 0 ||
+			outfmt_bin_header(out, kind, nservers, config, strlen(config)) < 0)
+		goto write_error;
+
+	fprintf(stderr, "%lu %s records converted to binary\n", nrec,
+			kind == OUTFMT_STAMP ? "stamp" : "clock");
+	return (0);
+
+write_error:
+	fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+	return (1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	char magic[sizeof(OUTFMT_MAGIC)];
+	FILE *in, *out;
+	int binary, err;
+
+	if (argc != 3 || argv[1][0] == '-')
+		usage();
+
+	in = fopen(argv[1], "r");
+	if (in == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[1], strerror(errno));
+		return (1);
+	}
+	binary = fread(magic, sizeof(magic), 1, in) == 1 &&
+			memcmp(magic, OUTFMT_MAGIC, sizeof(magic)) == 0;
+	rewind(in);
+
+	out = fopen(argv[2], "w");
+	if (out == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[2], strerror(errno));
+		return (1);
+	}
+
+	if (binary)
+		err = bin_to_ascii(argv[1], out);
+	else
+		err = ascii_to_bin(argv[1], in, out);
+	fclose(in);
+
+	if (fclose(out) == EOF && err == 0) {
+		fprintf(stderr, "Error writing %s: %s\n", argv[2], strerror(errno));
+		err = 1;
+	}
+	return (err);
+}
@@ -143,14 +143,19 @@ struct radclock_handle {
 	unsigned int unix_signal;    // for recording of HUP and TERM
 	struct FIFO *alarm_buffer;   // buffer for sIDs of packet SIGALRMs
 	
-	/* Output file descriptors */
+	/* Output file descriptors, written to by the output writer thread */
 	FILE* stampout_fd;
 	FILE* matout_fd;
+	FILE* stampout_bin_fd;
+	FILE* matout_bin_fd;
+	struct output_writer *output_writer;
 
 	/* Threads */
 	pthread_t threads[8];
 	int pthread_flag_stop;
 	pthread_mutex_t globaldata_mutex;
+	struct proc_wakeup *proc_wakeup;    // wakes PROC when new data arrives
+	struct ntpserv *ntpserv;            // clock published to the NTP server
 
 	/* Configuration */
 	struct radclock_config *conf;
@@ -62,6 +62,7 @@
 #include "logger.h"
 #include "verbose.h"
 #include "sync_history.h"
+#include "sync_thetahat.h"
 #include "sync_algo.h"
 #include "create_stamp.h"
 #include "config_mgr.h"
@@ -110,9 +111,12 @@ static void usage(void) {
 		"\t-r <filename> read raw sync input from pcap file (\"-\" for stdin)\n"
 		"\t-s <filename> read sync input from ascii file (header comments and "
 				"extra columns skipped)\n"
+		"\t-S <filename> read sync input from binary stamp file\n"
 		"\t-w <filename> write raw sync output to file (modified pcap format)\n"
 		"\t-a <filename> write sync output to file (ascii)\n"
 		"\t-o <filename> write radclock algo output to file (ascii)\n"
+		"\t-A <filename> write sync output to file (binary)\n"
+		"\t-O <filename> write radclock algo output to file (binary)\n"
 		"\t-P <filename> write pid lockfile to file\n"
 		"\t-U <port_number> NTP upstream port\n"
 		"\t-D <port_number> NTP downstream port\n"
@@ -169,7 +173,8 @@ rehash_daemon(struct radclock_handle *handle, uint32_t param_mask)
 	//XXX Should check we have only one input selected
 	if (HAS_UPDATE(param_mask, UPDMASK_NETWORKDEV) ||
 			HAS_UPDATE(param_mask, UPDMASK_SYNC_IN_PCAP) ||
-			HAS_UPDATE(param_mask, UPDMASK_SYNC_IN_ASCII))
+			HAS_UPDATE(param_mask, UPDMASK_SYNC_IN_ASCII) ||
+			HAS_UPDATE(param_mask, UPDMASK_SYNC_IN_BIN))
 	{
 		verbose(LOG_WARNING, " It is not possible to change the type of input "
 				"on the fly!");
@@ -178,6 +183,7 @@ rehash_daemon(struct radclock_handle *handle, uint32_t param_mask)
 		CLEAR_UPDATE(param_mask, UPDMASK_NETWORKDEV);
 		CLEAR_UPDATE(param_mask, UPDMASK_SYNC_IN_PCAP);
 		CLEAR_UPDATE(param_mask, UPDMASK_SYNC_IN_ASCII);
+		CLEAR_UPDATE(param_mask, UPDMASK_SYNC_IN_BIN);
 	}
 
 	if (HAS_UPDATE(param_mask, UPDMASK_VERBOSE)) {
@@ -229,16 +235,20 @@ rehash_daemon(struct radclock_handle *handle, uint32_t param_mask)
 	}
 
 	/* Management of output files */
-	if (HAS_UPDATE(param_mask, UPDMASK_SYNC_OUT_ASCII)) {
+	if (HAS_UPDATE(param_mask, UPDMASK_SYNC_OUT_ASCII) ||
+			HAS_UPDATE(param_mask, UPDMASK_SYNC_OUT_BIN)) {
 		close_output_stamp(handle);
 		open_output_stamp(handle);
 		CLEAR_UPDATE(param_mask, UPDMASK_SYNC_OUT_ASCII);
+		CLEAR_UPDATE(param_mask, UPDMASK_SYNC_OUT_BIN);
 	}
 
-	if (HAS_UPDATE(param_mask, UPDMASK_CLOCK_OUT_ASCII)) {
+	if (HAS_UPDATE(param_mask, UPDMASK_CLOCK_OUT_ASCII) ||
+			HAS_UPDATE(param_mask, UPDMASK_CLOCK_OUT_BIN)) {
 		close_output_matlab(handle);
 		open_output_matlab(handle);
 		CLEAR_UPDATE(param_mask, UPDMASK_CLOCK_OUT_ASCII);
+		CLEAR_UPDATE(param_mask, UPDMASK_CLOCK_OUT_BIN);
 	}
 
 	if (HAS_UPDATE(param_mask, UPDMASK_SYNC_OUT_PCAP)) {
@@ -471,28 +481,24 @@ create_handle(struct radclock_config *conf, int is_daemon)
 	/* Output files */
 	handle->stampout_fd = NULL;
 	handle->matout_fd = NULL;
+	handle->stampout_bin_fd = NULL;
+	handle->matout_bin_fd = NULL;
+	handle->output_writer = NULL;
 
 	/* Thread related */
 	handle->pthread_flag_stop = 0;
 	pthread_mutex_init(&(handle->globaldata_mutex), NULL);
+	if (init_proc_wakeup(handle))
+		return (NULL);
 
 	handle->syncalgo_mode = RADCLOCK_BIDIR; // hardwired, as yet not really used
 	handle->stamp_source = NULL;
 
 	/* Raw data queues */
-	handle->pcap_queue = (void*) malloc(sizeof(struct raw_data_bundle));
-	JDEBUG_MEMORY(JDBG_MALLOC, handle->pcap_queue);
-	memset(handle->pcap_queue, 0, sizeof(struct raw_data_queue));
-	pthread_mutex_init(&(handle->pcap_queue->rdb_mutex), NULL);
-	handle->pcap_queue->rdb_start = NULL;
-	handle->pcap_queue->rdb_end = NULL;
-
-	handle->ieee1588eq_queue = (void*) malloc(sizeof(struct raw_data_bundle));
-	JDEBUG_MEMORY(JDBG_MALLOC, handle->ieee1588eq_queue);
-	memset(handle->ieee1588eq_queue, 0, sizeof(struct raw_data_queue));
-	pthread_mutex_init(&(handle->ieee1588eq_queue->rdb_mutex), NULL);
-	handle->ieee1588eq_queue->rdb_start = NULL;
-	handle->ieee1588eq_queue->rdb_end = NULL;
+	if (rawdata_queue_init(&handle->pcap_queue, RAWDATA_QUEUE_SIZE))
+		return (NULL);
+	if (rawdata_queue_init(&handle->ieee1588eq_queue, RAWDATA_QUEUE_SIZE))
+		return (NULL);
 
 	/* Handle structure for per-server data, and generic stamp queue */
 	struct bidir_algodata *algodata;
@@ -770,9 +776,12 @@ init_handle(struct radclock_handle *handle)
 		handle->stamp_source = (void *) stamp_source;
 	}
 
-	/* Open output files */
+	/* Open output files, written to by their own thread */
 	open_output_stamp(handle);
 	open_output_matlab(handle);
+	if (start_output_writer(handle))
+		verbose(LOG_WARNING, "Output files will be written to by the "
+				"processing thread");
 
 	return (0);
 }
@@ -904,8 +913,11 @@ start_live(struct radclock_handle *handle)
 	/* Do not stop PROC in HUP case (owns sync algo state) */
 	if (handle->unix_signal == SIGHUP)
 		handle->pthread_flag_stop &= ~PTH_DATA_PROC_STOP;
+	else
+		proc_wakeup(handle);
 
 	if (handle->conf->server_ntp == BOOL_ON) {
+		ntpserv_wakeup(handle);
 		pthread_join(handle->threads[PTH_NTP_SERV], &thread_status);
 		verbose(LOG_NOTICE, "NTP server thread is dead.");
 	}
@@ -1023,7 +1035,7 @@ main(int argc, char *argv[])
 	param_mask = UPDMASK_NOUPD;
 
 	/* Reading the command line arguments */
-	while ((ch = getopt(argc, argv, "dxvhc:i:l:n:t:r:w:s:a:o:p:P:U:D:V")) != -1)
+	while ((ch = getopt(argc, argv, "dxvhc:i:l:n:t:r:w:s:S:a:o:A:O:p:P:U:D:V")) != -1)
 		switch (ch) {
 		case 'x':
 			SET_UPDATE(param_mask, UPDMASK_SERVER_IPC);
@@ -1105,6 +1117,14 @@ main(int argc, char *argv[])
 			SET_UPDATE(param_mask, UPDMASK_SYNC_IN_ASCII);
 			strcpy(conf->sync_in_ascii, optarg);
 			break;
+		case 'S':
+			if (strlen(optarg) > MAXLINE) {
+				fprintf(stdout, "ERROR: parameter too long\n");
+				exit (1);
+			}
+			SET_UPDATE(param_mask, UPDMASK_SYNC_IN_BIN);
+			strcpy(conf->sync_in_bin, optarg);
+			break;
 		case 'a':
 			if (strlen(optarg) > MAXLINE) {
 				fprintf(stdout, "ERROR: parameter too long\n");
@@ -1121,6 +1141,22 @@ main(int argc, char *argv[])
 			SET_UPDATE(param_mask, UPDMASK_CLOCK_OUT_ASCII);
 			strcpy(conf->clock_out_ascii, optarg);
 			break;
+		case 'A':
+			if (strlen(optarg) > MAXLINE) {
+				fprintf(stdout, "ERROR: parameter too long\n");
+				exit (1);
+			}
+			SET_UPDATE(param_mask, UPDMASK_SYNC_OUT_BIN);
+			strcpy(conf->sync_out_bin, optarg);
+			break;
+		case 'O':
+			if (strlen(optarg) > MAXLINE) {
+				fprintf(stdout, "ERROR: parameter too long\n");
+				exit (1);
+			}
+			SET_UPDATE(param_mask, UPDMASK_CLOCK_OUT_BIN);
+			strcpy(conf->clock_out_bin, optarg);
+			break;
 		case 'P':
 			if (strlen(optarg) > MAXLINE) {
 				fprintf(stdout, "ERROR: parameter too long\n");
@@ -1212,6 +1248,8 @@ main(int argc, char *argv[])
 
 	/* Knowing the number of servers, create space for corresponding RADclocks */
 	init_mRADclocks(handle, handle->nservers);
+	if (init_ntpserv(handle))
+		return (1);
 
 	
 	/*
@@ -1318,8 +1356,8 @@ main(int argc, char *argv[])
 	verbose(LOG_NOTICE, "%ld valid timestamp tuples extracted over all servers", stamp_total);
 
 
-	/* Close output files */
-	close_output_stamp(handle);
+	/* Write out pending output and close output files */
+	stop_output_writer(handle);
 
 	/* Print out last good phat value */
 	verbose(LOG_NOTICE, "Last estimate of the clock source period: %12.10lg",
@@ -1343,21 +1381,24 @@ main(int argc, char *argv[])
 
 	/* Clear thread stuff */
 	pthread_mutex_destroy(&(handle->globaldata_mutex));
+	destroy_proc_wakeup(handle);
+	destroy_ntpserv(handle);
 
 	/* Detach IPC shared memory if were running as IPC server. */
 	if (handle->conf->server_ipc == BOOL_ON)
 		sms_detach(handle->clock);
 
+	/* Release the link to the kernel clock */
+	close_kernel_clock(handle->clock);
+
 	/* Free the clock handle members and itself. */
 	free(handle->conf->time_server);
 	free(handle->rad_data);
 	free(handle->rad_error);
 	free(handle->ntp_client);
 	free(handle->ntp_server);
-	pthread_mutex_destroy(&(handle->pcap_queue->rdb_mutex));
-	pthread_mutex_destroy(&(handle->ieee1588eq_queue->rdb_mutex));
-	free(handle->pcap_queue);
-	free(handle->ieee1588eq_queue);
+	rawdata_queue_free(handle->pcap_queue);
+	rawdata_queue_free(handle->ieee1588eq_queue);
 
 	struct bidir_algodata *algodata = handle->algodata;
 	free(algodata->laststamp);
@@ -1365,6 +1406,7 @@ main(int argc, char *argv[])
 	for (int s=0; s<handle->nservers; s++) {
 		struct bidir_algostate *state = &algodata->state[s];
 		history_free(&state->stamp_hist);
+		history_free(&state->Tf_hist);
 		history_free(&state->Df_hist);
 		history_free(&state->Db_hist);
 		history_free(&state->Dfhat_hist);
@@ -1373,6 +1415,16 @@ main(int argc, char *argv[])
 		history_free(&state->RTT_hist);
 		history_free(&state->RTThat_hist);
 		history_free(&state->thnaive_hist);
+		history_minwin_free(&state->RTT_shift_mw);
+		history_minwin_free(&state->RTT_near_mw);
+		history_minwin_free(&state->RTT_far_mw);
+		history_minwin_free(&state->Df_shift_mw);
+		history_minwin_free(&state->Db_shift_mw);
+		if (state->thwin != NULL) {
+			thwin_free(state->thwin);
+			JDEBUG_MEMORY(JDBG_FREE, state->thwin);
+			free(state->thwin);
+		}
 	}
 	free(algodata->state);
 	destroy_stamp_queue((struct bidir_algodata*)handle->algodata);
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ratelimit.h"
+#include "jdebug.h"
+
+
+/*
+ * The bucket is kept as the time it will be full again, the token bucket of
+ * GCRA: a request takes a token by pushing tat one interval further, which is
+ * possible as long as tat does not get more than burst intervals ahead of now.
+ * An entry with tat in the past holds a full bucket.
+ * Each field is updated on its own with compare-and-swap, so that the server
+ * threads never wait on each other. A client is known by a keyed 64 bit hash
+ * of its address, odd so that 0 marks an unused entry. The low bits give the
+ * set, entries of a set differ in the others.
+ */
+struct rl_entry {
+	uint64_t tag;			// hash of the client address or prefix, 0 if unused
+	uint64_t tat;			// bucket full again at [ns]
+	uint64_t kod_at;		// no KoD to this client before [ns]
+};
+
+/* Entries of a set, on their own cache lines */
+struct rl_set {
+	struct rl_entry way[RATELIMIT_WAYS];
+} __attribute__((aligned(64)));
+
+
+struct ratelimit {
+	struct rl_set *table;		// RATELIMIT_SETS sets
+	uint64_t seed[2];			// hash key, so that sets cannot be targeted
+	uint64_t interval;			// between tokens [ns]
+	uint64_t tolerance;			// (burst - 1) intervals [ns]
+	uint64_t kod_interval;		// between two KoD to a client [ns]
+	int kod;					// send KoD, or only drop
+	uint64_t evictions;
+};
+
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z;
+
+	z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+
+struct ratelimit *
+ratelimit_create(double rate, int burst, int kod)
+{
+	struct ratelimit *rl;
+	struct timespec ts;
+	uint64_t x;
+
+	if (rate <= 0 || burst < 1)
+		return (NULL);
+
+	rl = (struct ratelimit *) calloc(1, sizeof(struct ratelimit));
+	JDEBUG_MEMORY(JDBG_MALLOC, rl);
+	if (rl == NULL)
+		return (NULL);
+	if (posix_memalign((void **)&rl->table, 64,
+			RATELIMIT_SETS * sizeof(struct rl_set))) {
+		JDEBUG_MEMORY(JDBG_FREE, rl);
+		free(rl);
+		return (NULL);
+	}
+	JDEBUG_MEMORY(JDBG_MALLOC, rl->table);
+	memset(rl->table, 0, RATELIMIT_SETS * sizeof(struct rl_set));
+
+	rl->interval = (uint64_t) (1e9 / rate);
+	if (rl->interval == 0)
+		rl->interval = 1;
+	rl->tolerance = (uint64_t) (burst - 1) * rl->interval;
+	rl->kod_interval = rl->interval > 1000000000 ? rl->interval : 1000000000;
+	rl->kod = kod;
+
+	/* Not cryptographic, only has to differ between tables and runs */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	x = ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) ^
+			((uint64_t) getpid() << 32) ^ (uint64_t) (uintptr_t) rl;
+	rl->seed[0] = splitmix64(&x);
+	rl->seed[1] = splitmix64(&x);
+
+	return (rl);
+}
+
+
+void
+ratelimit_free(struct ratelimit *rl)
+{
+	if (rl == NULL)
+		return;
+	JDEBUG_MEMORY(JDBG_FREE, rl->table);
+	free(rl->table);
+	JDEBUG_MEMORY(JDBG_FREE, rl);
+	free(rl);
+}
+
+
+uint64_t
+ratelimit_evictions(struct ratelimit *rl)
+{
+	return (__atomic_load_n(&rl->evictions, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * IPv4 addresses are keyed in their IPv4-mapped IPv6 form, so that a dual stack
+ * socket gives the same key. Returns -1 for other address families.
+ */
+static int
+rl_key(const struct sockaddr *sa, uint64_t key[2])
+{
+	const uint8_t *a;
+	uint32_t v4;
+	int i;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		v4 = ntohl(((const struct sockaddr_in *) sa)->sin_addr.s_addr);
+		break;
+
+	case AF_INET6:
+		a = ((const struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *) sa)->sin6_addr)) {
+			v4 = (uint32_t) a[12] << 24 | (uint32_t) a[13] << 16 |
+					(uint32_t) a[14] << 8 | a[15];
+			break;
+		}
+		key[0] = 0;
+		for (i = 0; i < 8; i++)
+			key[0] = (key[0] << 8) | a[i];
+		key[1] = 0;
+		return (0);
+
+	default:
+		return (-1);
+	}
+
+	key[0] = 0;
+	key[1] = 0xffff00000000ULL | v4;
+	return (0);
+}
+
+
+static inline uint64_t
+rl_hash(const struct ratelimit *rl, const uint64_t key[2])
+{
+	uint64_t h;
+
+	h = (key[0] ^ rl->seed[0]) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (h >> 32) ^ key[1] ^ rl->seed[1]) * 0xbf58476d1ce4e5b9ULL;
+	return (h ^ (h >> 29));
+}
+
+
+/*
+ * A thread racing with the eviction of an entry may charge one request to the
+ * new client, or see the evicted client's bucket once. Either way the limit is
+ * off by a request at most.
+ */
+int
+ratelimit_check(struct ratelimit *rl, const struct sockaddr *sa, uint64_t now)
+{
+	struct rl_entry *set, *e;
+	uint64_t key[2], h, tag, t, old, min, tat, next, kod_at;
+	int i;
+
+	if (rl_key(sa, key) < 0)
+		return (RATELIMIT_PASS);
+
+	h = rl_hash(rl, key);
+	set = rl->table[h & (RATELIMIT_SETS - 1)].way;
+	tag = h | 1;
+
+lookup:
+	e = NULL;
+	old = min = 0;
+	for (i = 0; i < RATELIMIT_WAYS; i++) {
+		t = __atomic_load_n(&set[i].tag, __ATOMIC_ACQUIRE);
+		if (t == tag) {
+			e = &set[i];
+			goto charge;
+		}
+		tat = __atomic_load_n(&set[i].tat, __ATOMIC_RELAXED);
+		if (e == NULL || tat < min) {
+			e = &set[i];
+			old = t;
+			min = tat;
+		}
+	}
+
+	/* New client, takes the place of the fullest bucket. Another thread may
+	 * have taken it first, possibly for this very client. */
+	if (!__atomic_compare_exchange_n(&e->tag, &old, tag, 0, __ATOMIC_ACQ_REL,
+			__ATOMIC_RELAXED))
+		goto lookup;
+	__atomic_store_n(&e->kod_at, 0, __ATOMIC_RELAXED);
+	if (min > now) {
+		__atomic_fetch_add(&rl->evictions, 1, __ATOMIC_RELAXED);
+		__atomic_compare_exchange_n(&e->tat, &min, now, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED);
+	}
+
+charge:
+	tat = __atomic_load_n(&e->tat, __ATOMIC_RELAXED);
+	do {
+		next = (tat > now) ? tat : now;
+		if (next - now > rl->tolerance)
+			goto limited;
+	} while (!__atomic_compare_exchange_n(&e->tat, &tat, next + rl->interval,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return (RATELIMIT_PASS);
+
+limited:
+	if (!rl->kod)
+		return (RATELIMIT_DROP);
+	kod_at = __atomic_load_n(&e->kod_at, __ATOMIC_RELAXED);
+	if (now >= kod_at && __atomic_compare_exchange_n(&e->kod_at, &kod_at,
+			now + rl->kod_interval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return (RATELIMIT_KOD);
+	return (RATELIMIT_DROP);
+}
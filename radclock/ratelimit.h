@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+
+/*
+ * Per-client rate limiting of the NTP server.
+ * Each client address is given a token bucket of burst tokens refilled at rate
+ * tokens per second, and a request is answered only if it can take a token.
+ * Over the limit, the client is sent a RATE Kiss-o'-Death, at most once per
+ * token interval (and per second), and further requests are dropped silently.
+ * IPv4 clients are tracked by address, IPv6 ones by /64 prefix.
+ * The buckets live in a fixed size set associative table, a client not found
+ * replaces the entry of its set whose bucket is the fullest, ie the least
+ * recently charged. Evicting a client that has been limited only gives it a
+ * full bucket again, so the table fails open under address spoofing.
+ * The NTP server threads share one table, so that a client is limited as a
+ * whole whichever thread its requests reach. The table is lock-free.
+ */
+#define RATELIMIT_SETS		2048	/* Power of 2 */
+#define RATELIMIT_WAYS		4		/* Entries per set */
+
+#define RATELIMIT_PASS		0
+#define RATELIMIT_KOD		1
+#define RATELIMIT_DROP		2
+
+struct ratelimit;
+struct sockaddr;
+
+struct ratelimit *ratelimit_create(double rate, int burst, int kod);
+void ratelimit_free(struct ratelimit *rl);
+
+/* Charge a request of address sa received at time now [ns, monotonic] */
+int ratelimit_check(struct ratelimit *rl, const struct sockaddr *sa,
+		uint64_t now);
+
+/* Clients pushed out of the table before their bucket refilled, so far */
+uint64_t ratelimit_evictions(struct ratelimit *rl);
+
+#endif
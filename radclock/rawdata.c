@@ -50,6 +50,7 @@
 #include "create_stamp.h"
 #include "verbose.h"
 #include "rawdata.h"
+#include "pthread_mgr.h"
 #include "jdebug.h"
 
 
@@ -62,34 +63,130 @@ timer_t spy_timerid;
 
 
 /*
- * Insert a newly created raw_data_bundle structure (packet or PPS signal...)
- * into the clock_handle raw data linked list.
- * We always insert at the HEAD.
- * Original intent was to make this lock-free, but currently not.
- * Original comment: lock needed since seems that free_and_cherry_pick is
- *     actually messing with this new rdb if hammering with NTP control packets
- * TODO: add argument to allow optional use of locks depending on use case.
- * IMPORTANT: we do assume libpcap gives us packets in chronological order
+ * Allocate a raw data queue with all its slots, so that nothing needs to be
+ * allocated on the capture path. Capacity is rounded up to a power of 2.
  */
-inline void
-insert_rdb_in_list(struct raw_data_queue *rq, struct raw_data_bundle *rdb)
+int
+rawdata_queue_init(struct raw_data_queue **rq, unsigned int capacity)
 {
+	struct raw_data_queue *q;
+	void *mem;
+	uint64_t size;
+
 	JDEBUG
 
-	pthread_mutex_lock(&rq->rdb_mutex);
+	size = 1;
+	while (size < capacity)
+		size <<= 1;
 
-	JDEBUG_STR("INSERT: rdb at %p, ->next at %p, end at %p, start at %p",
-		rdb, rdb->next, rq->rdb_end, rq->rdb_start);
+	/* Keep producer and consumer indices on their own cache lines */
+	if (posix_memalign(&mem, 64, sizeof(struct raw_data_queue))) {
+		verbose(LOG_ERR, "Cannot allocate raw data queue");
+		return (1);
+	}
+	JDEBUG_MEMORY(JDBG_MALLOC, mem);
+	q = (struct raw_data_queue *) mem;
+	memset(q, 0, sizeof(struct raw_data_queue));
+
+	q->slots = (struct raw_data_bundle *) calloc(size,
+			sizeof(struct raw_data_bundle));
+	JDEBUG_MEMORY(JDBG_MALLOC, q->slots);
+	if (q->slots == NULL) {
+		verbose(LOG_ERR, "Cannot allocate %llu raw data queue slots",
+				(long long unsigned) size);
+		JDEBUG_MEMORY(JDBG_FREE, q);
+		free(q);
+		return (1);
+	}
+	q->mask = size - 1;
+
+	*rq = q;
+	return (0);
+}
 
-	if (rq->rdb_start != NULL)
-		rq->rdb_start->next = rdb;
 
-	rq->rdb_start = rdb;
+void
+rawdata_queue_free(struct raw_data_queue *rq)
+{
+	if (rq == NULL)
+		return;
 
-	if (rq->rdb_end == NULL)
-		rq->rdb_end = rdb;
+	if (rq->drops > 0)
+		verbose(LOG_NOTICE, "Raw data queue dropped %llu elements in total",
+				(long long unsigned) rq->drops);
 
-	pthread_mutex_unlock(&rq->rdb_mutex);
+	JDEBUG_MEMORY(JDBG_FREE, rq->slots);
+	free(rq->slots);
+	JDEBUG_MEMORY(JDBG_FREE, rq);
+	free(rq);
+}
+
+
+/*
+ * Producer side. Give the next free slot to fill, or NULL if the ring is full,
+ * in which case the data is dropped and accounted for. Must be followed by
+ * rdq_publish() once the slot is filled.
+ * Called from pcap_loop() or a signal handler, so nothing in here may block,
+ * allocate or log.
+ * IMPORTANT: we do assume libpcap gives us packets in chronological order
+ */
+static inline struct raw_data_bundle *
+rdq_reserve(struct raw_data_queue *rq)
+{
+	uint64_t head;
+
+	head = __atomic_load_n(&rq->head, __ATOMIC_ACQUIRE);
+	if (rq->tail - head > rq->mask) {
+		__atomic_store_n(&rq->drops, rq->drops + 1, __ATOMIC_RELAXED);
+		return (NULL);
+	}
+
+	return (&rq->slots[rq->tail & rq->mask]);
+}
+
+static inline void
+rdq_publish(struct raw_data_queue *rq)
+{
+	__atomic_store_n(&rq->tail, rq->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Consumer side. Give the oldest filled slot, or NULL if the ring is empty.
+ * The slot stays owned by the consumer until rdq_release() hands it back.
+ * Also reports drops since last time, from the PROC thread where logging is
+ * harmless.
+ */
+static struct raw_data_bundle *
+rdq_peek(struct raw_data_queue *rq)
+{
+	uint64_t drops;
+
+	drops = __atomic_load_n(&rq->drops, __ATOMIC_RELAXED);
+	if (drops != rq->drops_seen) {
+		verbose(LOG_WARNING, "Raw data queue full, dropped %llu elements "
+				"(%llu in total)", (long long unsigned) (drops - rq->drops_seen),
+				(long long unsigned) drops);
+		rq->drops_seen = drops;
+	}
+
+	if (rq->head == __atomic_load_n(&rq->tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+
+	return (&rq->slots[rq->head & rq->mask]);
+}
+
+static inline void
+rdq_release(struct raw_data_queue *rq)
+{
+	__atomic_store_n(&rq->head, rq->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side, is there anything left to read? */
+int
+rawdata_pending(struct raw_data_queue *rq)
+{
+	return (rq->head != __atomic_load_n(&rq->tail, __ATOMIC_ACQUIRE));
 }
 
 
@@ -109,19 +206,16 @@ fill_rawdata_pcap(u_char *c_handle, const struct pcap_pkthdr *pcap_hdr,
 {
 	struct radclock_handle *handle;
 	struct raw_data_bundle *rdb;
+	bpf_u_int32 caplen;
 
 	JDEBUG
 
 	handle = (struct radclock_handle *) c_handle;
 
-	/* Initialise raw data bundle */
-	rdb = (struct raw_data_bundle *) malloc(sizeof(struct raw_data_bundle));
-	JDEBUG_MEMORY(JDBG_MALLOC, rdb);
-	assert(rdb);
-
-	RD_PKT(rdb)->buf = (void *) malloc( pcap_hdr->caplen * sizeof(char));
-	JDEBUG_MEMORY(JDBG_MALLOC, RD_PKT(rdb)->buf);
-	assert(RD_PKT(rdb)->buf);
+	/* Grab the next free slot, drop the packet if none */
+	rdb = rdq_reserve(handle->pcap_queue);
+	if (rdb == NULL)
+		return;
 
 	/* Copy data of interest into the raw data bundle */
 	RD_PKT(rdb)->vcount = 0;
@@ -130,16 +224,19 @@ fill_rawdata_pcap(u_char *c_handle, const struct pcap_pkthdr *pcap_hdr,
 	extract_vcount_stamp(handle->clock, handle->clock->pcap_handle,
 			pcap_hdr, packet_data, &(RD_PKT(rdb)->vcount), &(RD_PKT(rdb)->pcap_hdr));
 
-	//memcpy(&(RD_PKT(rdb)->pcap_hdr), pcap_hdr, sizeof(struct pcap_pkthdr));
-	memcpy(RD_PKT(rdb)->buf, packet_data, pcap_hdr->caplen * sizeof(char));
+	/* Slots are sized for the capture snaplen, should never truncate */
+	caplen = pcap_hdr->caplen;
+	if (caplen > sizeof(RD_PKT(rdb)->buf))
+		caplen = sizeof(RD_PKT(rdb)->buf);
+	RD_PKT(rdb)->pcap_hdr.caplen = caplen;
+	memcpy(RD_PKT(rdb)->buf, packet_data, caplen);
 
-	rdb->next = NULL;
-	rdb->read = 0;		/* Of course not read yet */
 	rdb->type = RD_TYPE_NTP;
 
-	/* Insert the new bundle in the linked list */
-	insert_rdb_in_list(handle->pcap_queue, rdb);
-	verbose(VERB_DEBUG, " MAIN: Inserted new rdb into linked list");
+	/* Make the new bundle visible to the consumer, and wake it up */
+	rdq_publish(handle->pcap_queue);
+	proc_wakeup(handle);
+	verbose(VERB_DEBUG, " MAIN: Inserted new rdb into raw data queue");
 }
 
 
@@ -153,9 +250,10 @@ fill_rawdata_spy(int sig)
 
 	JDEBUG
 
-	/* Initialise raw data bundle */
-	rdb = (struct raw_data_bundle *) malloc (sizeof(struct raw_data_bundle));
-	JDEBUG_MEMORY(JDBG_MALLOC, rdb);
+// TODO SHOULD HAVE IT'S OWN RAW_DATA_QUEUE
+	rdb = rdq_reserve(clock_handle->pcap_queue);
+	if (rdb == NULL)
+		return;
 
 	/* What time is it mister stratum-1? */
 	radclock_get_vcounter(clock_handle->clock, &(RD_SPY(rdb)->Ta));
@@ -163,13 +261,10 @@ fill_rawdata_spy(int sig)
 	gettimeofday( &(RD_SPY(rdb)->Te), NULL);
 	radclock_get_vcounter(clock_handle->clock, &(RD_SPY(rdb)->Tf));
 
-	rdb->next = NULL;
-	rdb->read = 0;
 	rdb->type = RD_TYPE_SPY;
 
-	/* Insert the new bundle in the linked list */
-// TODO SHOULD HAVE IT'S OWN RAW_DATA_QUEUE
-	insert_rdb_in_list(clock_handle->pcap_queue, rdb);
+	rdq_publish(clock_handle->pcap_queue);
+	proc_wakeup(clock_handle);
 }
 
 
@@ -238,6 +333,48 @@ spy_loop(struct radclock_handle *handle)
 }
 
 
+/*
+ * Capture loop on the memory mapped ring, in place of pcap_loop(). Blocks of
+ * frames are passed to PROC as they are handed over by the kernel, the frames
+ * themselves stay in the ring. PROC hands each block back to the kernel once
+ * walked. The ring waits for PROC to give back a block before handing it over
+ * again, so at most the number of blocks in the ring are ever in the raw data
+ * queue.
+ * Returns like pcap_loop(), -1 on error and -2 on explicit break.
+ */
+static int
+ring_loop(struct radclock_handle *handle, struct pktcap_ring *ring)
+{
+	struct raw_data_bundle *rdb;
+	void *block;
+	int err;
+
+	JDEBUG
+
+	for (;;) {
+		err = pktcap_ring_next_block(ring, 1000, &block);
+		if (err == 1)		// timeout, nothing captured
+			continue;
+		if (err < 0)
+			return (err);
+
+		/* Drop the whole block if PROC is that far behind */
+		rdb = rdq_reserve(handle->pcap_queue);
+		if (rdb == NULL) {
+			pktcap_ring_release_block(ring, block);
+			continue;
+		}
+
+		RD_RING(rdb)->block = block;
+		rdb->type = RD_TYPE_RING;
+
+		rdq_publish(handle->pcap_queue);
+		proc_wakeup(handle);
+		verbose(VERB_DEBUG, " MAIN: Inserted new ring block into raw data queue");
+	}
+}
+
+
 int
 capture_raw_data(struct radclock_handle *handle)
 {
@@ -263,6 +400,10 @@ capture_raw_data(struct radclock_handle *handle)
 			 * relevant information and inserting raw data bundles in the
 			 * linked list known by the clock handle.
 			 */
+			if (handle->clock->pcap_ring) {
+				err = ring_loop(handle, handle->clock->pcap_ring);
+				break;
+			}
 			err = pcap_loop(handle->clock->pcap_handle, -1 /*packet*/,
 					fill_rawdata_pcap, (u_char *) handle);
 			break;
@@ -302,78 +443,6 @@ capture_raw_data(struct radclock_handle *handle)
 
 
 
-/* This function will free the raw_data that has already been read and deliver
- * the next raw data element to read. Remember that the access to the raw data
- * buffer is lock free (e.g., pcap_loop() is adding element to it) !!
- * IMPORTANT: Forbidden to screw up in here, there is no safety net
- */
-struct raw_data_bundle *
-free_and_cherrypick(struct raw_data_queue *rq)
-{
-	struct raw_data_bundle *rdb, *rdb_tofree;
-
-	JDEBUG
-
-	/* Position at the end of the buffer */
-	rdb_tofree = NULL;
-	rdb = rq->rdb_end;
-
-	/* Is the buffer empty ? */
-	if (rdb == NULL)
-		return (rdb);
-
-	/* Scan from the end toward the head, removing items already read,
-	 * exiting and returning on the first non-read item found.
-	 * As a special case, if there is only one in the queue and it has already
-	 * been read, leave it there and return NULL, as if it weren't there.
-	 * This is so that pcap_loop() does not get confused.
-	 */
-	while (rdb != rq->rdb_start) {
-		if (rdb->read == 0)
-			break;
-		else {
-			/* Record who is the buddy to kill */
-			rdb_tofree = rdb;
-			rdb = rdb->next;
-			
-			/* Position new end of the raw data buffer and nuke */
-			// XXX again, should get rid of the locking
-			pthread_mutex_lock(&rq->rdb_mutex);
-			rq->rdb_end = rdb;
-			rdb_tofree->next = NULL;
-
-			if (rdb_tofree->type == RD_TYPE_NTP) {
-				JDEBUG_MEMORY(JDBG_FREE, RD_PKT(rdb_tofree)->buf);
-				free(RD_PKT(rdb_tofree)->buf);
-				RD_PKT(rdb_tofree)->buf = NULL;
-			}
-			JDEBUG_STR( "FREE: rdb at %p, ->next at %p, end at %p, start at %p",
-				rdb_tofree, rdb_tofree->next,
-				rq->rdb_end, rq->rdb_start);
-			JDEBUG_MEMORY(JDBG_FREE, rdb_tofree);
-			free(rdb_tofree);
-			rdb_tofree = NULL;
-			pthread_mutex_unlock(&rq->rdb_mutex);
-		}
-	}
-
-	/* Remember we never delete the first element of the raw data buffer. So we
-	 * can have a lock free add at the HEAD of the list. However, we may have
-	 * read the first element, so we don't want get_bidir_stamp() to spin like
-	 * a crazy on this return. If we read it before, return error code.
-	 * Here, rdb should NEVER be NULL. If we sef fault here, blame the guy who
-	 * wrote that ...
-	 */
-	//verbose(VERB_DEBUG, " PROC: Exiting free_and_cheerypick");
-	if (rdb->read == 1)
-		return (NULL);
-
-	return (rdb);
-}
-
-
-
-
 int
 deliver_rawdata_spy(struct radclock_handle *handle, struct stamp_t *stamp)
 {
@@ -381,11 +450,9 @@ deliver_rawdata_spy(struct radclock_handle *handle, struct stamp_t *stamp)
 
 	JDEBUG
 
-	/* Do some clean up if needed and gives the current raw data bundle
-	 * to process.
-	 */
+	/* Gives the current raw data bundle to process */
 	// TODO should have it's own queue
-	rdb = free_and_cherrypick(handle->pcap_queue);
+	rdb = rdq_peek(handle->pcap_queue);
 
 	/* Check we have something to do */
 	if (rdb == NULL)
@@ -405,8 +472,8 @@ deliver_rawdata_spy(struct radclock_handle *handle, struct stamp_t *stamp)
 	BST(stamp)->Tf = RD_SPY(rdb)->Tf;
 	stamp->type = STAMP_SPY;
 
-	/* Mark this raw data element read */
-	rdb->read = 1;
+	/* Done with this raw data element, hand the slot back */
+	rdq_release(handle->pcap_queue);
 
 	return (0);
 }
@@ -414,22 +481,31 @@ deliver_rawdata_spy(struct radclock_handle *handle, struct stamp_t *stamp)
 
 
 
+/*
+ * Give PROC the next captured packet, in place: the header and payload of pkt
+ * point into the raw data slot, nothing is copied. The slot is handed back to
+ * the capture side on the next call, so the packet is only valid until then.
+ */
 // XXX TODO XXX this is a bit messy. some parts are specific to the source,
 // maybe that should be in the corresponding file?  Quite complicated with
 // multiple sources, the chain list management is not re-entrant with multiple
 // sources!!
-// badly named, returns a thing called pkt which is really buffer with
-// the pcap head and pkt back to back, confusion !!
 int
-deliver_rawdata_pcap(struct radclock_handle *handle, struct radpcap_packet_t *pkt,
-		vcounter_t *vcount)
+deliver_rawdata_pcap(struct radclock_handle *handle, struct rawdata_cursor *cur,
+		struct radpcap_packet_t *pkt, vcounter_t *vcount)
 {
 	struct raw_data_bundle *rdb;
 
 	JDEBUG
 
-	/* Do some clean up if needed and gives current rdb to process */
-	rdb = free_and_cherrypick(handle->pcap_queue);
+	/* Done with the previous packet, hand its slot back */
+	if (cur->held) {
+		rdq_release(handle->pcap_queue);
+		cur->held = 0;
+	}
+
+	/* Gives current rdb to process */
+	rdb = rdq_peek(handle->pcap_queue);
 
 	/* Check we have something to do */
 	if (rdb == NULL)
@@ -438,32 +514,84 @@ deliver_rawdata_pcap(struct radclock_handle *handle, struct radpcap_packet_t *pk
 	if (rdb->type != RD_TYPE_NTP) {
 		verbose(LOG_ERR, "!! Asked to deliver NTP packet from rawdata but "
 				"parsing other type !!");
+		/* Drop it, or PROC would never find the queue empty */
+		rdq_release(handle->pcap_queue);
 		return (1);
 	}
 
-	/* Copy pcap header and packet payload back-to-back: buffer=[pcap_hdr][frame]
-	 * Thus mapping of pcap data from  rd_pcap  to  radpcap_packet_t  is
+	/* Mapping of pcap data from  rd_pcap  to  radpcap_packet_t  is
 	 * pcap_hdr --> header
 	 *	     buf --> payload
-	 * The buffer is defined (in get_network_stamp) to be way larger than needed,
-	 * so should be safe to copy the captured payload.
 	 */
-	memcpy(pkt->buffer, &(RD_PKT(rdb)->pcap_hdr), sizeof(struct pcap_pkthdr));
-	memcpy(pkt->buffer + sizeof(struct pcap_pkthdr), RD_PKT(rdb)->buf,
-			RD_PKT(rdb)->pcap_hdr.caplen);
-
-	/* Position the pointers of the radpcap_packet structure */
-	pkt->header = pkt->buffer;
-	pkt->payload = pkt->buffer + sizeof(struct pcap_pkthdr);
+	pkt->header = &(RD_PKT(rdb)->pcap_hdr);
+	pkt->payload = RD_PKT(rdb)->buf;
 	pkt->size = RD_PKT(rdb)->pcap_hdr.caplen + sizeof(struct pcap_pkthdr);
 	pkt->type = pcap_datalink(handle->clock->pcap_handle);
 
 	/* Fill the vcount */
 	*vcount = RD_PKT(rdb)->vcount;
 
-	/* Mark this raw data element read */
-	rdb->read = 1;
+	cur->held = 1;
 
 	return (0);
 }
 
+
+/*
+ * Same as deliver_rawdata_pcap() for the capture ring. The pcap header is built
+ * in the cursor, the payload points into the ring block walked. The block is
+ * handed back to the kernel and its raw data slot released once all its frames
+ * are delivered, so the payload is only valid until the next call.
+ */
+int
+deliver_rawdata_ring(struct radclock_handle *handle, struct rawdata_cursor *cur,
+		struct radpcap_packet_t *pkt, vcounter_t *vcount)
+{
+	struct raw_data_bundle *rdb;
+	unsigned char *frame;
+	static int no_vcount_logged = 0;
+
+	JDEBUG
+
+	for (;;) {
+		/* Start on the next block if the current one is done with */
+		if (cur->ring.block == NULL) {
+			rdb = rdq_peek(handle->pcap_queue);
+			if (rdb == NULL)
+				return (1);
+
+			if (rdb->type != RD_TYPE_RING) {
+				verbose(LOG_ERR, "!! Asked to deliver NTP packet from ring but "
+						"parsing other type !!");
+				rdq_release(handle->pcap_queue);
+				return (1);
+			}
+			pktcap_ring_cursor_init(handle->clock->pcap_ring, &cur->ring,
+					RD_RING(rdb)->block);
+		}
+
+		frame = pktcap_ring_next_frame(&cur->ring, &cur->hdr);
+		if (frame)
+			break;
+
+		/* Block walked, back to the kernel */
+		pktcap_ring_release_block(handle->clock->pcap_ring, cur->ring.block);
+		cur->ring.block = NULL;
+		rdq_release(handle->pcap_queue);
+	}
+
+	/* Without FFclock support there is nothing to extract, say it once */
+	if (extract_vcount_ring(handle->clock, frame, vcount)) {
+		if (!no_vcount_logged)
+			verbose(LOG_ERR, "Cannot extract raw timestamp from ring frames");
+		no_vcount_logged = 1;
+		*vcount = 0;
+	}
+
+	pkt->header = &cur->hdr;
+	pkt->payload = frame;
+	pkt->size = cur->hdr.caplen + sizeof(struct pcap_pkthdr);
+	pkt->type = handle->clock->pcap_ring->linktype;
+
+	return (0);
+}
@@ -35,18 +35,18 @@
  * to us. Example are a NTP packet captured via LibPcap or a PPS
  * timestamped.
  * Structure is designed to be versatile enough to handle raw data of
- * different nature in a doubled chain list.
- * IMPORTANT: the design is lock free. I could have created a mutex to
- * ensure the producer/consumer don't mess up, but the point of this 
- * buffer chain is to ensure low level capture function (e.g. the 
- * callback passed to pcap_loop()) returns as fast as possible. So we 
- * don't want to block and wait for the mutex to be unlocked.
+ * different nature in a single ring of pre-allocated slots.
+ * IMPORTANT: the design is lock free. The point of this buffer is to ensure
+ * the low level capture function (e.g. the callback passed to pcap_loop())
+ * returns as fast as possible. So we don't want to block and wait for a mutex
+ * to be unlocked, nor call the allocator for every packet.
  */
 
 typedef enum { 
 	RD_UNKNOWN,
 	RD_TYPE_SPY,
 	RD_TYPE_NTP,		/* Handed by libpcap */
+	RD_TYPE_RING,		/* Block of NTP frames in the capture ring */
 	RD_TYPE_1588,
 	RD_TYPE_PPS,
 } rawdata_type_t;
@@ -71,43 +71,88 @@ struct rd_spy_stamp {
 struct rd_pcap_pkt {
 	vcounter_t vcount;				/* vcount stamp for this buddy */
 	struct pcap_pkthdr pcap_hdr;	/* The PCAP header */
-	void* buf;						/* Actual data, contains packet */
+	char buf[BPF_PACKET_SIZE];		/* Actual data, up to the capture snaplen */
 };
 
 
 /*
- * Raw data bundle. Holds actual raw_data and deals with link list
- * and light locking
+ * Raw data structure specific to the capture ring. The frames are not copied,
+ * the block stays owned by the consumer until it has been walked and handed
+ * back to the kernel.
+ */
+struct rd_ring_block {
+	void *block;
+};
+
+
+/*
+ * Raw data bundle. Holds actual raw_data, one per slot of the queue.
  */
 struct raw_data_bundle {
-	struct raw_data_bundle *next;	// next points toward the Head
-	int read;							// Have I been read? i.e. ready to be freed?
 	rawdata_type_t type;			/* If we know the type, let's put it there */
 	union rd_t {
 		struct rd_pcap_pkt rd_pkt;
 		struct rd_spy_stamp rd_spy;
+		struct rd_ring_block rd_ring;
 	} rd;
 };
 
+
+/*
+ * Raw data queue.
+ * Fixed capacity single producer / single consumer ring. The producer is the
+ * capture callback (or the spy signal handler), the consumer is the PROC
+ * thread. Same index conventions as the FIFO: the 64 bit indices never wrap,
+ * the queue is empty when head = tail and full when tail = head + capacity.
+ * The producer owns tail and publishes a filled slot with a release store, the
+ * consumer owns head and hands a slot back the same way. Each side reads the
+ * other's index with an acquire load, so no lock is needed.
+ * When the ring is full the new data is dropped and counted, the consumer
+ * reports drops as it notices them.
+ */
+#define RAWDATA_QUEUE_SIZE	1024	/* Number of slots, power of 2 */
+
 struct raw_data_queue {
-	struct raw_data_bundle *rdb_start;
-	struct raw_data_bundle *rdb_end;
+	uint64_t head __attribute__((aligned(64)));	// next slot to read, consumer
+	uint64_t drops_seen;		// drops already reported, consumer
+
+	uint64_t tail __attribute__((aligned(64)));	// next slot to fill, producer
+	uint64_t drops;				// data dropped on full ring, producer
 
-	// XXX arbiter between insert_rdb_in_list and free_and_cherry_pick.	Should
-	// not need a lock, but there is quite some messing around if hammering NTP
-	// control packets
-	pthread_mutex_t rdb_mutex;
+	struct raw_data_bundle *slots __attribute__((aligned(64)));
+	uint64_t mask;				// capacity - 1
 };
 
 #define RD_PKT(x) (&((x)->rd.rd_pkt))
 #define RD_SPY(x) (&((x)->rd.rd_spy))
+#define RD_RING(x) (&((x)->rd.rd_ring))
 
 
 
+int rawdata_queue_init(struct raw_data_queue **rq, unsigned int capacity);
+void rawdata_queue_free(struct raw_data_queue *rq);
+int rawdata_pending(struct raw_data_queue *rq);
+
 int capture_raw_data(struct radclock_handle *handle);
 
+/*
+ * Consumer side position in the raw data. Packets are delivered in place, the
+ * raw data slot (or ring block) they live in is only handed back on the next
+ * delivery.
+ */
+struct rawdata_cursor {
+	int held;							// current raw data slot still in use
+	struct pktcap_ring_cursor ring;		// ring block being walked
+	struct pcap_pkthdr hdr;				// pcap header of the current ring frame
+};
+
 int deliver_rawdata_pcap(struct radclock_handle *handle,
-		struct radpcap_packet_t *pkt, vcounter_t *vcount);
+		struct rawdata_cursor *cur, struct radpcap_packet_t *pkt,
+		vcounter_t *vcount);
+
+int deliver_rawdata_ring(struct radclock_handle *handle,
+		struct rawdata_cursor *cur, struct radpcap_packet_t *pkt,
+		vcounter_t *vcount);
 
 int deliver_rawdata_spy(struct radclock_handle *handle, struct stamp_t *stamp);
 
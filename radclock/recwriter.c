@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE		/* sem_clockwait */
+
+#include "../config.h"
+
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "recwriter.h"
+#include "semwait.h"
+#include "verbose.h"
+#include "jdebug.h"
+
+
+struct recwriter {
+	uint64_t head __attribute__((aligned(64)));	// next record to write, writer
+	uint64_t drops_seen;		// drops already reported, writer
+
+	uint64_t tail __attribute__((aligned(64)));	// next record to fill, PROC
+	uint64_t drops;				// records dropped on full ring, PROC
+	int waiting;				// PROC waits for room, lossless only
+
+	char *recs __attribute__((aligned(64)));
+	uint64_t mask;				// capacity - 1
+
+	struct recwriter_def def;
+	pthread_t thread;
+	pthread_mutex_t lock;		// consumer side of the ring and the sink
+	sem_t wakeup;
+	sem_t room;
+	int stop;
+	int flush_req;
+	int active;					// the sink has somewhere to write to
+
+	size_t unflushed;			// bytes written since last flush
+	struct timeval last_flush;	// CLOCK_MONOTONIC
+};
+
+
+static long
+ms_since(struct timeval *now, struct timeval *then)
+{
+	return ((now->tv_sec - then->tv_sec) * 1000 +
+			(now->tv_usec - then->tv_usec) / 1000);
+}
+
+/* Flushes are timed on the monotonic clock, the daemon steps the system one */
+static void
+rw_now(struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Write out all records published so far, lock held. The sink discards the
+ * records pushed while it has nowhere to write them.
+ */
+void
+recwriter_drain(struct recwriter *rw)
+{
+	uint64_t tail;
+
+	tail = __atomic_load_n(&rw->tail, __ATOMIC_ACQUIRE);
+	while (rw->head != tail) {
+		rw->unflushed += rw->def.write(rw->def.arg,
+				rw->recs + (rw->head & rw->mask) * rw->def.rec_size);
+
+		/* Pairs with PROC setting waiting then checking for room */
+		__atomic_store_n(&rw->head, rw->head + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&rw->waiting, __ATOMIC_SEQ_CST) &&
+				__atomic_exchange_n(&rw->waiting, 0, __ATOMIC_SEQ_CST))
+			sem_post(&rw->room);
+	}
+}
+
+
+static void *
+rw_thread(void *arg)
+{
+	struct recwriter *rw;
+	struct timeval tv;
+	sigset_t block_mask;
+	uint64_t drops;
+	int stop;
+
+	rw = (struct recwriter *) arg;
+
+	/* Signals are for the main thread */
+	sigfillset(&block_mask);
+	pthread_sigmask(SIG_BLOCK, &block_mask, NULL);
+
+	do {
+		sem_wait_us(&rw->wakeup, rw->def.flush_ms * 1000);
+		stop = __atomic_load_n(&rw->stop, __ATOMIC_ACQUIRE);
+
+		pthread_mutex_lock(&rw->lock);
+		recwriter_drain(rw);
+		rw_now(&tv);
+		if (__atomic_exchange_n(&rw->flush_req, 0, __ATOMIC_RELAXED) || stop ||
+				rw->unflushed >= rw->def.flush_bytes ||
+				ms_since(&tv, &rw->last_flush) >= rw->def.flush_ms) {
+			rw->def.flush(rw->def.arg, rw->unflushed, &tv);
+			rw->unflushed = 0;
+			rw->last_flush = tv;
+		}
+		pthread_mutex_unlock(&rw->lock);
+
+		drops = __atomic_load_n(&rw->drops, __ATOMIC_RELAXED);
+		if (drops != rw->drops_seen) {
+			verbose(LOG_WARNING, "Queue of %s writer full, dropped %llu %s "
+					"(%llu in total)", rw->def.name,
+					(long long unsigned) (drops - rw->drops_seen), rw->def.what,
+					(long long unsigned) drops);
+			rw->drops_seen = drops;
+		}
+	} while (!stop);
+
+	return (NULL);
+}
+
+
+/*
+ * Start the writer thread. It does not take records until made active.
+ */
+struct recwriter *
+recwriter_start(const struct recwriter_def *def)
+{
+	struct recwriter *rw;
+	int err;
+
+	JDEBUG
+
+	rw = (struct recwriter *) calloc(1, sizeof(struct recwriter));
+	JDEBUG_MEMORY(JDBG_MALLOC, rw);
+	if (rw == NULL) {
+		verbose(LOG_ERR, "Cannot allocate %s queue", def->name);
+		return (NULL);
+	}
+	rw->recs = (char *) calloc(def->nrecs, def->rec_size);
+	JDEBUG_MEMORY(JDBG_MALLOC, rw->recs);
+	if (rw->recs == NULL) {
+		verbose(LOG_ERR, "Cannot allocate %s queue", def->name);
+		goto free_rw;
+	}
+	rw->mask = def->nrecs - 1;
+	rw->def = *def;
+	rw_now(&rw->last_flush);
+
+	if (sem_init(&rw->wakeup, 0, 0) < 0 || sem_init(&rw->room, 0, 0) < 0) {
+		verbose(LOG_ERR, "Cannot initialise %s semaphores: %s", def->name,
+				strerror(errno));
+		goto free_recs;
+	}
+	pthread_mutex_init(&rw->lock, NULL);
+
+	verbose(LOG_NOTICE, "Starting %s writer thread", def->name);
+	err = pthread_create(&rw->thread, NULL, rw_thread, (void *)rw);
+	if (err) {
+		verbose(LOG_ERR, "pthread_create() returned error number %d", err);
+		pthread_mutex_destroy(&rw->lock);
+		sem_destroy(&rw->wakeup);
+		sem_destroy(&rw->room);
+		goto free_recs;
+	}
+
+	return (rw);
+
+free_recs:
+	JDEBUG_MEMORY(JDBG_FREE, rw->recs);
+	free(rw->recs);
+free_rw:
+	JDEBUG_MEMORY(JDBG_FREE, rw);
+	free(rw);
+	return (NULL);
+}
+
+
+/*
+ * Stop the writer thread once all records pushed have been written out and
+ * flushed. PROC must not push records anymore.
+ */
+void
+recwriter_stop(struct recwriter *rw)
+{
+	JDEBUG
+
+	__atomic_store_n(&rw->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&rw->wakeup);
+	pthread_join(rw->thread, NULL);
+
+	pthread_mutex_destroy(&rw->lock);
+	sem_destroy(&rw->wakeup);
+	sem_destroy(&rw->room);
+	JDEBUG_MEMORY(JDBG_FREE, rw->recs);
+	free(rw->recs);
+	JDEBUG_MEMORY(JDBG_FREE, rw);
+	free(rw);
+}
+
+
+/* Held to change where the sink writes to, the writer is kept out */
+void
+recwriter_lock(struct recwriter *rw)
+{
+	pthread_mutex_lock(&rw->lock);
+}
+
+void
+recwriter_unlock(struct recwriter *rw)
+{
+	pthread_mutex_unlock(&rw->lock);
+}
+
+
+/* Let PROC push records, if the sink has somewhere to write them */
+void
+recwriter_set_active(struct recwriter *rw, int active)
+{
+	__atomic_store_n(&rw->active, active, __ATOMIC_RELEASE);
+}
+
+
+/* Get the sink flushed as soon as possible, safe from a signal handler */
+void
+recwriter_flush_request(struct recwriter *rw)
+{
+	__atomic_store_n(&rw->flush_req, 1, __ATOMIC_RELAXED);
+	sem_post(&rw->wakeup);
+}
+
+
+int
+recwriter_active(struct recwriter *rw)
+{
+	return (__atomic_load_n(&rw->active, __ATOMIC_ACQUIRE));
+}
+
+
+/*
+ * Producer side. Give the next free record to fill, or NULL if the ring is
+ * full, in which case the record is dropped and accounted for. A lossless
+ * writer is waited for instead. Must be followed by recwriter_publish() once
+ * the record is filled, or the record is simply reused next time.
+ */
+void *
+recwriter_reserve(struct recwriter *rw)
+{
+	uint64_t head;
+
+	head = __atomic_load_n(&rw->head, __ATOMIC_ACQUIRE);
+	while (rw->tail - head > rw->mask) {
+		if (!rw->def.lossless) {
+			__atomic_store_n(&rw->drops, rw->drops + 1, __ATOMIC_RELAXED);
+			return (NULL);
+		}
+		__atomic_store_n(&rw->waiting, 1, __ATOMIC_SEQ_CST);
+		sem_post(&rw->wakeup);
+		head = __atomic_load_n(&rw->head, __ATOMIC_SEQ_CST);
+		if (rw->tail - head > rw->mask) {
+			while (sem_wait(&rw->room) < 0 && errno == EINTR)
+				;
+			head = __atomic_load_n(&rw->head, __ATOMIC_ACQUIRE);
+		}
+		__atomic_store_n(&rw->waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	return (rw->recs + (rw->tail & rw->mask) * rw->def.rec_size);
+}
+
+/* Wake the writer only once a batch is pending, it wakes up regularly anyway */
+void
+recwriter_publish(struct recwriter *rw)
+{
+	uint64_t head;
+
+	__atomic_store_n(&rw->tail, rw->tail + 1, __ATOMIC_RELEASE);
+	head = __atomic_load_n(&rw->head, __ATOMIC_ACQUIRE);
+	if (rw->tail - head == rw->def.batch)
+		sem_post(&rw->wakeup);
+}
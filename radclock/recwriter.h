@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RECWRITER_H
+#define _RECWRITER_H
+
+
+/*
+ * Writer thread fed through a bounded single producer / single consumer ring
+ * of fixed size records, behind the stamp and algo outputs and the raw trace
+ * dump. The producer (PROC) only copies records in, with the same conventions
+ * as the raw data queue, and the writer hands them over to a sink that formats
+ * and writes them out. Only the record format and the sink differ between
+ * outputs.
+ * The writer wakes up once a batch of records is pending or every flush
+ * interval, writes out all pending records, and has the sink flush once enough
+ * bytes have been written, the flush interval has elapsed, or a flush was
+ * requested.
+ * The producer never waits on the disk: when the ring is full the record is
+ * dropped and counted, and the writer reports drops. A lossless writer has the
+ * producer wait for room instead, so that every record is written.
+ */
+struct timeval;
+
+struct recwriter_def {
+	const char *name;		// in log messages
+	const char *what;		// what records are, in drop reports
+	size_t rec_size;
+	unsigned int nrecs;		// capacity of the ring, power of 2
+	unsigned int batch;		// records pending to wake the writer
+	size_t flush_bytes;
+	long flush_ms;
+	int lossless;
+
+	/* The sink, called by the writer with its lock held, now is on
+	 * CLOCK_MONOTONIC */
+	void *arg;
+	size_t (*write)(void *arg, void *rec);		// returns bytes written
+	void (*flush)(void *arg, size_t unflushed, struct timeval *now);
+};
+
+struct recwriter;
+
+
+/* Writer side, called from the main thread */
+struct recwriter *recwriter_start(const struct recwriter_def *def);
+void recwriter_stop(struct recwriter *rw);
+void recwriter_lock(struct recwriter *rw);
+void recwriter_unlock(struct recwriter *rw);
+void recwriter_drain(struct recwriter *rw);
+void recwriter_set_active(struct recwriter *rw, int active);
+void recwriter_flush_request(struct recwriter *rw);
+
+/* Producer side, called from PROC */
+int recwriter_active(struct recwriter *rw);
+void *recwriter_reserve(struct recwriter *rw);
+void recwriter_publish(struct recwriter *rw);
+
+#endif
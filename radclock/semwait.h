@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SEMWAIT_H
+#define _SEMWAIT_H
+
+/*
+ * Bounded wait on a semaphore, timed on CLOCK_MONOTONIC where the system
+ * allows, so that the daemon stepping the system clock does not stretch the
+ * wait. Otherwise the deadline is on CLOCK_REALTIME, as sem_timedwait() has
+ * it. Needs _GNU_SOURCE defined before any system header for sem_clockwait().
+ * Waits at most us microseconds, interrupted waits are resumed. Returns like
+ * sem_timedwait().
+ */
+static inline int
+sem_wait_us(sem_t *sem, long us)
+{
+	struct timespec ts;
+	clockid_t clock;
+	int err;
+
+#if defined(HAVE_SEM_CLOCKWAIT) || defined(HAVE_SEM_CLOCKWAIT_NP)
+	clock = CLOCK_MONOTONIC;
+#else
+	clock = CLOCK_REALTIME;
+#endif
+	clock_gettime(clock, &ts);
+	ts.tv_sec += us / 1000000;
+	ts.tv_nsec += 1000 * (us % 1000000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	do {
+#if defined(HAVE_SEM_CLOCKWAIT)
+		err = sem_clockwait(sem, clock, &ts);
+#elif defined(HAVE_SEM_CLOCKWAIT_NP)
+		err = sem_clockwait_np(sem, clock, TIMER_ABSTIME, &ts, NULL);
+#else
+		err = sem_timedwait(sem, &ts);
+#endif
+	} while (err < 0 && errno == EINTR);
+
+	return (err);
+}
+
+#endif
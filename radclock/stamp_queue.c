@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../config.h"
+#include "radclock.h"
+#include "radclock-private.h"
+#include "verbose.h"
+#include "proto_ntp.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "stamp_queue.h"
+#include "jdebug.h"
+
+
+/*
+ * The queue elements live in a fixed pool and refer to each other by index
+ * into the pool, STQ_NIL marking the end of a list.
+ * All elements are linked in insertion order (prev toward head/youngest), the
+ * order used for trimming and dumps. In addition each element is indexed
+ * according to its current kind:
+ *   c-halfstamp (Ta only): c-halfstamp list, sorted on Ta, oldest first
+ *   s-halfstamp (Tf only): counted only, they are not expected
+ *   fullstamp   (Ta, Tf) : fullstamp heap, smallest (Ta, seq) on top
+ * The id index is an open addressing table with linear probing, sized at twice
+ * the pool so that probe sequences stay short.
+ */
+#define STQ_NIL			(-1)
+#define STQ_HASH_BITS	6
+#define STQ_HASH_SIZE	(1 << STQ_HASH_BITS)
+
+_Static_assert((STQ_HASH_SIZE & (STQ_HASH_SIZE - 1)) == 0,
+		"STQ_HASH_SIZE must be a power of 2");
+_Static_assert(STQ_HASH_SIZE >= 2 * MAX_STQ_SIZE,
+		"STQ_HASH_SIZE must be at least twice MAX_STQ_SIZE");
+
+struct stq_elt {
+	struct stamp_t stamp;
+	uint64_t seq;		// insertion sequence number, breaks Ta ties
+	int prev;			// insertion order list, toward the head
+	int next;
+	int cprev;			// c-halfstamp list, toward older Ta
+	int cnext;
+	int heappos;		// position in fullstamp heap, fullstamps only
+};
+
+struct stamp_queue {
+	struct stq_elt elt[MAX_STQ_SIZE];
+	int start;			// youngest element
+	int end;			// oldest element
+	int size;
+	int freelist;		// unused elements, chained through next
+	uint64_t seq;
+
+	int hash[STQ_HASH_SIZE];
+
+	int heap[MAX_STQ_SIZE];
+	int nfull;
+
+	int coldest;		// c-halfstamp list
+	int cyoungest;
+
+	int nshalf;
+};
+
+#define STQ_CHALF(st)	((BST(st)->Ta != 0) && (BST(st)->Tf == 0))
+#define STQ_SHALF(st)	((BST(st)->Ta == 0) && (BST(st)->Tf != 0))
+#define STQ_FULL(st)	((BST(st)->Ta != 0) && (BST(st)->Tf != 0))
+
+
+
+/* Routines to create and destroy a stamp queue. The queue is anchored
+ * to a pointer within the passed argument, so storage for the
+ * queue can be allocated and freed here.
+ */
+void
+init_stamp_queue(struct bidir_algodata *algodata)
+{
+	struct stamp_queue *q;
+	int i;
+
+	q = calloc(1, sizeof(struct stamp_queue));
+	JDEBUG_MEMORY(JDBG_MALLOC, q);
+	q->start = STQ_NIL;
+	q->end = STQ_NIL;
+	q->size = 0;
+	q->coldest = STQ_NIL;
+	q->cyoungest = STQ_NIL;
+
+	for (i = 0; i < MAX_STQ_SIZE; i++)
+		q->elt[i].next = (i < MAX_STQ_SIZE - 1) ? i + 1 : STQ_NIL;
+	q->freelist = 0;
+
+	for (i = 0; i < STQ_HASH_SIZE; i++)
+		q->hash[i] = STQ_NIL;
+
+	algodata->q = q;
+}
+
+void
+destroy_stamp_queue(struct bidir_algodata *algodata)
+{
+	JDEBUG_MEMORY(JDBG_FREE, algodata->q);
+	free(algodata->q);
+	algodata->q = NULL;
+}
+
+
+
+/*
+ * Id index. Ids are NTP timestamps, whose low order bits are not uniform
+ * enough to be used directly, so mix them first and keep the top bits.
+ */
+static inline int
+stq_hash_home(uint64_t id)
+{
+	return ((id * 0x9E3779B97F4A7C15ULL) >> (64 - STQ_HASH_BITS));
+}
+
+static int
+stq_hash_find(struct stamp_queue *q, uint64_t id)
+{
+	int h, k;
+
+	for (h = stq_hash_home(id); (k = q->hash[h]) != STQ_NIL;
+			h = (h + 1) & (STQ_HASH_SIZE - 1)) {
+		if (q->elt[k].stamp.id == id)
+			return (k);
+	}
+	return (STQ_NIL);
+}
+
+static void
+stq_hash_insert(struct stamp_queue *q, int k)
+{
+	int h;
+
+	h = stq_hash_home(q->elt[k].stamp.id);
+	while (q->hash[h] != STQ_NIL)
+		h = (h + 1) & (STQ_HASH_SIZE - 1);
+	q->hash[h] = k;
+}
+
+/* Backward shift deletion, keeps probe sequences unbroken without tombstones */
+static void
+stq_hash_remove(struct stamp_queue *q, int k)
+{
+	int i, j, h;
+
+	i = stq_hash_home(q->elt[k].stamp.id);
+	while (q->hash[i] != k)
+		i = (i + 1) & (STQ_HASH_SIZE - 1);
+
+	q->hash[i] = STQ_NIL;
+	j = i;
+	for (;;) {
+		j = (j + 1) & (STQ_HASH_SIZE - 1);
+		if (q->hash[j] == STQ_NIL)
+			break;
+		h = stq_hash_home(q->elt[q->hash[j]].stamp.id);
+		/* Entry at j can move into the hole if its home is not in (i, j] */
+		if (((j - h) & (STQ_HASH_SIZE - 1)) >= ((j - i) & (STQ_HASH_SIZE - 1))) {
+			q->hash[i] = q->hash[j];
+			q->hash[j] = STQ_NIL;
+			i = j;
+		}
+	}
+}
+
+
+
+/*
+ * Fullstamp heap, ordered on Ta. Ties go to the element inserted first, as the
+ * old tail to head scan did.
+ */
+static inline int
+stq_heap_less(struct stamp_queue *q, int a, int b)
+{
+	struct stq_elt *ea, *eb;
+
+	ea = &q->elt[a];
+	eb = &q->elt[b];
+	if (BST(&ea->stamp)->Ta != BST(&eb->stamp)->Ta)
+		return (BST(&ea->stamp)->Ta < BST(&eb->stamp)->Ta);
+	return (ea->seq < eb->seq);
+}
+
+static inline void
+stq_heap_set(struct stamp_queue *q, int pos, int k)
+{
+	q->heap[pos] = k;
+	q->elt[k].heappos = pos;
+}
+
+static void
+stq_heap_siftup(struct stamp_queue *q, int pos)
+{
+	int k, parent;
+
+	k = q->heap[pos];
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!stq_heap_less(q, k, q->heap[parent]))
+			break;
+		stq_heap_set(q, pos, q->heap[parent]);
+		pos = parent;
+	}
+	stq_heap_set(q, pos, k);
+}
+
+static void
+stq_heap_siftdown(struct stamp_queue *q, int pos)
+{
+	int k, child;
+
+	k = q->heap[pos];
+	for (;;) {
+		child = 2 * pos + 1;
+		if (child >= q->nfull)
+			break;
+		if (child + 1 < q->nfull && stq_heap_less(q, q->heap[child + 1],
+				q->heap[child]))
+			child++;
+		if (!stq_heap_less(q, q->heap[child], k))
+			break;
+		stq_heap_set(q, pos, q->heap[child]);
+		pos = child;
+	}
+	stq_heap_set(q, pos, k);
+}
+
+static void
+stq_heap_remove(struct stamp_queue *q, int k)
+{
+	int pos, last;
+
+	pos = q->elt[k].heappos;
+	q->nfull--;
+	if (pos != q->nfull) {
+		/* Move last element into the hole, then restore heap order */
+		last = q->heap[q->nfull];
+		stq_heap_set(q, pos, last);
+		stq_heap_siftup(q, pos);
+		stq_heap_siftdown(q, q->elt[last].heappos);
+	}
+	q->elt[k].heappos = STQ_NIL;
+}
+
+
+
+/*
+ * List of c-halfstamps, sorted on Ta. Requests are sent in time order, so the
+ * insertion point is almost always the young end.
+ */
+static void
+stq_chalf_link(struct stamp_queue *q, int k)
+{
+	vcounter_t Ta;
+	int j;
+
+	Ta = BST(&q->elt[k].stamp)->Ta;
+	j = q->cyoungest;
+	while (j != STQ_NIL && BST(&q->elt[j].stamp)->Ta > Ta)
+		j = q->elt[j].cprev;
+
+	/* Insert k just after j (toward younger) */
+	q->elt[k].cprev = j;
+	if (j == STQ_NIL) {
+		q->elt[k].cnext = q->coldest;
+		q->coldest = k;
+	} else {
+		q->elt[k].cnext = q->elt[j].cnext;
+		q->elt[j].cnext = k;
+	}
+	if (q->elt[k].cnext == STQ_NIL)
+		q->cyoungest = k;
+	else
+		q->elt[q->elt[k].cnext].cprev = k;
+}
+
+static void
+stq_chalf_unlink(struct stamp_queue *q, int k)
+{
+	struct stq_elt *e;
+
+	e = &q->elt[k];
+	if (e->cprev == STQ_NIL)
+		q->coldest = e->cnext;
+	else
+		q->elt[e->cprev].cnext = e->cnext;
+	if (e->cnext == STQ_NIL)
+		q->cyoungest = e->cprev;
+	else
+		q->elt[e->cnext].cprev = e->cprev;
+}
+
+
+
+/* Add or remove element k to or from the structure matching its kind. */
+static void
+stq_index(struct stamp_queue *q, int k)
+{
+	struct stamp_t *st;
+
+	st = &q->elt[k].stamp;
+	if (STQ_CHALF(st))
+		stq_chalf_link(q, k);
+	else if (STQ_SHALF(st))
+		q->nshalf++;
+	else if (STQ_FULL(st)) {
+		stq_heap_set(q, q->nfull++, k);
+		stq_heap_siftup(q, q->nfull - 1);
+	}
+}
+
+static void
+stq_unindex(struct stamp_queue *q, int k)
+{
+	struct stamp_t *st;
+
+	st = &q->elt[k].stamp;
+	if (STQ_CHALF(st))
+		stq_chalf_unlink(q, k);
+	else if (STQ_SHALF(st))
+		q->nshalf--;
+	else if (STQ_FULL(st))
+		stq_heap_remove(q, k);
+}
+
+
+/* Remove element k from the queue altogether and return it to the pool */
+static void
+stq_remove(struct stamp_queue *q, int k)
+{
+	struct stq_elt *e;
+
+	e = &q->elt[k];
+	stq_unindex(q, k);
+	stq_hash_remove(q, k);
+
+	if (e->prev == STQ_NIL)
+		q->start = e->next;
+	else
+		q->elt[e->prev].next = e->next;
+	if (e->next == STQ_NIL)
+		q->end = e->prev;
+	else
+		q->elt[e->next].prev = e->prev;
+
+	e->next = q->freelist;
+	q->freelist = k;
+	q->size--;
+}
+
+
+
+/*
+ * Insert a client or server halfstamp into the stamp queue, perform duplicate
+ * halfstamp detection and client request<-->server reply matching, and trim 
+ * excessive queue if needed. 
+ * The queue allows many client requests to be buffered while waiting for their
+ * replies, and can cope with both reordering, and loss, of both client and
+ * server packets.
+ *
+ * If a matching halfstamp is found in the queue then the existing queue entry
+ * will be completed in situ, else a new halfstamp will be inserted at head.
+ * Duplicate halfstamps are not a problem, they are simply dropped with warning.
+ *
+ * The stamp->id field as an (assumed) unique key. Since this is in fact a 
+ * timestamp field, inserted c-halfstamps will very likely be in id-order as 
+ * well as in true temporal order, but this is NOT assumed or used. A small 
+ * exception is in the queue trimming, which drops the tail element.
+ * In the very unlikely event that the tail element is not in fact the oldest
+ * (most stale), this will not create any problems beyond the loss of a stamp.
+ * Other kinds of halfstamp cleaning (based on temporal ordering, not id) are
+ * dealt with in get_fullstamp_from_queue_andclean.
+ *
+ * Stamps from different servers are treated in the same way.
+ *
+ * Return codes: err = 0 : halfstamp insertion resulted in fullstamp
+ *               err = 1 : insertion but no fullstamp, or halfstamp dropped
+ */
+int
+insertandmatch_halfstamp(struct stamp_queue *q, struct stamp_t *new, int mode)
+{
+	struct stq_elt *qel;
+	struct stamp_t *stamp;
+	int k, foundhalfstamptofill;
+
+	if ((mode != MODE_CLIENT) && (mode != MODE_SERVER)) {
+		verbose(LOG_ERR, "Unsupported stamp matching mode: %d", mode);
+		return (-1);
+	}
+
+	/* Look up id, determine if duplicate, match, or new */
+	k = stq_hash_find(q, new->id);
+	foundhalfstamptofill = (k != STQ_NIL);
+	if (foundhalfstamptofill) {
+		stamp = &q->elt[k].stamp;
+		switch (mode) {
+			case MODE_CLIENT:
+				if (BST(stamp)->Ta != 0) {
+					verbose(LOG_WARNING, "Dropping duplicate NTP client request.");
+					return (1);
+				}
+				break;
+
+			case MODE_SERVER:
+				if (BST(stamp)->Tf != 0) {
+					verbose(LOG_WARNING, "Dropping duplicate NTP server response.");
+					return (1);
+				}
+				break;
+		}
+		stq_unindex(q, k);
+	}
+
+	/* If this id is new, then create and insert blank queue element. */
+	else {
+		/* If queue too long, trim off last element */
+		if (q->size == MAX_STQ_SIZE) {
+			verbose(LOG_WARNING, "Stamp matching queue has hit max size.");
+			stq_remove(q, q->end);
+		}
+
+		/* Take blank element from the pool and insert at head */
+		k = q->freelist;
+		qel = &q->elt[k];
+		q->freelist = qel->next;
+		memset(&qel->stamp, 0, sizeof(struct stamp_t));
+		qel->seq = q->seq++;
+		qel->heappos = STQ_NIL;
+		qel->prev = STQ_NIL;
+		qel->next = q->start;		// will be STQ_NIL as reqd if queue empty
+		if (q->start == STQ_NIL)	// queue was empty
+			q->end = k;
+		else
+			q->elt[q->start].prev = k;
+		q->start = k;
+		q->size++;
+
+		/* Fill fields common to both halfstamps */
+		switch (mode) {
+			case MODE_CLIENT:
+			case MODE_SERVER:
+			qel->stamp.type = STAMP_NTP;
+		}
+		qel->stamp.id = new->id;
+		stq_hash_insert(q, k);
+	}
+
+	/* Selectively copy content of new halfstamp into stamp to fill. */
+	stamp = &q->elt[k].stamp;
+	switch (mode) {
+		case MODE_CLIENT:
+			strncpy(stamp->server_ipaddr, new->server_ipaddr, 16);
+			BST(stamp)->Ta = BST(new)->Ta;
+			break;
+		case MODE_SERVER:
+			stamp->ttl = new->ttl;
+			stamp->refid = new->refid;
+			stamp->stratum = new->stratum;
+			stamp->LI = new->LI;
+			stamp->rootdelay = new->rootdelay;
+			stamp->rootdispersion = new->rootdispersion;
+			BST(stamp)->Tb = BST(new)->Tb;
+			BST(stamp)->Te = BST(new)->Te;
+			BST(stamp)->Tf = BST(new)->Tf;
+	}
+	stq_index(q, k);
+
+	/* Print out queue from head to tail (youngest at top of printout). */
+	if (VERB_LEVEL>1) {
+		for (k = q->start; k != STQ_NIL; k = q->elt[k].next) {
+			stamp = &q->elt[k].stamp;
+			if (stamp->type == STAMP_NTP) {
+				verbose(VERB_DEBUG, "  stamp queue dump: [%llu]   %llu %llu %.6Lf %.6Lf %s",
+				(long long unsigned) stamp->id,
+				(long long unsigned) BST(stamp)->Ta, (long long unsigned) BST(stamp)->Tf,
+				BST(stamp)->Tb, BST(stamp)->Te,
+				stamp->server_ipaddr);
+			}
+		}
+	}
+
+	if (foundhalfstamptofill)
+		return (0);
+	else
+		return (1);
+}
+
+
+/*
+ * Remove the oldest full stamp from the queue, and clean dangerous halfstamps
+ * (should be exactly one fullstamp, but code allows for 0 or more than 1).
+ *
+ * Principle is that fullstamps should never be removed out of order.  Here 
+ * stamp order is defined by the outgoing raw stamp Ta. This implies that client
+ * halfstamps older than the fullstamp should be cleaned out, since should they
+ * ever be filled, they would be out of order when removed. This also prevents
+ * c-halfstamps which are never matched (missing server replies) from bloating
+ * the queue permanently.
+ * An alternative ordering based on Tf is possible, but has more disadvantages.
+ * Note:  older = in queue longer = smaller value.
+ * 
+ * Server halfstamps shouldn't normally occur but sometimes do, for example if
+ * a c-halfstamp is cleaned, and its matching response arrives later. This can
+ * arise when a retry response returns before the (in fact not lost) original
+ * response. They are cleaned safely in reasonable time by comparison on Tf
+ * against the fullstamp, since Ta is not available for them.
+ *
+ * The stamp.id field (see insertandmatch_halfstamp) is used only to match two
+ * halfstamps into a fullstamp, not to establish stamp order. The fullstamp is
+ * the top of the Ta heap, ties going to the first inserted.
+ *
+ * To support stamps from multiple servers coexisting in the queue, c-halfstamp
+ * cleanout is only performed when the serverID matches that of the full stamp.
+ * Only the c-halfstamps older than the fullstamp are visited.
+ * This check is dropped for s-halfstamps, as they shouldn't be there anyway.
+ *
+ * Error codes:  err = 0 : success, fullstamp found and returned
+ *               err = 1 : failure, couldn't find fullstamp, nothing returned
+ */
+int
+get_fullstamp_from_queue_andclean(struct stamp_queue *q, struct stamp_t *stamp)
+{
+	struct stamp_t *st;
+	vcounter_t	full_time;			// used to record stamp order
+	vcounter_t	full_Tf;
+	int startsize;
+	int k, kprev, knext;
+
+	JDEBUG
+
+	if (q->size == 0) {
+		verbose(LOG_WARNING, "Stamp matching queue empty, no stamp returned");
+		return (1);
+	} else
+	  	startsize = q->size;
+
+	/* Pass back oldest full stamp */
+	if (q->nfull == 0) {
+		verbose(LOG_WARNING, "Did not find any full stamp in stamp queue");
+		return (1);
+	}
+	k = q->heap[0];
+	memcpy(stamp, &q->elt[k].stamp, sizeof(struct stamp_t));
+	full_time = BST(stamp)->Ta;
+	full_Tf = BST(stamp)->Tf;
+	stq_remove(q, k);
+
+	/* Clean server halfstamps older than the fullstamp, from any server */
+	if (q->nshalf > 0) {
+		for (k = q->end; k != STQ_NIL; k = kprev) {
+			kprev = q->elt[k].prev;
+			st = &q->elt[k].stamp;
+			if (!STQ_SHALF(st))
+				continue;
+			verbose(LOG_WARNING, "Found server halfstamp in stamp queue");
+			if (BST(st)->Tf < full_Tf) {
+				verbose(VERB_DEBUG, "Clearing out dangerous halfstamp");
+				stq_remove(q, k);
+			}
+		}
+	}
+
+	/* Clean client halfstamps older than the fullstamp, from its server */
+	for (k = q->coldest; k != STQ_NIL; k = knext) {
+		knext = q->elt[k].cnext;
+		st = &q->elt[k].stamp;
+		if (BST(st)->Ta >= full_time)
+			break;
+		if (strcmp(st->server_ipaddr, stamp->server_ipaddr) == 0) {
+			verbose(VERB_DEBUG, "Clearing out dangerous halfstamp");
+			stq_remove(q, k);
+		}
+	}
+
+	verbose(VERB_DEBUG, "Stamp queue had %d stamps, freed %d, %d left",
+		startsize, startsize - q->size, q->size);
+
+	return (0);
+}
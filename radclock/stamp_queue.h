@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STAMP_QUEUE_H
+#define _STAMP_QUEUE_H
+
+
+/*
+ * Stamp matching queue.
+ * Holds NTP halfstamps until request and reply are matched into fullstamps,
+ * which are handed out in Ta order. The queue is a fixed pool of MAX_STQ_SIZE
+ * elements, with an id index for matching, a Ta-ordered heap of the
+ * fullstamps, and a Ta-ordered list of client halfstamps for the cleanout.
+ * See stamp_queue.c for the matching and cleaning rules.
+ * The queue itself is created and destroyed with init_stamp_queue() and
+ * destroy_stamp_queue() (sync_algo.h).
+ */
+
+/* To bound the memory used if stamps are not paired in queue */
+#define MAX_STQ_SIZE	20
+
+int insertandmatch_halfstamp(struct stamp_queue *q, struct stamp_t *new,
+		int mode);
+
+int get_fullstamp_from_queue_andclean(struct stamp_queue *q,
+		struct stamp_t *stamp);
+
+#endif
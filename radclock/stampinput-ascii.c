@@ -24,12 +24,24 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
 #include <arpa/inet.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../config.h"
 #include "radclock.h"
@@ -46,70 +58,497 @@
 #include "jdebug.h"
 
 
+/*
+ * Files at least this large are parsed up front by several threads, if there
+ * are several CPUs. Smaller ones are parsed line by line while replaying.
+ */
+#define ASCII_PREPARSE_MIN		(4 << 20)		// [B]
+#define ASCII_PREPARSE_THREADS	8
+
+/*
+ * A decimal of up to 19 significant digits is an exact integer mantissa over
+ * an exact power of ten, their ratio is then correctly rounded just as
+ * strtold() rounds. Anything else goes to strtold().
+ */
+#if LDBL_MANT_DIG >= 64
+#define LD_EXACT_POW10	27
+#define LD_EXACT_MANT	UINT64_MAX
+#else
+#define LD_EXACT_POW10	22
+#define LD_EXACT_MANT	(1ULL << 53)
+#endif
+
 #define ASCII_DATA(x) ((struct ascii_data *)(x->priv_data))
 
 
 struct ascii_data
 {
-	FILE *fd;
+	char *map;					// the whole file
+	size_t maplen;
+	const char *cur;			// next line to parse while replaying
+	const char *end;
+	struct ascii_stamp *stamps;	// or stamps parsed up front
+	size_t nstamps;
+	size_t next;
+	size_t nbad;				// malformed lines skipped
+	int firstpass;
+};
+
+static const long double ld_pow10[] = {
+	1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L,
+	1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+	1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+
+
+/* Whitespace as scanf() skips it, within a line */
+static inline int
+is_blank(char c)
+{
+	return (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f');
+}
+
+static inline int
+is_digit(char c)
+{
+	return (c >= '0' && c <= '9');
+}
+
+static inline const char *
+skip_blanks(const char *p, const char *end)
+{
+	while (p < end && is_blank(*p))
+		p++;
+	return (p);
+}
+
+
+/*
+ * Copy the token at p for the strtoX() fallbacks, which need a terminated
+ * string. Long tokens are cut, as scanf() field widths would.
+ */
+static void
+copy_token(const char *p, const char *end, char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size - 1 && p + i < end && !is_blank(p[i]); i++)
+		buf[i] = p[i];
+	buf[i] = '\0';
+}
+
+
+/* %llu. Returns the end of the number, or NULL if there is none. */
+static const char *
+parse_u64(const char *p, const char *end, uint64_t *val)
+{
+	char buf[64], *e;
+	uint64_t v;
+	int n;
+
+	v = 0;
+	for (n = 0; n < 19 && p + n < end && is_digit(p[n]); n++)
+		v = v * 10 + (p[n] - '0');
+	if (n > 0 && (p + n == end || !is_digit(p[n]))) {
+		*val = v;
+		return (p + n);
+	}
+
+	/* Sign, overflow or no number */
+	copy_token(p, end, buf, sizeof(buf));
+	v = strtoull(buf, &e, 10);
+	if (e == buf)
+		return (NULL);
+	*val = v;
+	return (p + (e - buf));
+}
+
+
+/* %d */
+static const char *
+parse_int(const char *p, const char *end, int *val)
+{
+	char buf[64], *e;
+	long v;
+	int n;
+
+	v = 0;
+	for (n = 0; n < 9 && p + n < end && is_digit(p[n]); n++)
+		v = v * 10 + (p[n] - '0');
+	if (n > 0 && (p + n == end || !is_digit(p[n]))) {
+		*val = (int) v;
+		return (p + n);
+	}
+
+	copy_token(p, end, buf, sizeof(buf));
+	v = strtol(buf, &e, 10);
+	if (e == buf)
+		return (NULL);
+	*val = (int) v;
+	return (p + (e - buf));
+}
+
+
+/* %Lf, plain decimals are converted here, exponents, hex, inf and nan are not */
+static const char *
+parse_ld(const char *p, const char *end, long double *val)
+{
+	char buf[64], *e;
+	const char *q;
+	uint64_t mant;
+	int ndigits, nfrac, any, neg;
+
+	q = p;
+	neg = 0;
+	if (q < end && (*q == '-' || *q == '+'))
+		neg = (*q++ == '-');
+
+	mant = 0;
+	ndigits = 0;
+	nfrac = 0;
+	any = 0;
+	for (; q < end && is_digit(*q); q++) {
+		any = 1;
+		if (mant == 0 && *q == '0')
+			continue;
+		if (ndigits == 19)
+			goto fallback;
+		mant = mant * 10 + (*q - '0');
+		ndigits++;
+	}
+	if (q < end && *q == '.') {
+		for (q++; q < end && is_digit(*q); q++) {
+			any = 1;
+			nfrac++;
+			if (mant == 0 && *q == '0')
+				continue;
+			if (ndigits == 19)
+				goto fallback;
+			mant = mant * 10 + (*q - '0');
+			ndigits++;
+		}
+	}
+	if (!any || nfrac > LD_EXACT_POW10 || mant > LD_EXACT_MANT)
+		goto fallback;
+	if (q < end && (*q == 'e' || *q == 'E' || *q == 'x' || *q == 'X' ||
+			*q == 'p' || *q == 'P'))
+		goto fallback;
+
+	*val = (long double) mant / ld_pow10[nfrac];
+	if (neg)
+		*val = -*val;
+	return (q);
+
+fallback:
+	copy_token(p, end, buf, sizeof(buf));
+	*val = strtold(buf, &e);
+	if (e == buf)
+		return (NULL);
+	return (p + (e - buf));
+}
+
+
+/*
+ * Fields of the line [p, end), the conversions stop at the first failure as
+ * with scanf(). Returns the number of fields read, -1 if the line is blank.
+ */
+static int
+parse_line(const char *p, const char *end, struct ascii_stamp *st)
+{
+	p = skip_blanks(p, end);
+	if (p == end)
+		return (-1);
+
+	st->sID = 0;
+	if ((p = parse_u64(p, end, &st->Ta)) == NULL)
+		return (0);
+	if ((p = parse_ld(skip_blanks(p, end), end, &st->Tb)) == NULL)
+		return (1);
+	if ((p = parse_ld(skip_blanks(p, end), end, &st->Te)) == NULL)
+		return (2);
+	if ((p = parse_u64(skip_blanks(p, end), end, &st->Tf)) == NULL)
+		return (3);
+	if ((p = parse_u64(skip_blanks(p, end), end, &st->id)) == NULL)
+		return (4);
+	if ((p = parse_int(skip_blanks(p, end), end, &st->sID)) == NULL)
+		return (5);
+	return (6);
+}
+
+
+/*
+ * Next stamp of [*pp, end), skipping blank and malformed lines (counted in
+ * nbad). Returns 0 if there is none left.
+ */
+static int
+parse_next(const char **pp, const char *end, struct ascii_stamp *st,
+		size_t *nbad)
+{
+	const char *p, *eol;
+
+	for (p = *pp; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		st->ncols = parse_line(p, eol, st);
+		if (st->ncols >= 4) {
+			*pp = eol + 1;
+			return (1);
+		}
+		if (st->ncols >= 0)
+			(*nbad)++;
+	}
+	*pp = end;
+	return (0);
+}
+
+
+/*
+ * Skip contiguous comment lines (comment char selectable) at p. Used to skip
+ * comment block headings in ascii input files.
+ */
+static const char *
+skip_commentblock(const char *p, const char *end, const char commentchar)
+{
+	const char *eol;
+
+	while (p < end && *p == commentchar) {
+		eol = memchr(p, '\n', end - p);
+		p = eol ? eol + 1 : end;
+	}
+	return (p);
+}
+
+
+struct parse_chunk
+{
+	pthread_t thread;
+	const char *start;
+	const char *end;
+	struct ascii_stamp *stamps;
+	size_t nstamps;
+	size_t nbad;
+	int running;
+	int err;
 };
 
+static void
+parse_chunk(struct parse_chunk *chunk)
+{
+	struct ascii_stamp *stamps;
+	const char *p;
+	size_t size;
+
+	/* Stamp lines are a bit over 100 bytes */
+	size = (chunk->end - chunk->start) / 64 + 16;
+	chunk->stamps = malloc(size * sizeof(struct ascii_stamp));
+	JDEBUG_MEMORY(JDBG_MALLOC, chunk->stamps);
+	if (chunk->stamps == NULL) {
+		chunk->err = 1;
+		return;
+	}
+	p = chunk->start;
+	for (;;) {
+		if (chunk->nstamps == size) {
+			size *= 2;
+			stamps = realloc(chunk->stamps, size * sizeof(struct ascii_stamp));
+			if (stamps == NULL) {
+				chunk->err = 1;
+				return;
+			}
+			chunk->stamps = stamps;
+		}
+		if (!parse_next(&p, chunk->end, &chunk->stamps[chunk->nstamps],
+				&chunk->nbad))
+			break;
+		chunk->nstamps++;
+	}
+}
+
+static void *
+parse_thread(void *arg)
+{
+	sigset_t block_mask;
+
+	/* Signals are for the main thread */
+	sigfillset(&block_mask);
+	pthread_sigmask(SIG_BLOCK, &block_mask, NULL);
+
+	parse_chunk((struct parse_chunk *) arg);
+	return (NULL);
+}
+
 
-/* Function to skip contiguous comment lines (comment char selectable)
- * Used to skip comment block headings in ascii input files.
+/*
+ * Parse all stamps of the ascii stamp file held in buf, comment heading
+ * included, into a new array. The file is split into nthreads chunks at line
+ * boundaries, parsed concurrently. Returns 0 on success.
  */
 int
-skip_commentblock(FILE *fd, const char commentchar)
+ascii_parse(const char *buf, size_t len, int nthreads,
+		struct ascii_stamp **stamps, size_t *nstamps, size_t *nbad)
 {
-	int c;
-	// see if first char of line is a comment
-	while ((c=fgetc(fd))!=EOF && c==commentchar ){
-		while ((fgetc(fd))!= '\n'){}    // skip to start of next line
-		//fprintf(stdout,"c line: \n");
+	struct parse_chunk *chunks;
+	const char *p, *end, *eol;
+	size_t n;
+	int i, err;
+
+	p = skip_commentblock(buf, buf + len, '%');
+	end = buf + len;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	chunks = calloc(nthreads, sizeof(struct parse_chunk));
+	JDEBUG_MEMORY(JDBG_MALLOC, chunks);
+	if (chunks == NULL)
+		return (1);
+	for (i = 0; i < nthreads; i++) {
+		chunks[i].start = p;
+		if (i == nthreads - 1)
+			p = end;
+		else {
+			p = chunks[i].start + (end - chunks[i].start) / (nthreads - i);
+			eol = memchr(p, '\n', end - p);
+			p = eol ? eol + 1 : end;
+		}
+		chunks[i].end = p;
 	}
-	if (c!=EOF) {
-		// oops, first char wasn't a comment, push it back, is the first data element
-		c= ungetc(c,fd);
+
+	/* The first chunk is ours */
+	err = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&chunks[i].thread, NULL, parse_thread, &chunks[i]) == 0)
+			chunks[i].running = 1;
+		else
+			verbose(LOG_WARNING, "Cannot start ascii parsing thread, "
+					"parsing in this one");
+	}
+	parse_chunk(&chunks[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (chunks[i].running)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			parse_chunk(&chunks[i]);
+	}
+
+	n = 0;
+	*nbad = 0;
+	for (i = 0; i < nthreads; i++) {
+		n += chunks[i].nstamps;
+		*nbad += chunks[i].nbad;
+		err |= chunks[i].err;
 	}
-	return (c);   // returns EOF if no data
+	*nstamps = n;
+	*stamps = NULL;
+	if (!err && nthreads == 1) {
+		*stamps = chunks[0].stamps;
+		chunks[0].stamps = NULL;
+	} else if (!err) {
+		*stamps = malloc((n ? n : 1) * sizeof(struct ascii_stamp));
+		JDEBUG_MEMORY(JDBG_MALLOC, *stamps);
+		if (*stamps) {
+			for (n = 0, i = 0; i < nthreads; i++) {
+				memcpy(*stamps + n, chunks[i].stamps,
+						chunks[i].nstamps * sizeof(struct ascii_stamp));
+				n += chunks[i].nstamps;
+			}
+		} else
+			err = 1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		JDEBUG_MEMORY(JDBG_FREE, chunks[i].stamps);
+		free(chunks[i].stamps);
+	}
+	JDEBUG_MEMORY(JDBG_FREE, chunks);
+	free(chunks);
+	return (err);
 }
 
 
-/* Open an ascii stamp input file. */
-static FILE *
-open_timestamp(char* in)
+/* Map an ascii stamp input file, and parse it up front if worth it */
+static int
+open_timestamp(char* in, struct ascii_data *data)
 {
-	FILE* stamp_fd = NULL;
-	int ch;
-	if ((stamp_fd = fopen(in,"r")) == NULL) {
+	struct timeval start, stop;
+	struct stat st;
+	double secs;
+	long ncpu;
+	int fd, nthreads;
+
+	if ((fd = open(in, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
 		verbose(LOG_ERR, "Open failed on preprocessed stamp input file- %s", in);
-		return (NULL);
+		if (fd >= 0)
+			close(fd);
+		return (-1);
 	}
+	data->maplen = st.st_size;
+	if (data->maplen > 0) {
+		data->map = mmap(NULL, data->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data->map == MAP_FAILED) {
+			verbose(LOG_ERR, "Cannot map stamp input file %s: %s", in,
+					strerror(errno));
+			data->map = NULL;
+			close(fd);
+			return (-1);
+		}
+		madvise(data->map, data->maplen, MADV_SEQUENTIAL);
+	}
+	close(fd);
 
-	if ((ch=skip_commentblock(stamp_fd,'%'))==EOF)
+	data->cur = skip_commentblock(data->map, data->map + data->maplen, '%');
+	data->end = data->map + data->maplen;
+	if (data->cur == data->end)
 		verbose(LOG_WARNING,"Stored ascii stamp file %s seems to be data free", in);
 	else
 		verbose(LOG_NOTICE, "Reading from stored ascii stamp file %s", in);
 
-	return (stamp_fd);
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (data->maplen < ASCII_PREPARSE_MIN || ncpu < 2)
+		return (0);
+
+	nthreads = ncpu < ASCII_PREPARSE_THREADS ? ncpu : ASCII_PREPARSE_THREADS;
+	gettimeofday(&start, NULL);
+	if (ascii_parse(data->map, data->maplen, nthreads, &data->stamps,
+			&data->nstamps, &data->nbad)) {
+		verbose(LOG_ERR, "Cannot parse ascii stamp file %s", in);
+		return (-1);
+	}
+	gettimeofday(&stop, NULL);
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) * 1e-6;
+	verbose(LOG_NOTICE, "Parsed %lu stamps in %.1f MB with %d threads, %.0f MB/s",
+			(unsigned long) data->nstamps, data->maplen / 1e6, nthreads,
+			secs > 0 ? data->maplen / 1e6 / secs : 0);
+
+	/* Done with the text */
+	munmap(data->map, data->maplen);
+	data->map = NULL;
+	return (0);
 }
 
 static int
 asciistamp_init(struct radclock_handle *handle, struct stampsource *source)
 {
-	source->priv_data = (struct ascii_data *) malloc(sizeof(struct ascii_data));
-	JDEBUG_MEMORY(JDBG_MALLOC, source->priv_data);
-	if (!ASCII_DATA(source)) {
+	struct ascii_data *data;
+
+	data = (struct ascii_data *) calloc(1, sizeof(struct ascii_data));
+	JDEBUG_MEMORY(JDBG_MALLOC, data);
+	if (data == NULL) {
 		verbose(LOG_ERR, "Couldn't allocate memory");
 		return (-1);
 	}
+	data->firstpass = 1;
+	source->priv_data = data;
 
 	// Timestamp file input
 	if (strlen(handle->conf->sync_in_ascii) > 0) {
-		// preprocessed ascii TS input available, assumed 4 column
-		ASCII_DATA(source)->fd = open_timestamp(handle->conf->sync_in_ascii);
-		if (!ASCII_DATA(source)->fd)
+		if (open_timestamp(handle->conf->sync_in_ascii, data) < 0) {
+			if (data->map)
+				munmap(data->map, data->maplen);
+			JDEBUG_MEMORY(JDBG_FREE, data);
+			free(data);
 			return (-1);
+		}
 	}
 	return (0);
 }
@@ -134,6 +573,9 @@ asciistamp_init(struct radclock_handle *handle, struct stampsource *source)
  * (see serverIPtoID). This is unimportant as the sID<-->IP mapping is arbitrary,
  * but can be confusing when externally visualising the output.
  *
+ * Each line is read as sscanf(line, "%llu %Lf %Lf %llu %llu %d") would read it,
+ * lines with fewer than 4 fields are skipped, anything after the 6th is ignored.
+ *
  * TODO:  increase robustness to possible variations in import format
  *  Currently traditional 6col (and 5col) are "working" by fluke, sID read fails, so get
  *  sID=0, which is correct, and buggy stamp->id doesn't matter as matching done already.
@@ -142,40 +584,53 @@ static int
 asciistamp_get_next(struct radclock_handle *handle, struct stampsource *source,
     struct stamp_t *stamp)
 {
-	FILE *stamp_fd = ASCII_DATA(source)->fd;
-	int ncols;
-	int input_sID = 0;
-	static int firstpass = 1;
+	struct ascii_data *data = ASCII_DATA(source);
+	struct ascii_stamp parsed, *st;
 
-	if ((ncols = fscanf(stamp_fd, "%"VC_FMT" %Lf %Lf %"VC_FMT" %"VC_FMT" %d",
-	    &(BST(stamp)->Ta), &(BST(stamp)->Tb),
-	    &(BST(stamp)->Te), &(BST(stamp)->Tf), &stamp->id, &input_sID )) == EOF )
-	{
+	if (data->stamps) {
+		if (data->next == data->nstamps)
+			st = NULL;
+		else
+			st = &data->stamps[data->next++];
+	} else {
+		st = &parsed;
+		if (!parse_next(&data->cur, data->end, st, &data->nbad))
+			st = NULL;
+	}
+	if (st == NULL) {
+		if (data->nbad)
+			verbose(LOG_WARNING, "Skipped %lu malformed lines in ascii input "
+					"file.", (unsigned long) data->nbad);
 		verbose(LOG_NOTICE, "Got EOF on ascii input file.");
 		return (-1);
 	}
-	else {
-		// skip to start of next line (robust to additional unexpected columns)
-		while((fgetc(stamp_fd))!= '\n'){}
-
-		/* Assign distinct fake IP address matching serverID */
-		if (firstpass) {
-			verbose(LOG_NOTICE, "Found ≥ %d columns in ascii input file.", ncols);
-			if (ncols == 6)
-				verbose(LOG_NOTICE, "Assuming multiple servers, will assign fake "
-				    "IP's as 10.0.0.input_sID in first-seen order");
-			firstpass = 0;
-		}
 
-		// Assign IP to server (for each input stamp, even in single server case)
-		sprintf(stamp->server_ipaddr, "10.0.0.%d", input_sID);
-//		verbose(VERB_DEBUG, "input serverID value %d assigned to fake IP address %s",
-//		    input_sID, stamp->server_ipaddr);
+	/* Missing fields are left alone, as fscanf() used to */
+	BST(stamp)->Ta = st->Ta;
+	BST(stamp)->Tb = st->Tb;
+	BST(stamp)->Te = st->Te;
+	BST(stamp)->Tf = st->Tf;
+	if (st->ncols > 4)
+		stamp->id = st->id;
 
-		// TODO: need to detect stamp type, ie, get a better input format
-		stamp->type = STAMP_NTP;
-		source->ntp_stats.ref_count += 2;
+	/* Assign distinct fake IP address matching serverID */
+	if (data->firstpass) {
+		verbose(LOG_NOTICE, "Found ≥ %d columns in ascii input file.", st->ncols);
+		if (st->ncols == 6)
+			verbose(LOG_NOTICE, "Assuming multiple servers, will assign fake "
+			    "IP's as 10.0.0.input_sID in first-seen order");
+		data->firstpass = 0;
 	}
+
+	// Assign IP to server (for each input stamp, even in single server case)
+	sprintf(stamp->server_ipaddr, "10.0.0.%d", st->sID);
+//	verbose(VERB_DEBUG, "input serverID value %d assigned to fake IP address %s",
+//	    st->sID, stamp->server_ipaddr);
+
+	// TODO: need to detect stamp type, ie, get a better input format
+	stamp->type = STAMP_NTP;
+	source->ntp_stats.ref_count += 2;
+
 	return (0);
 }
 
@@ -191,9 +646,14 @@ asciistamp_breakloop(struct radclock_handle *handle, struct stampsource *source)
 static void
 asciistamp_finish(struct radclock_handle *handle, struct stampsource *source)
 {
-	fclose(ASCII_DATA(source)->fd);
-	JDEBUG_MEMORY(JDBG_FREE, ASCII_DATA(source));
-	free(ASCII_DATA(source));
+	struct ascii_data *data = ASCII_DATA(source);
+
+	if (data->map)
+		munmap(data->map, data->maplen);
+	JDEBUG_MEMORY(JDBG_FREE, data->stamps);
+	free(data->stamps);
+	JDEBUG_MEMORY(JDBG_FREE, data);
+	free(data);
 }
 
 static int
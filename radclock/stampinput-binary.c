@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replay of a binary stamp file (see outputfmt.h). The file is mapped and
+ * read sequentially, stamps are taken as is with no parsing. Stamps are
+ * handed over exactly as the ascii source does from the same data, so that
+ * replays from either give the same results.
+ */
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <string.h>
+
+#include "../config.h"
+#include "radclock.h"
+#include "radclock-private.h"
+
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "config_mgr.h"
+#include "verbose.h"
+#include "create_stamp.h"
+#include "outputfmt.h"
+#include "stampinput.h"
+#include "stampinput_int.h"
+#include "jdebug.h"
+
+
+#define BINARY_DATA(x) ((struct binary_data *)(x->priv_data))
+
+
+struct binary_data
+{
+	struct outfmt_file file;
+	size_t next;				// index of the next stamp to replay
+};
+
+
+static int
+binstamp_init(struct radclock_handle *handle, struct stampsource *source)
+{
+	struct binary_data *data;
+
+	data = (struct binary_data *) calloc(1, sizeof(struct binary_data));
+	JDEBUG_MEMORY(JDBG_MALLOC, data);
+	if (data == NULL) {
+		verbose(LOG_ERR, "Couldn't allocate memory");
+		return (-1);
+	}
+	source->priv_data = data;
+
+	if (outfmt_bin_open(handle->conf->sync_in_bin, &data->file) < 0) {
+		verbose(LOG_ERR, "Open failed on binary stamp input file- %s: %s",
+				handle->conf->sync_in_bin, strerror(errno));
+		goto err_out;
+	}
+	if (data->file.kind != OUTFMT_STAMP) {
+		verbose(LOG_ERR, "%s is not a binary stamp file",
+				handle->conf->sync_in_bin);
+		outfmt_bin_close(&data->file);
+		goto err_out;
+	}
+
+	if (data->file.nrec == 0)
+		verbose(LOG_WARNING, "Stored binary stamp file %s seems to be data free",
+				handle->conf->sync_in_bin);
+	else
+		verbose(LOG_NOTICE, "Reading %lu stamps from stored binary stamp file %s",
+				(unsigned long) data->file.nrec, handle->conf->sync_in_bin);
+	if (data->file.nservers > 1)
+		verbose(LOG_NOTICE, "Assuming multiple servers, will assign fake "
+				"IP's as 10.0.0.input_sID in first-seen order");
+
+	return (0);
+
+err_out:
+	JDEBUG_MEMORY(JDBG_FREE, data);
+	free(data);
+	return (-1);
+}
+
+
+static int
+binstamp_get_next(struct radclock_handle *handle, struct stampsource *source,
+	struct stamp_t *stamp)
+{
+	struct binary_data *data = BINARY_DATA(source);
+	struct outfmt_stamp_rec rec;
+
+	if (data->next >= data->file.nrec) {
+		verbose(LOG_NOTICE, "Got EOF on binary input file.");
+		return (-1);
+	}
+	outfmt_bin_get(&data->file, data->next++, &rec);
+
+	BST(stamp)->Ta = rec.Ta;
+	BST(stamp)->Tb = outfmt_join_ld(rec.Tb);
+	BST(stamp)->Te = outfmt_join_ld(rec.Te);
+	BST(stamp)->Tf = rec.Tf;
+	stamp->id = rec.id;
+
+	// Assign IP to server (for each input stamp, even in single server case)
+	sprintf(stamp->server_ipaddr, "10.0.0.%d", rec.sID);
+
+	stamp->type = STAMP_NTP;
+	source->ntp_stats.ref_count += 2;
+
+	return (0);
+}
+
+
+static void
+binstamp_breakloop(struct radclock_handle *handle, struct stampsource *source)
+{
+	verbose(LOG_WARNING, "Call to breakloop in binary replay has no effect");
+	return;
+}
+
+
+static void
+binstamp_finish(struct radclock_handle *handle, struct stampsource *source)
+{
+	outfmt_bin_close(&BINARY_DATA(source)->file);
+	JDEBUG_MEMORY(JDBG_FREE, BINARY_DATA(source));
+	free(BINARY_DATA(source));
+}
+
+static int
+binstamp_update_filter(struct radclock_handle *handle, struct stampsource *source)
+{
+	/* So far this does nothing ...  */
+	return (0);
+}
+
+static int
+binstamp_update_dumpout(struct radclock_handle *handle, struct stampsource *source)
+{
+	/* So far this does nothing ...  */
+	return (0);
+}
+
+//This is externed elsehere
+struct stampsource_def binary_source =
+{
+	.init             = binstamp_init,
+	.get_next_stamp   = binstamp_get_next,
+	.source_breakloop = binstamp_breakloop,
+	.destroy          = binstamp_finish,
+	.update_filter    = binstamp_update_filter,
+	.update_dumpout   = binstamp_update_dumpout,
+};
@@ -61,6 +61,7 @@
 #include "stampinput_int.h"
 #include "ntohll.h"
 #include "rawdata.h"
+#include "tracedump.h"
 #include "jdebug.h"
 
 
@@ -74,137 +75,64 @@
 
 struct livepcap_data
 {
-	pcap_t *live_input;
-	pcap_dumper_t *trace_output;
+	pcap_t *live_input;				// filter compiler only with a capture ring
+	struct tracedump *trace_output;	// raw output written by its own thread
 	struct sockaddr_storage ss_if;
+	struct pktcap_ring *ring;		// capture ring instead of libpcap if set
+	struct rawdata_cursor cursor;	// raw data being delivered to PROC
 };
 
 #define LIVEPCAP_DATA(x) ((struct livepcap_data *)(x->priv_data))
 
 
 /*
- * Present a somewhat mac layer independent view of packets to higher layers.
+ * Present a somewhat mac layer independent view of packets on drive.
  * This serves several purposes:
- * - sanitize input to synchronisation algorithm.
  * - allow to dump any mac layer into a unique DLT type on drive.
  * - store RAW counter values in abused SLL address field.
- * These are achieved by replacing the link layer header by a Linux SLL one.
+ * These are achieved by replacing the link layer header by a Linux SLL one, in
+ * a copy of the packet made into hdr and frame. The frame must have room for
+ * BPF_PACKET_SIZE bytes after the SLL header.
  */
 int
-insert_sll_header(radpcap_packet_t *packet)
+insert_sll_header(radpcap_packet_t *packet, struct pcap_pkthdr *hdr,
+		u_char *frame)
 {
-	struct ether_header *eh;
 	linux_sll_header_t *sllh;
+	struct pcap_pkthdr *pcaph;
 	uint16_t ethertype;
 	size_t etherlen;
-	char *tmpbuffer;
-	struct pcap_pkthdr *pcaph;
+	size_t len;
 
 	JDEBUG
 
-	etherlen = 0;
-	
-	switch(packet->type) {
-	
-	/* BSD Loopback interface */
-	// TODO a bit ugly, but good enough for now on
-	case DLT_NULL:
-		switch (*(uint32_t *)packet->payload) {
-		case AF_INET:
-			ethertype = ETHERTYPE_IP;
-			break;
-		case AF_INET6:
-			ethertype = ETHERTYPE_IPV6;
-			break;
-		default:
-			fprintf(stderr, "Non IP protocol on DLT_NULL\n");
-			return (1);
-		}
-		eh = (struct ether_header *)packet->payload;
-		etherlen = 4;
-		break;
-
-	case DLT_LINUX_SLL:
-		/* Nothing to do here */
-		return (0);
-
-	case DLT_IEEE802_11:
-	case DLT_EN10MB:
-		eh = (struct ether_header *)packet->payload;
-		ethertype = ntohs(eh->ether_type);
-		etherlen = sizeof(struct ether_header);
-
-		/* Ethernet with 802.2 and maybe SNAP header */
-		if (ethertype < 0x0600) {
-			verbose(LOG_ERR, "Not an ethernet.v2 frame, type not supported.");
-			return (1);
-		}
-
-		/* It is a bit ugly, but easier for cross-platform defs */
-		if (ethertype == ETHERTYPE_VLAN) {
-			ethertype = *(uint16_t *)((char *)packet->payload + 16);
-			etherlen = 18;
-		}
-
-		switch (ethertype) {
-		/* IPv4 */
-		case (ETHERTYPE_IP):
-		/* IPv6 */
-		case (ETHERTYPE_IPV6):
-		/* IEEE 1588 over Ethernet */
-		case (0x88F7):
-			break;
-		default:
-			verbose(LOG_ERR,"It seems we are trying to capture encapsulated packets");
-			verbose(LOG_ERR, "Do not support protocol type %u", ethertype);
-			return (1);
-		}
-		break;
-
-	default:
-		/* failed */
-		verbose(LOG_ERR, "Link Layer DLT type not supported yet");
+	if (get_link_layer_info(packet, &ethertype, &etherlen))
 		return (1);
-	}
 
-	/*
-	 * Create the new frame using the SLL header. It would have been more
-	 * efficient to avoid copying data, but ethernet header smaller than SLL
-	 * header. Simpler to maintain continuous memory block with same assumptions
-	 * as what has been received from libpcap.
-	 */
-	tmpbuffer = (char *) malloc(RADPCAP_PACKET_BUFSIZE);
-	JDEBUG_MEMORY(JDBG_MALLOC, tmpbuffer);
+	pcaph = (struct pcap_pkthdr *)packet->header;
+	if (pcaph->caplen < etherlen)
+		return (1);
+	len = pcaph->caplen - etherlen;
+	if (len > BPF_PACKET_SIZE)
+		len = BPF_PACKET_SIZE;
 
-	/* Copy the pcap header */
-	memcpy(tmpbuffer, packet->header, sizeof(struct pcap_pkthdr));
+	/* Create the Linux SLL header, keeping the original one if it was SLL */
+	sllh = (linux_sll_header_t *) frame;
+	if (packet->type == DLT_LINUX_SLL)
+		memcpy(sllh, packet->payload, sizeof(linux_sll_header_t));
+	else {
+		sllh->pkttype = htons(LINUX_SLL_OTHERHOST);
+		sllh->hatype = htons(ARPHRD_ETHER);
+		sllh->protocol = htons(ethertype);
+	}
 
-	/* Create the Linux SLL header */
-	sllh = (linux_sll_header_t *) (tmpbuffer + sizeof(struct pcap_pkthdr));
-	sllh->pkttype = htons(LINUX_SLL_OTHERHOST);
-	sllh->hatype = htons(ARPHRD_ETHER);
-	sllh->protocol = htons(ethertype);
+	/* Copy what is encapsulated in the link layer */
+	memcpy(frame + sizeof(linux_sll_header_t),
+			(char *)packet->payload + etherlen, len);
 
-	/* Copy what is encapsulated in ethernet */
-	pcaph = (struct pcap_pkthdr *)packet->header;
-	memcpy((char *)sllh + sizeof(linux_sll_header_t), (char *)eh + etherlen,
-			pcaph->caplen - etherlen);
-	
-	/* We made a copy so get rid of the former buffer */
-	JDEBUG_MEMORY(JDBG_FREE, packet->buffer);
-	free(packet->buffer);
-	
-	/* Reposition radpcap_packet fields to new values */
-	packet->buffer	= tmpbuffer;
-	packet->header	= tmpbuffer;
-	packet->payload = tmpbuffer + sizeof(struct pcap_pkthdr);
-	packet->type	= DLT_LINUX_SLL;
-	packet->size	= packet->size + sizeof(linux_sll_header_t) - etherlen;
-	
-	/* Update pcap header */
-	pcaph = (struct pcap_pkthdr *)packet->header;
-	pcaph->caplen = pcaph->caplen + sizeof(linux_sll_header_t) - etherlen;
-	pcaph->len = pcaph->len + sizeof(linux_sll_header_t) - etherlen;
+	*hdr = *pcaph;
+	hdr->caplen = len + sizeof(linux_sll_header_t);
+	hdr->len = pcaph->len + sizeof(linux_sll_header_t) - etherlen;
 
 	return (0);
 }
@@ -214,7 +142,7 @@ insert_sll_header(radpcap_packet_t *packet)
  * Store the vcount value in place of the MAC adresses in the Linux SLL header
  */
 void
-set_vcount_in_sll(radpcap_packet_t *packet, vcounter_t vcount)
+set_vcount_in_sll(linux_sll_header_t *hdr, vcounter_t vcount)
 {
 	vcounter_t network_vcount;
 
@@ -225,7 +153,6 @@ set_vcount_in_sll(radpcap_packet_t *packet, vcounter_t vcount)
 	assert(sizeof(vcounter_t) == sizeof(char)*8);
 
 	/* Hijack the address field to store the vcount */
-	linux_sll_header_t *hdr = (linux_sll_header_t*) packet->payload;
 	memcpy(hdr->addr, &network_vcount, sizeof(network_vcount));
 	hdr->halen = htons(8);
 }
@@ -233,68 +160,69 @@ set_vcount_in_sll(radpcap_packet_t *packet, vcounter_t vcount)
 
 /*
  * This is the callback passed to get_network_stamp().
- * It takes a radpcap_packet_t and fills this structure with the actual packet
- * read from the live interface.
+ * It points the radpcap_packet_t view to the next packet read from the live
+ * interface, without copying it.
  * The first trick here is to use deliver_rawdata_pcap() that actually retrieves
- * the BPF header, the packet captured and the vcount value padded in between.
- * The second trick, is to write all data retrieved to the output raw file (if
- * any) before passing the data to the sync algo. The link layer header is
- * replaced by a Linux SLL header and the vcount is stored in its address field.
+ * the BPF header, the packet captured and the vcount value padded in between,
+ * in place in the raw data queue. With the capture ring, deliver_rawdata_ring()
+ * gives the frame in place in the ring instead.
+ * The second trick, is to pass all data retrieved to the output raw file (if
+ * any) before passing the data to the sync algo. Only there is the packet
+ * copied, the link layer header replaced by a Linux SLL header and the vcount
+ * stored in its address field. The copy is made straight into the queue of the
+ * thread writing the file, and dropped if that queue is full.
  */
 static int
 get_packet_livepcap(struct radclock_handle *handle, void *userdata,
 		radpcap_packet_t **radpkt_p)
 {
 	struct livepcap_data *data;
-	pcap_dumper_t *traceoutput;
+	struct tracedump *traceoutput;
+	struct tracedump_rec *rec;
 	radpcap_packet_t *radpkt;
-	struct pcap_pkthdr *pcap_hdr;
 	vcounter_t vcount;
-	vcounter_t vcount_debug;
 	long double time;
 	int err;
 
 	JDEBUG
 
 	vcount = 0;
-	vcount_debug = 0;
 	data = (struct livepcap_data *) userdata;
-	traceoutput = data->trace_output;
+	traceoutput = __atomic_load_n(&data->trace_output, __ATOMIC_ACQUIRE);
 	radpkt = *radpkt_p;
 
 	/* Retrieve the next radcap-packet from the raw data buffer */
-	err = deliver_rawdata_pcap(handle, radpkt, &vcount);
+	if (data->ring)
+		err = deliver_rawdata_ring(handle, &data->cursor, radpkt, &vcount);
+	else
+		err = deliver_rawdata_pcap(handle, &data->cursor, radpkt, &vcount);
 	if (err)		// Raw data buffer is empty, or wrong RD_TYPE
 		return (1);
 
-	/* Replace the link layer header by the Linux SLL header for generic
-	 * encapsulation of the IP payload */
-	if (insert_sll_header(radpkt)) {
-		verbose(LOG_ERR, "Could not insert Linux SLL header");
-	}
-
-	/* Store the vcount in the address field of the SLL header */
-	set_vcount_in_sll(radpkt, vcount);
-	assert(get_vcount(radpkt, &vcount_debug) == 0);	// get it back out
-	assert(vcount == vcount_debug);
-
-	/* If prefer a radclock timestamp over kernel options, generate and
-	 * overwrite existing ts in copied pcap header
-	 */
-	if (handle->clock->tsmode == PKTCAP_TSMODE_RADCLOCK) {
-		read_RADabs_UTC(RAD_DATA(handle), &vcount, &time, PLOCAL_ACTIVE);
-		pcap_hdr = (struct pcap_pkthdr *)radpkt->header;
-		pcap_hdr->ts.tv_sec = (time_t) time;
-		pcap_hdr->ts.tv_usec = (suseconds_t)(1e6 * (time - (time_t)time));
-	}
+	/* The frame is as captured, the vcount comes alongside */
+	radpkt->live = 1;
+	radpkt->vcount = vcount;
 
 	/* Write out raw data if -w option active in main program */
-	if (traceoutput) {
-		pcap_dump((u_char *)traceoutput, (struct pcap_pkthdr *)radpkt->header,
-				(u_char *)radpkt->payload);
+	if (traceoutput && tracedump_active(traceoutput) &&
+			(rec = tracedump_reserve(traceoutput))) {
+		if (insert_sll_header(radpkt, &rec->hdr, rec->frame))
+			verbose(LOG_ERR, "Could not insert Linux SLL header");
+		else {
+			/* Store the vcount in the address field of the SLL header */
+			set_vcount_in_sll((linux_sll_header_t *)rec->frame, vcount);
+
+			/* If prefer a radclock timestamp over kernel options, generate
+			 * and overwrite existing ts in copied pcap header
+			 */
+			if (handle->clock->tsmode == PKTCAP_TSMODE_RADCLOCK) {
+				read_RADabs_UTC(RAD_DATA(handle), &vcount, &time, PLOCAL_ACTIVE);
+				rec->hdr.ts.tv_sec = (time_t) time;
+				rec->hdr.ts.tv_usec = (suseconds_t)(1e6 * (time - (time_t)time));
+			}
 
-		if (pcap_dump_flush(traceoutput) < 0)
-			verbose(LOG_ERR, "Error dumping packet data");
+			tracedump_publish(traceoutput);
+		}
 	}
 
 	/* Store interface address in radpkt */
@@ -538,6 +466,46 @@ build_BPFfilter(struct radclock_handle *handle, char *fltstr, int maxsize, char
 }
 
 
+/*
+ * Open the capture ring on the live device with the BPF filter. The pcap handle
+ * returned is a dead one, only used to compile filters.
+ */
+static pcap_t *
+open_live_ring(struct radclock_handle *handle, struct livepcap_data *ldata,
+		char *fltstr, int timeout)
+{
+	pcap_t *p_handle;
+	struct bpf_program filter;
+	int err;
+
+	/* The ring only deals with Ethernet framing */
+	p_handle = pcap_open_dead(DLT_EN10MB, BPF_PACKET_SIZE);
+	if (!p_handle) {
+		verbose(LOG_ERR, "Error creating pcap handle");
+		return (NULL);
+	}
+
+	if (pcap_compile(p_handle, &filter, fltstr, 0, 0) == -1) {
+		verbose(LOG_ERR, "pcap filter compiling failure, pcap says: %s",
+				pcap_geterr(p_handle));
+		pcap_close(p_handle);
+		return (NULL);
+	}
+
+	err = pktcap_ring_open(handle->conf->network_device, &filter, timeout,
+			&ldata->ring);
+	pcap_freecode(&filter);
+	if (err) {
+		pcap_close(p_handle);
+		return (NULL);
+	}
+
+	verbose(LOG_NOTICE, "Reading from live interface %s through a capture ring",
+			handle->conf->network_device);
+	return (p_handle);
+}
+
+
 /* Open a live device with a BPF filter */
 static pcap_t *
 open_live(struct radclock_handle *handle, struct livepcap_data *ldata)
@@ -600,6 +568,13 @@ open_live(struct radclock_handle *handle, struct livepcap_data *ldata)
 	}
 	//verbose(LOG_NOTICE, "Packet filter: %s", fltstr);
 
+	if (conf->capture_backend == CAPTURE_BACKEND_RING) {
+		p_handle = open_live_ring(handle, ldata, fltstr, pcap_timeout);
+		if (p_handle)
+			return (p_handle);
+		verbose(LOG_WARNING, "Capture ring not available, using libpcap");
+	}
+
 	/*
 	 * We got the parameters, open the live device. Set the timeout to 2ms before
 	 * waking up the userland process, no IMMEDIATE mode!
@@ -639,51 +614,33 @@ pcap_err:
 static int
 livepcapstamp_init(struct radclock_handle *handle, struct stampsource *source)
 {
-	/*
-	 * Create the handle to be sure to dump the packet in the right format while
-	 * being able to support any link layer type thanks to the LINUX_SLL
-	 * encapsulation of the link layer.
-	 */
 	pktcap_tsmode_t capture_mode;
-	pcap_t *p_handle_traceout;
 	struct radclock_config *conf;
 	int err;
 
 	conf = handle->conf;
 
-	/* Open the handle early to assure we have permissions to access it.
-	 * We do not close this, even though for libpcap 1.1.1 it is never used
-	 * after the pcap_dump_open() call.  For safety purposes we leave the
-	 * handle open incase of libpcap interface change on the pcap_dumper_t
-	 * struct which might, in the future, utilize the handle.
-	 */
-	p_handle_traceout = pcap_open_dead(DLT_LINUX_SLL, BPF_PACKET_SIZE);
-	if (!p_handle_traceout) {
-		verbose(LOG_ERR, "Error creating pcap handle");
-		JDEBUG_MEMORY(JDBG_FREE, LIVEPCAP_DATA(source));
-		free(LIVEPCAP_DATA(source));
-		return (-1);
-	}
-
 	source->priv_data = malloc(sizeof(struct livepcap_data));
 	JDEBUG_MEMORY(JDBG_MALLOC, source->priv_data);
 	if (!LIVEPCAP_DATA(source)) {
 		verbose(LOG_ERR, "Error allocating memory");
-		pcap_close(p_handle_traceout);
 		return (-1);
 	}
 
+	LIVEPCAP_DATA(source)->ring = NULL;
+	LIVEPCAP_DATA(source)->cursor.held = 0;
+	LIVEPCAP_DATA(source)->cursor.ring.block = NULL;
 	LIVEPCAP_DATA(source)->live_input = open_live(handle, LIVEPCAP_DATA(source));
 
 	if (!LIVEPCAP_DATA(source)->live_input) {
 		verbose(LOG_ERR, "Error creating pcap handle");
 		JDEBUG_MEMORY(JDBG_FREE, LIVEPCAP_DATA(source));
 		free(LIVEPCAP_DATA(source));
-		pcap_close(p_handle_traceout);
 		return (-1);
 	}
 	// TODO that could be written in a more simpler way once we clean the sources
 	handle->clock->pcap_handle = LIVEPCAP_DATA(source)->live_input;
+	handle->clock->pcap_ring = LIVEPCAP_DATA(source)->ring;
 
 	/* Set the packet capture mode to suit daemon requirements.
 	 * Strictly speaking the daemon only needs the raw counter read, but it must
@@ -693,15 +650,21 @@ livepcapstamp_init(struct radclock_handle *handle, struct stampsource *source)
 	 * The requested mode can potentially be overridden by pktcap_get_tsmode .
 	 * TODO:  set pktcap_tsmode up as conf param, if need to change ever arises.
 	 */
-	err = pktcap_set_tsmode(handle->clock, LIVEPCAP_DATA(source)->live_input,
-			PKTCAP_TSMODE_FFNATIVECLOCK, 0);
+	if (LIVEPCAP_DATA(source)->ring)
+		err = pktcap_ring_set_tsmode(handle->clock, LIVEPCAP_DATA(source)->ring,
+				PKTCAP_TSMODE_FFNATIVECLOCK, 0);
+	else
+		err = pktcap_set_tsmode(handle->clock, LIVEPCAP_DATA(source)->live_input,
+				PKTCAP_TSMODE_FFNATIVECLOCK, 0);
 	if (err) {
 		verbose(LOG_WARNING, "Could not set requested pkt capture timestamping mode");
 		return (-1);
 	}
 
 	/* Verbosely check we did things right  (returned tsmode is not used) */
-	pktcap_get_tsmode(handle->clock, LIVEPCAP_DATA(source)->live_input, &capture_mode);
+	if (LIVEPCAP_DATA(source)->ring == NULL)
+		pktcap_get_tsmode(handle->clock, LIVEPCAP_DATA(source)->live_input,
+				&capture_mode);
 
 	/* Test if previous file exists. Rename it if so */
 	if (strlen(conf->sync_out_pcap) > 0) {
@@ -725,20 +688,14 @@ livepcapstamp_init(struct radclock_handle *handle, struct stampsource *source)
 			out_fd = NULL;
 		}
 
-		/* pcap_dump_open stores the link layer type in the dump file header */
-		LIVEPCAP_DATA(source)->trace_output = pcap_dump_open(p_handle_traceout,
-				conf->sync_out_pcap);
+		LIVEPCAP_DATA(source)->trace_output = tracedump_open(conf->sync_out_pcap);
 		if (!LIVEPCAP_DATA(source)->trace_output) {
-			verbose(LOG_ERR, "Error opening raw output: %s",
-					pcap_geterr(p_handle_traceout));
 			JDEBUG_MEMORY(JDBG_FREE, LIVEPCAP_DATA(source));
 			free(LIVEPCAP_DATA(source));
 			return (-1);
 		}
-	} else {
+	} else
 		LIVEPCAP_DATA(source)->trace_output = NULL;
-		pcap_close(p_handle_traceout);
-	}
 
 	return (0);
 }
@@ -767,23 +724,31 @@ livepcapstamp_get_next(struct radclock_handle *handle, struct stampsource *sourc
  * catches a SIGHUP signal. This call does not affect other threads. In other
  * words, the pcap_get*() functions have to be in the main thread. Will not work
  * otherwise
+ * The raw output file is flushed by its writer thread.
  */
 static void
 livepcapstamp_breakloop(struct radclock_handle *handle, struct stampsource *source)
 {
+	if (LIVEPCAP_DATA(source)->trace_output)
+		tracedump_flush_request(LIVEPCAP_DATA(source)->trace_output);
 
-	pcap_breakloop(LIVEPCAP_DATA(source)->live_input);
+	if (LIVEPCAP_DATA(source)->ring)
+		pktcap_ring_breakloop(LIVEPCAP_DATA(source)->ring);
+	else
+		pcap_breakloop(LIVEPCAP_DATA(source)->live_input);
 }
 
 
 static void
 livepcapstamp_finish(struct radclock_handle *handle, struct stampsource *source)
 {
-	if (LIVEPCAP_DATA(source)->trace_output) {
-		pcap_dump_flush(LIVEPCAP_DATA(source)->trace_output);
-		pcap_dump_close(LIVEPCAP_DATA(source)->trace_output);
-	}
+	if (LIVEPCAP_DATA(source)->trace_output)
+		tracedump_close(LIVEPCAP_DATA(source)->trace_output);
 
+	if (LIVEPCAP_DATA(source)->ring) {
+		handle->clock->pcap_ring = NULL;
+		pktcap_ring_close(LIVEPCAP_DATA(source)->ring);
+	}
 	pcap_close(LIVEPCAP_DATA(source)->live_input);
 	JDEBUG_MEMORY(JDBG_FREE, LIVEPCAP_DATA(source));
 	free(LIVEPCAP_DATA(source));
@@ -796,6 +761,7 @@ livepcapstamp_update_filter(struct radclock_handle *handle, struct stampsource *
 	struct bpf_program filter;
 	char fltstr[MAXBPFLINE];               // bpf filter string
 	int strsize;
+	int err;
 
 	strcpy(fltstr, "");
 	strsize = build_BPFfilter(handle, fltstr, MAXBPFLINE, handle->hostIP);
@@ -813,6 +779,13 @@ livepcapstamp_update_filter(struct radclock_handle *handle, struct stampsource *
 				pcap_geterr(LIVEPCAP_DATA(source)->live_input));
 		goto pcap_err;
 	}
+	if (LIVEPCAP_DATA(source)->ring) {
+		err = pktcap_ring_setfilter(LIVEPCAP_DATA(source)->ring, &filter);
+		pcap_freecode(&filter);
+		if (err)
+			goto err_out;
+		return (0);
+	}
 	if (pcap_setfilter( LIVEPCAP_DATA(source)->live_input, &filter) == -1) {
 		verbose(LOG_ERR, "pcap filter setting failure, pcap says: %s",
 				pcap_geterr(LIVEPCAP_DATA(source)->live_input));
@@ -832,43 +805,30 @@ err_out:
 }
 
 
+/*
+ * Switch the raw output to the file now configured, or stop it. The writer
+ * thread finishes the current file first, PROC carries on meanwhile.
+ */
 static int
 livepcapstamp_update_dumpout(struct radclock_handle *handle,
 		struct stampsource *source)
 {
+	struct tracedump *td;
+
 	if (LIVEPCAP_DATA(source)->trace_output) {
-		pcap_dump_flush(LIVEPCAP_DATA(source)->trace_output);
-		pcap_dump_close(LIVEPCAP_DATA(source)->trace_output);
+		if (tracedump_rotate(LIVEPCAP_DATA(source)->trace_output,
+				handle->conf->sync_out_pcap))
+			return (-1);
+		return (0);
 	}
 
 	if (strlen(handle->conf->sync_out_pcap) > 0) {
-		pcap_t *p_handle_traceout;
-		/* We never close this handle for future safety if libpcap
-		 * changes its interface, and in the future might utilize this
-		 * handle.
-		 */
-		p_handle_traceout = pcap_open_dead(DLT_LINUX_SLL, BPF_PACKET_SIZE);
-		if (!p_handle_traceout) {
-			verbose(LOG_ERR, "Error creating pcap handle");
-			JDEBUG_MEMORY(JDBG_FREE, LIVEPCAP_DATA(source));
-			free(LIVEPCAP_DATA(source));
-			return (-1);
-		}
-		
-		LIVEPCAP_DATA(source)->trace_output = pcap_dump_open(p_handle_traceout,
-				handle->conf->sync_out_pcap);
-
-		if (!LIVEPCAP_DATA(source)->trace_output) {
-			verbose(LOG_ERR, "Error opening raw output: %s",
-					pcap_geterr(p_handle_traceout));
-			JDEBUG_MEMORY(JDBG_FREE, LIVEPCAP_DATA(source));
-			free(LIVEPCAP_DATA(source));
-			pcap_close(p_handle_traceout);
+		td = tracedump_open(handle->conf->sync_out_pcap);
+		if (!td)
 			return (-1);
-		}
+		__atomic_store_n(&LIVEPCAP_DATA(source)->trace_output, td,
+				__ATOMIC_RELEASE);
 	}
-	else
-		LIVEPCAP_DATA(source)->trace_output = NULL;
 
 	return (0);
 }
@@ -76,12 +76,10 @@ get_packet_tracefile(struct radclock_handle *handle, void *userdata,
 	radpcap_packet_t *packet = *packet_p;
 
 	/*
-	 * Read the packet from the input trace and store pcap header and packet
-	 * payload into the buffer one after the other. Use the generic libpcap
-	 * function since the vcount is hidden in the ethernet SLL header (seamless)
+	 * Read the packet from the input trace, pcap header and packet payload are
+	 * left in the libpcap buffer. Use the generic libpcap function since the
+	 * vcount is hidden in the ethernet SLL header (seamless)
 	 */
-	packet->header  = packet->buffer;
-	packet->payload = packet->buffer + sizeof(struct pcap_pkthdr);
 	ret = pcap_next_ex(data->trace_input,
 		(struct pcap_pkthdr**) (&(packet->header)),
 		(const u_char **) (&(packet->payload)));
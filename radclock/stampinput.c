@@ -46,6 +46,7 @@
 
 
 extern struct stampsource_def ascii_source;
+extern struct stampsource_def binary_source;
 extern struct stampsource_def livepcap_source;
 extern struct stampsource_def filepcap_source;
 extern struct stampsource_def spy_source;
@@ -58,6 +59,7 @@ is_live_source(struct radclock_handle *handle)
 	
 	if (strlen(handle->conf->sync_in_ascii) > 0) 		input_type++;
 	if (strlen(handle->conf->sync_in_pcap) > 0) 		input_type++; 
+	if (strlen(handle->conf->sync_in_bin) > 0) 		input_type++;
 //	if (strlen(handle->conf->network_device) > 0) 	input_type++; 
 
 	if (input_type > 1) {
@@ -111,6 +113,12 @@ create_source(struct radclock_handle *handle)
 			handle->conf->server_ntp = BOOL_OFF;  
 		}
 
+		if (strlen(handle->conf->sync_in_bin) > 0) {
+			INPUT_OPS(src) = &binary_source;
+			handle->conf->server_ipc = BOOL_OFF;  
+			handle->conf->server_ntp = BOOL_OFF;  
+		}
+
 		break;
 
 	case RADCLOCK_SYNC_LIVE:
@@ -69,4 +69,20 @@ struct stampsource
 	struct timeref_stats ntp_stats;
 };
 
+
+/* Stamp line of an ascii input file, ncols fields were read */
+struct ascii_stamp
+{
+	uint64_t Ta;
+	uint64_t Tf;
+	long double Tb;
+	long double Te;
+	uint64_t id;
+	int sID;
+	int ncols;
+};
+
+int ascii_parse(const char *buf, size_t len, int nthreads,
+		struct ascii_stamp **stamps, size_t *nstamps, size_t *nbad);
+
 #endif
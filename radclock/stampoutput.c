@@ -25,11 +25,14 @@
  */
 
 #include <arpa/inet.h>
+#include <sys/time.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 #include <pcap.h>
 
 #include "../config.h"
@@ -41,236 +44,420 @@
 #include "sync_history.h"
 #include "sync_algo.h"
 #include "config_mgr.h"
+#include "outputfmt.h"
+#include "recwriter.h"
 #include "stampoutput.h"
 #include "jdebug.h"
 
 
-int
-open_output_stamp(struct radclock_handle *handle)
+struct output_writer {
+	struct recwriter *rw;
+	struct radclock_handle *handle;
+	struct timeval last_sync;	// CLOCK_MONOTONIC, from the writer
+};
+
+
+/* The writer lock protects the files once the writer is started */
+static void
+ow_lock(struct radclock_handle *handle)
 {
-	char *backup;
+	if (handle->output_writer)
+		recwriter_lock(handle->output_writer->rw);
+}
 
-	/* Sometimes, there is nothing to do */
-	if (strlen(handle->conf->sync_out_ascii) == 0)
-		return (0);
+static void
+ow_unlock(struct radclock_handle *handle)
+{
+	if (handle->output_writer)
+		recwriter_unlock(handle->output_writer->rw);
+}
+
+/* Let PROC push records if there is a file to write them to */
+static void
+ow_set_active(struct radclock_handle *handle)
+{
+	if (handle->output_writer)
+		recwriter_set_active(handle->output_writer->rw,
+				handle->stampout_fd != NULL || handle->matout_fd != NULL ||
+				handle->stampout_bin_fd != NULL || handle->matout_bin_fd != NULL);
+}
+
+/* Write out the records pushed so far, writer lock held */
+static void
+ow_drain(struct radclock_handle *handle)
+{
+	if (handle->output_writer)
+		recwriter_drain(handle->output_writer->rw);
+}
+
+
+/*
+ * Create output file path, backing up any previous one. Only the writer
+ * thread writes to it, through a large buffer flushed regularly.
+ */
+static FILE *
+create_output_file(const char *path, const char *desc)
+{
+	FILE *fp;
+	char *backup;
 
 	/* Test if previous file exists. Rename it if so */
-	handle->stampout_fd = fopen(handle->conf->sync_out_ascii, "r");
-	if (handle->stampout_fd) {
-		fclose(handle->stampout_fd);
-		backup = (char *) malloc(strlen(handle->conf->sync_out_ascii)+ 5);
+	fp = fopen(path, "r");
+	if (fp) {
+		fclose(fp);
+		backup = (char *) malloc(strlen(path) + 5);
 		JDEBUG_MEMORY(JDBG_MALLOC, backup);
 
-		sprintf(backup, "%s.old", handle->conf->sync_out_ascii);
-		if (rename(handle->conf->sync_out_ascii, backup) < 0) {
-			verbose(LOG_ERR, "Cannot rename existing output file: %s",
-			    handle->conf->sync_out_ascii);
-
+		sprintf(backup, "%s.old", path);
+		if (rename(path, backup) < 0) {
+			verbose(LOG_ERR, "Cannot rename existing output file: %s", path);
 			JDEBUG_MEMORY(JDBG_FREE, backup);
 			free(backup);
 			exit(EXIT_FAILURE);
 		}
-		verbose(LOG_NOTICE, "Backed up existing output file: %s",
-		    handle->conf->sync_out_ascii);
+		verbose(LOG_NOTICE, "Backed up existing output file: %s", path);
 		JDEBUG_MEMORY(JDBG_FREE, backup);
 		free(backup);
-		handle->stampout_fd = NULL;
 	}
 
-	/* Open output file to store input data in preprocessed stamp format */
-	handle->stampout_fd = fopen(handle->conf->sync_out_ascii,"w");
-	if (handle->stampout_fd == NULL) {
-		verbose(LOG_ERR, "Open failed on stamp output file- %s",
-		    handle->conf->sync_out_ascii);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		verbose(LOG_ERR, "Open failed on %s output file- %s", desc, path);
 		exit(EXIT_FAILURE);
-	} else {  // write out comment header describing data
-		/* TODO: turn off buffering? */
-		setvbuf(handle->stampout_fd, (char *)NULL, _IONBF, 0);
-		fprintf(handle->stampout_fd, "%% BEGIN_HEADER\n");
-		fprintf(handle->stampout_fd, "%% description: radclock local vcounter "
-		    "and NTP server stamps\n");
-		fprintf(handle->stampout_fd, "%% type: NTP_rad\n");
-		fprintf(handle->stampout_fd, "%% version: 4\n");
-		fprintf(handle->stampout_fd, "%% fields: Ta Tb Te Tf nonce [sID]\n");
-		fprintf(handle->stampout_fd, "%% END_HEADER\n");
 	}
-	return (0);
+	setvbuf(fp, (char *)NULL, _IOFBF, OUTPUT_BUFSIZE);
+
+	return (fp);
 }
 
 
-void close_output_stamp(struct radclock_handle *handle)
+/* Binary output files record the configuration they have been produced with */
+static FILE *
+create_output_bin(struct radclock_handle *handle, const char *path,
+		const char *desc, int kind)
 {
-	if (handle->stampout_fd != NULL) {
+	FILE *fp, *mem;
+	char *config = NULL;
+	size_t config_len = 0;
+
+	fp = create_output_file(path, desc);
+
+	mem = open_memstream(&config, &config_len);
+	if (mem) {
+		config_write(mem, handle->conf, handle->nservers);
+		fclose(mem);
+	}
+	if (outfmt_bin_header(fp, kind, handle->nservers, config, config_len) < 0)
+		verbose(LOG_ERR, "Failed to write header of %s output file- %s",
+				desc, path);
+	free(config);
+	fflush(fp);
+
+	return (fp);
+}
+
+
+int
+open_output_stamp(struct radclock_handle *handle)
+{
+	ow_lock(handle);
+
+	/* Preprocessed stamp format */
+	if (strlen(handle->conf->sync_out_ascii) > 0) {
+		handle->stampout_fd = create_output_file(handle->conf->sync_out_ascii,
+				"stamp");
+		outfmt_ascii_header(handle->stampout_fd, OUTFMT_STAMP);
 		fflush(handle->stampout_fd);
-		fclose(handle->stampout_fd);
+	}
+	if (strlen(handle->conf->sync_out_bin) > 0)
+		handle->stampout_bin_fd = create_output_bin(handle,
+				handle->conf->sync_out_bin, "binary stamp", OUTFMT_STAMP);
+
+	ow_set_active(handle);
+	ow_unlock(handle);
+
+	return (0);
+}
+
+
+static void
+close_output_file(FILE **fp)
+{
+	if (*fp != NULL) {
+		fflush(*fp);
+		fclose(*fp);
+		*fp = NULL;
 	}
 }
 
 
+/* Records already pushed still go to the file being closed */
+void close_output_stamp(struct radclock_handle *handle)
+{
+	ow_lock(handle);
+	ow_drain(handle);
+	close_output_file(&handle->stampout_fd);
+	close_output_file(&handle->stampout_bin_fd);
+	ow_set_active(handle);
+	ow_unlock(handle);
+}
 
 
 int
 open_output_matlab(struct radclock_handle *handle)
 {
-	char *backup;
+	ow_lock(handle);
+
+	/* Synchronisation algorithm output (for Matlab, written in RADalgo_bidir) */
+	if (strlen(handle->conf->clock_out_ascii) > 0) {
+		handle->matout_fd = create_output_file(handle->conf->clock_out_ascii,
+				"Matlab");
+		outfmt_ascii_header(handle->matout_fd, OUTFMT_CLOCK);
+		fflush(handle->matout_fd);
+	}
+	if (strlen(handle->conf->clock_out_bin) > 0)
+		handle->matout_bin_fd = create_output_bin(handle,
+				handle->conf->clock_out_bin, "binary clock", OUTFMT_CLOCK);
 
-	/* Sometimes, there is nothing to do */
-	if (strlen(handle->conf->clock_out_ascii) == 0)
-		return (0);
+	ow_set_active(handle);
+	ow_unlock(handle);
 
-	/* Test if previous file exists. Rename it if so */
-	handle->matout_fd = fopen(handle->conf->clock_out_ascii, "r");
-	if (handle->matout_fd) {
-		fclose(handle->matout_fd);
-		backup = (char*) malloc(strlen(handle->conf->clock_out_ascii) + 5);
-		JDEBUG_MEMORY(JDBG_MALLOC, backup);
+	return (0);
+}
 
-		sprintf(backup, "%s.old", handle->conf->clock_out_ascii);
-		if (rename(handle->conf->clock_out_ascii, backup) < 0) {
-			verbose(LOG_ERR, "Cannot rename existing output file: %s",
-			    handle->conf->clock_out_ascii);
-			JDEBUG_MEMORY(JDBG_FREE, backup);
-			free(backup);
-			exit(EXIT_FAILURE);
+
+/* Records already pushed still go to the file being closed */
+void
+close_output_matlab(struct radclock_handle *handle)
+{
+	ow_lock(handle);
+	ow_drain(handle);
+	close_output_file(&handle->matout_fd);
+	close_output_file(&handle->matout_bin_fd);
+	ow_set_active(handle);
+	ow_unlock(handle);
+}
+
+
+/* This function covers the cases of the
+ *   stamp out (4tuple + nonce + sID)  [ input to RADclock offline ]
+ *   algo-internals (lots..    + sID)  [ input to matlab evaluation analysis ]
+ * in ascii and/or binary format (see outputfmt.h).
+ * Returns the number of bytes written, writer lock held.
+ */
+static size_t
+write_out_files(struct radclock_handle *handle, struct output_rec *rec)
+{
+	struct outfmt_stamp_rec srec;
+	struct outfmt_clock_rec crec;
+	size_t written = 0;
+	int err;
+
+	if ((rec->stamp.type != STAMP_NTP) && (rec->stamp.type != STAMP_SPY))
+		verbose(LOG_ERR, "Do not know how to print a stamp of type %d",
+				rec->stamp.type);
+
+	/* Deal with sync output */
+	if (handle->stampout_fd != NULL || handle->stampout_bin_fd != NULL) {
+		outfmt_stamp_rec(&srec, &rec->stamp, rec->sID);
+		if (handle->stampout_fd != NULL) {
+			err = outfmt_print_stamp(handle->stampout_fd, &srec, handle->nservers);
+			if (err < 0)
+				verbose(LOG_ERR, "Failed to write ascii data to timestamp file");
+			else
+				written += err;
+		}
+		if (handle->stampout_bin_fd != NULL) {
+			err = outfmt_bin_write(handle->stampout_bin_fd, OUTFMT_STAMP, &srec);
+			if (err < 0)
+				verbose(LOG_ERR, "Failed to write binary data to timestamp file");
+			else
+				written += err;
 		}
-		verbose(LOG_NOTICE, "Backed up existing output file: %s",
-		    handle->conf->clock_out_ascii);
-		JDEBUG_MEMORY(JDBG_FREE, backup);
-		free(backup);
-		handle->matout_fd = NULL;
 	}
 
+	/* Deal with internal algo output */
+	if (handle->matout_fd != NULL || handle->matout_bin_fd != NULL) {
+		outfmt_clock_rec(&crec, &rec->stamp, &rec->output, rec->sID);
+		if (handle->matout_fd != NULL) {
+			err = outfmt_print_clock(handle->matout_fd, &crec, handle->nservers);
+			if (err < 0)
+				verbose(LOG_ERR, "Failed to write data to matlab file");
+			else
+				written += err;
+		}
+		if (handle->matout_bin_fd != NULL) {
+			err = outfmt_bin_write(handle->matout_bin_fd, OUTFMT_CLOCK, &crec);
+			if (err < 0)
+				verbose(LOG_ERR, "Failed to write binary data to clock file");
+			else
+				written += err;
+		}
+	}
 
-	/* Open output file to store synchronisation algorithm output (for Matlab,
-	 * written in RADalgo_bidir).
-	 */
-	handle->matout_fd = fopen(handle->conf->clock_out_ascii,"w");
-	if (handle->matout_fd == NULL) {
-		verbose(LOG_ERR, "Open failed on Matlab output file- %s",
-		    handle->conf->clock_out_ascii);
-		exit(EXIT_FAILURE);
-	} else
-		/* TODO turn off buffering ? */
-		setvbuf(handle->matout_fd, (char *)NULL, _IONBF, 0);
-
-	fprintf(handle->matout_fd, "%% NTP packet filtering run with:\n");
-	fprintf(handle->matout_fd, "%%\n");
-	fprintf(handle->matout_fd, "%% column 1 - Tb \n");
-	fprintf(handle->matout_fd, "%% column 2 - Tf \n");
-	fprintf(handle->matout_fd, "%% column 3 - RTT\n");
-	fprintf(handle->matout_fd, "%% column 4 - phat\n");
-	fprintf(handle->matout_fd, "%% column 5 - plocal\n");
-	fprintf(handle->matout_fd, "%% column 6 - K\n");
-	fprintf(handle->matout_fd, "%% column 7 - thetahat\n");
-	fprintf(handle->matout_fd, "%% columns 8--10 - RTThat, RTThat_new, RTThat_sh\n");
-	fprintf(handle->matout_fd, "%% columns 11--17 - th_naive, minET, minET_last,"
-	    " RADclockout, RADclockin, pDf, pDb\n");
-	fprintf(handle->matout_fd, "%% columns 18--22 - perr, plocalerr, wsum, "
-	    "best_Tf, clock status\n");
-	fprintf(handle->matout_fd, "%%\n");
+	return (written);
+}
 
-	return (0);
+
+/* Sink of the writer */
+static size_t
+ow_write(void *arg, void *rec)
+{
+	struct output_writer *ow = (struct output_writer *) arg;
+
+	return (write_out_files(ow->handle, (struct output_rec *) rec));
 }
 
 
+static long
+ms_since(struct timeval *now, struct timeval *then)
+{
+	return ((now->tv_sec - then->tv_sec) * 1000 +
+			(now->tv_usec - then->tv_usec) / 1000);
+}
 
-void
-close_output_matlab(struct radclock_handle *handle)
+static void
+ow_flush_file(FILE *fp)
 {
-	if (handle->matout_fd != NULL) {
-		fflush(handle->matout_fd);
-		fclose(handle->matout_fd);
+	if (fp && fflush(fp) == EOF)
+		verbose(LOG_ERR, "Failed to flush output file: %s", strerror(errno));
+}
+
+static void
+ow_sync_file(FILE *fp)
+{
+	if (fp && fsync(fileno(fp)) < 0)
+		verbose(LOG_WARNING, "Cannot sync output file: %s", strerror(errno));
+}
+
+/* Flush the files, and get them to disk if the sync interval has elapsed */
+static void
+ow_flush(void *arg, size_t unflushed, struct timeval *now)
+{
+	struct output_writer *ow = (struct output_writer *) arg;
+	struct radclock_handle *handle = ow->handle;
+
+	if (unflushed > 0) {
+		ow_flush_file(handle->stampout_fd);
+		ow_flush_file(handle->matout_fd);
+		ow_flush_file(handle->stampout_bin_fd);
+		ow_flush_file(handle->matout_bin_fd);
+	}
+
+	/* The sync interval starts with the first flush */
+	if (ow->last_sync.tv_sec == 0 && ow->last_sync.tv_usec == 0)
+		ow->last_sync = *now;
+	if (ms_since(now, &ow->last_sync) >= OUTPUT_SYNC_MS) {
+		ow_sync_file(handle->stampout_fd);
+		ow_sync_file(handle->matout_fd);
+		ow_sync_file(handle->stampout_bin_fd);
+		ow_sync_file(handle->matout_bin_fd);
+		ow->last_sync = *now;
 	}
 }
 
-/* This function covers the cases of the
- *   ascii stamp out (4tuple + nonce + sID)  [ input to RADclock offline ]
- *   ascii algo-internals (lots..    + sID)  [ input to matlab evaluation analysis ]
- * Data is output one line per stamp regardless of originating server, with
- * the serverID in the last column when applicable.
+
+/*
+ * Start the output writer thread. Output files may be opened before or after.
+ * When replaying a trace the writer is lossless, PROC waits for room.
+ */
+int
+start_output_writer(struct radclock_handle *handle)
+{
+	struct recwriter_def def;
+	struct output_writer *ow;
+
+	JDEBUG
+
+	ow = (struct output_writer *) calloc(1, sizeof(struct output_writer));
+	JDEBUG_MEMORY(JDBG_MALLOC, ow);
+	if (ow == NULL) {
+		verbose(LOG_ERR, "Cannot allocate output writer");
+		return (1);
+	}
+	ow->handle = handle;
+
+	memset(&def, 0, sizeof(def));
+	def.name = "output";
+	def.what = "stamps";
+	def.rec_size = sizeof(struct output_rec);
+	def.nrecs = OUTPUT_QUEUE_SIZE;
+	def.batch = OUTPUT_BATCH;
+	def.flush_bytes = OUTPUT_BUFSIZE;
+	def.flush_ms = OUTPUT_FLUSH_MS;
+	def.lossless = (handle->run_mode != RADCLOCK_SYNC_LIVE);
+	def.arg = ow;
+	def.write = ow_write;
+	def.flush = ow_flush;
+	ow->rw = recwriter_start(&def);
+	if (ow->rw == NULL) {
+		JDEBUG_MEMORY(JDBG_FREE, ow);
+		free(ow);
+		return (1);
+	}
+
+	handle->output_writer = ow;
+	ow_set_active(handle);
+	return (0);
+}
+
+
+/*
+ * Write out all records pushed, stop the writer thread and close the output
+ * files. PROC must not push records anymore.
  */
 void
-print_out_files(struct radclock_handle *handle, struct stamp_t *stamp,
-	struct bidir_algooutput *output, int sID)
+stop_output_writer(struct radclock_handle *handle)
 {
-	int err;
+	struct output_writer *ow = handle->output_writer;
 
-	/* ld since must hold [s] since timescale origin, and at least 1mus precision */
-	long double currtime_out, currtime_in;
+	JDEBUG
 
-	if ((stamp->type != STAMP_NTP) && (stamp->type != STAMP_SPY))
-		verbose(LOG_ERR, "Do not know how to print a stamp of type %d", stamp->type);
+	if (ow) {
+		recwriter_stop(ow->rw);
+		handle->output_writer = NULL;
+	}
 
-	currtime_out = (long double)(BST(stamp)->Ta * output->phat) + output->K;
-	currtime_in  = (long double)(BST(stamp)->Tf * output->phat) + output->K;
+	close_output_stamp(handle);
+	close_output_matlab(handle);
 
-	/* Deal with sync output */
-	if (handle->stampout_fd != NULL) {
-		if (handle->nservers == 1)	// omit last column with serverID
-			err = fprintf(handle->stampout_fd,"%"VC_FMT" %.9Lf %.9Lf %"VC_FMT" %llu\n",
-			  (long long unsigned)BST(stamp)->Ta, BST(stamp)->Tb, BST(stamp)->Te,
-			  (long long unsigned)BST(stamp)->Tf,
-			  (long long unsigned)stamp->id);
-		else	// include serverID in last column
-			err = fprintf(handle->stampout_fd,"%"VC_FMT" %.9Lf %.9Lf %"VC_FMT" %llu %d\n",
-			  (long long unsigned)BST(stamp)->Ta, BST(stamp)->Tb, BST(stamp)->Te,
-			  (long long unsigned)BST(stamp)->Tf,
-			  (long long unsigned)stamp->id,
-			  sID);
-
-		if (err < 0)
-			verbose(LOG_ERR, "Failed to write ascii data to timestamp file");
+	if (ow) {
+		JDEBUG_MEMORY(JDBG_FREE, ow);
+		free(ow);
 	}
+}
 
 
-	/* Deal with internal algo output */
-	if (handle->matout_fd == NULL)
+/*
+ * Called by PROC after every stamp. Only copies the stamp and algo output to
+ * the writer, never touches the files. Without a writer, the files are
+ * written to directly.
+ */
+void
+print_out_files(struct radclock_handle *handle, struct stamp_t *stamp,
+	struct bidir_algooutput *output, int sID)
+{
+	struct output_writer *ow = handle->output_writer;
+	struct output_rec *rec, direct;
+
+	if (ow == NULL) {
+		if (handle->stampout_fd == NULL && handle->matout_fd == NULL &&
+				handle->stampout_bin_fd == NULL && handle->matout_bin_fd == NULL)
+			return;
+		direct.stamp = *stamp;
+		direct.output = *output;
+		direct.sID = sID;
+		write_out_files(handle, &direct);
 		return;
+	}
 
-	char *buf;
-	buf = (char *) malloc(500 * sizeof(char));  // must be big enuf for single disk access
-	JDEBUG_MEMORY(JDBG_MALLOC, buf);
-
-	sprintf(buf,
-		"%.9Lf %"VC_FMT" %"VC_FMT" %.10lg %.10lg %.11Lf %.10lf "
-		"%"VC_FMT" %"VC_FMT" %"VC_FMT" %.9lg %.9lg %.9lg %.11Lf "
-		"%.11Lf %.10lf %.10lf %.6lg %.6lg %.6lg %"VC_FMT" %u "
-		"%.9lg %.9lg %.9lg",    // pathpenalty metrics
-		BST(stamp)->Tb,
-		(unsigned long long)BST(stamp)->Tf,
-		(unsigned long long)output->RTT,
-		output->phat,
-		output->plocal,
-		output->K,
-		output->thetahat,
-		(unsigned long long)output->RTThat,
-		(unsigned long long)output->RTThat_new,
-		(unsigned long long)output->RTThat_shift,
-		output->th_naive,
-		output->minET,
-		output->minET_last,
-		currtime_out,
-		currtime_in,
-		output->pDf,
-		output->pDb,
-		output->perr,
-		output->plocalerr,
-		output->wsum,
-		output->best_Tf,
-		output->status,
-		// pathpenalty metrics
-		output->pathpenalty,
-		output->Pchange,
-		output->Pquality);
-		
-	if (handle->nservers > 1)  // add last column with serverID
-		sprintf(buf,"%s %d", buf, sID);
-
-	err = fprintf(handle->matout_fd, "%s\n", buf);
-	if (err < 0)
-		verbose(LOG_ERR, "Failed to write data to matlab file");
-
-	JDEBUG_MEMORY(JDBG_FREE, buf);
-	free(buf);
+	if (!recwriter_active(ow->rw))
+		return;
+	rec = (struct output_rec *) recwriter_reserve(ow->rw);
+	if (rec == NULL)
+		return;
+	rec->stamp = *stamp;
+	rec->output = *output;
+	rec->sID = sID;
+	recwriter_publish(ow->rw);
 }
-
@@ -28,6 +28,30 @@
 #define _STAMPOUTPUT_H
 
 
+/*
+ * Stamp (sync_out) and algo (clock_out) output files, ascii and binary.
+ * PROC only copies the stamp and algo output into a recwriter ring (see
+ * recwriter.h), the writer thread formats them and writes the files through
+ * large buffers, and fsyncs them every sync interval.
+ * When live, PROC never waits on the disk and records are dropped when the
+ * ring is full. When replaying a trace every record is written, PROC waits for
+ * room instead.
+ */
+#define OUTPUT_QUEUE_SIZE	1024		/* Number of records, power of 2 */
+#define OUTPUT_BATCH		64			/* Records pending to wake the writer */
+#define OUTPUT_BUFSIZE		(1 << 16)	/* stdio buffer of each file */
+#define OUTPUT_FLUSH_MS		1000
+#define OUTPUT_SYNC_MS		60000
+
+struct output_rec {
+	struct stamp_t stamp;
+	struct bidir_algooutput output;
+	int sID;
+};
+
+int start_output_writer(struct radclock_handle *handle);
+void stop_output_writer(struct radclock_handle *handle);
+
 int open_output_stamp(struct radclock_handle *handle) ;
 void close_output_stamp(struct radclock_handle *handle) ;
 
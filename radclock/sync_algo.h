@@ -89,6 +89,7 @@ struct bidir_metaparam {
 	/* algo meta-parameters */
 	int offset_ratio;             // used in setting of state->Eoffset
 	double plocal_quality;        // used in setting of state->Eplocal_qual
+	int thetahat_fastexp;         // Boolean, approximate exp in thetahat weights
 	/* path meta-parameters */
 	double path_scale;            // [s] comparison scale used in pref-server code
 	double relasym_bound_global;  // used in pathpenalty metric
@@ -212,6 +213,7 @@ struct bidir_algostate {
 
 	/* Time Series Histories */
 	history stamp_hist;
+	history Tf_hist;           // Tf column of stamp_hist, dense for window loops
 	history Df_hist;
 	history Db_hist;
 	//history Asym_hist;       // currently Asymhat not based on filtering a raw asym
@@ -222,6 +224,15 @@ struct bidir_algostate {
 	history RTThat_hist;
 	history thnaive_hist;
 
+	/* Sliding window minima trackers over the above histories */
+	history_minwin RTT_shift_mw;  // RTThat_shift over shift window
+	history_minwin RTT_near_mw;   // near_i in phat warmup and plocal algos
+	history_minwin RTT_far_mw;    // far_i in plocal algo
+	history_minwin Df_shift_mw;   // Dfhat_shift over shift window
+	history_minwin Db_shift_mw;   // Dbhat_shift over shift window
+
+	struct thwin_buf *thwin;      // thetahat window columns
+
 	/* OWD */
 	double Dfhat;              // Estimate of minimal Df
  	double next_Dfhat;         // Df estimate to be in the next half top window
@@ -350,6 +361,47 @@ struct bidir_algodata {
 #define OUTPUT(h,x) (SOUTPUT(h,h->pref_sID,x))
 
 
+/*
+ * Time spent per sub-algo of RADalgo_bidir, only when built with ALGO_PROFILE
+ * (see tests/bench_algo.c). The daemon is built without, at no cost.
+ */
+enum algo_prof {
+	ALGO_PROF_WINDOW,       // history window management, warmup end init
+	ALGO_PROF_RTT,
+	ALGO_PROF_OWDASYM,
+	ALGO_PROF_PHAT,
+	ALGO_PROF_PLOCAL,
+	ALGO_PROF_THETAHAT,
+	ALGO_PROF_PATHPENALTY,
+	ALGO_PROF_MAX
+};
+
+#ifdef ALGO_PROFILE
+#include <time.h>
+
+extern uint64_t algo_prof_ns[ALGO_PROF_MAX];    // [ns] cumulated
+
+static inline uint64_t
+algo_prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#define ALGO_PROF_START		uint64_t algo_prof_t = algo_prof_now()
+#define ALGO_PROF_LAP(_id) do {						\
+		uint64_t algo_prof_t1 = algo_prof_now();		\
+		algo_prof_ns[_id] += algo_prof_t1 - algo_prof_t;	\
+		algo_prof_t = algo_prof_t1;				\
+	} while (0)
+#else
+#define ALGO_PROF_START
+#define ALGO_PROF_LAP(_id)
+#endif
+
+
 /*
  * Functions declarations
  */
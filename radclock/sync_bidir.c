@@ -44,6 +44,7 @@
 #include "radclock-private.h"
 #include "radclock_daemon.h"
 #include "sync_history.h"
+#include "sync_thetahat.h"
 #include "sync_algo.h"
 #include "create_stamp.h"
 #include "rawdata.h"
@@ -54,6 +55,11 @@
 #include "jdebug.h"
 
 
+#ifdef ALGO_PROFILE
+uint64_t algo_prof_ns[ALGO_PROF_MAX];
+#endif
+
+
 
 /* Function to copy a stamp. Note argument reversal. */
 inline void copystamp(struct bidir_stamp *orig, struct bidir_stamp *copy)
@@ -155,8 +161,10 @@ adjust_warmup_win(index_t i, struct bidir_algostate *p, unsigned int plocal_winr
 
 	verbose(VERB_CONTROL,"Adjusting Warmup window");
 	
-	/* Adjust warmup wrt shift, plocal, and offset windows */
-	win = MAX(p->offset_win, MAX(p->shift_win, p->plocal_win + p->plocal_win/(plocal_winratio/2) ));
+	/* Adjust warmup wrt shift, plocal, and offset windows.
+	 * The first full stamp slides the shift window off stamp warmup_win-shift_win,
+	 * which must still be in the warmup sized histories, hence shift_win+1 */
+	win = MAX(p->offset_win, MAX(p->shift_win + 1, p->plocal_win + p->plocal_win/(plocal_winratio/2) ));
 
 	if (i==0) {
 		if ( win > p->warmup_win ) {    // simplify full algo a little
@@ -306,6 +314,7 @@ update_state(struct bidir_metaparam *metaparam, struct bidir_algostate *state,
 		verbose(VERB_CONTROL, "Resizing st_win history from %u to %u. Current stamp range is [%ld %lu]",
 		    state->stamp_hist.buffer_sz, stamp_sz, oldest_i, curr_i);
 		history_resize(&state->stamp_hist, stamp_sz);
+		history_resize(&state->Tf_hist, stamp_sz);
 		oldest_i = history_old(&state->stamp_hist);
 		verbose(VERB_CONTROL, "Range on exit: [%ld %lu]", oldest_i, curr_i);
 	}
@@ -580,7 +589,7 @@ void init_RTTOWDAsym_full(struct bidir_algostate *state, struct bidir_stamp *sta
 	/* Initialize shift_end (index of left boundary of shift window).
 	 * Check to ensure stamps at shift_end are actually in history.
 	 */
-	if (si > state->shift_win)
+	if (si >= state->shift_win)
 		state->shift_end = si - (state->shift_win-1);
 	else
 		state->shift_end = 0;    // just in case window sizes incorrectly set
@@ -1086,9 +1095,9 @@ process_OWDAsym_full(struct bidir_algostate *state, struct bidir_stamp *stamp)
 		state->Dfhat_shift =  MIN(state->Dfhat_shift,Df);
 		state->Dbhat_shift =  MIN(state->Dbhat_shift,Db);
 	} else {
-		state->Dfhat_shift = history_min_slide_value_dbl(&state->Df_hist,
+		state->Dfhat_shift = history_minwin_slide_value_dbl(&state->Df_shift_mw,
 		    state->Dfhat_shift, state->shift_end_OWD, si-1);
-		state->Dbhat_shift = history_min_slide_value_dbl(&state->Db_hist,
+		state->Dbhat_shift = history_minwin_slide_value_dbl(&state->Db_shift_mw,
 		    state->Dbhat_shift, state->shift_end_OWD, si-1);
 		state->shift_end_OWD++;
 	}
@@ -1175,7 +1184,7 @@ process_RTT_full(struct bidir_algostate *state, struct radclock_data *rad_data,
 		    state->shift_win, si - state->shift_end + 1);
 		state->RTThat_shift =  MIN(state->RTThat_shift,RTT);
 	} else {
-		state->RTThat_shift = history_min_slide_value(&state->RTT_hist,
+		state->RTThat_shift = history_minwin_slide_value(&state->RTT_shift_mw,
 		    state->RTThat_shift, state->shift_end, si-1);
 		state->shift_end++;
 	}
@@ -1323,7 +1332,7 @@ int process_phat_warmup (struct bidir_algostate* state, vcounter_t RTT,
 	*/
 
 	if ( si%warmup_winratio ) {
-		state->near_i = history_min_slide(&state->RTT_hist, state->near_i,
+		state->near_i = history_minwin_slide(&state->RTT_near_mw, state->near_i,
 		    si - state->wwidth, si - 1);
 	}
 	else {
@@ -1579,9 +1588,9 @@ process_plocal_full(struct bidir_algostate* state, struct radclock_data *rad_dat
 
 	lhs = si - state->wwidth - state->plocal_win - state->wwidth/2;
 	rhs = si - 1             - state->plocal_win - state->wwidth/2;
-	state->far_i  = history_min_slide(&state->RTT_hist, state->far_i, lhs, rhs);
+	state->far_i  = history_minwin_slide(&state->RTT_far_mw, state->far_i, lhs, rhs);
 	//       if get qual warning, should we Then exclude the current stamp?
-	state->near_i = history_min_slide(&state->RTT_hist, state->near_i,
+	state->near_i = history_minwin_slide(&state->RTT_near_mw, state->near_i,
 	    si-state->wwidth, si-1); // is normal to give old win as input
 
 	/* Compute time intervals between NTP timestamps of selected stamps */
@@ -1651,6 +1660,56 @@ process_plocal_full(struct bidir_algostate* state, struct radclock_data *rad_dat
  * THETAHAT ALGO
  * ===========================================================================*/
 
+/* Gather the offset window [jmin,si] into contiguous columns and run the
+ * thetahat window kernel over it.
+ * Weighting errors use RTThat_hist if given, otherwise the current RTThat.
+ * If storage cannot be had, returns a window of null weight and infinite
+ * error, so that the current estimate is kept.
+ */
+static void
+thetahat_window(struct bidir_metaparam *metaparam, struct bidir_algostate *state,
+    struct bidir_stamp *stamp, index_t jmin, history *RTThat_hist,
+    double plocal_coef, struct thwin_result *res)
+{
+	struct thwin_buf *buf = state->thwin;
+	struct thwin_window win;
+	index_t si = state->stamp_i;
+	index_t j;
+	unsigned int k, n;
+	vcounter_t RTT_j;
+
+	n = (unsigned int) (si - jmin + 1);
+	if (buf == NULL || thwin_reserve(buf, n)) {
+		verbose(LOG_ERR, "malloc failed allocating memory");
+		memset(res, 0, sizeof(*res));
+		res->minET = INFINITY;
+		return;
+	}
+
+	for (k = 0; k < n; k++) {
+		j = si - k;
+		RTT_j = history_vc(&state->RTT_hist, j);
+		buf->RTTerr2[k] = (double)RTT_j - state->RTThat;
+		if (RTThat_hist != NULL)
+			buf->RTTerr[k] = (double)RTT_j - history_vc(RTThat_hist, j);
+		buf->age[k]     = (double)(stamp->Tf - history_vc(&state->Tf_hist, j));
+		buf->thnaive[k] = history_dbl(&state->thnaive_hist, j);
+	}
+
+	win.RTTerr      = (RTThat_hist != NULL) ? buf->RTTerr : buf->RTTerr2;
+	win.RTTerr2     = buf->RTTerr2;
+	win.age         = buf->age;
+	win.thnaive     = buf->thnaive;
+	win.n           = n;
+	win.phat        = state->phat;
+	win.skmrate     = metaparam->BestSKMrate;
+	win.Eoffset     = state->Eoffset;
+	win.plocal_coef = plocal_coef;
+	win.fastexp     = metaparam->thetahat_fastexp;
+	thwin_run(&win, res);
+}
+
+
 void
 process_thetahat_warmup(struct bidir_metaparam *metaparam, struct bidir_algostate* state,
     struct bidir_stamp* stamp, struct radclock_data *rad_data, vcounter_t RTT,
@@ -1659,26 +1718,21 @@ process_thetahat_warmup(struct bidir_metaparam *metaparam, struct bidir_algostat
 	index_t si = state->stamp_i;  // convenience
 
 	double thetahat;     // double ok since this corrects clock which is already almost right
-	double wj;           // weight of pkt i
 	double wsum = 0;     // sum of weights
 	double th_naive = 0; // thetahat naive estimate
-	double ET = 0;       // error thetahat ?
 	double minET = 0;    // error thetahat ?
 
-	double *thnaive_tmp;
 	double gapsize;      // size in seconds between pkts, used to track widest gap in offset_win
 
 	index_t adj_win;     // adjusted window
-	index_t j;           // loop index, needs to be signed to avoid problem when j hits zero
 	index_t jmin  = 0;   // index that hits low end of loop
 	index_t jbest = 0;   // record best packet selected in window
 
-	double Ebound;         // per-stamp error bound on thetahat  (currently just ET)
 	double Ebound_min = 0; // smallest Ebound in offset win
+	struct thwin_result thwin;  // window kernel outputs
 	index_t RTT_end;       // indices of last pkts in RTT history
 	index_t thnaive_end;   // indices of last pkts in thnaive history
 	struct bidir_stamp *stamp_tmp;
-	vcounter_t *RTT_tmp;   // RTT value holder
 
 
 	/* During warmup, no plocal refinement, no gap detection, no SD error
@@ -1723,57 +1777,18 @@ process_thetahat_warmup(struct bidir_metaparam *metaparam, struct bidir_algostat
 	thnaive_end = history_old(&state->thnaive_hist);
 	jmin = MAX(jmin, MAX(RTT_end, thnaive_end));
 
-	for ( j = si; j >= jmin; j-- ) {
-		/* Reassess pt errors each time, as RTThat not stable in warmup.
-		 * Errors due to phat errors are small
-		 * then add aging with pessimistic rate (safer to trust recent)
-		 */
-		RTT_tmp   = history_find(&state->RTT_hist, j);
-		stamp_tmp = history_find(&state->stamp_hist, j);
-		ET  = state->phat * ((double)(*RTT_tmp) - state->RTThat );
-		ET += state->phat * (double)( stamp->Tf - stamp_tmp->Tf ) * metaparam->BestSKMrate;
-
-		/* Per point bound error is simply ET in here */
-		//Ebound  = ET;
-
-		/* Record best in window, smaller the better. When i<offset_win, must
-		 * to be zero since arg minRTT is at the new stamp, which has no aging
-		 */
-		if ( j == si ) {
-			minET = ET;
-			jbest = j;
-		} else {
-			if ( ET < minET ) {
-				minET = ET;
-				jbest = j;
-				//Ebound_min = Ebound;    // could give weighted version instead
-			}
-		}
-		/* calculate weight, is <=1
-		 * note: Eoffset initialised to non-0 value, safe to divide
-		 */
-		wj = exp(- ET * ET / state->Eoffset / state->Eoffset);
-		wsum += wj;
-		thnaive_tmp = history_find(&state->thnaive_hist, j);
-		thetahat = thetahat + wj * *thnaive_tmp;
-	}
-
-	/* Set Ebound_min to second best ET in window */
-	for ( j = si; j >= jmin; j-- ) {
-		if ( j == jbest ) continue;
-
-		RTT_tmp   = history_find(&state->RTT_hist, j);
-		stamp_tmp = history_find(&state->stamp_hist, j);
-		ET  = state->phat * ((double)(*RTT_tmp) - state->RTThat );
-		ET += state->phat * (double)( stamp->Tf - stamp_tmp->Tf ) * metaparam->BestSKMrate;
-
-		/* Record best in window excluding jbest */
-		if ( j == si || (jbest == 1) && (j == si - 1) )
-			Ebound_min = ET;		// initialize
-		else
-			if ( ET < Ebound_min ) Ebound_min = ET;
-
-	}
+	/* Reassess pt errors each time, as RTThat not stable in warmup.
+	 * Errors due to phat errors are small, then add aging with pessimistic rate
+	 * (safer to trust recent). Per point bound error is simply ET in here.
+	 * When i<offset_win, minET must be zero since arg minRTT is at the new
+	 * stamp, which has no aging. Ebound_min is the second best ET in window.
+	 */
+	thetahat_window(metaparam, state, stamp, jmin, NULL, 0, &thwin);
+	wsum       = thwin.wsum;
+	thetahat   = thwin.thsum;
+	minET      = thwin.minET;
+	jbest      = si - thwin.kbest;
+	Ebound_min = thwin.Ebound_min;
 
 
 
@@ -1898,13 +1913,11 @@ void process_thetahat_full(struct bidir_metaparam *metaparam, struct bidir_algos
 	index_t si = state->stamp_i;  // convenience
 
 	double thetahat;     // double ok since this corrects clock which is almost right
-	double wj;           // weight of pkt i
 	double wsum = 0;     // sum of weights
 	double th_naive = 0; // thetahat naive estimate
 	double ET = 0;       // error thetahat ?
 	double minET = 0;    // error thetahat ?
 
-	double *thnaive_tmp;
 	double gapsize;    // size in seconds between pkts, tracks widest gap in offset_win
 	//int gap = 0;    // logical: 1 = have found a large gap at THIS stamp  // not used
 
@@ -1913,16 +1926,14 @@ void process_thetahat_full(struct bidir_metaparam *metaparam, struct bidir_algos
 	index_t jmin  = 0;      // index that hits low end of loop
 	index_t jbest = 0;      // record best packet selected in window
 
-	double Ebound;          // per-stamp error bound on thetahat  (currently just ET)
 	double Ebound_min = 0;  // smallest Ebound in offset win
 	index_t st_end;         // indices of last pkts in stamp history
 	index_t RTT_end;        // indices of last pkts in RTT history
 	index_t RTThat_end;     // indices of last pkts in RTThat history
 	index_t thnaive_end;    // indices of last pkts in thnaive history
 	struct bidir_stamp *stamp_tmp;
-	struct bidir_stamp *stamp_tmp2;
-	vcounter_t *RTT_tmp;    // RTT value holder
-	vcounter_t *RTThat_tmp; // RTThat value holder
+	double plocal_coef;     // plocal correction of thnaive, per unit of age
+	struct thwin_result thwin;  // window kernel outputs
 
 
 	if ((stamp->Te - stamp->Tb) >= RTT*state->phat * 0.95) {
@@ -1993,73 +2004,35 @@ void process_thetahat_full(struct bidir_metaparam *metaparam, struct bidir_algos
 
 	jmin = MAX(jmin, MAX(st_end, MAX(RTT_end, MAX(RTThat_end, thnaive_end))));
 
-	for (j = si; j >= jmin; j--) {
-		/* first one done, and one fewer intervals than stamps
-		 * find largest gap between stamps in window */
-		if (j < si - 1) {
-			stamp_tmp = history_find(&state->stamp_hist, j);
-			stamp_tmp2 = history_find(&state->stamp_hist, j+1);
-			gapsize = MAX(gapsize, state->phat * (double) (stamp_tmp2->Tf - stamp_tmp->Tf));
-		}
-
-		/*
-		 * Don't reassess pt errors (shifts already accounted for) then add SD
-		 * quality measure (large SD at small RTT=> delayed Te, distorting
-		 * th_naive) then add aging with pessimistic rate (safer to trust recent)
-		 */
-		RTT_tmp    = history_find(&state->RTT_hist, j);
-		RTThat_tmp = history_find(&state->RTThat_hist, j);
-		stamp_tmp  = history_find(&state->stamp_hist, j);
-		ET  = state->phat * ((double)(*RTT_tmp) - *RTThat_tmp);
-		ET += state->phat * (double) ( stamp->Tf - stamp_tmp->Tf ) * metaparam->BestSKMrate;
-
-		/* Per point bound error is ET without the SD penalty */
-		//Ebound  = ET;
-
-		/* Add SD penalty to ET
-		 * SD quality measure has been problematic in different cases:
-		 * - kernel timestamping with hardware based servers(DAG, 1588), punish good stamps
-		 * - with bad NTP servers that have SD > Eoffset_qual all the time.
-		 * Definitively removed on 28/07/2011
-		 */
-		//ET += stamp_tmp->Te - stamp_tmp->Tb;
-
-		/* Record best in window, smaller the better. When i<offset_win, must be
-		 * zero since arg minRTT also in win. Initialise minET to 1st in window. */
-		if ( j == si ) {
-			minET = ET; jbest = j; Ebound_min = Ebound;
-		} else {
-			if (ET < minET) { minET = ET; jbest = j; }
-			//if (Ebound < Ebound_min) { Ebound_min = Ebound; } // dont assume min index same here
-		}
-		/* Calculate weight, is <=1 Note: Eoffset initialised to non-0 value, safe to divide */
-		wj = exp(- ET * ET / state->Eoffset / state->Eoffset);
-		wsum += wj;
-
-		/* Correct phat already used by difference with more locally accurate plocal */
-		thnaive_tmp = history_find(&state->thnaive_hist, j);
-		if (state->plocal_problem)
-			thetahat += wj * (*thnaive_tmp);
-		else
-			thetahat += wj * (*thnaive_tmp - (state->plocal / state->phat - 1) *
-			    state->phat * (double) (stamp->Tf - stamp_tmp->Tf));
-	}
-
-	/* Set Ebound_min to second best ET in window */
-	for (j = si; j >= jmin; j--) {
-		if (j == jbest) continue;
-
-		RTT_tmp   = history_find(&state->RTT_hist, j);
-		stamp_tmp = history_find(&state->stamp_hist, j);
-		ET  = state->phat * ((double)(*RTT_tmp) - state->RTThat );
-		ET += state->phat * (double)( stamp->Tf - stamp_tmp->Tf ) * metaparam->BestSKMrate;
+	/* First one done, and one fewer intervals than stamps
+	 * find largest gap between stamps in window */
+	for (j = si - 2; j >= jmin && j < si; j--)
+		gapsize = MAX(gapsize, state->phat * (double) (history_vc(&state->Tf_hist, j+1) -
+		    history_vc(&state->Tf_hist, j)));
 
-		/* Record best in window excluding jbest */
-		if ( j == si || (jbest == 1) && (j == si - 1) )
-			Ebound_min = ET;    // initialize
-		else
-			if ( ET < Ebound_min ) Ebound_min = ET;
-	}
+	/*
+	 * Don't reassess pt errors (shifts already accounted for) then add SD
+	 * quality measure (large SD at small RTT=> delayed Te, distorting
+	 * th_naive) then add aging with pessimistic rate (safer to trust recent).
+	 * SD quality measure has been problematic in different cases:
+	 * - kernel timestamping with hardware based servers(DAG, 1588), punish good stamps
+	 * - with bad NTP servers that have SD > Eoffset_qual all the time.
+	 * Definitively removed on 28/07/2011
+	 * Correct phat already used by difference with more locally accurate
+	 * plocal. Ebound_min is the second best ET in window, evaluated against
+	 * the current RTThat.
+	 */
+	if (state->plocal_problem)
+		plocal_coef = 0;
+	else
+		plocal_coef = (state->plocal / state->phat - 1) * state->phat;
+	thetahat_window(metaparam, state, stamp, jmin, &state->RTThat_hist,
+	    plocal_coef, &thwin);
+	wsum       = thwin.wsum;
+	thetahat   = thwin.thsum;
+	minET      = thwin.minET;
+	jbest      = si - thwin.kbest;
+	Ebound_min = thwin.Ebound_min;
 
 	/* Check Quality and calculate new candidate estimate
 	 * If quality over window looks good, use weights over window, otherwise
@@ -2080,6 +2053,7 @@ void process_thetahat_full(struct bidir_metaparam *metaparam, struct bidir_algos
 	} else {
 		//  BUG  where has gap code gone!!
 		thetahat = state->thetahat;  // this will effectively suppress sanity check TODO: make logic clearer
+		ET = state->phat * ((double)RTT - state->RTThat);
 		verbose(VERB_QUALITY, "i=%lu: thetahat quality very poor. wsum = %5.3lg, "
 		    "curr err = %5.3lg, old = %5.3lg, this pt-err = [%5.3lg] [ms]",
 		    si, wsum, 1000*minET, 1000*state->minET, 1000*ET);
@@ -2391,6 +2365,7 @@ RADalgo_bidir(struct radclock_handle *handle, struct bidir_algostate *state,
 
 		/* Create sufficient storage in needed per-stamp histories */
 		history_init(&state->stamp_hist,   (unsigned int) state->warmup_win, sizeof(struct bidir_stamp) );
+		history_init(&state->Tf_hist,      (unsigned int) state->warmup_win, sizeof(vcounter_t) );
 		history_init(&state->Df_hist,      (unsigned int) state->warmup_win, sizeof(double) );
 		history_init(&state->Db_hist,      (unsigned int) state->warmup_win, sizeof(double) );
 		history_init(&state->Dfhat_hist,   (unsigned int) state->warmup_win, sizeof(double) );
@@ -2400,6 +2375,18 @@ RADalgo_bidir(struct radclock_handle *handle, struct bidir_algostate *state,
 		history_init(&state->RTThat_hist,  (unsigned int) state->warmup_win, sizeof(vcounter_t) );
 		history_init(&state->thnaive_hist, (unsigned int) state->warmup_win, sizeof(double) );
 
+		/* Sliding minima trackers, storage follows that of their history */
+		history_minwin_init(&state->RTT_shift_mw, &state->RTT_hist);
+		history_minwin_init(&state->RTT_near_mw,  &state->RTT_hist);
+		history_minwin_init(&state->RTT_far_mw,   &state->RTT_hist);
+		history_minwin_init(&state->Df_shift_mw,  &state->Df_hist);
+		history_minwin_init(&state->Db_shift_mw,  &state->Db_hist);
+
+		/* Thetahat window columns, sized on first use */
+		state->thwin = calloc(1, sizeof(struct thwin_buf));
+		JDEBUG_MEMORY(JDBG_MALLOC, state->thwin);
+		verbose(VERB_CONTROL, "Thetahat window kernel: %s", thwin_kernel_name());
+
 		/* Parameter summary: physical, network, windows, thresholds, sanity */
 		print_algo_parameters(metaparam, state);
 	}
@@ -2430,6 +2417,7 @@ RADalgo_bidir(struct radclock_handle *handle, struct bidir_algostate *state,
 	 * immediately for availability in history hunting loops. */
 	history_add(&state->RTT_hist,   state->stamp_i, &RTT);
 	history_add(&state->stamp_hist, state->stamp_i, stamp);
+	history_add(&state->Tf_hist,    state->stamp_i, &stamp->Tf);
 
 
 	/* =============================================================================
@@ -2463,12 +2451,19 @@ RADalgo_bidir(struct radclock_handle *handle, struct bidir_algostate *state,
 		ADD_STATUS(rad_data, STARAD_UNSYNC);
 	}
 	else if (state->stamp_i < state->warmup_win) {
+		ALGO_PROF_START;
 		process_RTT_warmup(state, RTT);
+		ALGO_PROF_LAP(ALGO_PROF_RTT);
 		process_OWDAsym_warmup(state, stamp);
+		ALGO_PROF_LAP(ALGO_PROF_OWDASYM);
 		process_phat_warmup(state, RTT, warmup_winratio);
+		ALGO_PROF_LAP(ALGO_PROF_PHAT);
 		state->plocal = state->phat;
+		ALGO_PROF_LAP(ALGO_PROF_PLOCAL);
 		process_thetahat_warmup(metaparam, state, stamp, rad_data, RTT, output);
+		ALGO_PROF_LAP(ALGO_PROF_THETAHAT);
 		output->pathpenalty = state->RTThat * state->phat * metaparam->relasym_bound_global;
+		ALGO_PROF_LAP(ALGO_PROF_PATHPENALTY);
 		// TODO: review UNSYNC un/re-setting in general, should be more quality based
 		if (state->stamp_i >= NTP_BURST)
 			DEL_STATUS(rad_data, STARAD_UNSYNC);
@@ -2486,17 +2481,26 @@ RADalgo_bidir(struct radclock_handle *handle, struct bidir_algostate *state,
 			verbose(VERB_CONTROL, "i=%lu: End of Warmup Phase. Stamp read check: "
 			    "%llu %22.10Lf %22.10Lf %llu",
 			    state->stamp_i, stamp->Ta, stamp->Tb, stamp->Te, stamp->Tf);
+			ALGO_PROF_LAP(ALGO_PROF_WINDOW);
 		}
 	}
 	else {
+		ALGO_PROF_START;
 		manage_historywin(state, stamp, RTT);    // performs next_pstamp init
+		ALGO_PROF_LAP(ALGO_PROF_WINDOW);
 		process_RTT_full(state, rad_data, RTT);
+		ALGO_PROF_LAP(ALGO_PROF_RTT);
 		process_OWDAsym_full(state, stamp);
+		ALGO_PROF_LAP(ALGO_PROF_OWDASYM);
 		update_next_pstamp(state, stamp, RTT);
 		p_insane = process_phat_full(metaparam, state, stamp, rad_data, RTT, qual_warning);
+		ALGO_PROF_LAP(ALGO_PROF_PHAT);
 		process_plocal_full(state, rad_data, plocal_winratio, p_insane, qual_warning, output);
+		ALGO_PROF_LAP(ALGO_PROF_PLOCAL);
 		process_thetahat_full(metaparam, state, stamp, rad_data, RTT, qual_warning, output);
+		ALGO_PROF_LAP(ALGO_PROF_THETAHAT);
 		update_pathpenalty_full(metaparam, state, stamp, output);
+		ALGO_PROF_LAP(ALGO_PROF_PATHPENALTY);
 	}
 
 	/* Processing complete */
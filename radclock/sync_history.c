@@ -36,17 +36,32 @@
 #include "jdebug.h"
 
 
+/* Smallest power of 2 able to hold buffer_sz items */
+static index_t
+history_capacity(unsigned int buffer_sz)
+{
+	index_t cap = 1;
+
+	while (cap < buffer_sz)
+		cap <<= 1;
+	return cap;
+}
+
 int history_init(history *hist, unsigned int buffer_sz, size_t item_sz)
 {
-	hist->buffer = malloc(buffer_sz * item_sz);
+	index_t cap;
+
+	cap = history_capacity(buffer_sz);
+	hist->buffer = malloc(cap * item_sz);
 	JDEBUG_MEMORY(JDBG_MALLOC, hist->buffer);
 	if (hist->buffer == NULL) {
 		verbose(LOG_ERR, "malloc failed allocating memory");
 		return 1;
 	}
-	memset(hist->buffer, 0, buffer_sz * item_sz);
+	memset(hist->buffer, 0, cap * item_sz);
 
 	hist->buffer_sz   = buffer_sz;
+	hist->mask        = cap - 1;
 	hist->oldest_i    = 0;  // ignored when item_count=0
 	hist->newest_i    = -1;
 	hist->item_count  = 0;
@@ -60,6 +75,7 @@ void history_free(history *hist)
 	hist->buffer_sz  = 0;
 	hist->item_count = 0;
 	hist->item_sz    = 0;
+	hist->mask       = 0;
 	JDEBUG_MEMORY(JDBG_FREE, hist->buffer);
 	free(hist->buffer);
 	hist->buffer     = NULL;
@@ -78,7 +94,7 @@ void history_add(history *hist, index_t i, const void *item)
 		return;
 	}
 
-	posn = hist->buffer + (i % hist->buffer_sz) * hist->item_sz;
+	posn = history_at(hist, i);
 	memcpy(posn, item, hist->item_sz);
 	hist->newest_i++;
 
@@ -120,7 +136,7 @@ void * history_find(history *hist, index_t i)
 		verbose(LOG_ERR, "history_find: item i=%lu absent from history, cannot access", i);
 		return NULL;
 	} else
-		return hist->buffer + ( i % hist->buffer_sz ) * hist->item_sz;
+		return history_at(hist, i);
 }
 
 /* TODO: consider creating a history_replace fn for in-situ replacment */
@@ -131,10 +147,13 @@ void * history_find(history *hist, index_t i)
  * stamp index positioning. The value of newest_i does not change.
  * How the algos handle perhaps not having the elements they need available in
  * the history is not handled here!
+ * If the storage capacity is unchanged, items are already in place and only
+ * the logical size is updated.
  */
 int history_resize(history *hist, unsigned int new_size)
 {
 	unsigned long int j;
+	index_t new_cap;
 	void *new_buffer, *src, *dst;
 
 	if (new_size == hist->buffer_sz) {
@@ -142,14 +161,24 @@ int history_resize(history *hist, unsigned int new_size)
 		return 0;
 	}
 
+	new_cap = history_capacity(new_size);
+	if (new_cap == hist->mask + 1) {
+		if (hist->item_count > new_size) {
+			hist->item_count = new_size;
+			hist->oldest_i = hist->newest_i - new_size + 1;
+		}
+		hist->buffer_sz = new_size;
+		return 0;
+	}
+
 	/* Allocate a new buffer to copy the correct items. Initialised to 0 */
-	new_buffer = malloc(new_size * hist->item_sz);
+	new_buffer = malloc(new_cap * hist->item_sz);
 	JDEBUG_MEMORY(JDBG_MALLOC, new_buffer);
 	if (new_buffer == NULL) {
 		verbose(LOG_ERR, "malloc failed allocating memory");
 		return 1;
 	}
-	memset(new_buffer, 0, new_size * hist->item_sz);
+	memset(new_buffer, 0, new_cap * hist->item_sz);
 
 	if (hist->item_count > 0) {
 		/* Truncate held history if needed */
@@ -160,13 +189,14 @@ int history_resize(history *hist, unsigned int new_size)
 
 		/* Copy items maintaining stamp index positioning */
 		for ( j=hist->oldest_i; j<=hist->newest_i; j++ ) {
-			src = hist->buffer + ( j % hist->buffer_sz ) * hist->item_sz;
-			dst = new_buffer   + ( j % new_size )        * hist->item_sz;
+			src = history_at(hist, j);
+			dst = (char *)new_buffer + (j & (new_cap - 1)) * hist->item_sz;
 			memcpy(dst, src, hist->item_sz);
 		}
 	}
 
 	hist->buffer_sz = new_size;
+	hist->mask      = new_cap - 1;
 
 	JDEBUG_MEMORY(JDBG_FREE, hist->buffer);
 	free(hist->buffer);
@@ -231,14 +261,14 @@ index_t history_min(history *hist, index_t j, index_t i)
 	if ( i < j )
 		verbose(LOG_ERR,"Error in history_min, index range bad, j= %u, i= %u", j,i);
 
-	/* Initialise at j end */
+	/* Initialise at j end, checking it is still held */
 	//	min_curr = hist->buffer[j % hist->buffer_sz];    // old way
 	min_curr = (vcounter_t*) history_find(hist, j);
 	ind_curr = j;
 
 	while ( j < i ) {
 		j++;
-		tmp = (vcounter_t*) history_find(hist, j);
+		tmp = (vcounter_t*) history_at(hist, j);
 		if ( *tmp < *min_curr ) {  // < not ≤ : ignore larger repeat arg min indicies
 //			if ( *tmp == *min_curr )
 //				verbose(LOG_ERR,"history_min: repeat minimum : j= %u, i= %u (%llu %llu)", j , i, *tmp, *min_curr);
@@ -260,13 +290,13 @@ index_t history_min_dbl(history *hist, index_t j, index_t i)
 	if ( i < j )
 		verbose(LOG_ERR,"Error in history_min_dbl, index range bad, j= %u, i= %u", j,i);
 
-	/* Initialise at j end */
+	/* Initialise at j end, checking it is still held */
 	min_curr = history_find(hist, j);
 	ind_curr = j;
 
 	while ( j < i ) {
 		j++;
-		tmp = history_find(hist, j);
+		tmp = history_at(hist, j);
 		if ( *tmp < *min_curr ) {
 			min_curr = tmp;
 			ind_curr = j;
@@ -454,3 +484,291 @@ double history_min_slide_value_dbl(history *hist, double min_curr, index_t j, in
 	return min_curr;
 }
 
+
+
+
+
+/* =============================================================================
+ * SLIDING WINDOW MINIMUM VIA MONOTONIC DEQUE
+ * ===========================================================================*/
+
+/* The deque is a circular buffer of indices. Values are not copied, they are
+ * read from the history when needed, so the deque is type agnostic and only the
+ * comparisons made while advancing the window depend on the timeseries type.
+ */
+#define MW_POS(mw,k)   (((mw)->head + (k)) % (mw)->buffer_sz)
+#define MW_FRONT(mw)   ((mw)->buffer[(mw)->head])
+#define MW_BACK(mw)    ((mw)->buffer[MW_POS(mw, (mw)->count - 1)])
+
+#define HIST_VC(h,k)   history_vc(h, k)
+#define HIST_DBL(h,k)  history_dbl(h, k)
+
+
+int history_minwin_init(history_minwin *mw, history *hist)
+{
+	mw->hist      = hist;
+	mw->buffer    = NULL;
+	mw->buffer_sz = 0;
+	mw->head      = 0;
+	mw->count     = 0;
+	mw->lo        = 0;
+	mw->hi        = 0;
+	mw->valid     = 0;
+
+	return 0;
+}
+
+void history_minwin_free(history_minwin *mw)
+{
+	JDEBUG_MEMORY(JDBG_FREE, mw->buffer);
+	free(mw->buffer);
+	mw->buffer    = NULL;
+	mw->buffer_sz = 0;
+	mw->count     = 0;
+	mw->valid     = 0;
+}
+
+/* Ensure the deque can hold any window the history can, (re)allocating it to
+ * follow history_resize. A window never holds more items than the history, one
+ * extra slot is harmless. Returns 1 if no deque is available.
+ */
+static int
+minwin_prepare(history_minwin *mw)
+{
+	unsigned int sz = mw->hist->buffer_sz + 1;
+
+	if (mw->buffer_sz == sz && mw->buffer != NULL)
+		return 0;
+
+	JDEBUG_MEMORY(JDBG_FREE, mw->buffer);
+	free(mw->buffer);
+	mw->buffer = malloc(sz * sizeof(index_t));
+	JDEBUG_MEMORY(JDBG_MALLOC, mw->buffer);
+	mw->valid = 0;
+	if (mw->buffer == NULL) {
+		verbose(LOG_ERR, "malloc failed allocating memory");
+		mw->buffer_sz = 0;
+		return 1;
+	}
+	mw->buffer_sz = sz;
+
+	return 0;
+}
+
+/* Empty the deque, ready to track a new window starting at lo */
+static void
+minwin_restart(history_minwin *mw, index_t lo)
+{
+	mw->head  = 0;
+	mw->count = 0;
+	mw->lo    = lo;
+	mw->hi    = lo - 1;
+	mw->valid = 1;
+}
+
+/* Move the tracked window to [lo,hi] and return the index of its (first) minimum.
+ * Windows normally only move forward, in which case indices leaving on the left
+ * are dropped from the front, and those entering on the right are pushed at the
+ * back after removing any candidates they beat. Otherwise the deque is rebuilt.
+ */
+
+/* Version operating on vcounter_t timeseries */
+static index_t
+minwin_advance(history_minwin *mw, index_t lo, index_t hi)
+{
+	history *hist = mw->hist;
+	vcounter_t x;
+	index_t k;
+
+	if (!mw->valid || lo < mw->lo || hi < mw->hi)
+		minwin_restart(mw, lo);
+
+	while (mw->count > 0 && MW_FRONT(mw) < lo) {
+		mw->head = (mw->head + 1) % mw->buffer_sz;
+		mw->count--;
+	}
+	mw->lo = lo;
+
+	k = (mw->hi + 1 > lo) ? mw->hi + 1 : lo;
+	for ( ; k <= hi; k++) {
+		x = HIST_VC(hist, k);
+		while (mw->count > 0 && HIST_VC(hist, MW_BACK(mw)) > x)  // keep repeats
+			mw->count--;
+		mw->buffer[MW_POS(mw, mw->count)] = k;
+		mw->count++;
+	}
+	mw->hi = hi;
+
+	return MW_FRONT(mw);
+}
+
+/* Version operating on double timeseries */
+static index_t
+minwin_advance_dbl(history_minwin *mw, index_t lo, index_t hi)
+{
+	history *hist = mw->hist;
+	double x;
+	index_t k;
+
+	if (!mw->valid || lo < mw->lo || hi < mw->hi)
+		minwin_restart(mw, lo);
+
+	while (mw->count > 0 && MW_FRONT(mw) < lo) {
+		mw->head = (mw->head + 1) % mw->buffer_sz;
+		mw->count--;
+	}
+	mw->lo = lo;
+
+	k = (mw->hi + 1 > lo) ? mw->hi + 1 : lo;
+	for ( ; k <= hi; k++) {
+		x = HIST_DBL(hist, k);
+		while (mw->count > 0 && HIST_DBL(hist, MW_BACK(mw)) > x)
+			mw->count--;
+		mw->buffer[MW_POS(mw, mw->count)] = k;
+		mw->count++;
+	}
+	mw->hi = hi;
+
+	return MW_FRONT(mw);
+}
+
+
+/* Drop-in replacements for the history_min_slide family.
+ * Arguments and return values are as for the corresponding function above,
+ * with the same decision logic, only the brute force search when the current
+ * minimum exits is replaced by the deque, which is kept up to date with the
+ * new window [j+1,i+1] on every call. It is therefore up to the calling
+ * function to ensure that the values needed are still in the history.
+ */
+
+/* Version operating on vcounter_t timeseries */
+index_t history_minwin_slide(history_minwin *mw, index_t index_curr, index_t j, index_t i)
+{
+	vcounter_t *tmp_curr;
+	vcounter_t *new;
+	index_t front;
+
+	if ( i < j ) {
+		verbose(LOG_ERR,"Error in minwin_slide, window width < 1: %u %u %u", j,i,i-j+1);
+		return i+1;
+	}
+	if (minwin_prepare(mw))
+		return history_min_slide(mw->hist, index_curr, j, i);
+	front = minwin_advance(mw, j+1, i+1);
+
+	/* Window only 1 wide anyway, easy */
+	if (i == j)
+		return i+1;
+
+	/* New one must be new min */
+	new      = history_find(mw->hist, i+1);
+	tmp_curr = history_find(mw->hist, index_curr);
+	if ( *new < *tmp_curr )
+		return i+1;
+
+	/* One being dropped was min, front of new window takes over */
+	if (j == index_curr)
+		return front;
+
+	/* min_curr inside window and still valid, easy */
+	return index_curr;
+}
+
+/* Version operating on vcounter_t timeseries */
+vcounter_t history_minwin_slide_value(history_minwin *mw, vcounter_t min_curr, index_t j, index_t i)
+{
+	vcounter_t *tmp;
+	index_t front;
+
+	tmp = (vcounter_t *) history_find(mw->hist, i+1);  // new value entering
+
+	if ( i < j ) {
+		verbose(LOG_ERR,"Error in minwin_slide_value, window width less than 1: %u %u %u", j,i,i-j+1);
+		return *tmp;
+	}
+	if (minwin_prepare(mw))
+		return history_min_slide_value(mw->hist, min_curr, j, i);
+	front = minwin_advance(mw, j+1, i+1);
+
+	/* Window only 1 wide anyway, easy */
+	if (i == j)
+		return *tmp;
+
+	/* New one must be new min */
+	if ( *tmp < min_curr )
+		return *tmp;
+
+	/* One being dropped was min, front of new window takes over */
+	tmp = (vcounter_t *) history_find(mw->hist, j);  // value exiting
+	if ( *tmp == min_curr )
+		return HIST_VC(mw->hist, front);
+
+	/* min_curr inside window and still valid, easy */
+	return min_curr;
+}
+
+/* Version operating on double timeseries */
+index_t history_minwin_slide_dbl(history_minwin *mw, index_t index_curr, index_t j, index_t i)
+{
+	double *tmp_curr;
+	double *tmp;
+	index_t front;
+
+	if ( i < j ) {
+		verbose(LOG_ERR,"Error in minwin_slide_dbl, window width less than 1: %u %u %u", j,i,i-j+1);
+		return i+1;
+	}
+	if (minwin_prepare(mw))
+		return history_min_slide_dbl(mw->hist, index_curr, j, i);
+	front = minwin_advance_dbl(mw, j+1, i+1);
+
+	/* Window only 1 wide anyway, easy */
+	if (i == j)
+		return i+1;
+
+	/* New one must be new min */
+	tmp = history_find(mw->hist, i+1);
+	tmp_curr = history_find(mw->hist, index_curr);
+	if ( *tmp < *tmp_curr )
+		return i+1;
+
+	/* One being dropped was min, front of new window takes over */
+	if (j == index_curr)
+		return front;
+
+	/* min_curr inside window and still valid, easy */
+	return index_curr;
+}
+
+/* Version operating on double timeseries */
+double history_minwin_slide_value_dbl(history_minwin *mw, double min_curr, index_t j, index_t i)
+{
+	double *tmp;
+	index_t front;
+
+	tmp = history_find(mw->hist, i+1);  // new value entering
+
+	if ( i < j ) {
+		verbose(LOG_ERR,"Error in minwin_slide_value_dbl, window width less than 1: %u %u %u", j,i,i-j+1);
+		return *tmp;
+	}
+	if (minwin_prepare(mw))
+		return history_min_slide_value_dbl(mw->hist, min_curr, j, i);
+	front = minwin_advance_dbl(mw, j+1, i+1);
+
+	/* Window only 1 wide anyway, easy */
+	if (i == j)
+		return *tmp;
+
+	/* New one must be new min */
+	if ( *tmp < min_curr )
+		return *tmp;
+
+	/* One being dropped was min, front of new window takes over */
+	tmp = history_find(mw->hist, j);  // value exiting
+	if ( *tmp == min_curr )
+		return HIST_DBL(mw->hist, front);
+
+	/* min_curr inside window and still valid, easy */
+	return min_curr;
+}
@@ -43,6 +43,11 @@ typedef unsigned long int index_t;    // sufficient even if only 4 bytes
  * The structure records the size of the type being stored, but not the
  * type itself, this must be cast by the calling program who is aware of which
  * time series they are operating on.
+ *
+ * The storage itself is rounded up to a power of two so that the circular
+ * mapping is a mask rather than a modulo. The logical size buffer_sz alone
+ * determines which items are held, so {oldest_i,item_count} and resizing are
+ * exactly as if the storage were buffer_sz long.
  */
 typedef struct sync_hist {
 	void *buffer;             // data buffer
@@ -51,6 +56,7 @@ typedef struct sync_hist {
 	size_t item_sz;           // size of each item
 	index_t oldest_i;         // global index of oldest item stored
 	index_t newest_i;         // global index of newest item stored
+	index_t mask;             // storage capacity - 1, capacity a power of 2
 } history;
 
 int  history_init(history *hist, unsigned int buffer_sz, size_t item_sz);
@@ -61,6 +67,27 @@ index_t history_new(history *hist);
 void *history_find(history *hist, index_t index);
 int history_resize(history *hist, unsigned int buffer_sz);
 
+/* Unchecked typed accessors for the inner loops of the algo. Unlike
+ * history_find, the caller must ensure that oldest_i <= i <= newest_i.
+ */
+static inline void *
+history_at(const history *hist, index_t i)
+{
+	return (char *)hist->buffer + (i & hist->mask) * hist->item_sz;
+}
+
+static inline vcounter_t
+history_vc(const history *hist, index_t i)
+{
+	return ((const vcounter_t *)hist->buffer)[i & hist->mask];
+}
+
+static inline double
+history_dbl(const history *hist, index_t i)
+{
+	return ((const double *)hist->buffer)[i & hist->mask];
+}
+
 /* Forms that operate on vcounter_t */
 index_t    history_min(history *hist, index_t j, index_t i);
 index_t    history_min_slide(history *hist,        index_t index_curr,  index_t j, index_t i);
@@ -72,4 +99,43 @@ index_t history_min_slide_dbl(history *hist,    index_t index_curr, index_t j, i
 double  history_min_slide_value_dbl(history *hist, double min_curr, index_t j, index_t i);
 
 
+/* Support for tracking the minimum of a window sliding over a history in
+ * amortized O(1) per slide.
+ * A monotonic deque holds the indices of the candidate minima of the window
+ * [lo,hi] currently tracked, the front being the (first) arg min. Each index
+ * enters and leaves the deque at most once as the window slides, so the full
+ * history_min rescan otherwise needed when the current minimum exits the
+ * window is replaced by a lookup of the front.
+ * Candidates are kept if equal to a newcomer, so the front is always the
+ * smallest index yielding the minimum, in line with the < not ≤ convention.
+ *
+ * A minwin is attached to a single history, but is specific to a window, so
+ * a history may have several. The deque is sized to the history buffer, and is
+ * silently rebuilt if the history is resized or the window moves backward, so
+ * callers only need to pass the same window arguments as for the history_min_slide
+ * family, whose results are reproduced exactly.
+ */
+typedef struct sync_hist_minwin {
+	history *hist;            // history holding the timeseries
+	index_t *buffer;          // deque of candidate indices, circularly mapped
+	unsigned int buffer_sz;   // deque capacity (max number of candidates)
+	unsigned int head;        // buffer position of front candidate
+	unsigned int count;       // current number of candidates held
+	index_t lo;               // window [lo,hi] currently tracked
+	index_t hi;
+	int valid;                // if 0, window must be rebuilt on next use
+} history_minwin;
+
+int  history_minwin_init(history_minwin *mw, history *hist);
+void history_minwin_free(history_minwin *mw);
+
+/* Forms that operate on vcounter_t */
+index_t    history_minwin_slide(history_minwin *mw,       index_t index_curr, index_t j, index_t i);
+vcounter_t history_minwin_slide_value(history_minwin *mw, vcounter_t min_curr, index_t j, index_t i);
+
+/* Forms that operate on double */
+index_t history_minwin_slide_dbl(history_minwin *mw,       index_t index_curr, index_t j, index_t i);
+double  history_minwin_slide_value_dbl(history_minwin *mw, double min_curr,    index_t j, index_t i);
+
+
 #endif    /* _SYNC_HISTORY_H */
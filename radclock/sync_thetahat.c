@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../config.h"
+#include "sync_thetahat.h"
+#include "jdebug.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define THWIN_X86
+#include <immintrin.h>
+#endif
+
+
+int
+thwin_reserve(struct thwin_buf *buf, unsigned int n)
+{
+	double *cols;
+
+	if (n <= buf->size)
+		return 0;
+
+	/* One allocation holding the 4 columns */
+	cols = malloc(4 * n * sizeof(double));
+	JDEBUG_MEMORY(JDBG_MALLOC, cols);
+	if (cols == NULL)
+		return 1;
+
+	thwin_free(buf);
+	buf->RTTerr  = cols;
+	buf->RTTerr2 = cols + n;
+	buf->age     = cols + 2 * n;
+	buf->thnaive = cols + 3 * n;
+	buf->size    = n;
+	return 0;
+}
+
+void
+thwin_free(struct thwin_buf *buf)
+{
+	JDEBUG_MEMORY(JDBG_FREE, buf->RTTerr);
+	free(buf->RTTerr);
+	memset(buf, 0, sizeof(*buf));
+}
+
+
+
+/* =============================================================================
+ * FAST EXP
+ * ===========================================================================*/
+
+/* exp(x) = 2^n * exp(r), with n = round(x/ln2) and |r| <= ln2/2.
+ * exp(r) is approximated by its degree 7 Taylor polynomial, the truncation
+ * error r^8/8! * exp(|r|) being < 7.3e-9 relative. 2^n is built directly into
+ * the exponent bits: adding FE_SHIFT rounds x/ln2 to the nearest integer and
+ * leaves it in the low mantissa bits.
+ */
+#define FE_MIN      -708.0                     // below, result would be subnormal
+#define FE_SHIFT    6755399441055744.0         // 2^52 + 2^51
+#define FE_LOG2E    1.4426950408889634074
+#define FE_LN2_HI   6.93147180369123816490e-01
+#define FE_LN2_LO   1.90821492927058770002e-10
+#define FE_C2       (1.0/2)
+#define FE_C3       (1.0/6)
+#define FE_C4       (1.0/24)
+#define FE_C5       (1.0/120)
+#define FE_C6       (1.0/720)
+#define FE_C7       (1.0/5040)
+
+double
+thwin_fastexp(double x)
+{
+	union { double d; uint64_t u; } t, s;
+	double n, r, p;
+
+	if (!(x >= FE_MIN))
+		return 0;
+
+	t.d = x * FE_LOG2E + FE_SHIFT;
+	n = t.d - FE_SHIFT;
+	r = x - n * FE_LN2_HI;
+	r = r - n * FE_LN2_LO;
+
+	p = FE_C6 + r * FE_C7;
+	p = FE_C5 + r * p;
+	p = FE_C4 + r * p;
+	p = FE_C3 + r * p;
+	p = FE_C2 + r * p;
+	p = 1.0 + r * p;
+	p = 1.0 + r * p;
+
+	s.u = (t.u + 1023) << 52;
+	return p * s.d;
+}
+
+
+
+/* =============================================================================
+ * SCALAR KERNEL
+ * ===========================================================================*/
+
+/* Running state of a pass over the window. min1/k1/min2 are the two smallest
+ * ET2 seen so far, needed as kbest is only known at the end of the pass.
+ */
+struct thwin_acc {
+	double wsum;
+	double thsum;
+	double minET;
+	unsigned int kbest;
+	double min1;
+	unsigned int k1;
+	double min2;
+};
+
+static void
+acc_init(struct thwin_acc *acc)
+{
+	acc->wsum  = 0;
+	acc->thsum = 0;
+	acc->minET = INFINITY;
+	acc->kbest = 0;
+	acc->min1  = INFINITY;
+	acc->k1    = 0;
+	acc->min2  = INFINITY;
+}
+
+/* Add the summaries of a disjoint set of window positions. Ties go to the
+ * smallest k, as in a pass of increasing k with updating if new<best.
+ */
+static void
+acc_merge(struct thwin_acc *acc, double wsum, double thsum, double minET,
+	unsigned int kbest, double min1, unsigned int k1, double min2)
+{
+	acc->wsum  += wsum;
+	acc->thsum += thsum;
+
+	if (minET < acc->minET || (minET == acc->minET && kbest < acc->kbest)) {
+		acc->minET = minET;
+		acc->kbest = kbest;
+	}
+
+	if (min1 < acc->min1 || (min1 == acc->min1 && k1 < acc->k1)) {
+		acc->min2 = fmin(acc->min1, fmin(acc->min2, min2));
+		acc->min1 = min1;
+		acc->k1   = k1;
+	} else
+		acc->min2 = fmin(acc->min2, fmin(min1, min2));
+}
+
+/* Process positions [k,n) one by one */
+static void
+acc_run(const struct thwin_window *win, struct thwin_acc *acc, unsigned int k)
+{
+	double aging, ET, ET2, wj;
+
+	for (; k < win->n; k++) {
+		aging = win->phat * win->age[k] * win->skmrate;
+		ET  = win->phat * win->RTTerr[k];
+		ET += aging;
+		ET2 = win->phat * win->RTTerr2[k];
+		ET2 += aging;
+
+		if (win->fastexp)
+			wj = thwin_fastexp(- ET * ET / win->Eoffset / win->Eoffset);
+		else
+			wj = exp(- ET * ET / win->Eoffset / win->Eoffset);
+		acc->wsum  += wj;
+		acc->thsum += wj * (win->thnaive[k] - win->plocal_coef * win->age[k]);
+
+		if (ET < acc->minET) {
+			acc->minET = ET;
+			acc->kbest = k;
+		}
+		if (ET2 < acc->min1) {
+			acc->min2 = acc->min1;
+			acc->min1 = ET2;
+			acc->k1   = k;
+		} else if (ET2 < acc->min2)
+			acc->min2 = ET2;
+	}
+}
+
+static void
+acc_finish(const struct thwin_window *win, const struct thwin_acc *acc,
+	struct thwin_result *res)
+{
+	res->wsum  = acc->wsum;
+	res->thsum = acc->thsum;
+	res->minET = acc->minET;
+	res->kbest = acc->kbest;
+
+	if (win->n < 2)
+		res->Ebound_min = 0;
+	else if (acc->k1 != acc->kbest)
+		res->Ebound_min = acc->min1;
+	else
+		res->Ebound_min = acc->min2;
+}
+
+void
+thwin_scalar(const struct thwin_window *win, struct thwin_result *res)
+{
+	struct thwin_acc acc;
+
+	acc_init(&acc);
+	acc_run(win, &acc, 0);
+	acc_finish(win, &acc, res);
+}
+
+
+
+/* =============================================================================
+ * SIMD KERNELS
+ * Each lane runs the scalar pass over a strided subset of the window. Lanes are
+ * then merged in order and the remaining tail is processed by the scalar code.
+ * ===========================================================================*/
+
+#ifdef THWIN_X86
+
+__attribute__((target("sse2")))
+static inline __m128d
+fastexp_sse2(__m128d x)
+{
+	__m128d t, n, r, p, s;
+
+	t = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(FE_LOG2E)), _mm_set1_pd(FE_SHIFT));
+	n = _mm_sub_pd(t, _mm_set1_pd(FE_SHIFT));
+	r = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(FE_LN2_HI)));
+	r = _mm_sub_pd(r, _mm_mul_pd(n, _mm_set1_pd(FE_LN2_LO)));
+
+	p = _mm_add_pd(_mm_set1_pd(FE_C6), _mm_mul_pd(r, _mm_set1_pd(FE_C7)));
+	p = _mm_add_pd(_mm_set1_pd(FE_C5), _mm_mul_pd(r, p));
+	p = _mm_add_pd(_mm_set1_pd(FE_C4), _mm_mul_pd(r, p));
+	p = _mm_add_pd(_mm_set1_pd(FE_C3), _mm_mul_pd(r, p));
+	p = _mm_add_pd(_mm_set1_pd(FE_C2), _mm_mul_pd(r, p));
+	p = _mm_add_pd(_mm_set1_pd(1.0), _mm_mul_pd(r, p));
+	p = _mm_add_pd(_mm_set1_pd(1.0), _mm_mul_pd(r, p));
+
+	s = _mm_castsi128_pd(_mm_slli_epi64(_mm_add_epi64(_mm_castpd_si128(t),
+	    _mm_set1_epi64x(1023)), 52));
+	return _mm_and_pd(_mm_mul_pd(p, s), _mm_cmpge_pd(x, _mm_set1_pd(FE_MIN)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128d
+select_sse2(__m128d m, __m128d a, __m128d b)
+{
+	return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+}
+
+__attribute__((target("sse2")))
+static void
+thwin_sse2_impl(const struct thwin_window *win, struct thwin_result *res)
+{
+	struct thwin_acc acc;
+	__m128d phat, rate, E, coef, sign;
+	__m128d age, aging, ET, ET2, x, w, m, kv;
+	__m128d wsum, thsum, minET, kbest, min1, k1, min2;
+	double lw[2], lth[2], lmin[2], lkb[2], lm1[2], lk1[2], lm2[2], xs[2];
+	unsigned int k, l;
+
+	phat = _mm_set1_pd(win->phat);
+	rate = _mm_set1_pd(win->skmrate);
+	E    = _mm_set1_pd(win->Eoffset);
+	coef = _mm_set1_pd(win->plocal_coef);
+	sign = _mm_set1_pd(-0.0);
+
+	wsum  = _mm_setzero_pd();
+	thsum = _mm_setzero_pd();
+	minET = _mm_set1_pd(INFINITY);
+	min1  = _mm_set1_pd(INFINITY);
+	min2  = _mm_set1_pd(INFINITY);
+	kbest = _mm_setzero_pd();
+	k1    = _mm_setzero_pd();
+	kv    = _mm_set_pd(1, 0);
+
+	for (k = 0; k + 2 <= win->n; k += 2) {
+		age   = _mm_loadu_pd(win->age + k);
+		aging = _mm_mul_pd(_mm_mul_pd(phat, age), rate);
+		ET    = _mm_add_pd(_mm_mul_pd(phat, _mm_loadu_pd(win->RTTerr + k)), aging);
+		ET2   = _mm_add_pd(_mm_mul_pd(phat, _mm_loadu_pd(win->RTTerr2 + k)), aging);
+
+		x = _mm_div_pd(_mm_div_pd(_mm_mul_pd(_mm_xor_pd(ET, sign), ET), E), E);
+		if (win->fastexp)
+			w = fastexp_sse2(x);
+		else {
+			_mm_storeu_pd(xs, x);
+			xs[0] = exp(xs[0]);
+			xs[1] = exp(xs[1]);
+			w = _mm_loadu_pd(xs);
+		}
+		wsum  = _mm_add_pd(wsum, w);
+		thsum = _mm_add_pd(thsum, _mm_mul_pd(w, _mm_sub_pd(
+		    _mm_loadu_pd(win->thnaive + k), _mm_mul_pd(coef, age))));
+
+		m     = _mm_cmplt_pd(ET, minET);
+		minET = select_sse2(m, ET, minET);
+		kbest = select_sse2(m, kv, kbest);
+
+		m     = _mm_cmplt_pd(ET2, min1);
+		min2  = select_sse2(m, min1, _mm_min_pd(min2, ET2));
+		min1  = select_sse2(m, ET2, min1);
+		k1    = select_sse2(m, kv, k1);
+
+		kv = _mm_add_pd(kv, _mm_set1_pd(2));
+	}
+
+	_mm_storeu_pd(lw, wsum);
+	_mm_storeu_pd(lth, thsum);
+	_mm_storeu_pd(lmin, minET);
+	_mm_storeu_pd(lkb, kbest);
+	_mm_storeu_pd(lm1, min1);
+	_mm_storeu_pd(lk1, k1);
+	_mm_storeu_pd(lm2, min2);
+
+	acc_init(&acc);
+	for (l = 0; l < 2; l++)
+		acc_merge(&acc, lw[l], lth[l], lmin[l], (unsigned int) lkb[l],
+		    lm1[l], (unsigned int) lk1[l], lm2[l]);
+	acc_run(win, &acc, k);
+	acc_finish(win, &acc, res);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256d
+fastexp_avx2(__m256d x)
+{
+	__m256d t, n, r, p, s;
+
+	t = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(FE_LOG2E)), _mm256_set1_pd(FE_SHIFT));
+	n = _mm256_sub_pd(t, _mm256_set1_pd(FE_SHIFT));
+	r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(FE_LN2_HI)));
+	r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(FE_LN2_LO)));
+
+	p = _mm256_add_pd(_mm256_set1_pd(FE_C6), _mm256_mul_pd(r, _mm256_set1_pd(FE_C7)));
+	p = _mm256_add_pd(_mm256_set1_pd(FE_C5), _mm256_mul_pd(r, p));
+	p = _mm256_add_pd(_mm256_set1_pd(FE_C4), _mm256_mul_pd(r, p));
+	p = _mm256_add_pd(_mm256_set1_pd(FE_C3), _mm256_mul_pd(r, p));
+	p = _mm256_add_pd(_mm256_set1_pd(FE_C2), _mm256_mul_pd(r, p));
+	p = _mm256_add_pd(_mm256_set1_pd(1.0), _mm256_mul_pd(r, p));
+	p = _mm256_add_pd(_mm256_set1_pd(1.0), _mm256_mul_pd(r, p));
+
+	s = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(
+	    _mm256_castpd_si256(t), _mm256_set1_epi64x(1023)), 52));
+	return _mm256_and_pd(_mm256_mul_pd(p, s),
+	    _mm256_cmp_pd(x, _mm256_set1_pd(FE_MIN), _CMP_GE_OQ));
+}
+
+__attribute__((target("avx2")))
+static void
+thwin_avx2_impl(const struct thwin_window *win, struct thwin_result *res)
+{
+	struct thwin_acc acc;
+	__m256d phat, rate, E, coef, sign;
+	__m256d age, aging, ET, ET2, x, w, m, kv;
+	__m256d wsum, thsum, minET, kbest, min1, k1, min2;
+	double lw[4], lth[4], lmin[4], lkb[4], lm1[4], lk1[4], lm2[4], xs[4];
+	unsigned int k, l;
+
+	phat = _mm256_set1_pd(win->phat);
+	rate = _mm256_set1_pd(win->skmrate);
+	E    = _mm256_set1_pd(win->Eoffset);
+	coef = _mm256_set1_pd(win->plocal_coef);
+	sign = _mm256_set1_pd(-0.0);
+
+	wsum  = _mm256_setzero_pd();
+	thsum = _mm256_setzero_pd();
+	minET = _mm256_set1_pd(INFINITY);
+	min1  = _mm256_set1_pd(INFINITY);
+	min2  = _mm256_set1_pd(INFINITY);
+	kbest = _mm256_setzero_pd();
+	k1    = _mm256_setzero_pd();
+	kv    = _mm256_set_pd(3, 2, 1, 0);
+
+	for (k = 0; k + 4 <= win->n; k += 4) {
+		age   = _mm256_loadu_pd(win->age + k);
+		aging = _mm256_mul_pd(_mm256_mul_pd(phat, age), rate);
+		ET    = _mm256_add_pd(_mm256_mul_pd(phat, _mm256_loadu_pd(win->RTTerr + k)), aging);
+		ET2   = _mm256_add_pd(_mm256_mul_pd(phat, _mm256_loadu_pd(win->RTTerr2 + k)), aging);
+
+		x = _mm256_div_pd(_mm256_div_pd(_mm256_mul_pd(_mm256_xor_pd(ET, sign), ET), E), E);
+		if (win->fastexp)
+			w = fastexp_avx2(x);
+		else {
+			_mm256_storeu_pd(xs, x);
+			for (l = 0; l < 4; l++)
+				xs[l] = exp(xs[l]);
+			w = _mm256_loadu_pd(xs);
+		}
+		wsum  = _mm256_add_pd(wsum, w);
+		thsum = _mm256_add_pd(thsum, _mm256_mul_pd(w, _mm256_sub_pd(
+		    _mm256_loadu_pd(win->thnaive + k), _mm256_mul_pd(coef, age))));
+
+		m     = _mm256_cmp_pd(ET, minET, _CMP_LT_OQ);
+		minET = _mm256_blendv_pd(minET, ET, m);
+		kbest = _mm256_blendv_pd(kbest, kv, m);
+
+		m     = _mm256_cmp_pd(ET2, min1, _CMP_LT_OQ);
+		min2  = _mm256_blendv_pd(_mm256_min_pd(min2, ET2), min1, m);
+		min1  = _mm256_blendv_pd(min1, ET2, m);
+		k1    = _mm256_blendv_pd(k1, kv, m);
+
+		kv = _mm256_add_pd(kv, _mm256_set1_pd(4));
+	}
+
+	_mm256_storeu_pd(lw, wsum);
+	_mm256_storeu_pd(lth, thsum);
+	_mm256_storeu_pd(lmin, minET);
+	_mm256_storeu_pd(lkb, kbest);
+	_mm256_storeu_pd(lm1, min1);
+	_mm256_storeu_pd(lk1, k1);
+	_mm256_storeu_pd(lm2, min2);
+
+	acc_init(&acc);
+	for (l = 0; l < 4; l++)
+		acc_merge(&acc, lw[l], lth[l], lmin[l], (unsigned int) lkb[l],
+		    lm1[l], (unsigned int) lk1[l], lm2[l]);
+	acc_run(win, &acc, k);
+	acc_finish(win, &acc, res);
+}
+
+#endif    /* THWIN_X86 */
+
+
+int
+thwin_sse2(const struct thwin_window *win, struct thwin_result *res)
+{
+#ifdef THWIN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		thwin_sse2_impl(win, res);
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+int
+thwin_avx2(const struct thwin_window *win, struct thwin_result *res)
+{
+#ifdef THWIN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		thwin_avx2_impl(win, res);
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+
+
+/* =============================================================================
+ * RUNTIME DISPATCH
+ * The choice only depends on the CPU, so it is made once, on first use.
+ * ===========================================================================*/
+
+static void (*thwin_kernel)(const struct thwin_window *, struct thwin_result *) = NULL;
+static const char *thwin_name = "scalar";
+
+static void
+thwin_select(void)
+{
+	thwin_kernel = thwin_scalar;
+	thwin_name = "scalar";
+#ifdef THWIN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		thwin_kernel = thwin_avx2_impl;
+		thwin_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		thwin_kernel = thwin_sse2_impl;
+		thwin_name = "sse2";
+	}
+#endif
+}
+
+void
+thwin_run(const struct thwin_window *win, struct thwin_result *res)
+{
+	if (thwin_kernel == NULL)
+		thwin_select();
+	thwin_kernel(win, res);
+}
+
+const char *
+thwin_kernel_name(void)
+{
+	if (thwin_kernel == NULL)
+		thwin_select();
+	return thwin_name;
+}
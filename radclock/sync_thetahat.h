@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SYNC_THETAHAT_H
+#define _SYNC_THETAHAT_H
+
+
+/* Thetahat window kernel.
+ * The thetahat algos weight each stamp j of the offset window by its point
+ * error ET_j, and need the weighted sum of the naive offsets, the smallest ET
+ * and its position, and the second best error bound. The window is first
+ * gathered out of the histories into the contiguous columns below, with k=0
+ * the current stamp i and k=n-1 the oldest stamp (j = i - k), then a single
+ * pass computes all outputs:
+ *
+ *   ET_k  = phat*RTTerr_k  + phat*age_k*skmrate
+ *   ET2_k = phat*RTTerr2_k + phat*age_k*skmrate
+ *   w_k   = exp(-ET_k^2 / Eoffset^2)
+ *   wsum  = sum w_k,   thsum = sum w_k * (thnaive_k - plocal_coef*age_k)
+ *   minET = min ET_k   (first k on ties)
+ *   Ebound_min = min ET2_k over k != kbest  (0 if n=1)
+ *
+ * The scalar kernel with libm exp follows the order of operations of the
+ * original loops and gives identical results. The SIMD kernels only differ
+ * through the order of the sums. The fast exp mode has relative error below
+ * THWIN_FASTEXP_RELERR and flushes weights below exp(-708) to 0.
+ */
+
+#define THWIN_FASTEXP_RELERR   1e-8
+
+/* Window columns and parameters */
+struct thwin_window {
+	const double *RTTerr;   // RTT_j - RTThat_j  [counter units], weighting error
+	const double *RTTerr2;  // RTT_j - RTThat    [counter units], bound error
+	const double *age;      // Tf_i - Tf_j       [counter units]
+	const double *thnaive;  // naive offset estimates [s]
+	unsigned int n;         // window width, n >= 1
+	double phat;
+	double skmrate;         // aging rate, BestSKMrate
+	double Eoffset;
+	double plocal_coef;     // (plocal/phat - 1)*phat, 0 for no plocal refinement
+	int fastexp;            // use fast exp approximation
+};
+
+struct thwin_result {
+	double wsum;            // sum of weights
+	double thsum;           // weighted sum of thnaive (not normalised)
+	double minET;           // smallest ET in window
+	unsigned int kbest;     // position of minET
+	double Ebound_min;      // smallest ET2 in window excluding kbest
+};
+
+/* Storage for the window columns, grown as needed */
+struct thwin_buf {
+	double *RTTerr;
+	double *RTTerr2;
+	double *age;
+	double *thnaive;
+	unsigned int size;
+};
+
+int  thwin_reserve(struct thwin_buf *buf, unsigned int n);
+void thwin_free(struct thwin_buf *buf);
+
+/* Process window with the best kernel available on this CPU */
+void thwin_run(const struct thwin_window *win, struct thwin_result *res);
+const char *thwin_kernel_name(void);
+
+/* Individual kernels, thwin_sse2/avx2 return 1 if not supported */
+void thwin_scalar(const struct thwin_window *win, struct thwin_result *res);
+int  thwin_sse2(const struct thwin_window *win, struct thwin_result *res);
+int  thwin_avx2(const struct thwin_window *win, struct thwin_result *res);
+
+double thwin_fastexp(double x);
+
+#endif    /* _SYNC_THETAHAT_H */
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "create_stamp.h"
+#include "recwriter.h"
+#include "tracedump.h"
+#include "verbose.h"
+#include "jdebug.h"
+
+
+struct tracedump {
+	struct recwriter *rw;
+	pcap_t *p_handle;			// link layer type of the file
+	pcap_dumper_t *dumper;		// NULL if no file is open
+};
+
+
+/* Open path and write the file header, writer locked (or not started) */
+static int
+td_openfile(struct tracedump *td, const char *path)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		verbose(LOG_ERR, "Cannot open raw output %s: %s", path, strerror(errno));
+		return (1);
+	}
+	setvbuf(fp, NULL, _IOFBF, TRACEDUMP_FLUSH_BYTES);
+
+	td->dumper = pcap_dump_fopen(td->p_handle, fp);
+	if (td->dumper == NULL) {
+		verbose(LOG_ERR, "Error opening raw output: %s",
+				pcap_geterr(td->p_handle));
+		fclose(fp);
+		return (1);
+	}
+
+	return (0);
+}
+
+
+static void
+td_closefile(struct tracedump *td)
+{
+	if (td->dumper == NULL)
+		return;
+	if (pcap_dump_flush(td->dumper) < 0)
+		verbose(LOG_ERR, "Error dumping packet data");
+	pcap_dump_close(td->dumper);
+	td->dumper = NULL;
+}
+
+
+/* Sink of the writer. Packets pushed while no file is open are discarded. */
+static size_t
+td_write(void *arg, void *rec)
+{
+	struct tracedump *td = (struct tracedump *) arg;
+	struct tracedump_rec *trec = (struct tracedump_rec *) rec;
+
+	if (td->dumper == NULL)
+		return (0);
+	pcap_dump((u_char *)td->dumper, &trec->hdr, trec->frame);
+
+	/* pcap record header on file is 16 bytes */
+	return (16 + trec->hdr.caplen);
+}
+
+
+static void
+td_flush(void *arg, size_t unflushed, struct timeval *now)
+{
+	struct tracedump *td = (struct tracedump *) arg;
+
+	if (td->dumper && unflushed > 0) {
+		if (pcap_dump_flush(td->dumper) < 0)
+			verbose(LOG_ERR, "Error dumping packet data");
+	}
+}
+
+
+/*
+ * Open the raw output file and start its writer thread.
+ */
+struct tracedump *
+tracedump_open(const char *path)
+{
+	struct recwriter_def def;
+	struct tracedump *td;
+
+	JDEBUG
+
+	td = (struct tracedump *) calloc(1, sizeof(struct tracedump));
+	JDEBUG_MEMORY(JDBG_MALLOC, td);
+	if (td == NULL) {
+		verbose(LOG_ERR, "Cannot allocate raw output");
+		return (NULL);
+	}
+
+	/* The dump file header records the Linux SLL encapsulation */
+	td->p_handle = pcap_open_dead(DLT_LINUX_SLL, BPF_PACKET_SIZE);
+	if (td->p_handle == NULL) {
+		verbose(LOG_ERR, "Error creating pcap handle");
+		goto free_td;
+	}
+	if (td_openfile(td, path))
+		goto close_handle;
+
+	memset(&def, 0, sizeof(def));
+	def.name = "raw output";
+	def.what = "packets";
+	def.rec_size = sizeof(struct tracedump_rec);
+	def.nrecs = TRACEDUMP_QUEUE_SIZE;
+	def.batch = TRACEDUMP_BATCH;
+	def.flush_bytes = TRACEDUMP_FLUSH_BYTES;
+	def.flush_ms = TRACEDUMP_FLUSH_MS;
+	def.arg = td;
+	def.write = td_write;
+	def.flush = td_flush;
+	td->rw = recwriter_start(&def);
+	if (td->rw == NULL)
+		goto close_file;
+	recwriter_set_active(td->rw, 1);
+
+	return (td);
+
+close_file:
+	td_closefile(td);
+close_handle:
+	pcap_close(td->p_handle);
+free_td:
+	JDEBUG_MEMORY(JDBG_FREE, td);
+	free(td);
+	return (NULL);
+}
+
+
+/*
+ * Finish writing the packets queued to the current file, close it and carry
+ * on with path, if any. PROC may keep pushing packets meanwhile.
+ */
+int
+tracedump_rotate(struct tracedump *td, const char *path)
+{
+	int err;
+
+	JDEBUG
+
+	err = 0;
+	recwriter_lock(td->rw);
+	recwriter_drain(td->rw);
+	recwriter_set_active(td->rw, 0);
+	td_closefile(td);
+	if (path && strlen(path) > 0)
+		err = td_openfile(td, path);
+	recwriter_set_active(td->rw, td->dumper != NULL);
+	recwriter_unlock(td->rw);
+
+	return (err);
+}
+
+
+/*
+ * Stop the writer thread, once all packets queued have been written out.
+ * PROC must not push packets anymore.
+ */
+void
+tracedump_close(struct tracedump *td)
+{
+	JDEBUG
+
+	recwriter_stop(td->rw);
+	td_closefile(td);
+	pcap_close(td->p_handle);
+
+	JDEBUG_MEMORY(JDBG_FREE, td);
+	free(td);
+}
+
+
+/* Get the file flushed as soon as possible, safe from a signal handler */
+void
+tracedump_flush_request(struct tracedump *td)
+{
+	recwriter_flush_request(td->rw);
+}
+
+
+/* Is there a file to write packets to? */
+int
+tracedump_active(struct tracedump *td)
+{
+	return (recwriter_active(td->rw));
+}
+
+
+/*
+ * Producer side, see recwriter_reserve() and recwriter_publish(). Packets are
+ * dropped when the ring is full.
+ */
+struct tracedump_rec *
+tracedump_reserve(struct tracedump *td)
+{
+	return ((struct tracedump_rec *) recwriter_reserve(td->rw));
+}
+
+void
+tracedump_publish(struct tracedump *td)
+{
+	recwriter_publish(td->rw);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TRACEDUMP_H
+#define _TRACEDUMP_H
+
+
+/*
+ * Raw pcap trace dump (-w option).
+ * PROC hands packets over to a writer thread through a recwriter ring (see
+ * recwriter.h), and never waits on the dump: packets are dropped when the ring
+ * is full. The file is flushed on request too.
+ * Needs create_stamp.h for the record size.
+ */
+#define TRACEDUMP_QUEUE_SIZE	1024		/* Number of records, power of 2 */
+#define TRACEDUMP_BATCH			64			/* Records pending to wake the writer */
+#define TRACEDUMP_FLUSH_BYTES	(1 << 16)	/* Also the size of the file buffer */
+#define TRACEDUMP_FLUSH_MS		1000
+
+/* A packet with its Linux SLL header, as written out */
+struct tracedump_rec {
+	struct pcap_pkthdr hdr;
+	u_char frame[BPF_PACKET_SIZE + sizeof(linux_sll_header_t)];
+};
+
+struct tracedump;
+
+
+/* Writer side, called from the main thread */
+struct tracedump *tracedump_open(const char *path);
+int tracedump_rotate(struct tracedump *td, const char *path);
+void tracedump_close(struct tracedump *td);
+void tracedump_flush_request(struct tracedump *td);
+
+/* Producer side, called from PROC */
+int tracedump_active(struct tracedump *td);
+struct tracedump_rec *tracedump_reserve(struct tracedump *td);
+void tracedump_publish(struct tracedump *td);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * Micro-benchmark of the synchronization algorithm. Stamps are loaded from
+ * Stratum1Stamps.dat (or the stamp file given) and fed to RADalgo_bidir
+ * directly, with no daemon thread around, for several poll_period and
+ * SKM_SCALE settings. sync_bidir.c is built with ALGO_PROFILE, which times
+ * each sub-algo.
+ *
+ * Output is one line per setting, fields separated by spaces, after a '%'
+ * commented header naming them:
+ *   poll_period skm_scale stamps/s mean and p99 [ns] per stamp
+ *   then [ns] per stamp in each sub-algo
+ * Every round must give the same clock, bit for bit, or the test fails.
+ *
+ * usage: bench_algo [stampfile [rounds]]
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <pcap.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_thetahat.h"
+#include "sync_algo.h"
+#include "config_mgr.h"
+
+#define ROUNDS		5
+
+static const int poll_periods[] = { 1, 16, 64 };
+static const double skm_scales[] = { SKM_SCALE_POOR, SKM_SCALE_GOOD,
+		4 * SKM_SCALE_GOOD };
+
+static const char *prof_names[ALGO_PROF_MAX] = {
+	"window", "RTT", "OWDAsym", "phat", "plocal", "thetahat", "pathpenalty"
+};
+
+struct result {
+	double stamps_per_s;
+	double mean_ns;
+	double p99_ns;
+	double prof_ns[ALGO_PROF_MAX];
+};
+
+
+/* The algo logs through the daemon verbose(), keep quiet */
+void
+verbose(int facility, const char *format, ...)
+{
+}
+
+
+/* Server 0 stamps of a stamp file, as the ascii replay reads them */
+static long
+load_stamps(const char *path, struct bidir_stamp **stamps)
+{
+	struct bidir_stamp st;
+	unsigned long long Ta, Tf, id;
+	char line[1024];
+	long n, size;
+	int sID;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+	n = 0;
+	size = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		sID = 0;
+		if (line[0] == '%' || sscanf(line, "%llu %Lf %Lf %llu %llu %d", &Ta,
+				&st.Tb, &st.Te, &Tf, &id, &sID) < 4 || sID != 0)
+			continue;
+		st.Ta = Ta;
+		st.Tf = Tf;
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			*stamps = realloc(*stamps, size * sizeof(struct bidir_stamp));
+			if (*stamps == NULL)
+				return (-1);
+		}
+		(*stamps)[n++] = st;
+	}
+	fclose(fp);
+	return (n);
+}
+
+
+static void
+free_state(struct bidir_algostate *state)
+{
+	history_free(&state->stamp_hist);
+	history_free(&state->Tf_hist);
+	history_free(&state->Df_hist);
+	history_free(&state->Db_hist);
+	history_free(&state->Dfhat_hist);
+	history_free(&state->Dbhat_hist);
+	history_free(&state->Asymhat_hist);
+	history_free(&state->RTT_hist);
+	history_free(&state->RTThat_hist);
+	history_free(&state->thnaive_hist);
+	history_minwin_free(&state->RTT_shift_mw);
+	history_minwin_free(&state->RTT_near_mw);
+	history_minwin_free(&state->RTT_far_mw);
+	history_minwin_free(&state->Df_shift_mw);
+	history_minwin_free(&state->Db_shift_mw);
+	if (state->thwin != NULL) {
+		thwin_free(state->thwin);
+		free(state->thwin);
+	}
+}
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+
+/*
+ * Run all stamps through a fresh algo, rounds times. Returns 1 if the rounds
+ * don't agree.
+ */
+static int
+bench(struct radclock_handle *handle, struct bidir_stamp *stamps, long n,
+		int rounds, struct result *res)
+{
+	struct bidir_algostate state;
+	struct bidir_algooutput output, first;
+	struct radclock_data rad_data;
+	struct radclock_error rad_error;
+	struct bidir_stamp stamp;
+	uint64_t *ns, t, total;
+	long i, k;
+	int r, j;
+
+	ns = malloc(rounds * n * sizeof(uint64_t));
+	if (ns == NULL)
+		return (1);
+	memset(algo_prof_ns, 0, sizeof(algo_prof_ns));
+	memset(&first, 0, sizeof(first));
+
+	total = 0;
+	for (r = 0, k = 0; r < rounds; r++) {
+		memset(&state, 0, sizeof(state));
+		state.stamp_i = -1;
+		memset(&output, 0, sizeof(output));
+		memset(&rad_data, 0, sizeof(rad_data));
+		memset(&rad_error, 0, sizeof(rad_error));
+		for (i = 0; i < n; i++, k++) {
+			stamp = stamps[i];
+			t = now_ns();
+			RADalgo_bidir(handle, &state, &stamp, 0, &rad_data, &rad_error,
+					&output);
+			ns[k] = now_ns() - t;
+			total += ns[k];
+		}
+		free_state(&state);
+
+		if (r == 0)
+			first = output;
+		else if (output.phat != first.phat || output.plocal != first.plocal ||
+				output.thetahat != first.thetahat || output.K != first.K ||
+				output.RTThat != first.RTThat ||
+				output.pathpenalty != first.pathpenalty) {
+			free(ns);
+			return (1);
+		}
+	}
+
+	qsort(ns, k, sizeof(uint64_t), cmp_u64);
+	res->stamps_per_s = k / (total * 1e-9);
+	res->mean_ns = (double)total / k;
+	res->p99_ns = ns[(k * 99) / 100];
+	for (j = 0; j < ALGO_PROF_MAX; j++)
+		res->prof_ns[j] = (double)algo_prof_ns[j] / k;
+	free(ns);
+	return (0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock_handle *handle;
+	struct radclock_config *conf;
+	struct bidir_stamp *stamps;
+	struct result res;
+	char path[1024];
+	const char *srcdir;
+	long n;
+	int rounds, p, s, j;
+
+	if (argc > 1)
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	else {
+		srcdir = getenv("srcdir");
+		snprintf(path, sizeof(path), "%s/Stratum1Stamps.dat", srcdir ? srcdir : ".");
+	}
+	rounds = argc > 2 ? atoi(argv[2]) : ROUNDS;
+	if (rounds < 1)
+		rounds = 1;
+
+	stamps = NULL;
+	n = load_stamps(path, &stamps);
+	if (n < 1) {
+		fprintf(stdout, "FAIL cannot load stamps from %s\n", path);
+		return (1);
+	}
+
+	handle = calloc(1, sizeof(struct radclock_handle));
+	conf = calloc(1, sizeof(struct radclock_config));
+	config_init(conf);
+	handle->conf = conf;
+	pthread_mutex_init(&handle->globaldata_mutex, NULL);
+
+	fprintf(stdout, "%% bench_algo: %s, %ld stamps, %d rounds, thetahat kernel %s\n",
+			path, n, rounds, thwin_kernel_name());
+	fprintf(stdout, "%% poll_period skm_scale stamps/s mean_ns p99_ns");
+	for (j = 0; j < ALGO_PROF_MAX; j++)
+		fprintf(stdout, " %s_ns", prof_names[j]);
+	fprintf(stdout, "\n");
+
+	for (p = 0; p < sizeof(poll_periods) / sizeof(poll_periods[0]); p++)
+	for (s = 0; s < sizeof(skm_scales) / sizeof(skm_scales[0]); s++) {
+		conf->poll_period = poll_periods[p];
+		conf->metaparam.SKM_SCALE = skm_scales[s];
+		if (bench(handle, stamps, n, rounds, &res)) {
+			fprintf(stdout, "FAIL rounds differ, poll_period %d skm_scale %g\n",
+					poll_periods[p], skm_scales[s]);
+			return (1);
+		}
+		fprintf(stdout, "%d %g %.0f %.1f %.1f", poll_periods[p], skm_scales[s],
+				res.stamps_per_s, res.mean_ns, res.p99_ns);
+		for (j = 0; j < ALGO_PROF_MAX; j++)
+			fprintf(stdout, " %.1f", res.prof_ns[j]);
+		fprintf(stdout, "\n");
+	}
+
+	pthread_mutex_destroy(&handle->globaldata_mutex);
+	free(conf->time_server);
+	free(conf);
+	free(handle);
+	free(stamps);
+	return (0);
+}
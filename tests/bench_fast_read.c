@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Micro-benchmark of the inline fast read (libradclock/radclock_fast.h)
+ * against radclock_gettime, in ns per call.
+ *
+ * The SMS is set up on a private key (sms_fixture.h) and published with
+ * sms_write, with a clock running off the TSC, so no daemon is needed. The
+ * fast conversion is first checked against radclock_vcount_to_abstime over
+ * counter values either side of the last update and of an expected leap
+ * second, with and without the local period.
+ *
+ * Needs a TSC on x86_64, exits with the automake skip code otherwise.
+ *
+ * Usage: bench_fast_read [calls]
+ */
+
+#include "../config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "radclock.h"
+#include "radclock_fast.h"
+#include "radclock-private.h"
+#include "sms_fixture.h"
+
+
+#ifndef RADCLOCK_FAST_SUPPORTED
+int
+main(int argc, char **argv)
+{
+	fprintf(stdout, "Fast read not supported on this platform, skipping\n");
+	return (SMS_FIXTURE_SKIP);
+}
+#else
+
+static int
+bench_get_vcounter(struct radclock *clock, vcounter_t *vcount)
+{
+	*vcount = radclock_fast_readtsc();
+	return (0);
+}
+
+
+/* Publish a clock on the TSC, nominal 3GHz, set to the system clock */
+static void
+publish(struct radclock *clock, vcounter_t tsc)
+{
+	struct radclock_data rd;
+	struct radclock_error re;
+
+	sms_fixture_data(&rd, &re, SMS_FIXTURE_FREQ, tsc, sms_fixture_now());
+	sms_write(clock, &rd, &re);
+}
+
+
+/* Largest difference [s] between the two conversions */
+static double
+check(struct radclock *clock, struct radclock_fast *fast, vcounter_t tsc,
+		int n, vcounter_t step)
+{
+	long double ld, fd;
+	vcounter_t vcount;
+	int64_t sec;
+	uint64_t frac;
+	double diff, maxdiff = 0;
+	int i;
+
+	if (radclock_fast_refresh(fast))
+		return (1);
+	for (i = 0; i < n; i++) {
+		vcount = tsc - n / 4 * step + i * step;
+		radclock_vcount_to_abstime(clock, &vcount, &ld);
+		radclock_fast_vcount_to_bintime(fast, vcount, &sec, &frac);
+		fd = sec + frac / 18446744073709551616.0L;
+		diff = (double) (fd > ld ? fd - ld : ld - fd);
+		if (diff > maxdiff)
+			maxdiff = diff;
+	}
+	return (maxdiff);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock *clock;
+	struct radclock_sms *sms;
+	struct radclock_fast fast;
+	radclock_local_period_t mode;
+	struct timespec ts;
+	long double abstime;
+	vcounter_t tsc;
+	double t, ns_lib, ns_fast, diff_p, diff_pl;
+	long sink = 0;
+	int i, n;
+
+	n = (argc > 1) ? atoi(argv[1]) : 2000000;
+	if (n < 1) {
+		fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+		return (1);
+	}
+
+	clock = sms_fixture_create();
+	if (clock == NULL)
+		return (SMS_FIXTURE_SKIP);
+	sms = (struct radclock_sms *) clock->ipc_sms;
+	clock->get_vcounter = bench_get_vcounter;
+	strcpy(clock->hw_counter, "tsc");
+
+	memset(&ts, 0, sizeof(ts));
+	tsc = radclock_fast_readtsc();
+	publish(clock, tsc);
+	if (radclock_fast_init(clock, &fast))
+		return (1);
+
+	/* Conversion accuracy from 250s before the update to 750s after. The
+	 * local period path of the library is noisy on stdout, sample it less. */
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+	diff_p = check(clock, &fast, tsc, 2000, (vcounter_t) (0.5 * 3e9));
+	mode = RADCLOCK_LOCAL_PERIOD_ON;
+	radclock_set_local_period_mode(clock, &mode);
+	diff_pl = check(clock, &fast, tsc, 8, (vcounter_t) (2.5 * 3e9));
+	fprintf(stdout, "Max difference to long double: %.3g [s] (phat), %.3g [s] (plocal)\n",
+			diff_p, diff_pl);
+
+	/* Timing without the library plocal fprintf */
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+	radclock_fast_refresh(&fast);
+
+	t = sms_fixture_now();
+	for (i = 0; i < n; i++) {
+		radclock_gettime(clock, &abstime);
+		sink += (long) abstime;
+	}
+	ns_lib = (sms_fixture_now() - t) * 1e9 / n;
+
+	t = sms_fixture_now();
+	for (i = 0; i < n; i++) {
+		radclock_fast_gettime(&fast, &ts);
+		sink += ts.tv_nsec;
+	}
+	ns_fast = (sms_fixture_now() - t) * 1e9 / n;
+
+	fprintf(stdout, "radclock_gettime:      %6.1f ns/call\n", ns_lib);
+	fprintf(stdout, "radclock_fast_gettime: %6.1f ns/call (x%.1f)\n", ns_fast,
+			ns_lib / ns_fast);
+
+	/* A new update is picked up */
+	publish(clock, radclock_fast_readtsc());
+	if (radclock_fast_gettime(&fast, &ts) == 1 ||
+			fast.seq_seen != __atomic_load_n(&sms->v2.seq, __ATOMIC_RELAXED)) {
+		fprintf(stderr, "Fast read did not refresh after update\n");
+		return (1);
+	}
+
+	radclock_destroy(clock);
+
+	if (sink == 42)
+		fprintf(stdout, "\n");
+	return (diff_p > 1e-9 || diff_pl > 1e-9);
+}
+
+#endif	/* RADCLOCK_FAST_SUPPORTED */
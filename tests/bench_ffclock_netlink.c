@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Micro-benchmark of FFdata reads from the kernel, over the persistent netlink
+ * channel opened by init_kernel_clock, against one-shot sockets allocated and
+ * connected on each call (the behaviour once the channel is closed).
+ * Only reads are timed, so that running it does not disturb the kernel clock.
+ * Both paths must return the same FFdata when the clock is not being updated.
+ *
+ * Needs a Linux kernel with FFclock support, exits with the automake skip
+ * code otherwise.
+ *
+ * Usage: bench_ffclock_netlink [calls]
+ */
+
+#include "../config.h"
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "kclock.h"
+
+#define SKIP	77
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+
+static double
+bench_get(struct radclock *clock, int n, struct ffclock_data *cdat)
+{
+	double t;
+	int i;
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		if (get_kernel_ffclock(clock, cdat))
+			return (-1);
+	}
+	return (n / (now() - t));
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock *clock;
+	struct ffclock_data cdat_chan, cdat_oneshot;
+	double rate_chan, rate_oneshot;
+	int n;
+
+	n = (argc > 1) ? atoi(argv[1]) : 20000;
+	if (n < 1) {
+		fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+		return (1);
+	}
+
+	clock = radclock_create();
+	if (clock == NULL)
+		return (1);
+
+	clock->kernel_version = found_ffwd_kernel_version();
+	if (clock->kernel_version < 2 || init_kernel_clock(clock)) {
+		fprintf(stdout, "No FFclock netlink support in this kernel, skipping\n");
+		radclock_destroy(clock);
+		return (SKIP);
+	}
+
+	memset(&cdat_chan, 0, sizeof(cdat_chan));
+	memset(&cdat_oneshot, 0, sizeof(cdat_oneshot));
+
+	rate_chan = bench_get(clock, n, &cdat_chan);
+	close_kernel_clock(clock);
+	rate_oneshot = bench_get(clock, n, &cdat_oneshot);
+
+	if (rate_chan < 0 || rate_oneshot < 0) {
+		fprintf(stderr, "FFdata read failed\n");
+		radclock_destroy(clock);
+		return (1);
+	}
+
+	fprintf(stdout, "One-shot sockets:   %10.0f calls/sec\n", rate_oneshot);
+	fprintf(stdout, "Persistent channel: %10.0f calls/sec (x%.2f)\n", rate_chan,
+			rate_chan / rate_oneshot);
+
+	/* Same data through both paths, unless a daemon updated it in between */
+	if (memcmp(&cdat_chan, &cdat_oneshot, sizeof(cdat_chan)) != 0 &&
+			cdat_chan.update_ffcount == cdat_oneshot.update_ffcount) {
+		fprintf(stderr, "FFdata differs between persistent and one-shot reads\n");
+		radclock_destroy(clock);
+		return (1);
+	}
+
+	radclock_destroy(clock);
+	return (0);
+}
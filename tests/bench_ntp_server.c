@@ -0,0 +1,609 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Load test of the daemon's NTP server (radclock/pthread_ntpserver.c).
+ *
+ * The server threads run in process on a loopback port, answering from a
+ * synchronised clock counting CLOCK_MONOTONIC nanoseconds, so that the rec
+ * and xmt timestamps of responses can be checked against the client side.
+ * Each client thread keeps a window of requests in flight. The requests
+ * answered per second, the server CPU time per request and the round trip
+ * latency distribution are reported for one and several server threads, one
+ * line per run, with the rate limiter off.
+ * Every response is checked against its request, the server counters against
+ * the requests, and stopping the server must be immediate.
+ * A last run sends a burst over a low rate limit, which must be answered up to
+ * the burst size, then with a single RATE Kiss-o'-Death, plus the tokens and
+ * KoD the run may have been given over its duration.
+ *
+ * Exits with the automake skip code if loopback UDP is not available.
+ *
+ * Usage: bench_ntp_server [seconds [clients]]
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "pthread_mgr.h"
+#include "proto_ntp.h"
+#include "misc.h"
+#include "config_mgr.h"
+
+#define SKIP		77
+#define WINDOW		16		// requests in flight per client
+#define TIMEOUT_MS	200		// outstanding requests are lost after this
+#define MAX_CLIENTS	64
+
+#define ROOTDELAY	0.001
+#define MINRTT		0.0002
+#define ROOTDISP	0.0005
+#define ERRBOUND	1e-5
+
+#define LIMIT_RATE	10.0
+#define LIMIT_BURST	5
+#define LIMIT_SENT	50
+#define LIMIT_THREADS	4
+#define LIMIT_PORTS	8		// source ports of the limited client
+
+static uint64_t last_changed;	// counter of the server clock update
+
+
+/* The server logs through the daemon verbose(), keep errors only */
+void
+verbose(int facility, const char *format, ...)
+{
+	va_list ap;
+
+	if (facility != LOG_ERR)
+		return;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+int
+get_verbose_level(void)
+{
+	return (0);
+}
+
+void
+init_thread_signal_mgt(void)
+{
+}
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static uint64_t
+cpu_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+bench_get_vcounter(struct radclock *clock, vcounter_t *vcount)
+{
+	*vcount = now_ns();
+	return (0);
+}
+
+
+struct client {
+	pthread_t thread;
+	int id;
+	uint16_t port;
+	uint64_t deadline;
+
+	uint64_t sent[WINDOW];		// send time of the request in each slot
+	uint32_t seq[WINDOW];		// its sequence number, 0 if the slot is free
+	uint32_t next;
+
+	uint64_t *lat;				// round trip times [ns]
+	size_t nlat, maxlat;
+	uint64_t cpu;				// CPU time used by the client [ns]
+	unsigned long lost, bad;
+};
+
+
+static int
+send_request(struct client *c, int s, int slot)
+{
+	struct ntp_pkt pkt;
+
+	memset(&pkt, 0, LEN_PKT_NOMAC);
+	pkt.li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING, NTP_VERSION, MODE_CLIENT);
+	pkt.ppoll = 4;
+	/* The nonce identifies the client and the request, and gives its slot */
+	c->seq[slot] = ++c->next * WINDOW + slot;
+	pkt.xmt.l_int = htonl(c->id);
+	pkt.xmt.l_fra = htonl(c->seq[slot]);
+	c->sent[slot] = now_ns();
+	return (send(s, &pkt, LEN_PKT_NOMAC, 0) == LEN_PKT_NOMAC ? 0 : -1);
+}
+
+
+/* Returns the request slot answered, or -1 if the response is wrong */
+static int
+check_response(struct client *c, struct ntp_pkt *pkt, int len, uint64_t t_recv)
+{
+	uint32_t seq, disp, disp0;
+	long double rec, xmt;
+	int slot;
+
+	if (len != LEN_PKT_NOMAC || PKT_MODE(pkt->li_vn_mode) != MODE_SERVER ||
+			PKT_LEAP(pkt->li_vn_mode) != LEAP_NOWARNING || pkt->stratum != 2 ||
+			pkt->ppoll != 4 || pkt->refid != inet_addr("10.0.0.1") ||
+			ntohl(pkt->rootdelay) != (uint32_t)((ROOTDELAY + MINRTT) * 65536. + 0.5))
+		return (-1);
+
+	seq = ntohl(pkt->org.l_fra);
+	slot = seq % WINDOW;
+	if (ntohl(pkt->org.l_int) != (uint32_t)c->id || c->seq[slot] != seq)
+		return (-1);
+
+	/* The server clock is CLOCK_MONOTONIC, rec and xmt are within the round
+	 * trip, to the rounding of the NTP format */
+	rec = NTPtime_to_UTCld(pkt->rec);
+	xmt = NTPtime_to_UTCld(pkt->xmt);
+	if (rec < c->sent[slot] * 1e-9L - 1e-9L || xmt < rec ||
+			xmt > t_recv * 1e-9L + 1e-9L)
+		return (-1);
+
+	/* Dispersion grows at 15 PPM from the clock update */
+	disp = ntohl(pkt->rootdispersion);
+	disp0 = (uint32_t)((ROOTDISP + ERRBOUND + 1e-9) * 65536. + 0.5);
+	if (disp < disp0 ||
+			disp > disp0 + 1 + (t_recv - last_changed) * 1e-9 * 15e-6 * 65536.)
+		return (-1);
+	return (slot);
+}
+
+
+static void *
+client_run(void *arg)
+{
+	struct client *c = (struct client *) arg;
+	struct sockaddr_in sin;
+	struct pollfd pfd;
+	union {
+		struct ntp_pkt pkt;
+		char buf[NTP_PKT_MAX_LEN];
+	} in;
+	uint64_t t;
+	int s, i, n, slot, outstanding;
+
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(c->port);
+	if (s < 0 || connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		c->bad++;
+		return (NULL);
+	}
+
+	outstanding = 0;
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (now_ns() < c->deadline) {
+		/* Refill the window, anything still in flight is lost */
+		if (outstanding == 0) {
+			for (i = 0; i < WINDOW; i++) {
+				if (c->seq[i])
+					c->lost++;
+				if (send_request(c, s, i) == 0)
+					outstanding++;
+				else
+					c->seq[i] = 0;
+			}
+		}
+
+		if (poll(&pfd, 1, TIMEOUT_MS) <= 0) {
+			outstanding = 0;
+			continue;
+		}
+		while ((n = recv(s, in.buf, sizeof(in.buf), MSG_DONTWAIT)) >= 0) {
+			t = now_ns();
+			slot = check_response(c, &in.pkt, n, t);
+			if (slot < 0) {
+				c->bad++;
+				continue;
+			}
+			if (c->nlat == c->maxlat) {
+				c->maxlat = c->maxlat ? 2 * c->maxlat : 65536;
+				c->lat = realloc(c->lat, c->maxlat * sizeof(uint64_t));
+				if (c->lat == NULL) {
+					c->bad++;
+					close(s);
+					return (NULL);
+				}
+			}
+			c->lat[c->nlat++] = t - c->sent[slot];
+			c->seq[slot] = 0;
+			outstanding--;
+			if (send_request(c, s, slot) == 0)
+				outstanding++;
+			else
+				c->seq[slot] = 0;
+		}
+	}
+	c->cpu = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+	close(s);
+	return (NULL);
+}
+
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+
+/* Free UDP port on the loopback, 0 if there is none */
+static uint16_t
+free_port(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	int s;
+
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s < 0)
+		return (0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+			getsockname(s, (struct sockaddr *)&sin, &len) < 0)
+		sin.sin_port = 0;
+	close(s);
+	return (ntohs(sin.sin_port));
+}
+
+
+static int
+start_server(struct radclock_handle *handle, int nthreads, pthread_t *server)
+{
+	handle->conf->ntp_server_threads = nthreads;
+	handle->conf->ntp_downstream_port = free_port();
+	handle->pthread_flag_stop = 0;
+	if (handle->conf->ntp_downstream_port == 0 ||
+			pthread_create(server, NULL, thread_ntp_server, handle))
+		return (SKIP);
+	usleep(100000);		// let the server bind
+	return (0);
+}
+
+/* Returns the time taken to stop [ns] */
+static uint64_t
+stop_server(struct radclock_handle *handle, pthread_t server)
+{
+	uint64_t t_stop;
+
+	t_stop = now_ns();
+	handle->pthread_flag_stop |= PTH_NTP_SERV_STOP;
+	ntpserv_wakeup(handle);
+	pthread_join(server, NULL);
+	return (now_ns() - t_stop);
+}
+
+
+static int
+run(struct radclock_handle *handle, int nthreads, int nclients, double seconds)
+{
+	struct client clients[MAX_CLIENTS];
+	struct ntpserv_stats st0, st1;
+	pthread_t server;
+	uint64_t *lat, t0, t1, t_stop, cpu;
+	unsigned long lost, bad;
+	size_t nlat, i;
+	int c, err;
+
+	handle->conf->ntp_server_rate = 0;
+	ntpserv_get_stats(handle, &st0);
+	if (start_server(handle, nthreads, &server))
+		return (SKIP);
+
+	memset(clients, 0, sizeof(clients));
+	cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+	t0 = now_ns();
+	for (c = 0; c < nclients; c++) {
+		clients[c].id = c + 1;
+		clients[c].port = handle->conf->ntp_downstream_port;
+		clients[c].deadline = t0 + (uint64_t)(seconds * 1e9);
+		pthread_create(&clients[c].thread, NULL, client_run, &clients[c]);
+	}
+	nlat = 0;
+	for (c = 0; c < nclients; c++) {
+		pthread_join(clients[c].thread, NULL);
+		nlat += clients[c].nlat;
+	}
+	t1 = now_ns();
+	cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+	/* Stopping must not wait on a receive timeout */
+	t_stop = stop_server(handle, server);
+	ntpserv_get_stats(handle, &st1);
+
+	lat = malloc((nlat + 1) * sizeof(uint64_t));
+	if (lat == NULL)
+		return (1);
+	nlat = 0;
+	lost = bad = 0;
+	for (c = 0; c < nclients; c++) {
+		for (i = 0; i < clients[c].nlat; i++)
+			lat[nlat++] = clients[c].lat[i];
+		lost += clients[c].lost;
+		bad += clients[c].bad;
+		cpu -= clients[c].cpu;
+		free(clients[c].lat);
+	}
+	if (nlat == 0) {
+		fprintf(stdout, "No response from the server\n");
+		free(lat);
+		return (1);
+	}
+	qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+
+	fprintf(stdout, "%d %d %.0f %.2f %.1f %.1f %.1f %.1f %lu %lu %.1f\n",
+			nthreads, nclients, nlat / ((t1 - t0) * 1e-9), cpu * 1e-3 / nlat,
+			lat[nlat / 2] * 1e-3, lat[nlat * 9 / 10] * 1e-3,
+			lat[nlat * 99 / 100] * 1e-3, lat[nlat - 1] * 1e-3,
+			lost, bad, t_stop * 1e-6);
+	free(lat);
+
+	err = 0;
+	if (bad) {
+		fprintf(stdout, "%lu wrong responses\n", bad);
+		err = 1;
+	}
+	if (lost * 100 > nlat) {
+		fprintf(stdout, "%lu requests lost\n", lost);
+		err = 1;
+	}
+	if (t_stop > 500000000) {
+		fprintf(stdout, "Server took %.0f ms to stop\n", t_stop * 1e-6);
+		err = 1;
+	}
+	if (st1.answered - st0.answered != st1.requests - st0.requests ||
+			st1.requests - st0.requests < nlat || st1.kod != st0.kod ||
+			st1.dropped != st0.dropped || st1.ignored != st0.ignored) {
+		fprintf(stdout, "Server counters do not match the requests\n");
+		err = 1;
+	}
+	return (err);
+}
+
+
+/* KoD answering request seq, as sent by check_limit() */
+static int
+is_kod(struct ntp_pkt *pkt, int len, uint32_t *seq)
+{
+	if (len != LEN_PKT_NOMAC || PKT_MODE(pkt->li_vn_mode) != MODE_SERVER ||
+			PKT_LEAP(pkt->li_vn_mode) != LEAP_NOTINSYNC || pkt->stratum != 0 ||
+			pkt->ppoll < NTP_MINPOLL || memcmp(&pkt->refid, "RATE", 4) != 0 ||
+			memcmp(&pkt->org, &pkt->rec, sizeof(l_fp)) != 0 ||
+			memcmp(&pkt->org, &pkt->xmt, sizeof(l_fp)) != 0)
+		return (0);
+	*seq = ntohl(pkt->org.l_fra);
+	return (1);
+}
+
+
+/*
+ * A burst of requests from a single client, well over the burst size. The
+ * first ones are answered with the time, the next one with a KoD, the others
+ * are dropped. The client sends from several ports, which the kernel spreads
+ * over the server threads, and still gets the limit only once.
+ */
+static int
+check_limit(struct radclock_handle *handle)
+{
+	struct client c;
+	struct ntpserv_stats st0, st1;
+	struct sockaddr_in sin;
+	struct pollfd pfd[LIMIT_PORTS];
+	union {
+		struct ntp_pkt pkt;
+		char buf[NTP_PKT_MAX_LEN];
+	} in;
+	pthread_t server;
+	uint64_t t0, t_last;
+	uint32_t seq;
+	unsigned long answered, kod, bad, extra, extra_kod;
+	int i, n;
+
+	handle->conf->ntp_server_rate = LIMIT_RATE;
+	handle->conf->ntp_server_burst = LIMIT_BURST;
+	handle->conf->ntp_server_kod = BOOL_ON;
+	ntpserv_get_stats(handle, &st0);
+	if (start_server(handle, LIMIT_THREADS, &server))
+		return (SKIP);
+
+	memset(&c, 0, sizeof(c));
+	c.id = MAX_CLIENTS + 1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(handle->conf->ntp_downstream_port);
+	for (i = 0; i < LIMIT_PORTS; i++) {
+		pfd[i].fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		pfd[i].events = POLLIN;
+		if (pfd[i].fd < 0 || connect(pfd[i].fd, (struct sockaddr *)&sin,
+				sizeof(sin)) < 0) {
+			while (i >= 0)
+				close(pfd[i--].fd);
+			stop_server(handle, server);
+			return (SKIP);
+		}
+	}
+
+	/* Requests are tracked in their slot of the window, a response checked
+	 * against the last request sent in the slot */
+	answered = kod = bad = 0;
+	t0 = t_last = now_ns();
+	for (i = 0; i < LIMIT_SENT; i++)
+		send_request(&c, pfd[i % LIMIT_PORTS].fd, i % WINDOW);
+	while (poll(pfd, LIMIT_PORTS, TIMEOUT_MS) > 0) {
+		for (i = 0; i < LIMIT_PORTS; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			n = recv(pfd[i].fd, in.buf, sizeof(in.buf), 0);
+			t_last = now_ns();
+			if (is_kod(&in.pkt, n, &seq) &&
+					ntohl(in.pkt.org.l_int) == (uint32_t)c.id)
+				kod++;
+			else if (n == LEN_PKT_NOMAC && in.pkt.stratum == 2 &&
+					ntohl(in.pkt.org.l_int) == (uint32_t)c.id)
+				answered++;
+			else
+				bad++;
+		}
+	}
+	for (i = 0; i < LIMIT_PORTS; i++)
+		close(pfd[i].fd);
+	stop_server(handle, server);
+	ntpserv_get_stats(handle, &st1);
+
+	fprintf(stdout, "%% rate limit %.0f/s burst %d, %d threads: %d sent from %d "
+			"ports, %lu answered, %lu KoD, %llu dropped\n", LIMIT_RATE,
+			LIMIT_BURST, LIMIT_THREADS, LIMIT_SENT, LIMIT_PORTS, answered, kod,
+			(unsigned long long) (st1.dropped - st0.dropped));
+
+	/* Requests were charged before their response came back. The bucket
+	 * refills during the run, and a KoD can be sent again every second. */
+	extra = (unsigned long) ((t_last - t0) * 1e-9 * LIMIT_RATE) + 1;
+	extra_kod = (unsigned long) ((t_last - t0) / 1000000000);
+	if (bad || answered < LIMIT_BURST || answered > LIMIT_BURST + extra ||
+			kod < 1 || kod > 1 + extra_kod) {
+		fprintf(stdout, "Expected %d answers and a KoD, up to %lu answers and "
+				"%lu KoD over %.0f ms\n", LIMIT_BURST, LIMIT_BURST + extra,
+				1 + extra_kod, (t_last - t0) * 1e-6);
+		return (1);
+	}
+	if (st1.requests - st0.requests != LIMIT_SENT ||
+			st1.answered - st0.answered != answered || st1.kod - st0.kod != kod ||
+			st1.dropped - st0.dropped != LIMIT_SENT - answered - kod) {
+		fprintf(stdout, "Server counters do not match the requests\n");
+		return (1);
+	}
+	return (0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock_handle *handle;
+	struct radclock_config *conf;
+	double seconds;
+	int nclients, nthreads, err;
+
+	seconds = (argc > 1) ? atof(argv[1]) : 1;
+	nclients = (argc > 2) ? atoi(argv[2]) : 4;
+	if (seconds <= 0 || nclients < 1 || nclients > MAX_CLIENTS) {
+		fprintf(stderr, "Usage: %s [seconds [clients]]\n", argv[0]);
+		return (1);
+	}
+
+	handle = calloc(1, sizeof(struct radclock_handle));
+	conf = calloc(1, sizeof(struct radclock_config));
+	if (handle == NULL || conf == NULL)
+		return (1);
+	handle->conf = conf;
+	handle->clock = radclock_create();
+	if (handle->clock == NULL)
+		return (1);
+	handle->clock->get_vcounter = bench_get_vcounter;
+
+	/* A synchronised stratum 2 server, with a 1ns counter and no offset */
+	handle->nservers = 1;
+	handle->pref_sID = 0;
+	handle->rad_data = calloc(1, sizeof(struct radclock_data));
+	handle->rad_error = calloc(1, sizeof(struct radclock_error));
+	handle->ntp_server = calloc(1, sizeof(struct radclock_ntp_server));
+	handle->ntp_client = calloc(1, sizeof(struct radclock_ntp_client));
+	if (!handle->rad_data || !handle->rad_error || !handle->ntp_server ||
+			!handle->ntp_client)
+		return (1);
+	RAD_DATA(handle)->phat = 1e-9;
+	RAD_DATA(handle)->phat_local = 1e-9;
+	last_changed = now_ns();
+	RAD_DATA(handle)->last_changed = last_changed;
+	RAD_ERROR(handle)->error_bound_avg = ERRBOUND;
+	NTP_SERVER(handle)->stratum = 1;
+	NTP_SERVER(handle)->rootdelay = ROOTDELAY;
+	NTP_SERVER(handle)->minRTT = MINRTT;
+	NTP_SERVER(handle)->rootdispersion = ROOTDISP;
+	NTP_CLIENT(handle)->s_to.sin_addr.s_addr = inet_addr("10.0.0.1");
+	if (init_ntpserv(handle))
+		return (1);
+
+	fprintf(stdout, "%% server_threads clients req/s srv_cpu_us p50_us p90_us "
+			"p99_us max_us lost bad stop_ms\n");
+	err = 0;
+	for (nthreads = 1; nthreads <= 4 && err == 0; nthreads *= 4)
+		err = run(handle, nthreads, nclients, seconds);
+	if (err == 0)
+		err = check_limit(handle);
+
+	destroy_ntpserv(handle);
+	return (err);
+}
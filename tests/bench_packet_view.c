@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Micro-benchmark of the live packet path into the stamp queue, through
+ * update_stamp_queue() (radclock/create_stamp.c).
+ *
+ * A stream of NTP client requests and server replies is laid out in raw data
+ * slots, as the capture side leaves them. The packets are then handed over to
+ * update_stamp_queue() in place, as get_network_stamp() does now, and through
+ * the former path kept below for reference: a packet buffer allocated per call,
+ * the slot copied into it, the link layer header replaced by a Linux SLL one in
+ * a second copy, and the vcount stored in it and read back. Both paths must
+ * produce the same fullstamps, then each is timed alone and packets/sec
+ * reported.
+ *
+ * Usage: bench_packet_view [packets] [rounds]
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include <pcap.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "proto_ntp.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "create_stamp.h"
+#include "stamp_queue.h"
+#include "rawdata.h"
+#include "ntohll.h"
+
+#define NSERVERS	4
+#define HOST_ADDR	0x0a000001		// 10.0.0.1
+#define SERVER_ADDR	0x0a000101		// 10.0.1.x
+
+
+/* The packet code logs through the daemon verbose(), count warnings instead */
+static long warnings = 0;
+
+void
+verbose(int facility, const char *format, ...)
+{
+	if (facility == LOG_WARNING || facility == LOG_ERR)
+		warnings++;
+}
+
+int
+get_verbose_level(void)
+{
+	return (0);
+}
+
+
+
+/*
+ * Former live path, as found in create_stamp.c and stampinput-livepcap.c
+ * before packets were delivered in place.
+ */
+#define LEGACY_BUFSIZE	65535
+
+static radpcap_packet_t *
+legacy_create_packet(void)
+{
+	radpcap_packet_t *pkt;
+
+	pkt = malloc(sizeof(radpcap_packet_t));
+	memset(pkt, 0, sizeof(radpcap_packet_t));
+	pkt->buffer = malloc(LEGACY_BUFSIZE);
+	return (pkt);
+}
+
+static void
+legacy_destroy_packet(radpcap_packet_t *pkt)
+{
+	free(pkt->buffer);
+	free(pkt);
+}
+
+static void
+legacy_deliver(struct rd_pcap_pkt *rd, radpcap_packet_t *pkt,
+		vcounter_t *vcount)
+{
+	memcpy(pkt->buffer, &rd->pcap_hdr, sizeof(struct pcap_pkthdr));
+	memcpy(pkt->buffer + sizeof(struct pcap_pkthdr), rd->buf,
+			rd->pcap_hdr.caplen);
+	pkt->header = pkt->buffer;
+	pkt->payload = pkt->buffer + sizeof(struct pcap_pkthdr);
+	pkt->size = rd->pcap_hdr.caplen + sizeof(struct pcap_pkthdr);
+	pkt->type = DLT_EN10MB;
+	*vcount = rd->vcount;
+}
+
+static void
+legacy_insert_sll(radpcap_packet_t *pkt)
+{
+	struct ether_header *eh;
+	linux_sll_header_t *sllh;
+	struct pcap_pkthdr *pcaph;
+	size_t etherlen;
+	char *tmp;
+
+	eh = (struct ether_header *)pkt->payload;
+	etherlen = sizeof(struct ether_header);
+
+	tmp = malloc(LEGACY_BUFSIZE);
+	memcpy(tmp, pkt->header, sizeof(struct pcap_pkthdr));
+	sllh = (linux_sll_header_t *) (tmp + sizeof(struct pcap_pkthdr));
+	sllh->pkttype = htons(3);
+	sllh->hatype = htons(ARPHRD_ETHER);
+	sllh->protocol = eh->ether_type;
+
+	pcaph = (struct pcap_pkthdr *)pkt->header;
+	memcpy((char *)sllh + sizeof(linux_sll_header_t), (char *)eh + etherlen,
+			pcaph->caplen - etherlen);
+	free(pkt->buffer);
+
+	pkt->buffer = tmp;
+	pkt->header = tmp;
+	pkt->payload = tmp + sizeof(struct pcap_pkthdr);
+	pkt->type = DLT_LINUX_SLL;
+	pkt->size = pkt->size + sizeof(linux_sll_header_t) - etherlen;
+	pcaph = (struct pcap_pkthdr *)pkt->header;
+	pcaph->caplen = pcaph->caplen + sizeof(linux_sll_header_t) - etherlen;
+	pcaph->len = pcaph->len + sizeof(linux_sll_header_t) - etherlen;
+}
+
+static int
+legacy_get_packet(struct rd_pcap_pkt *rd, radpcap_packet_t *pkt)
+{
+	linux_sll_header_t *hdr;
+	vcounter_t vcount, network_vcount, readback;
+
+	legacy_deliver(rd, pkt, &vcount);
+	legacy_insert_sll(pkt);
+
+	network_vcount = htonll(vcount);
+	hdr = (linux_sll_header_t *) pkt->payload;
+	memcpy(hdr->addr, &network_vcount, sizeof(network_vcount));
+	hdr->halen = htons(8);
+
+	if (get_vcount(pkt, &readback) || readback != vcount)
+		return (1);
+	return (0);
+}
+
+
+
+/*
+ * Synthetic capture: each server answers every request, a few requests are
+ * lost. Frames are Ethernet / IPv4 / UDP / NTP as seen on the wire.
+ */
+static void
+make_frame(struct rd_pcap_pkt *rd, int server, int mode, uint64_t id,
+		vcounter_t vcount)
+{
+	struct ether_header *eh;
+	struct ip *iph;
+	struct udphdr *udph;
+	struct ntp_pkt *ntp;
+	size_t len;
+
+	memset(rd, 0, sizeof(struct rd_pcap_pkt));
+	len = sizeof(struct ether_header) + sizeof(struct ip) +
+			sizeof(struct udphdr) + LEN_PKT_NOMAC;
+
+	eh = (struct ether_header *) rd->buf;
+	eh->ether_type = htons(ETHERTYPE_IP);
+
+	iph = (struct ip *) (rd->buf + sizeof(struct ether_header));
+	iph->ip_v = 4;
+	iph->ip_hl = sizeof(struct ip) / 4;
+	iph->ip_len = htons(len - sizeof(struct ether_header));
+	iph->ip_ttl = 64;
+	iph->ip_p = IPPROTO_UDP;
+	if (mode == MODE_CLIENT) {
+		iph->ip_src.s_addr = htonl(HOST_ADDR);
+		iph->ip_dst.s_addr = htonl(SERVER_ADDR + server);
+	} else {
+		iph->ip_src.s_addr = htonl(SERVER_ADDR + server);
+		iph->ip_dst.s_addr = htonl(HOST_ADDR);
+	}
+
+	udph = (struct udphdr *) ((char *)iph + sizeof(struct ip));
+	udph->uh_sport = htons(123);
+	udph->uh_dport = htons(123);
+	udph->uh_ulen = htons(sizeof(struct udphdr) + LEN_PKT_NOMAC);
+
+	ntp = (struct ntp_pkt *) ((char *)udph + sizeof(struct udphdr));
+	ntp->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING, NTP_VERSION, mode);
+	if (mode == MODE_CLIENT) {
+		ntp->xmt.l_int = htonl(id >> 32);
+		ntp->xmt.l_fra = htonl(id & 0xffffffff);
+	} else {
+		ntp->stratum = 1;
+		ntp->refid = htonl(0x47505300);
+		ntp->org.l_int = htonl(id >> 32);
+		ntp->org.l_fra = htonl(id & 0xffffffff);
+		ntp->rec.l_int = htonl((id >> 32) + 1);
+		ntp->xmt.l_int = htonl((id >> 32) + 1);
+		ntp->xmt.l_fra = htonl(1000);
+	}
+
+	rd->vcount = vcount;
+	rd->pcap_hdr.ts.tv_sec = id >> 32;
+	rd->pcap_hdr.caplen = len;
+	rd->pcap_hdr.len = len;
+}
+
+static int
+make_stream(struct rd_pcap_pkt *rd, int n)
+{
+	vcounter_t vcount;
+	uint64_t id;
+	int i, s;
+
+	vcount = 1000000;
+	id = (uint64_t)3600000000U << 32;
+	for (i = 0; i + 1 < n; ) {
+		s = (i / 2) % NSERVERS;
+		id += (uint64_t)1 << 32;
+		make_frame(&rd[i++], s, MODE_CLIENT, id, vcount);
+		vcount += 1000 * (s + 1);
+		/* Lose one reply in 50 */
+		if ((i / 2) % 50 == 49)
+			continue;
+		make_frame(&rd[i++], s, MODE_SERVER, id, vcount);
+		vcount += 100000;
+	}
+	return (i);
+}
+
+
+
+/*
+ * One pass over the stream, the way get_network_stamp() consumes it: packets
+ * are pushed until a fullstamp is found, which is then taken out of the queue.
+ * Keep the fullstamps if asked to.
+ */
+static int
+run_view(struct rd_pcap_pkt *rd, int n, struct stamp_t *out)
+{
+	struct bidir_algodata algodata;
+	struct timeref_stats stats;
+	radpcap_packet_t view;
+	struct stamp_t st;
+	int i, nfull;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&view, 0, sizeof(view));
+	init_stamp_queue(&algodata);
+	nfull = 0;
+
+	for (i = 0; i < n; i++) {
+		view.header = &rd[i].pcap_hdr;
+		view.payload = rd[i].buf;
+		view.size = rd[i].pcap_hdr.caplen + sizeof(struct pcap_pkthdr);
+		view.type = DLT_EN10MB;
+		view.live = 1;
+		view.vcount = rd[i].vcount;
+		((struct sockaddr_in *)&view.ss_if)->sin_family = AF_INET;
+		((struct sockaddr_in *)&view.ss_if)->sin_addr.s_addr = htonl(HOST_ADDR);
+
+		if (update_stamp_queue(algodata.q, &view, &stats) == 0) {
+			if (get_fullstamp_from_queue_andclean(algodata.q, &st) == 0 && out)
+				out[nfull] = st;
+			nfull++;
+		}
+	}
+	destroy_stamp_queue(&algodata);
+	return (nfull);
+}
+
+static int
+run_legacy(struct rd_pcap_pkt *rd, int n, struct stamp_t *out)
+{
+	struct bidir_algodata algodata;
+	struct timeref_stats stats;
+	radpcap_packet_t *pkt;
+	struct stamp_t st;
+	int i, err, nfull;
+
+	memset(&stats, 0, sizeof(stats));
+	init_stamp_queue(&algodata);
+	nfull = 0;
+
+	pkt = legacy_create_packet();
+	for (i = 0; i < n; i++) {
+		if (legacy_get_packet(&rd[i], pkt))
+			return (-1);
+		((struct sockaddr_in *)&pkt->ss_if)->sin_family = AF_INET;
+		((struct sockaddr_in *)&pkt->ss_if)->sin_addr.s_addr = htonl(HOST_ADDR);
+
+		err = update_stamp_queue(algodata.q, pkt, &stats);
+		if (err == 0) {
+			if (get_fullstamp_from_queue_andclean(algodata.q, &st) == 0 && out)
+				out[nfull] = st;
+			nfull++;
+
+			/* A new packet buffer for each get_network_stamp() call */
+			legacy_destroy_packet(pkt);
+			pkt = legacy_create_packet();
+		}
+	}
+	legacy_destroy_packet(pkt);
+	destroy_stamp_queue(&algodata);
+	return (nfull);
+}
+
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+static int
+same_stamp(struct stamp_t *a, struct stamp_t *b)
+{
+	return (a->id == b->id && a->ttl == b->ttl && a->stratum == b->stratum &&
+		a->refid == b->refid && strcmp(a->server_ipaddr, b->server_ipaddr) == 0 &&
+		BST(a)->Ta == BST(b)->Ta && BST(a)->Tb == BST(b)->Tb &&
+		BST(a)->Te == BST(b)->Te && BST(a)->Tf == BST(b)->Tf);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct rd_pcap_pkt *rd;
+	struct stamp_t *st_view, *st_legacy;
+	double t, rate_view, rate_legacy;
+	int i, n, np, rounds, n_view, n_legacy;
+
+	n = (argc > 1) ? atoi(argv[1]) : 200000;
+	rounds = (argc > 2) ? atoi(argv[2]) : 5;
+	if (n < 16 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [packets] [rounds]\n", argv[0]);
+		return (1);
+	}
+
+	rd = malloc(n * sizeof(struct rd_pcap_pkt));
+	st_view = malloc(n * sizeof(struct stamp_t));
+	st_legacy = malloc(n * sizeof(struct stamp_t));
+	if (rd == NULL || st_view == NULL || st_legacy == NULL)
+		return (1);
+	np = make_stream(rd, n);
+
+	/* Both paths must see the same fullstamps, without complaining */
+	n_view = run_view(rd, np, st_view);
+	n_legacy = run_legacy(rd, np, st_legacy);
+	if (n_view != n_legacy || n_view <= 0) {
+		fprintf(stdout, "FAIL %d fullstamps in place, %d through copies\n",
+				n_view, n_legacy);
+		return (1);
+	}
+	for (i = 0; i < n_view; i++) {
+		if (!same_stamp(&st_view[i], &st_legacy[i])) {
+			fprintf(stdout, "FAIL fullstamp %d differs, ids %llu/%llu\n", i,
+					(long long unsigned) st_view[i].id,
+					(long long unsigned) st_legacy[i].id);
+			return (1);
+		}
+	}
+	fprintf(stdout, "Equivalence: %d packets, %d fullstamps, %ld warnings\n",
+			np, n_view, warnings);
+
+	t = now();
+	for (i = 0; i < rounds; i++)
+		run_legacy(rd, np, NULL);
+	rate_legacy = (double) np * rounds / (now() - t);
+
+	t = now();
+	for (i = 0; i < rounds; i++)
+		run_view(rd, np, NULL);
+	rate_view = (double) np * rounds / (now() - t);
+
+	fprintf(stdout, "Copy and SLL rewrite: %10.0f packets/sec\n", rate_legacy);
+	fprintf(stdout, "In place view:        %10.0f packets/sec (x%.2f)\n",
+			rate_view, rate_view / rate_legacy);
+
+	free(st_legacy);
+	free(st_view);
+	free(rd);
+	return (0);
+}
@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Micro-benchmark of the NTP stamp matching queue (radclock/stamp_queue.c),
+ * against the doubly-linked list implementation it replaced, which is kept
+ * below for reference.
+ *
+ * Synthetic client request / server reply streams are generated for several
+ * servers, with losses in both directions, duplicates, retries and local
+ * reordering. Both queues are first run in lockstep to check they return
+ * the same codes, the same fullstamps in the same order, and raise the same
+ * number of warnings. Each is then timed alone, and packets/sec reported.
+ *
+ * Usage: bench_stamp_queue [packets] [rounds]
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "proto_ntp.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "stamp_queue.h"
+
+
+/* The queue code logs through the daemon verbose(), count warnings instead */
+static long warnings = 0;
+
+void
+verbose(int facility, const char *format, ...)
+{
+	if (facility == LOG_WARNING)
+		warnings++;
+}
+
+int
+get_verbose_level(void)
+{
+	return (0);
+}
+
+
+
+/*
+ * Legacy list queue, as found in create_stamp.c before the pooled queue.
+ */
+struct list_elt {
+	struct stamp_t stamp;
+	struct list_elt *prev;
+	struct list_elt *next;
+};
+
+struct list_queue {
+	struct list_elt *start;
+	struct list_elt *end;
+	int size;
+};
+
+static struct list_queue *
+list_init(void)
+{
+	return (calloc(1, sizeof(struct list_queue)));
+}
+
+static void
+list_destroy(struct list_queue *q)
+{
+	struct list_elt *elt, *next;
+
+	for (elt = q->start; elt != NULL; elt = next) {
+		next = elt->next;
+		free(elt);
+	}
+	free(q);
+}
+
+static int
+list_insertandmatch(struct list_queue *q, struct stamp_t *new, int mode)
+{
+	struct list_elt *qel;
+	struct stamp_t *stamp;
+	int foundhalfstamptofill;
+
+	foundhalfstamptofill = 0;
+	qel = q->start;
+	while (qel != NULL) {
+		stamp = &qel->stamp;
+		if (stamp->id == new->id) {
+			switch (mode) {
+				case MODE_CLIENT:
+					if (BST(stamp)->Ta != 0) {
+						verbose(LOG_WARNING, "Dropping duplicate NTP client request.");
+						return (1);
+					}
+					break;
+				case MODE_SERVER:
+					if (BST(stamp)->Tf != 0) {
+						verbose(LOG_WARNING, "Dropping duplicate NTP server response.");
+						return (1);
+					}
+					break;
+			}
+			foundhalfstamptofill = 1;
+			break;
+		}
+		qel = qel->next;
+	}
+
+	if (!foundhalfstamptofill) {
+		if (q->size == MAX_STQ_SIZE) {
+			verbose(LOG_WARNING, "Stamp matching queue has hit max size.");
+			q->end = q->end->prev;
+			free(q->end->next);
+			q->end->next = NULL;
+			q->size--;
+		}
+		qel = calloc(1, sizeof(struct list_elt));
+		qel->prev = NULL;
+		qel->next = q->start;
+		if (q->start == NULL)
+			q->end = qel;
+		else
+			q->start->prev = qel;
+		q->start = qel;
+		q->size++;
+		qel->stamp.type = STAMP_NTP;
+		qel->stamp.id = new->id;
+	}
+
+	stamp = &qel->stamp;
+	switch (mode) {
+		case MODE_CLIENT:
+			strncpy(stamp->server_ipaddr, new->server_ipaddr, 16);
+			BST(stamp)->Ta = BST(new)->Ta;
+			break;
+		case MODE_SERVER:
+			stamp->ttl = new->ttl;
+			stamp->refid = new->refid;
+			stamp->stratum = new->stratum;
+			stamp->LI = new->LI;
+			stamp->rootdelay = new->rootdelay;
+			stamp->rootdispersion = new->rootdispersion;
+			BST(stamp)->Tb = BST(new)->Tb;
+			BST(stamp)->Te = BST(new)->Te;
+			BST(stamp)->Tf = BST(new)->Tf;
+	}
+
+	return (foundhalfstamptofill ? 0 : 1);
+}
+
+static int
+list_getfullstamp(struct list_queue *q, struct stamp_t *stamp)
+{
+	struct list_elt *qel, *qelcopy;
+	struct stamp_t *st, *full_st = NULL;
+	vcounter_t full_time = 0, Tc;
+	int c_halfstamp, s_halfstamp, fullstamp, dangerous, c_older, s_older;
+
+	if (q->size == 0) {
+		verbose(LOG_WARNING, "Stamp matching queue empty, no stamp returned");
+		return (1);
+	}
+
+	for (qel = q->end; qel != NULL; qel = qel->prev) {
+		st = &qel->stamp;
+		Tc = BST(st)->Ta;
+		fullstamp = (Tc != 0) && (BST(st)->Tf != 0);
+		if (fullstamp && (full_time == 0 || Tc < full_time)) {
+			full_st = st;
+			full_time = Tc;
+		}
+	}
+	if (full_time > 0)
+		memcpy(stamp, full_st, sizeof(struct stamp_t));
+	else {
+		verbose(LOG_WARNING, "Did not find any full stamp in stamp queue");
+		return (1);
+	}
+
+	qel = q->end;
+	while (qel != NULL) {
+		st = &qel->stamp;
+		c_halfstamp = (BST(st)->Ta != 0) && (BST(st)->Tf == 0);
+		s_halfstamp = (BST(st)->Ta == 0) && (BST(st)->Tf != 0);
+		if (s_halfstamp)
+			verbose(LOG_WARNING, "Found server halfstamp in stamp queue");
+		c_older = c_halfstamp && BST(st)->Ta < full_time;
+		s_older = s_halfstamp && BST(st)->Tf < BST(full_st)->Tf;
+		dangerous = s_older ||
+			(c_older && strcmp(st->server_ipaddr, full_st->server_ipaddr) == 0);
+
+		if (st == full_st || dangerous) {
+			if (qel == q->end) {
+				if (qel == q->start) {
+					free(qel);
+					qel = NULL;
+					q->start = NULL;
+					q->end = NULL;
+				} else {
+					qel = qel->prev;
+					free(qel->next);
+					qel->next = NULL;
+					q->end = qel;
+				}
+			} else {
+				if (qel == q->start) {
+					q->start = qel->next;
+					qel->next->prev = NULL;
+					free(qel);
+					qel = NULL;
+				} else {
+					qel->next->prev = qel->prev;
+					qel->prev->next = qel->next;
+					qelcopy = qel;
+					qel = qel->prev;
+					free(qelcopy);
+				}
+			}
+			q->size--;
+		} else
+			qel = qel->prev;
+	}
+	return (0);
+}
+
+
+
+/*
+ * Synthetic packet stream.
+ * Each server is polled every POLL counter units, with per-request RTT jitter.
+ * Requests may be retried, and any packet may be lost, duplicated or swapped
+ * with its successor.
+ */
+#define POLL		1000000
+#define RTT		50000
+
+struct pkt {
+	vcounter_t vcount;		// capture time
+	uint64_t id;
+	int mode;
+	int server;
+};
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state);
+}
+
+static int
+cmp_pkt(const void *a, const void *b)
+{
+	const struct pkt *pa = a, *pb = b;
+
+	if (pa->vcount != pb->vcount)
+		return (pa->vcount < pb->vcount ? -1 : 1);
+	return (0);
+}
+
+static int
+make_stream(struct pkt *p, int n, int nservers)
+{
+	struct pkt tmp;
+	vcounter_t Ta;
+	uint64_t id;
+	int i, k, s, r;
+
+	k = 0;
+	id = 1;
+	for (i = 0; k < n - 4; i++) {
+		s = i % nservers;
+		Ta = (vcounter_t) (i / nservers) * POLL + s * (POLL / nservers) +
+			rng() % 1000 + 1;
+
+		/* Request, and a retry with a new id 10% of the time */
+		for (r = 0; r < 1 + ((rng() % 10) == 0); r++) {
+			id += 1 + rng() % 4096;
+			Ta += r * RTT / 2;
+			if (rng() % 50) {		// 2% request loss
+				p[k++] = (struct pkt) { Ta, id, MODE_CLIENT, s };
+				if ((rng() % 100) == 0)
+					p[k++] = (struct pkt) { Ta + 1, id, MODE_CLIENT, s };
+			}
+			if (rng() % 20) {		// 5% reply loss
+				p[k++] = (struct pkt) { Ta + RTT + rng() % (4 * RTT), id,
+						MODE_SERVER, s };
+				if ((rng() % 100) == 0)
+					p[k++] = (struct pkt) { Ta + 2 * RTT, id, MODE_SERVER, s };
+			}
+		}
+	}
+	n = k;
+	qsort(p, n, sizeof(struct pkt), cmp_pkt);
+
+	/* Local reordering */
+	for (i = 0; i < n - 1; i++) {
+		if ((rng() % 100) == 0) {
+			tmp = p[i];
+			p[i] = p[i + 1];
+			p[i + 1] = tmp;
+		}
+	}
+	return (n);
+}
+
+static void
+pkt_to_halfstamp(const struct pkt *p, struct stamp_t *stamp)
+{
+	memset(stamp, 0, sizeof(struct stamp_t));
+	stamp->type = STAMP_NTP;
+	stamp->id = p->id;
+	if (p->mode == MODE_CLIENT) {
+		snprintf(stamp->server_ipaddr, INET6_ADDRSTRLEN, "192.168.0.%d",
+				p->server + 1);
+		BST(stamp)->Ta = p->vcount;
+	} else {
+		stamp->ttl = 64;
+		stamp->stratum = 1;
+		stamp->refid = 0x47505300;
+		stamp->rootdelay = 0.;
+		stamp->rootdispersion = 1e-5;
+		BST(stamp)->Tb = 1e9 + p->vcount * 1e-9L;
+		BST(stamp)->Te = BST(stamp)->Tb + 1e-6L;
+		BST(stamp)->Tf = p->vcount;
+	}
+}
+
+static int
+same_stamp(struct stamp_t *a, struct stamp_t *b)
+{
+	return (a->id == b->id && a->type == b->type &&
+		strcmp(a->server_ipaddr, b->server_ipaddr) == 0 &&
+		a->ttl == b->ttl && a->stratum == b->stratum && a->LI == b->LI &&
+		a->refid == b->refid && a->rootdelay == b->rootdelay &&
+		a->rootdispersion == b->rootdispersion &&
+		BST(a)->Ta == BST(b)->Ta && BST(a)->Tb == BST(b)->Tb &&
+		BST(a)->Te == BST(b)->Te && BST(a)->Tf == BST(b)->Tf);
+}
+
+
+
+static int
+check_equivalence(struct pkt *p, int n)
+{
+	struct bidir_algodata algodata;
+	struct list_queue *lq;
+	struct stamp_t half, st1, st2;
+	long w1, w2;
+	int i, err1, err2, nfull;
+
+	init_stamp_queue(&algodata);
+	lq = list_init();
+	nfull = 0;
+	warnings = 0;
+
+	for (i = 0; i < n; i++) {
+		pkt_to_halfstamp(&p[i], &half);
+
+		w1 = warnings;
+		err1 = insertandmatch_halfstamp(algodata.q, &half, p[i].mode);
+		w1 = warnings - w1;
+		w2 = warnings;
+		err2 = list_insertandmatch(lq, &half, p[i].mode);
+		w2 = warnings - w2;
+		if (err1 != err2 || w1 != w2) {
+			fprintf(stdout, "FAIL insert %d: codes %d/%d, warnings %ld/%ld\n",
+					i, err1, err2, w1, w2);
+			return (1);
+		}
+		if (err1)
+			continue;
+
+		w1 = warnings;
+		err1 = get_fullstamp_from_queue_andclean(algodata.q, &st1);
+		w1 = warnings - w1;
+		w2 = warnings;
+		err2 = list_getfullstamp(lq, &st2);
+		w2 = warnings - w2;
+		if (err1 != err2 || w1 != w2 || (!err1 && !same_stamp(&st1, &st2))) {
+			fprintf(stdout, "FAIL extract %d: codes %d/%d, warnings %ld/%ld, "
+					"ids %llu/%llu\n", i, err1, err2, w1, w2,
+					(long long unsigned) st1.id, (long long unsigned) st2.id);
+			return (1);
+		}
+		nfull++;
+	}
+
+	fprintf(stdout, "  Equivalence: %d packets, %d fullstamps, %ld warnings\n",
+			n, nfull, warnings);
+	destroy_stamp_queue(&algodata);
+	list_destroy(lq);
+	return (0);
+}
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+/* Halfstamps are built beforehand so that only the queue is timed */
+static double
+bench_pooled(struct pkt *p, struct stamp_t *half, int n, int rounds)
+{
+	struct bidir_algodata algodata;
+	struct stamp_t st;
+	double t;
+	int i, r;
+
+	t = now();
+	for (r = 0; r < rounds; r++) {
+		init_stamp_queue(&algodata);
+		for (i = 0; i < n; i++) {
+			if (insertandmatch_halfstamp(algodata.q, &half[i], p[i].mode) == 0)
+				get_fullstamp_from_queue_andclean(algodata.q, &st);
+		}
+		destroy_stamp_queue(&algodata);
+	}
+	return ((double) n * rounds / (now() - t));
+}
+
+static double
+bench_list(struct pkt *p, struct stamp_t *half, int n, int rounds)
+{
+	struct list_queue *lq;
+	struct stamp_t st;
+	double t;
+	int i, r;
+
+	t = now();
+	for (r = 0; r < rounds; r++) {
+		lq = list_init();
+		for (i = 0; i < n; i++) {
+			if (list_insertandmatch(lq, &half[i], p[i].mode) == 0)
+				list_getfullstamp(lq, &st);
+		}
+		list_destroy(lq);
+	}
+	return ((double) n * rounds / (now() - t));
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct pkt *p;
+	struct stamp_t *half;
+	double rate_pool, rate_list;
+	int i, n, np, rounds, sc;
+
+	/* A single server, a typical set, and more servers than queue slots */
+	int nservers[] = { 1, 8, 32 };
+
+	n = (argc > 1) ? atoi(argv[1]) : 200000;
+	rounds = (argc > 2) ? atoi(argv[2]) : 5;
+	if (n < 16 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [packets] [rounds]\n", argv[0]);
+		return (1);
+	}
+
+	p = malloc(n * sizeof(struct pkt));
+	half = malloc(n * sizeof(struct stamp_t));
+	if (p == NULL || half == NULL)
+		return (1);
+
+	for (sc = 0; sc < sizeof(nservers)/sizeof(nservers[0]); sc++) {
+		fprintf(stdout, "%d servers\n", nservers[sc]);
+		np = make_stream(p, n, nservers[sc]);
+
+		if (check_equivalence(p, np))
+			return (1);
+
+		for (i = 0; i < np; i++)
+			pkt_to_halfstamp(&p[i], &half[i]);
+
+		rate_list = bench_list(p, half, np, rounds);
+		rate_pool = bench_pooled(p, half, np, rounds);
+		fprintf(stdout, "  List queue:   %10.0f packets/sec\n", rate_list);
+		fprintf(stdout, "  Pooled queue: %10.0f packets/sec (x%.2f)\n", rate_pool,
+				rate_pool / rate_list);
+	}
+
+	free(half);
+	free(p);
+	return (0);
+}
@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * NTP client flood generator, to load test an NTP server such as the daemon's
+ * (ntp_server option), over the loopback or a network.
+ *
+ * A sender thread sends client requests at a fixed rate, in batches with
+ * sendmmsg(), round robin over a set of sockets. Each socket has its own source
+ * port and, with -a, one of several source addresses taken from 127.0.0.1
+ * onwards, so that the server sees many clients. A receiver thread matches
+ * responses to requests on the org timestamp, which echoes the xmt nonce of the
+ * request, as the daemon's NTP client does. The nonce is made of a random salt
+ * and the request number.
+ *
+ * The report gives the offered and achieved request rates, the loss, and the
+ * distributions of the round trip time seen by the tool and of the server
+ * processing time, xmt - rec of the responses. Round trips are timed on reading
+ * batches of responses, so they include the tool's own queueing. KoD responses
+ * are counted apart, and do not enter the distributions. The report is one
+ * "key value" pair per line, in a fixed order, so that runs can be diffed.
+ *
+ * Usage: ntp_flood [-r rate] [-d seconds] [-s sockets] [-a addresses]
+ *                  [-b batch] [-t timeout_ms] [-p port] server
+ */
+
+#define _GNU_SOURCE		/* sendmmsg, recvmmsg */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proto_ntp.h"
+
+#ifdef MSG_WAITFORONE
+#define HAVE_MMSG
+#endif
+
+#define MAX_BATCH		256
+#define MAX_SOCKETS		1024
+#define INFLIGHT		(1 << 20)	// requests tracked, power of 2
+
+/* Log-linear histogram: 2^HIST_SUB buckets per power of 2 [ns] */
+#define HIST_SUB		5
+#define HIST_SIZE		((64 - HIST_SUB) << HIST_SUB)
+
+
+struct hist {
+	uint64_t count[HIST_SIZE];
+	uint64_t n;
+	uint64_t max;
+};
+
+/* A request in flight. seq is ~0 once answered. */
+struct inflight {
+	uint32_t seq;
+	uint64_t sent;			// [ns]
+};
+
+struct flood {
+	/* Parameters */
+	struct sockaddr_in server;
+	double rate;			// [requests/s]
+	double duration;		// [s]
+	int nsock;
+	int naddr;
+	int batch;
+	int timeout_ms;
+
+	int sock[MAX_SOCKETS];
+	uint32_t salt;
+	struct inflight *inflight;
+
+	/* Sender */
+	uint64_t sent;			// requests sent, read by the receiver
+	uint64_t send_errors;
+	uint64_t t_start, t_end;	// of sending [ns]
+	int done;
+
+	/* Receiver */
+	uint64_t answered;
+	uint64_t kod;
+	uint64_t unmatched;		// late, duplicated or not ours
+	uint64_t malformed;
+	struct hist rtt;
+	struct hist server_time;
+};
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+
+static void
+hist_add(struct hist *h, uint64_t v)
+{
+	int e, i;
+
+	/* Values below 2^HIST_SUB have their own bucket */
+	if (v < (1 << HIST_SUB))
+		i = (int)v;
+	else {
+		e = 63 - __builtin_clzll(v);
+		i = ((e - HIST_SUB + 1) << HIST_SUB) +
+				(int)((v >> (e - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+	}
+	h->count[i]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Middle of the bucket holding the p-th quantile [ns] */
+static double
+hist_quantile(struct hist *h, double p)
+{
+	uint64_t rank, sum;
+	int e, i, m;
+
+	if (h->n == 0)
+		return (0);
+	rank = (uint64_t)(p * (h->n - 1));
+	sum = 0;
+	for (i = 0; i < HIST_SIZE; i++) {
+		sum += h->count[i];
+		if (sum > rank)
+			break;
+	}
+	if (i < (1 << HIST_SUB))
+		return (i);
+	e = (i >> HIST_SUB) + HIST_SUB - 1;
+	m = i & ((1 << HIST_SUB) - 1);
+	return (((1ULL << HIST_SUB) + m + 0.5) * (double)(1ULL << (e - HIST_SUB)));
+}
+
+
+static void
+fill_request(struct flood *f, struct ntp_pkt *pkt, uint32_t seq)
+{
+	memset(pkt, 0, LEN_PKT_NOMAC);
+	pkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC, NTP_VERSION, MODE_CLIENT);
+	pkt->ppoll = NTP_MINPOLL;
+	pkt->xmt.l_int = htonl(f->salt);
+	pkt->xmt.l_fra = htonl(seq);
+}
+
+
+/*
+ * Send requests on a grid of 1/rate, batch by batch. Behind schedule, the
+ * batches are sent back to back.
+ */
+static void *
+sender(void *arg)
+{
+	struct flood *f = (struct flood *) arg;
+	struct ntp_pkt pkt[MAX_BATCH];
+	struct timespec ts;
+	uint64_t seq, due, t, total;
+	int i, n, k, err;
+#ifdef HAVE_MMSG
+	struct mmsghdr msg[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < MAX_BATCH; i++) {
+		iov[i].iov_base = &pkt[i];
+		iov[i].iov_len = LEN_PKT_NOMAC;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+
+	total = (uint64_t)(f->rate * f->duration);
+	seq = 0;
+	k = 0;
+	f->t_start = now_ns();
+	while (seq < total) {
+		/* Requests due by now */
+		t = now_ns();
+		due = (uint64_t)((t - f->t_start) * 1e-9 * f->rate) + 1;
+		if (due > total)
+			due = total;
+		if (due <= seq) {
+			t = f->t_start + (uint64_t)(seq * 1e9 / f->rate);
+			ts.tv_sec = t / 1000000000;
+			ts.tv_nsec = t % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			continue;
+		}
+		n = (due - seq < (uint64_t)f->batch) ? (int)(due - seq) : f->batch;
+
+		t = now_ns();
+		for (i = 0; i < n; i++) {
+			fill_request(f, &pkt[i], (uint32_t)(seq + i));
+			f->inflight[(seq + i) & (INFLIGHT - 1)].sent = t;
+			__atomic_store_n(&f->inflight[(seq + i) & (INFLIGHT - 1)].seq,
+					(uint32_t)(seq + i), __ATOMIC_RELEASE);
+		}
+#ifdef HAVE_MMSG
+		for (i = 0; i < n; ) {
+			err = sendmmsg(f->sock[k], &msg[i], n - i, 0);
+			if (err < 0) {
+				if (errno == EINTR)
+					continue;
+				f->send_errors++;
+				err = 1;		// skip the message that failed
+			}
+			i += err;
+		}
+#else
+		for (i = 0; i < n; i++)
+			if (send(f->sock[k], &pkt[i], LEN_PKT_NOMAC, 0) < 0)
+				f->send_errors++;
+#endif
+		seq += n;
+		__atomic_store_n(&f->sent, seq, __ATOMIC_RELEASE);
+		k = (k + 1) % f->nsock;
+	}
+	f->t_end = now_ns();
+	__atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+
+/*
+ * Kiss-o'-Death: stratum 0 and an ASCII kiss code as refid. An unsynchronised
+ * server also answers with stratum 0, but with an address or a blank refid.
+ */
+static int
+is_kod(struct ntp_pkt *pkt)
+{
+	const uint8_t *code = (const uint8_t *) &pkt->refid;
+	int i;
+
+	if (pkt->stratum != 0)
+		return (0);
+	for (i = 0; i < 4; i++)
+		if (!((code[i] >= 'A' && code[i] <= 'Z') ||
+				(code[i] >= '0' && code[i] <= '9')))
+			return (0);
+	return (1);
+}
+
+
+static void
+match_response(struct flood *f, struct ntp_pkt *pkt, int len, uint64_t t)
+{
+	struct inflight *in;
+	uint64_t rec, xmt;
+	uint32_t seq;
+
+	if (len < (int)LEN_PKT_NOMAC || PKT_MODE(pkt->li_vn_mode) != MODE_SERVER) {
+		f->malformed++;
+		return;
+	}
+	if (ntohl(pkt->org.l_int) != f->salt) {
+		f->unmatched++;
+		return;
+	}
+	/* The response may be read before the sender is done with the batch, the
+	 * request slot is published before sending */
+	seq = ntohl(pkt->org.l_fra);
+	in = &f->inflight[seq & (INFLIGHT - 1)];
+	if (__atomic_load_n(&in->seq, __ATOMIC_ACQUIRE) != seq) {
+		f->unmatched++;
+		return;
+	}
+	__atomic_store_n(&in->seq, ~0U, __ATOMIC_RELAXED);
+
+	if (is_kod(pkt)) {
+		f->kod++;
+		return;
+	}
+	f->answered++;
+	hist_add(&f->rtt, t - in->sent);
+
+	/* Server time, xmt - rec in NTP format, negative values taken as 0 */
+	rec = (uint64_t)ntohl(pkt->rec.l_int) << 32 | ntohl(pkt->rec.l_fra);
+	xmt = (uint64_t)ntohl(pkt->xmt.l_int) << 32 | ntohl(pkt->xmt.l_fra);
+	if ((int64_t)(xmt - rec) < 0)
+		hist_add(&f->server_time, 0);
+	else
+		hist_add(&f->server_time, ((xmt - rec) * 1000000000ULL) >> 32);
+}
+
+
+/* Receive until timeout_ms after the last request is sent */
+static void
+receiver(struct flood *f)
+{
+	struct pollfd pfd[MAX_SOCKETS];
+	struct sockaddr_in from;
+	union {
+		struct ntp_pkt pkt;
+		char buf[NTP_PKT_MAX_LEN];
+	} in[MAX_BATCH];
+	uint64_t t, t_last;
+	int i, n;
+#ifdef HAVE_MMSG
+	int j;
+	struct mmsghdr msg[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < MAX_BATCH; i++) {
+		iov[i].iov_base = &in[i];
+		iov[i].iov_len = sizeof(in[i]);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_name = &from;
+		msg[i].msg_hdr.msg_namelen = sizeof(from);
+	}
+#endif
+
+	for (i = 0; i < f->nsock; i++) {
+		pfd[i].fd = f->sock[i];
+		pfd[i].events = POLLIN;
+	}
+
+	t_last = 0;
+	for (;;) {
+		if (t_last == 0 && __atomic_load_n(&f->done, __ATOMIC_ACQUIRE))
+			t_last = now_ns();
+		if (t_last && now_ns() - t_last > f->timeout_ms * 1000000ULL)
+			break;
+
+		n = poll(pfd, f->nsock, 10);
+		if (n <= 0)
+			continue;
+		for (i = 0; i < f->nsock; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+#ifdef HAVE_MMSG
+			n = recvmmsg(f->sock[i], msg, MAX_BATCH, MSG_DONTWAIT, NULL);
+			t = now_ns();
+			for (j = 0; j < n; j++)
+				match_response(f, &in[j].pkt, msg[j].msg_len, t);
+#else
+			while ((n = recv(f->sock[i], in[0].buf, sizeof(in[0]),
+					MSG_DONTWAIT)) >= 0) {
+				t = now_ns();
+				match_response(f, &in[0].pkt, n, t);
+			}
+#endif
+		}
+	}
+}
+
+
+static int
+open_sockets(struct flood *f)
+{
+	struct sockaddr_in src;
+	int i;
+
+	for (i = 0; i < f->nsock; i++) {
+		f->sock[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (f->sock[i] < 0) {
+			fprintf(stderr, "Cannot open socket: %s\n", strerror(errno));
+			return (1);
+		}
+		memset(&src, 0, sizeof(src));
+		src.sin_family = AF_INET;
+		if (f->naddr > 1)
+			src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % f->naddr);
+		else
+			src.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(f->sock[i], (struct sockaddr *)&src, sizeof(src)) < 0 ||
+				connect(f->sock[i], (struct sockaddr *)&f->server,
+				sizeof(f->server)) < 0) {
+			fprintf(stderr, "Cannot bind or connect socket %d: %s\n", i,
+					strerror(errno));
+			return (1);
+		}
+		fcntl(f->sock[i], F_SETFL, O_NONBLOCK);
+	}
+	return (0);
+}
+
+
+static void
+print_hist(const char *name, struct hist *h)
+{
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *qname[] = { "p50", "p90", "p99", "p999" };
+	int i;
+
+	for (i = 0; i < 4; i++)
+		fprintf(stdout, "%s_%s_us %.1f\n", name, qname[i],
+				hist_quantile(h, q[i]) * 1e-3);
+	fprintf(stdout, "%s_max_us %.1f\n", name, h->max * 1e-3);
+}
+
+
+static void
+report(struct flood *f, const char *host)
+{
+	double elapsed, lost;
+
+	elapsed = (f->t_end - f->t_start) * 1e-9;
+	lost = (double)f->sent - f->answered - f->kod;
+
+	fprintf(stdout, "%% ntp_flood %s %s:%d\n", PACKAGE_VERSION, host,
+			ntohs(f->server.sin_port));
+	fprintf(stdout, "%% rate %.0f duration %.1f sockets %d addresses %d "
+			"batch %d timeout_ms %d\n", f->rate, f->duration, f->nsock,
+			f->naddr, f->batch, f->timeout_ms);
+	fprintf(stdout, "sent %llu\n", (unsigned long long)f->sent);
+	fprintf(stdout, "answered %llu\n", (unsigned long long)f->answered);
+	fprintf(stdout, "kod %llu\n", (unsigned long long)f->kod);
+	fprintf(stdout, "lost %.0f\n", lost);
+	fprintf(stdout, "unmatched %llu\n", (unsigned long long)f->unmatched);
+	fprintf(stdout, "malformed %llu\n", (unsigned long long)f->malformed);
+	fprintf(stdout, "send_errors %llu\n", (unsigned long long)f->send_errors);
+	fprintf(stdout, "offered_qps %.0f\n", elapsed > 0 ? f->sent / elapsed : 0);
+	fprintf(stdout, "achieved_qps %.0f\n",
+			elapsed > 0 ? f->answered / elapsed : 0);
+	fprintf(stdout, "loss_pct %.3f\n", f->sent ? 100 * lost / f->sent : 0);
+	print_hist("rtt", &f->rtt);
+	print_hist("server", &f->server_time);
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: ntp_flood [-r rate] [-d seconds] [-s sockets] "
+		"[-a addresses]\n"
+		"                 [-b batch] [-t timeout_ms] [-p port] server\n"
+		"\t-r requests per second, default 10000\n"
+		"\t-d seconds of sending, default 5\n"
+		"\t-s number of sockets (source ports), default 64\n"
+		"\t-a number of source addresses from 127.0.0.1, default 1 (any)\n"
+		"\t-b requests per sendmmsg() call, default 32\n"
+		"\t-t wait for responses after the last request [ms], default 500\n"
+		"\t-p server port, default 123\n");
+	exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct flood *f;
+	struct addrinfo hints, *ai;
+	pthread_t thread;
+	int ch, port;
+
+	f = calloc(1, sizeof(struct flood));
+	if (f == NULL)
+		return (1);
+	f->rate = 10000;
+	f->duration = 5;
+	f->nsock = 64;
+	f->naddr = 1;
+	f->batch = 32;
+	f->timeout_ms = 500;
+	port = DEFAULT_NTP_PORT;
+
+	while ((ch = getopt(argc, argv, "r:d:s:a:b:t:p:h")) != -1) {
+		switch (ch) {
+		case 'r':
+			f->rate = atof(optarg);
+			break;
+		case 'd':
+			f->duration = atof(optarg);
+			break;
+		case 's':
+			f->nsock = atoi(optarg);
+			break;
+		case 'a':
+			f->naddr = atoi(optarg);
+			break;
+		case 'b':
+			f->batch = atoi(optarg);
+			break;
+		case 't':
+			f->timeout_ms = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || f->rate <= 0 || f->duration <= 0 || f->nsock < 1 ||
+			f->nsock > MAX_SOCKETS || f->naddr < 1 || f->naddr > 65536 ||
+			f->batch < 1 || f->batch > MAX_BATCH || f->timeout_ms < 0 ||
+			port < 1 || port > 65535)
+		usage();
+	if (f->rate * f->duration >= (double)UINT32_MAX) {
+		fprintf(stderr, "Too many requests for one run\n");
+		return (1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(argv[0], NULL, &hints, &ai) != 0) {
+		fprintf(stderr, "Unknown server %s\n", argv[0]);
+		return (1);
+	}
+	memcpy(&f->server, ai->ai_addr, sizeof(f->server));
+	f->server.sin_port = htons(port);
+	freeaddrinfo(ai);
+
+	f->inflight = calloc(INFLIGHT, sizeof(struct inflight));
+	if (f->inflight == NULL)
+		return (1);
+	memset(f->inflight, 0xff, INFLIGHT * sizeof(struct inflight));
+	if (open_sockets(f))
+		return (1);
+	f->salt = (uint32_t)(now_ns() ^ getpid());
+
+	if (pthread_create(&thread, NULL, sender, f)) {
+		fprintf(stderr, "Cannot start sender\n");
+		return (1);
+	}
+	receiver(f);
+	pthread_join(thread, NULL);
+
+	report(f, argv[0]);
+	return (0);
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Path and server clock models of virtual NTP servers, and scenario files.
+ * See ntp_pathmodel.h.
+ */
+
+#include "../config.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntp_pathmodel.h"
+
+#define MAX_LINE	1024
+#define MAX_ARGS	8
+
+
+/* splitmix64, streams of the same seed are far apart */
+void
+pm_rng_init(struct pm_rng *rng, uint64_t seed, int stream)
+{
+	rng->state = seed * 0xbf58476d1ce4e5b9ULL +
+			(uint64_t)(stream + 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t
+pm_next(struct pm_rng *rng)
+{
+	uint64_t z;
+
+	z = (rng->state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+/* Uniform in (0,1), never 0 or 1 */
+double
+pm_uniform(struct pm_rng *rng)
+{
+	return (((pm_next(rng) >> 11) + 0.5) / 9007199254740992.0);
+}
+
+
+/* Jitter of the given mean */
+static double
+jitter(int dist, double mean, double shape, double u)
+{
+	switch (dist) {
+	case PM_JITTER_EXP:
+		return (-mean * log(u));
+	case PM_JITTER_UNIFORM:
+		return (2 * mean * u);
+	case PM_JITTER_PARETO:
+		return (mean * (shape - 1) * (pow(u, -1 / shape) - 1));
+	default:
+		return (0);
+	}
+}
+
+static void
+delays(struct pm_server *srv, double t, double *fwd, double *back)
+{
+	int i;
+
+	*fwd = srv->fwd;
+	*back = srv->back;
+	for (i = 0; i < srv->nshifts && srv->shift[i].at <= t; i++) {
+		*fwd += srv->shift[i].fwd;
+		*back += srv->shift[i].back;
+	}
+}
+
+static double
+clock_offset(struct pm_server *srv, double t)
+{
+	double offset;
+	int i;
+
+	offset = srv->offset + srv->drift * 1e-6 * t;
+	for (i = 0; i < srv->nsteps && srv->step[i].at <= t; i++)
+		offset += srv->step[i].fwd;
+	return (offset);
+}
+
+
+/*
+ * Play a request sent at time t to server s. The same number of draws is made
+ * whatever the outcome, so that changing a probability in a scenario does not
+ * change the delays of the other packets.
+ */
+void
+pm_exchange(struct pm_scenario *sc, int s, struct pm_rng *rng, double t,
+		struct pm_exchange *ex)
+{
+	struct pm_server *srv;
+	double u[12], fwd, back, trec;
+	int i;
+
+	srv = &sc->server[s];
+	for (i = 0; i < 12; i++)
+		u[i] = pm_uniform(rng);
+	delays(srv, t, &fwd, &back);
+
+	ex->fwd = fwd + jitter(srv->jitter, srv->jitter_fwd, srv->jitter_shape, u[0]);
+	ex->service = srv->service;
+	ex->back[0] = back + jitter(srv->jitter, srv->jitter_back,
+			srv->jitter_shape, u[1]);
+	ex->back[1] = ex->back[0] + srv->dup_gap * u[2];
+
+	ex->reordered = u[3] < srv->reorder;
+	if (ex->reordered)
+		ex->back[0] += srv->reorder_hold * u[4];
+
+	if (u[5] < srv->loss_fwd || u[6] < srv->loss_back)
+		ex->nreplies = 0;
+	else if (u[7] < srv->dup)
+		ex->nreplies = 2;
+	else
+		ex->nreplies = 1;
+
+	trec = t + ex->fwd;
+	ex->rec_err = clock_offset(srv, trec) + srv->noise * (2 * u[8] - 1);
+	ex->xmt_err = clock_offset(srv, trec + ex->service) +
+			srv->noise * (2 * u[9] - 1);
+	if (u[10] < srv->outlier) {
+		ex->rec_err += (u[11] < 0.5 ? -1 : 1) * srv->outlier_size;
+		ex->xmt_err += (u[11] < 0.5 ? -1 : 1) * srv->outlier_size;
+	}
+}
+
+
+/*
+ * Offset a client clock synchronised to server s is expected to have at time
+ * t: half the asymmetry of the minimum delays, which cannot be seen from the
+ * client, plus the error of the server clock.
+ */
+double
+pm_bias(struct pm_scenario *sc, int s, double t)
+{
+	struct pm_server *srv;
+	double fwd, back;
+
+	srv = &sc->server[s];
+	delays(srv, t, &fwd, &back);
+	return ((fwd - back) / 2 + clock_offset(srv, t));
+}
+
+/* Whether t is less than the settle time after a change of server s */
+int
+pm_settling(struct pm_scenario *sc, int s, double t)
+{
+	struct pm_server *srv;
+	int i;
+
+	srv = &sc->server[s];
+	for (i = 0; i < srv->nshifts; i++)
+		if (t >= srv->shift[i].at && t < srv->shift[i].at + sc->check.settle)
+			return (1);
+	for (i = 0; i < srv->nsteps; i++)
+		if (t >= srv->step[i].at && t < srv->step[i].at + sc->check.settle)
+			return (1);
+	return (0);
+}
+
+
+
+/*
+ * Scenario files
+ */
+static void
+server_defaults(struct pm_server *srv)
+{
+	memset(srv, 0, sizeof(struct pm_server));
+	srv->fwd = 250e-6;
+	srv->back = 250e-6;
+	srv->jitter_shape = 2.5;
+	srv->service = 10e-6;
+}
+
+static int
+add_event(int *n, struct pm_event *ev, double at, double fwd, double back)
+{
+	int i;
+
+	if (*n == PM_MAX_EVENTS)
+		return (1);
+	/* Kept in time order */
+	for (i = *n; i > 0 && ev[i - 1].at > at; i--)
+		ev[i] = ev[i - 1];
+	ev[i].at = at;
+	ev[i].fwd = fwd;
+	ev[i].back = back;
+	(*n)++;
+	return (0);
+}
+
+/* Returns an error message, NULL if fine */
+static const char *
+parse_server(struct pm_server *srv, char **arg, int narg)
+{
+	double v[4];
+	int i;
+
+	for (i = 1; i < narg && i <= 4; i++)
+		v[i - 1] = strtod(arg[i], NULL);
+
+	if (strcmp(arg[0], "delay") == 0 && narg == 3) {
+		srv->fwd = v[0];
+		srv->back = v[1];
+	} else if (strcmp(arg[0], "jitter") == 0 && narg >= 2) {
+		if (strcmp(arg[1], "none") == 0)
+			srv->jitter = PM_JITTER_NONE;
+		else if (strcmp(arg[1], "exp") == 0)
+			srv->jitter = PM_JITTER_EXP;
+		else if (strcmp(arg[1], "uniform") == 0)
+			srv->jitter = PM_JITTER_UNIFORM;
+		else if (strcmp(arg[1], "pareto") == 0)
+			srv->jitter = PM_JITTER_PARETO;
+		else
+			return ("unknown jitter distribution");
+		if (srv->jitter != PM_JITTER_NONE) {
+			if (narg < 4 || narg > 5)
+				return ("jitter needs forward and backward means");
+			srv->jitter_fwd = strtod(arg[2], NULL);
+			srv->jitter_back = strtod(arg[3], NULL);
+			if (narg == 5)
+				srv->jitter_shape = strtod(arg[4], NULL);
+			if (srv->jitter_shape <= 1)
+				return ("Pareto shape must be above 1");
+		}
+	} else if (strcmp(arg[0], "shift") == 0 && narg == 4) {
+		if (add_event(&srv->nshifts, srv->shift, v[0], v[1], v[2]))
+			return ("too many shifts");
+	} else if (strcmp(arg[0], "loss") == 0 && (narg == 2 || narg == 3)) {
+		srv->loss_fwd = v[0];
+		srv->loss_back = (narg == 3) ? v[1] : v[0];
+	} else if (strcmp(arg[0], "dup") == 0 && narg == 3) {
+		srv->dup = v[0];
+		srv->dup_gap = v[1];
+	} else if (strcmp(arg[0], "reorder") == 0 && narg == 3) {
+		srv->reorder = v[0];
+		srv->reorder_hold = v[1];
+	} else if (strcmp(arg[0], "service") == 0 && narg == 2) {
+		srv->service = v[0];
+	} else if (strcmp(arg[0], "offset") == 0 && (narg == 2 || narg == 3)) {
+		srv->offset = v[0];
+		srv->drift = (narg == 3) ? v[1] : 0;
+	} else if (strcmp(arg[0], "step") == 0 && narg == 3) {
+		if (add_event(&srv->nsteps, srv->step, v[0], v[1], 0))
+			return ("too many steps");
+	} else if (strcmp(arg[0], "noise") == 0 && narg == 2) {
+		srv->noise = v[0];
+	} else if (strcmp(arg[0], "outlier") == 0 && narg == 3) {
+		srv->outlier = v[0];
+		srv->outlier_size = v[1];
+	} else
+		return ("unknown server parameter or wrong number of values");
+
+	if (srv->fwd < 0 || srv->back < 0 || srv->service < 0)
+		return ("negative delay");
+	return (NULL);
+}
+
+static const char *
+parse_check(struct pm_check *check, char **arg, int narg)
+{
+	double v;
+
+	if (narg != 2)
+		return ("check needs one value");
+	v = strtod(arg[1], NULL);
+	if (strcmp(arg[0], "warmup") == 0)
+		check->warmup = v;
+	else if (strcmp(arg[0], "settle") == 0)
+		check->settle = v;
+	else if (strcmp(arg[0], "error") == 0)
+		check->error = v;
+	else if (strcmp(arg[0], "error_max") == 0)
+		check->error_max = v;
+	else if (strcmp(arg[0], "phat") == 0)
+		check->phat = v;
+	else if (strcmp(arg[0], "stamps") == 0)
+		check->stamps = v;
+	else
+		return ("unknown check");
+	return (NULL);
+}
+
+static const char *
+parse_line(struct pm_scenario *sc, char **arg, int narg)
+{
+	const char *err;
+	int s, first, last;
+
+	if (strcmp(arg[0], "name") == 0 && narg == 2) {
+		snprintf(sc->name, sizeof(sc->name), "%s", arg[1]);
+	} else if (strcmp(arg[0], "seed") == 0 && narg == 2) {
+		sc->seed = strtoull(arg[1], NULL, 0);
+	} else if (strcmp(arg[0], "servers") == 0 && narg == 2) {
+		s = atoi(arg[1]);
+		if (s < 1 || s > PM_MAX_SERVERS)
+			return ("bad number of servers");
+		/* New servers start from the settings of server 0 */
+		for (; sc->nservers < s; sc->nservers++)
+			sc->server[sc->nservers] = sc->server[0];
+		sc->nservers = s;
+	} else if (strcmp(arg[0], "duration") == 0 && narg == 2) {
+		sc->duration = strtod(arg[1], NULL);
+	} else if (strcmp(arg[0], "poll") == 0 && narg == 2) {
+		sc->poll = atoi(arg[1]);
+		if (sc->poll < 1)
+			return ("poll period must be at least 1 s");
+	} else if (strcmp(arg[0], "skew") == 0 && narg == 2) {
+		sc->skew = strtod(arg[1], NULL);
+	} else if (strcmp(arg[0], "server") == 0 && narg >= 3) {
+		if (strcmp(arg[1], "*") == 0) {
+			first = 0;
+			last = sc->nservers - 1;
+		} else {
+			first = last = atoi(arg[1]);
+			if (first < 0 || first >= sc->nservers)
+				return ("no such server");
+		}
+		for (s = first; s <= last; s++) {
+			err = parse_server(&sc->server[s], arg + 2, narg - 2);
+			if (err)
+				return (err);
+		}
+	} else if (strcmp(arg[0], "check") == 0 && narg >= 2) {
+		return (parse_check(&sc->check, arg + 1, narg - 1));
+	} else
+		return ("unknown keyword or wrong number of values");
+	return (NULL);
+}
+
+
+/*
+ * Read a scenario file. Errors are reported on stderr with their line number.
+ * Returns 0 on success.
+ */
+int
+pm_load(const char *path, struct pm_scenario *sc)
+{
+	char line[MAX_LINE], *arg[MAX_ARGS], *p;
+	const char *err, *base;
+	unsigned long nline;
+	int narg;
+	FILE *fp;
+
+	memset(sc, 0, sizeof(struct pm_scenario));
+	base = strrchr(path, '/');
+	snprintf(sc->name, sizeof(sc->name), "%s", base ? base + 1 : path);
+	sc->seed = 1;
+	sc->nservers = 1;
+	sc->duration = 3600;
+	sc->poll = 16;
+	server_defaults(&sc->server[0]);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open scenario %s\n", path);
+		return (1);
+	}
+
+	nline = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		nline++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		narg = 0;
+		for (p = strtok(line, " \t\r\n"); p; p = strtok(NULL, " \t\r\n")) {
+			if (narg == MAX_ARGS) {
+				fprintf(stderr, "%s:%lu: too many values\n", path, nline);
+				fclose(fp);
+				return (1);
+			}
+			arg[narg++] = p;
+		}
+		if (narg == 0)
+			continue;
+		err = parse_line(sc, arg, narg);
+		if (err) {
+			fprintf(stderr, "%s:%lu: %s\n", path, nline, err);
+			fclose(fp);
+			return (1);
+		}
+	}
+	fclose(fp);
+	return (0);
+}
+
+
+
+/*
+ * Timed items
+ */
+int
+pm_heap_init(struct pm_heap *h, int max)
+{
+	h->item = malloc(max * sizeof(struct pm_heap_item));
+	h->size = 0;
+	h->max = max;
+	h->seq = 0;
+	return (h->item == NULL);
+}
+
+void
+pm_heap_free(struct pm_heap *h)
+{
+	free(h->item);
+	h->item = NULL;
+}
+
+static int
+heap_less(struct pm_heap_item *a, struct pm_heap_item *b)
+{
+	return (a->t < b->t || (a->t == b->t && a->seq < b->seq));
+}
+
+/* Returns 1 if the heap is full */
+int
+pm_heap_push(struct pm_heap *h, double t, void *data)
+{
+	struct pm_heap_item it;
+	int i;
+
+	if (h->size == h->max)
+		return (1);
+	it.t = t;
+	it.seq = h->seq++;
+	it.data = data;
+	for (i = h->size++; i > 0 && heap_less(&it, &h->item[(i - 1) / 2]);
+			i = (i - 1) / 2)
+		h->item[i] = h->item[(i - 1) / 2];
+	h->item[i] = it;
+	return (0);
+}
+
+/* Earliest item, NULL if none */
+void *
+pm_heap_pop(struct pm_heap *h, double *t)
+{
+	struct pm_heap_item top, last;
+	int i, c;
+
+	if (h->size == 0)
+		return (NULL);
+	top = h->item[0];
+	last = h->item[--h->size];
+	for (i = 0; (c = 2 * i + 1) < h->size; i = c) {
+		if (c + 1 < h->size && heap_less(&h->item[c + 1], &h->item[c]))
+			c++;
+		if (!heap_less(&h->item[c], &last))
+			break;
+		h->item[i] = h->item[c];
+	}
+	h->item[i] = last;
+	if (t)
+		*t = top.t;
+	return (top.data);
+}
+
+/* Time of the earliest item, HUGE_VAL if none */
+double
+pm_heap_next(struct pm_heap *h)
+{
+	return (h->size ? h->item[0].t : HUGE_VAL);
+}
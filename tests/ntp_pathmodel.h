@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef _NTP_PATHMODEL_H
+#define _NTP_PATHMODEL_H
+
+/*
+ * Network path and server clock models of virtual NTP servers, shared by the
+ * stand-in server (ntp_standin) and the scenario test (test_scenarios).
+ *
+ * A scenario gives, for each virtual server, the minimum one way delays, a
+ * jitter distribution added on top, level shifts of the delays, loss,
+ * duplication and reordering of packets, and the errors of the server clock:
+ * offset, drift, steps, noise and outliers. Every draw comes from a seeded
+ * generator, one stream per server, so that a scenario always plays the same
+ * whatever the interleaving of the servers. Times are in seconds from the start
+ * of the scenario.
+ *
+ * Scenario files are read line by line, '#' starts a comment:
+ *   name <word>                        scenario name, used in reports
+ *   seed <n>                           random seed
+ *   servers <n>                        number of virtual servers
+ *   duration <s>                       length of the run
+ *   poll <s>                           poll period of the client, integer
+ *   skew <ppm>                         rate error of the host counter
+ *   server <id|*> <param> <values>     server parameters, for one or all:
+ *     delay <fwd> <back>                  minimum one way delays
+ *     jitter <none|exp|uniform|pareto> <fwd> <back> [shape]
+ *                                         mean of the jitter on each way
+ *     shift <at> <fwd> <back>             delays change by fwd and back at time at
+ *     loss <fwd> [back]                   loss probability on each way
+ *     dup <p> <gap>                       reply sent twice, up to gap apart
+ *     reorder <p> <hold>                  reply held up to hold longer
+ *     service <s>                         server time between rec and xmt
+ *     offset <s> [drift_ppm]              server clock error
+ *     step <at> <s>                       server clock step at time at
+ *     noise <s>                           uniform noise on rec and xmt, +/- s
+ *     outlier <p> <s>                     rec and xmt off by +/- s
+ *   check <what> <value>               pass criteria of test_scenarios:
+ *     warmup <s>                          nothing checked before
+ *     settle <s>                          errors not checked after a change
+ *     error <s>                           bound on the p99 clock error
+ *     error_max <s>                       bound on the max clock error
+ *     phat <ppm>                          bound on the final rate error
+ *     stamps <fraction>                   of requests making it to the algo
+ * Server parameters apply to the servers that exist when the line is read,
+ * servers added afterwards start as copies of server 0.
+ */
+
+#include <stdint.h>
+
+#define PM_MAX_SERVERS		64
+#define PM_MAX_EVENTS		16		// level shifts or steps, per server
+#define PM_NAME_LEN			64
+
+enum {
+	PM_JITTER_NONE,
+	PM_JITTER_EXP,
+	PM_JITTER_UNIFORM,
+	PM_JITTER_PARETO,
+};
+
+/* Delays or server clock change at a given time */
+struct pm_event {
+	double at;
+	double fwd;		// delay shifts, or clock step in fwd
+	double back;
+};
+
+struct pm_server {
+	double fwd;					// minimum delays [s]
+	double back;
+	int jitter;
+	double jitter_fwd;			// mean jitter [s]
+	double jitter_back;
+	double jitter_shape;		// Pareto shape, > 1
+	double loss_fwd;
+	double loss_back;
+	double dup;
+	double dup_gap;				// [s]
+	double reorder;
+	double reorder_hold;		// [s]
+	double service;				// [s]
+	double offset;				// [s]
+	double drift;				// [PPM]
+	double noise;				// [s]
+	double outlier;
+	double outlier_size;		// [s]
+	int nshifts;
+	struct pm_event shift[PM_MAX_EVENTS];
+	int nsteps;
+	struct pm_event step[PM_MAX_EVENTS];
+};
+
+/* Pass criteria, 0 when not checked */
+struct pm_check {
+	double warmup;		// [s] before any check
+	double settle;		// [s] not checked after a shift or step
+	double error;		// [s] bound on the p99 clock error
+	double error_max;	// [s] bound on the max clock error
+	double phat;		// [PPM] bound on the rate error at the end
+	double stamps;		// min fraction of requests turned into algo stamps
+};
+
+struct pm_scenario {
+	char name[PM_NAME_LEN];
+	uint64_t seed;
+	int nservers;
+	double duration;
+	int poll;
+	double skew;
+	struct pm_server server[PM_MAX_SERVERS];
+	struct pm_check check;
+};
+
+/* One random stream */
+struct pm_rng {
+	uint64_t state;
+};
+
+/*
+ * Fate of a request through the model. The request is lost when nreplies is 0,
+ * a reply is sent twice when 2. Server clock errors apply to rec and xmt.
+ */
+struct pm_exchange {
+	int nreplies;
+	int reordered;
+	double fwd;				// forward delay [s]
+	double service;			// [s]
+	double rec_err;			// server clock errors [s]
+	double xmt_err;
+	double back[2];			// backward delay of each reply [s]
+};
+
+int pm_load(const char *path, struct pm_scenario *sc);
+void pm_rng_init(struct pm_rng *rng, uint64_t seed, int stream);
+double pm_uniform(struct pm_rng *rng);
+void pm_exchange(struct pm_scenario *sc, int s, struct pm_rng *rng, double t,
+		struct pm_exchange *ex);
+double pm_bias(struct pm_scenario *sc, int s, double t);
+int pm_settling(struct pm_scenario *sc, int s, double t);
+
+
+/*
+ * Binary min-heap of timed items, used to release replies once their delays
+ * have elapsed. Items are opaque to the heap, ties go to the first pushed.
+ */
+struct pm_heap_item {
+	double t;
+	uint64_t seq;
+	void *data;
+};
+
+struct pm_heap {
+	struct pm_heap_item *item;
+	int size;
+	int max;
+	uint64_t seq;
+};
+
+int pm_heap_init(struct pm_heap *h, int max);
+void pm_heap_free(struct pm_heap *h);
+int pm_heap_push(struct pm_heap *h, double t, void *data);
+void *pm_heap_pop(struct pm_heap *h, double *t);
+double pm_heap_next(struct pm_heap *h);
+
+#endif
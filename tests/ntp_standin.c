@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Stand-in NTP server, to run the daemon end to end (NTP client, capture,
+ * stamp queue, algo) without an upstream server, over the loopback or within a
+ * network namespace.
+ *
+ * The virtual servers of a scenario file (see ntp_pathmodel.h) listen on
+ * consecutive addresses from the one given, 127.0.0.2 by default, since the
+ * daemon tells servers apart by address. Each request is played through the
+ * path and server clock models: the reply is timestamped as if the request
+ * had come through the forward delay, and held back for the service time and
+ * the backward delay before being sent, or dropped, or sent twice. Held
+ * replies are released in time order, which reorders them when the delays say
+ * so. The true time is the host's clock at startup, carried on by the
+ * monotonic clock, so that the model errors are the only ones of the servers.
+ * The real loopback path adds its own few microseconds each way.
+ *
+ * The models are seeded, but the arrival times of requests are real, so a run
+ * is only as repeatable as the host is. The scenario test test_scenarios plays
+ * the same models in virtual time, deterministically.
+ *
+ * At the end of the duration, or on SIGINT or SIGTERM, counters are printed
+ * as "key value" lines, release lateness in [mus].
+ *
+ * Usage: ntp_standin [-a address] [-p port] [-d seconds] scenario
+ */
+
+#define _GNU_SOURCE		/* ppoll */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proto_ntp.h"
+#include "ntp_pathmodel.h"
+
+#define MAX_PENDING		(1 << 16)	// replies held at once
+#define SERVER_REFID	0x53494d00	// "SIM"
+
+
+/* A reply held back until its release time */
+struct pending {
+	int server;
+	struct sockaddr_in to;
+	struct ntp_pkt pkt;
+};
+
+struct standin {
+	struct pm_scenario sc;
+	struct pm_rng rng[PM_MAX_SERVERS];
+	struct pm_heap heap;
+	int sock[PM_MAX_SERVERS];
+	struct pollfd pfd[PM_MAX_SERVERS];
+	long double utc0;		// true time at start [s]
+	double mono0;
+
+	/* Counters */
+	uint64_t requests;
+	uint64_t replies;		// sent, duplicates included
+	uint64_t lost;
+	uint64_t duplicated;
+	uint64_t reordered;
+	uint64_t dropped;		// too many replies held
+	uint64_t malformed;
+	uint64_t send_errors;
+	double late_sum;		// release lateness [s]
+	double late_max;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+
+static void
+on_signal(int sig)
+{
+	stop = 1;
+}
+
+static double
+clock_s(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/* Time since start [s] */
+static double
+elapsed(struct standin *si)
+{
+	return (clock_s(CLOCK_MONOTONIC) - si->mono0);
+}
+
+static l_fp
+ntp_time(long double utc)
+{
+	l_fp ts;
+	long double sec;
+
+	sec = floorl(utc);
+	ts.l_int = htonl((uint32_t)((uint64_t)sec + JAN_1970));
+	ts.l_fra = htonl((uint32_t)((utc - sec) * 4294967296.0L));
+	return (ts);
+}
+
+
+/*
+ * Play a request to server s, received at time t. Returns 1 if not a client
+ * request.
+ */
+static int
+serve(struct standin *si, int s, struct ntp_pkt *req, int len,
+		struct sockaddr_in *from, double t)
+{
+	struct pm_exchange ex;
+	struct pending *p;
+	long double rec;
+	int k;
+
+	if (len < (int)LEN_PKT_NOMAC || PKT_MODE(req->li_vn_mode) != MODE_CLIENT ||
+			PKT_VERSION(req->li_vn_mode) < 1 || PKT_VERSION(req->li_vn_mode) > 4)
+		return (1);
+	si->requests++;
+
+	pm_exchange(&si->sc, s, &si->rng[s], t, &ex);
+	if (ex.nreplies == 0)
+		si->lost++;
+	if (ex.nreplies == 2)
+		si->duplicated++;
+	if (ex.reordered && ex.nreplies > 0)
+		si->reordered++;
+
+	rec = si->utc0 + t + ex.fwd;
+	for (k = 0; k < ex.nreplies; k++) {
+		p = malloc(sizeof(struct pending));
+		if (p == NULL || pm_heap_push(&si->heap,
+				t + ex.fwd + ex.service + ex.back[k], p)) {
+			free(p);
+			si->dropped++;
+			continue;
+		}
+		p->server = s;
+		p->to = *from;
+		memset(&p->pkt, 0, sizeof(struct ntp_pkt));
+		p->pkt.li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING,
+				PKT_VERSION(req->li_vn_mode), MODE_SERVER);
+		p->pkt.stratum = 1;
+		p->pkt.ppoll = req->ppoll;
+		p->pkt.precision = -20;
+		p->pkt.rootdispersion = htonl(16);
+		p->pkt.refid = htonl(SERVER_REFID);
+		p->pkt.reftime = ntp_time(floorl(rec + ex.rec_err));
+		p->pkt.org = req->xmt;
+		p->pkt.rec = ntp_time(rec + ex.rec_err);
+		p->pkt.xmt = ntp_time(rec + ex.service + ex.xmt_err);
+	}
+	return (0);
+}
+
+
+/* Send the replies due by time t */
+static void
+release(struct standin *si, double t)
+{
+	struct pending *p;
+	double due;
+
+	while (pm_heap_next(&si->heap) <= t) {
+		p = pm_heap_pop(&si->heap, &due);
+		if (sendto(si->sock[p->server], &p->pkt, LEN_PKT_NOMAC, 0,
+				(struct sockaddr *)&p->to, sizeof(p->to)) < 0)
+			si->send_errors++;
+		else
+			si->replies++;
+		si->late_sum += t - due;
+		if (t - due > si->late_max)
+			si->late_max = t - due;
+		free(p);
+	}
+}
+
+
+static void
+run(struct standin *si, double duration)
+{
+	struct sockaddr_in from;
+	struct ntp_pkt buf[2];
+	struct timespec ts;
+	socklen_t fromlen;
+	double t, wait;
+	int s, n, len;
+
+	while (!stop) {
+		t = elapsed(si);
+		if (duration > 0 && t >= duration)
+			break;
+		release(si, t);
+
+		/* Sleep until the next release, or a request */
+		wait = pm_heap_next(&si->heap) - t;
+		if (wait > 0.1)
+			wait = 0.1;
+		if (wait < 0)
+			wait = 0;
+		ts.tv_sec = 0;
+		ts.tv_nsec = (long)(wait * 1e9);
+		n = ppoll(si->pfd, si->sc.nservers, &ts, NULL);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+			return;
+		}
+		if (n <= 0)
+			continue;
+
+		for (s = 0; s < si->sc.nservers; s++) {
+			if (!(si->pfd[s].revents & POLLIN))
+				continue;
+			for (;;) {
+				fromlen = sizeof(from);
+				len = recvfrom(si->sock[s], buf, sizeof(buf), 0,
+						(struct sockaddr *)&from, &fromlen);
+				if (len < 0)
+					break;
+				if (serve(si, s, buf, len, &from, elapsed(si)))
+					si->malformed++;
+			}
+		}
+	}
+}
+
+
+static int
+open_sockets(struct standin *si, struct in_addr *addr, int port)
+{
+	struct sockaddr_in sin;
+	int s;
+
+	for (s = 0; s < si->sc.nservers; s++) {
+		si->sock[s] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (si->sock[s] < 0) {
+			fprintf(stderr, "Cannot open socket: %s\n", strerror(errno));
+			return (1);
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(ntohl(addr->s_addr) + s);
+		sin.sin_port = htons(port);
+		if (bind(si->sock[s], (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+			fprintf(stderr, "Cannot bind server %d to %s:%d: %s\n", s,
+					inet_ntoa(sin.sin_addr), port, strerror(errno));
+			return (1);
+		}
+		fcntl(si->sock[s], F_SETFL, O_NONBLOCK);
+		si->pfd[s].fd = si->sock[s];
+		si->pfd[s].events = POLLIN;
+	}
+	return (0);
+}
+
+
+static void
+report(struct standin *si, struct in_addr *addr, int port, double t)
+{
+	fprintf(stdout, "%% ntp_standin %s %s, %d servers from %s:%d\n",
+			PACKAGE_VERSION, si->sc.name, si->sc.nservers, inet_ntoa(*addr),
+			port);
+	fprintf(stdout, "duration_s %.1f\n", t);
+	fprintf(stdout, "requests %llu\n", (unsigned long long)si->requests);
+	fprintf(stdout, "replies %llu\n", (unsigned long long)si->replies);
+	fprintf(stdout, "lost %llu\n", (unsigned long long)si->lost);
+	fprintf(stdout, "duplicated %llu\n", (unsigned long long)si->duplicated);
+	fprintf(stdout, "reordered %llu\n", (unsigned long long)si->reordered);
+	fprintf(stdout, "dropped %llu\n", (unsigned long long)si->dropped);
+	fprintf(stdout, "pending %d\n", si->heap.size);
+	fprintf(stdout, "malformed %llu\n", (unsigned long long)si->malformed);
+	fprintf(stdout, "send_errors %llu\n", (unsigned long long)si->send_errors);
+	fprintf(stdout, "late_mean_us %.1f\n", si->replies + si->send_errors ?
+			si->late_sum * 1e6 / (si->replies + si->send_errors) : 0);
+	fprintf(stdout, "late_max_us %.1f\n", si->late_max * 1e6);
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: ntp_standin [-a address] [-p port] [-d seconds] "
+		"scenario\n"
+		"\t-a address of the first virtual server, default 127.0.0.2\n"
+		"\t-p server port, default 123\n"
+		"\t-d seconds to run, default the scenario duration, 0 for ever\n");
+	exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct standin *si;
+	struct sigaction sa;
+	struct in_addr addr;
+	struct timespec ts;
+	double duration;
+	int ch, port, s;
+
+	si = calloc(1, sizeof(struct standin));
+	if (si == NULL)
+		return (1);
+	inet_aton("127.0.0.2", &addr);
+	port = DEFAULT_NTP_PORT;
+	duration = -1;
+
+	while ((ch = getopt(argc, argv, "a:p:d:h")) != -1) {
+		switch (ch) {
+		case 'a':
+			if (inet_aton(optarg, &addr) == 0)
+				usage();
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || port < 1 || port > 65535)
+		usage();
+
+	if (pm_load(argv[0], &si->sc))
+		return (1);
+	if (duration < 0)
+		duration = si->sc.duration;
+	for (s = 0; s < si->sc.nservers; s++)
+		pm_rng_init(&si->rng[s], si->sc.seed, s);
+	if (pm_heap_init(&si->heap, MAX_PENDING))
+		return (1);
+	if (open_sockets(si, &addr, port))
+		return (1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	si->mono0 = clock_s(CLOCK_MONOTONIC);
+	si->utc0 = ts.tv_sec + ts.tv_nsec * 1e-9L;
+	run(si, duration);
+
+	report(si, &addr, port, elapsed(si));
+
+	while (si->heap.size > 0)
+		free(pm_heap_pop(&si->heap, NULL));
+	pm_heap_free(&si->heap);
+	for (s = 0; s < si->sc.nservers; s++)
+		close(si->sock[s]);
+	free(si);
+	return (0);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "../config.h"
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "sms_fixture.h"
+
+vcounter_t sms_fixture_counter;
+long sms_fixture_counter_reads;
+
+
+static int
+fixture_get_vcounter(struct radclock *clock, vcounter_t *vcount)
+{
+	*vcount = sms_fixture_counter;
+	sms_fixture_counter_reads++;
+	return (0);
+}
+
+
+struct radclock *
+sms_fixture_create(void)
+{
+	struct radclock *clock;
+	char path[] = "/tmp/sms_fixture.XXXXXX";
+	key_t key;
+	int fd, err;
+
+	clock = radclock_create();
+	if (clock == NULL)
+		return (NULL);
+
+	/* The key file is only needed to create the segment, and the segment is
+	 * removed once detached */
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(clock);
+		return (NULL);
+	}
+	close(fd);
+	key = ftok(path, 'a');
+	clock->ipc_sms_id = -1;
+	err = (key == -1) || sms_create_writer(clock, key);
+	unlink(path);
+	if (err) {
+		fprintf(stdout, "Cannot create the SMS, skipping\n");
+		if (clock->ipc_sms_id >= 0)
+			shmctl(clock->ipc_sms_id, IPC_RMID, NULL);
+		free(clock);
+		return (NULL);
+	}
+	shmctl(clock->ipc_sms_id, IPC_RMID, NULL);
+
+	clock->get_vcounter = fixture_get_vcounter;
+	return (clock);
+}
+
+
+void
+sms_fixture_data(struct radclock_data *rd, struct radclock_error *re,
+		double freq, vcounter_t update, long double time)
+{
+	memset(rd, 0, sizeof(*rd));
+	memset(re, 0, sizeof(*re));
+	rd->phat = 1 / freq;
+	rd->phat_err = 1e-7;
+	rd->phat_local = rd->phat * (1 + 2.5e-7);
+	rd->ca = time - update * (long double)rd->phat + 37;
+	rd->last_changed = update;
+	rd->next_expected = update + (vcounter_t) (16 * freq);
+	rd->leapsec_total = 37;
+	rd->leapsec_expected = update + (vcounter_t) (5 * freq);
+	rd->leapsec_next = 1;
+	re->error_bound = 1e-5;
+	re->min_RTT = 2e-4;
+}
+
+
+double
+sms_fixture_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
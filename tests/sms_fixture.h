@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef _SMS_FIXTURE_H
+#define _SMS_FIXTURE_H
+
+/*
+ * Clock of the library tests, read from an SMS set up by sms_create_writer on
+ * a private key, so no daemon is needed and a running one is not disturbed.
+ * The counter is driven by the test through sms_fixture_counter. The tests
+ * publish clock data with sms_write, from sms_fixture_data or their own.
+ */
+
+#define SMS_FIXTURE_FREQ	3e9						// nominal counter rate
+#define SMS_FIXTURE_UPDATE	((vcounter_t) 1 << 45)	// counter at last update
+#define SMS_FIXTURE_SKIP	77
+
+/* Value returned by the counter, and number of reads */
+extern vcounter_t sms_fixture_counter;
+extern long sms_fixture_counter_reads;
+
+/* Clock on a fresh SMS, NULL if shared memory is not available. Released
+ * with radclock_destroy, the segment goes with the last detach. */
+struct radclock *sms_fixture_create(void);
+
+/* Clock on a counter at freq, reading time at counter value update, its last
+ * update. A leap second is expected 5 s later, the next update 16 s later. */
+void sms_fixture_data(struct radclock_data *rd, struct radclock_error *re,
+		double freq, vcounter_t update, long double time);
+
+/* Wall clock time [s] for the cost measurements */
+double sms_fixture_now(void);
+
+#endif
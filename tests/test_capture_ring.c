@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Check of the memory mapped capture ring used by the daemon in place of
+ * libpcap, on the loopback interface. NTP sized UDP datagrams are sent to a
+ * port matched by a BPF filter, and to another one which is not, then the
+ * blocks handed over by the kernel are walked in place. All the matching
+ * datagrams and only them must come out, once each and in order, with room
+ * before the network header for the Linux SLL header the daemon writes there.
+ * Also reports how many frames the kernel batched per block.
+ * Then every block of the ring is held, one datagram each: the ring must not
+ * hand over a block again before it has been given back, and then only with
+ * new frames.
+ *
+ * Needs Linux and the CAP_NET_RAW capability, exits with the automake skip
+ * code otherwise.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef linux
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#endif
+
+#include "radclock.h"
+#include "radclock-private.h"
+
+#define SKIP		77
+#define PORT		12123		// filtered in
+#define OTHER_PORT	12124		// filtered out
+#define NPKT		500
+#define NTP_LEN		48
+
+
+#if defined(linux) && defined(TPACKET3_HDRLEN)
+
+/* udp dst port PORT, IPv4 over Ethernet, snaplen as the daemon's */
+static struct sock_filter udp_port_insns[] = {
+	BPF_STMT(BPF_LD  + BPF_H   + BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0x0800, 0, 8),
+	BPF_STMT(BPF_LD  + BPF_B   + BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 6),
+	BPF_STMT(BPF_LD  + BPF_H   + BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX + BPF_B   + BPF_MSH, 14),
+	BPF_STMT(BPF_LD  + BPF_H   + BPF_IND, 16),
+	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, PORT, 0, 1),
+	BPF_STMT(BPF_RET + BPF_K, 236),
+	BPF_STMT(BPF_RET + BPF_K, 0),
+};
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+
+static int
+send_datagrams(void)
+{
+	struct sockaddr_in to;
+	unsigned char buf[NTP_LEN];
+	uint32_t seq;
+	int s, i;
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		perror("socket");
+		return (1);
+	}
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(buf, 0, sizeof(buf));
+
+	for (i = 0; i < NPKT; i++) {
+		seq = htonl(i);
+		memcpy(buf, &seq, sizeof(seq));
+		to.sin_port = htons(OTHER_PORT);
+		sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&to, sizeof(to));
+		to.sin_port = htons(PORT);
+		if (sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&to,
+				sizeof(to)) < 0) {
+			perror("sendto");
+			close(s);
+			return (1);
+		}
+	}
+	close(s);
+	return (0);
+}
+
+
+/* Sequence numbers of the first and last frames of the block */
+static int
+block_seqs(struct pktcap_ring *ring, void *block, uint32_t *first,
+		uint32_t *last)
+{
+	struct pktcap_ring_cursor cur;
+	struct pcap_pkthdr hdr;
+	unsigned char *frame;
+	uint32_t seq;
+	int n;
+
+	n = 0;
+	pktcap_ring_cursor_init(ring, &cur, block);
+	while ((frame = pktcap_ring_next_frame(&cur, &hdr)) != NULL) {
+		memcpy(&seq, frame + 14 + 20 + 8, sizeof(seq));
+		if (n++ == 0)
+			*first = ntohl(seq);
+		*last = ntohl(seq);
+	}
+	return (n);
+}
+
+
+static int
+check_wrap(struct pktcap_ring *ring)
+{
+	struct sockaddr_in to;
+	unsigned char buf[NTP_LEN];
+	void **held, *block;
+	uint32_t seq, next_seq, first, last;
+	unsigned int n, i;
+	double start;
+	int s, ret, err;
+
+	held = calloc(ring->block_nr, sizeof(void *));
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (held == NULL || s < 0) {
+		free(held);
+		return (1);
+	}
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	to.sin_port = htons(PORT);
+	memset(buf, 0, sizeof(buf));
+
+	/* A datagram at a time, the kernel retires each block on its timeout */
+	err = 1;
+	next_seq = NPKT;
+	first = last = 0;
+	n = 0;
+	start = now();
+	while (n < ring->block_nr && now() - start < 10) {
+		seq = htonl(next_seq++);
+		memcpy(buf, &seq, sizeof(seq));
+		sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&to, sizeof(to));
+		if (pktcap_ring_next_block(ring, 100, &block) != 0)
+			continue;
+		if (block_seqs(ring, block, &first, &last) == 0) {
+			fprintf(stderr, "Empty block handed over\n");
+			goto out;
+		}
+		held[n++] = block;
+	}
+	if (n < ring->block_nr) {
+		fprintf(stderr, "Only %u blocks of %u filled\n", n, ring->block_nr);
+		goto out;
+	}
+
+	/* The next block is still held */
+	seq = htonl(next_seq++);
+	memcpy(buf, &seq, sizeof(seq));
+	sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&to, sizeof(to));
+	if (pktcap_ring_next_block(ring, 100, &block) != 1) {
+		fprintf(stderr, "Block handed over again before it was given back\n");
+		goto out;
+	}
+
+	/* Once given back, it comes round again with new frames */
+	pktcap_ring_release_block(ring, held[0]);
+	held[0] = NULL;
+	start = now();
+	do {
+		seq = htonl(next_seq++);
+		memcpy(buf, &seq, sizeof(seq));
+		sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&to, sizeof(to));
+		ret = pktcap_ring_next_block(ring, 100, &block);
+	} while (ret == 1 && now() - start < 5);
+	if (ret != 0) {
+		fprintf(stderr, "Block given back not handed over again (%d)\n", ret);
+		goto out;
+	}
+	held[0] = block;
+	if (block_seqs(ring, block, &first, &seq) == 0 || first <= last) {
+		fprintf(stderr, "Block filled again starts at seq %u, last held %u\n",
+				first, last);
+		goto out;
+	}
+	fprintf(stdout, "%u blocks held, ring waited for the first one\n", n);
+	err = 0;
+
+out:
+	for (i = 0; i < n; i++)
+		if (held[i])
+			pktcap_ring_release_block(ring, held[i]);
+	close(s);
+	free(held);
+	return (err);
+}
+
+
+/* Room left for the SLL header by the kernel in every frame of the block */
+static int
+check_headroom(void *block)
+{
+	struct tpacket_block_desc *bd = block;
+	struct tpacket3_hdr *tp;
+	unsigned int i, room;
+
+	tp = (struct tpacket3_hdr *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+		room = tp->tp_net - TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) -
+				sizeof(struct sockaddr_ll);
+		if (tp->tp_net < TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) +
+				sizeof(struct sockaddr_ll) || room < 16) {
+			fprintf(stderr, "Only %u bytes before the network header\n", room);
+			return (1);
+		}
+		tp = (struct tpacket3_hdr *)((char *)tp + tp->tp_next_offset);
+	}
+	return (0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct pktcap_ring *ring;
+	struct pktcap_ring_cursor cur;
+	struct bpf_program filter;
+	struct pcap_pkthdr hdr;
+	unsigned char *frame;
+	void *block;
+	uint32_t seq;
+	uint16_t port;
+	double start;
+	int frames, blocks, err;
+
+	filter.bf_len = sizeof(udp_port_insns) / sizeof(udp_port_insns[0]);
+	filter.bf_insns = (struct bpf_insn *) udp_port_insns;
+
+	if (pktcap_ring_open("lo", &filter, 10, &ring)) {
+		fprintf(stdout, "Cannot open a capture ring on lo, skipping\n");
+		return (SKIP);
+	}
+
+	if (send_datagrams()) {
+		pktcap_ring_close(ring);
+		return (1);
+	}
+
+	frames = 0;
+	blocks = 0;
+	start = now();
+	while (frames < NPKT && now() - start < 5) {
+		err = pktcap_ring_next_block(ring, 100, &block);
+		if (err == 1)
+			continue;
+		if (err) {
+			fprintf(stderr, "Error %d waiting for a block\n", err);
+			goto fail;
+		}
+		blocks++;
+		if (check_headroom(block))
+			goto fail;
+
+		pktcap_ring_cursor_init(ring, &cur, block);
+		while ((frame = pktcap_ring_next_frame(&cur, &hdr)) != NULL) {
+			/* Read in place */
+			if (frame < (unsigned char *)ring->map ||
+					frame + hdr.caplen > (unsigned char *)ring->map + ring->map_len) {
+				fprintf(stderr, "Frame outside of the ring\n");
+				goto fail;
+			}
+			if (hdr.caplen != 14 + 20 + 8 + NTP_LEN || hdr.len != hdr.caplen) {
+				fprintf(stderr, "Unexpected frame length %u/%u\n", hdr.caplen,
+						hdr.len);
+				goto fail;
+			}
+			memcpy(&port, frame + 14 + 20 + 2, sizeof(port));
+			memcpy(&seq, frame + 14 + 20 + 8, sizeof(seq));
+			if (ntohs(port) != PORT || ntohl(seq) != (uint32_t)frames) {
+				fprintf(stderr, "Got port %u seq %u, expected port %u seq %d\n",
+						ntohs(port), ntohl(seq), PORT, frames);
+				goto fail;
+			}
+			frames++;
+		}
+		pktcap_ring_release_block(ring, block);
+	}
+
+	if (frames != NPKT) {
+		fprintf(stderr, "Got %d frames out of %d\n", frames, NPKT);
+		goto fail;
+	}
+	fprintf(stdout, "%d frames in %d blocks (%.1f frames per block)\n", frames,
+			blocks, (double)frames / blocks);
+
+	/* Breaking the loop is noticed on the next wait */
+	pktcap_ring_breakloop(ring);
+	err = pktcap_ring_next_block(ring, 100, &block);
+	if (err != -2) {
+		fprintf(stderr, "Break loop not honoured (%d)\n", err);
+		goto fail;
+	}
+
+	if (check_wrap(ring))
+		goto fail;
+
+	pktcap_ring_close(ring);
+	return (0);
+
+fail:
+	pktcap_ring_close(ring);
+	return (1);
+}
+
+#else
+
+int
+main(int argc, char **argv)
+{
+	fprintf(stdout, "No TPACKET_V3 capture ring on this system, skipping\n");
+	return (SKIP);
+}
+
+#endif
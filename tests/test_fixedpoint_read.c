@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Accuracy and throughput of the fixed-point reads (radclock_gettime_ns and
+ * friends) against the long double path.
+ *
+ * The SMS is set up on a private key (sms_fixture.h) and published with
+ * sms_write, with a counter driven by the test, so no daemon is needed. For
+ * counters from 14 MHz (HPET) to 10 GHz, counter values from 1000 s before the
+ * last update to a day after it, across an expected leap second, are converted
+ * both ways. The ns result must be the long double time truncated to the ns to
+ * within 1 ns.
+ *
+ * Usage: test_fixedpoint_read [calls]
+ */
+
+#include "../config.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "sms_fixture.h"
+
+
+/* Clock on a counter at freq, updated at counter value update, with period
+ * errors and the leap second an hour later */
+static void
+publish(struct radclock *clock, double freq, vcounter_t update)
+{
+	struct radclock_data rd;
+	struct radclock_error re;
+
+	sms_fixture_data(&rd, &re, freq, update, 0);
+	rd.phat = 1 / freq * (1 + 3.3e-5);
+	rd.phat_local = rd.phat * (1 - 2.5e-7);
+	rd.ca = 1.7e9 + 0.123456789 - update * (long double)rd.phat + 37;
+	rd.leapsec_expected = update + (vcounter_t) (3600 * freq);
+	sms_write(clock, &rd, &re);
+}
+
+
+/* Largest difference [ns] to the truncated long double time over n values
+ * from 1000s before the update to a day after */
+static long double
+check(struct radclock *clock, double freq, vcounter_t update, int n,
+		long double *maxerr)
+{
+	long double time, diff, maxdiff = 0;
+	vcounter_t vcount;
+	int64_t ns;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		vcount = update - (vcounter_t) (1000 * freq) +
+			(vcounter_t) (i * (87400 * freq / (n - 1)));
+		/* hit both sides of the origin and of the leap second */
+		if (i == n / 2)
+			vcount = update - 1;
+		if (i == n / 2 + 1)
+			vcount = update + (vcounter_t) (3600 * freq);
+		if (i == n / 2 + 2)
+			vcount = update + (vcounter_t) (3600 * freq) + 1;
+
+		radclock_vcount_to_abstime(clock, &vcount, &time);
+		radclock_vcount_to_abstime_ns(clock, &vcount, &ns);
+		diff = fabsl(ns - floorl(time * 1e9L));
+		if (diff > maxdiff)
+			maxdiff = diff;
+		diff = fabsl(ns - time * 1e9L);
+		if (diff > *maxerr)
+			*maxerr = diff;
+	}
+	return (maxdiff);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock *clock;
+	struct radclock_sms *sms;
+	radclock_local_period_t mode;
+	struct timespec ts;
+	long double time, maxdiff, maxerr, sink = 0;
+	vcounter_t update = (vcounter_t) 1 << 50;
+	double freqs[] = { 14.31818e6, 24e6, 1e9, 3e9, 10e9 };
+	double t, ns_ld, ns_fp;
+	int64_t ns;
+	int f, i, n, err = 0;
+
+	n = (argc > 1) ? atoi(argv[1]) : 2000000;
+	if (n < 1) {
+		fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+		return (1);
+	}
+
+	clock = sms_fixture_create();
+	if (clock == NULL)
+		return (SMS_FIXTURE_SKIP);
+	sms = (struct radclock_sms *) clock->ipc_sms;
+
+	/* The local period path of the library is noisy on stdout, check it on
+	 * fewer values */
+	for (f = 0; f < sizeof(freqs) / sizeof(freqs[0]); f++) {
+		publish(clock, freqs[f], update);
+		maxerr = 0;
+		mode = RADCLOCK_LOCAL_PERIOD_OFF;
+		radclock_set_local_period_mode(clock, &mode);
+		maxdiff = check(clock, freqs[f], update, 100000, &maxerr);
+		mode = RADCLOCK_LOCAL_PERIOD_ON;
+		radclock_set_local_period_mode(clock, &mode);
+		time = check(clock, freqs[f], update, 20, &maxerr);
+		maxdiff = time > maxdiff ? time : maxdiff;
+		fprintf(stdout, "%12.0f Hz: shift %u, max difference to truncated long "
+				"double %.0Lf [ns], to long double %.3Lf [ns]\n", freqs[f],
+				sms->v2.fp.shift, maxdiff, maxerr);
+		if (maxdiff > 1) {
+			fprintf(stdout, "FAIL: fixed-point read off by more than 1 ns\n");
+			err++;
+		}
+	}
+
+	/* timespec and ns reads agree */
+	sms_fixture_counter = update + 12345678;
+	radclock_gettime_ns(clock, &ns);
+	radclock_gettime_timespec(clock, &ts);
+	if (ts.tv_sec != ns / 1000000000 || ts.tv_nsec != ns % 1000000000) {
+		fprintf(stdout, "FAIL: timespec %ld.%09ld != %lld [ns]\n",
+				(long) ts.tv_sec, ts.tv_nsec, (long long) ns);
+		err++;
+	}
+
+	/* Throughput, 3 GHz counter */
+	publish(clock, 3e9, update);
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+
+	t = sms_fixture_now();
+	for (i = 0; i < n; i++) {
+		sms_fixture_counter = update + i;
+		radclock_gettime(clock, &time);
+		sink += time;
+	}
+	ns_ld = (sms_fixture_now() - t) * 1e9 / n;
+
+	t = sms_fixture_now();
+	for (i = 0; i < n; i++) {
+		sms_fixture_counter = update + i;
+		radclock_gettime_ns(clock, &ns);
+		sink += ns;
+	}
+	ns_fp = (sms_fixture_now() - t) * 1e9 / n;
+
+	fprintf(stdout, "Cost per read: long double %.1f [ns], fixed-point %.1f [ns] "
+			"(sink %d)\n", ns_ld, ns_fp, sink > 0);
+	fprintf(stdout, "%s\n", err ? "FAILED" : "OK");
+
+	radclock_destroy(clock);
+
+	return (err ? 1 : 0);
+}
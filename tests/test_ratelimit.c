@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Check of the NTP server rate limiter (radclock/ratelimit.c), on a simulated
+ * clock. A client sending faster than the rate is answered burst + rate * T
+ * times over T seconds (the last token may fall at T), is sent a KoD at most once per second, and does not
+ * limit other clients. IPv6 clients are limited per /64 prefix, IPv4-mapped
+ * addresses as IPv4 ones. A client in debt keeps its state through a flood of
+ * new sources filling the table. Threads sharing a table, as the NTP server
+ * threads do, give a client the limit once between them.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+#define RATE		10.0		// [requests/s]
+#define BURST		5
+#define SECOND		1000000000ULL
+#define T0			(1000 * SECOND)
+#define LAST		(T0 + SECOND - SECOND / 1000)	// last request of a 1 s flood
+#define THREADS		4
+
+
+static struct sockaddr_storage
+v4(const char *ip)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+
+	memset(&ss, 0, sizeof(ss));
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &sin->sin_addr);
+	return (ss);
+}
+
+static struct sockaddr_storage
+v6(const char *ip)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+
+	memset(&ss, 0, sizeof(ss));
+	sin6->sin6_family = AF_INET6;
+	inet_pton(AF_INET6, ip, &sin6->sin6_addr);
+	return (ss);
+}
+
+
+/* Requests of sa every step ns over [start, end), counted by outcome */
+static void
+flood(struct ratelimit *rl, struct sockaddr_storage *sa, uint64_t start,
+		uint64_t end, uint64_t step, long count[3])
+{
+	uint64_t t;
+
+	count[RATELIMIT_PASS] = 0;
+	count[RATELIMIT_KOD] = 0;
+	count[RATELIMIT_DROP] = 0;
+	for (t = start; t < end; t += step)
+		count[ratelimit_check(rl, (struct sockaddr *) sa, t)]++;
+}
+
+
+static int
+check_flood(void)
+{
+	struct ratelimit *rl;
+	struct sockaddr_storage a, b;
+	long count[3];
+	int i, ret;
+
+	ret = 0;
+	rl = ratelimit_create(RATE, BURST, 1);
+	a = v4("192.0.2.1");
+	b = v4("192.0.2.2");
+
+	/* A burst goes through at once, then one per token interval */
+	for (i = 0; i < BURST; i++)
+		if (ratelimit_check(rl, (struct sockaddr *) &a, T0) != RATELIMIT_PASS) {
+			fprintf(stdout, "FAIL request %d of a burst limited\n", i);
+			ret = 1;
+		}
+	if (ratelimit_check(rl, (struct sockaddr *) &a, T0) != RATELIMIT_KOD ||
+			ratelimit_check(rl, (struct sockaddr *) &a, T0) != RATELIMIT_DROP) {
+		fprintf(stdout, "FAIL over the burst, expected a KoD then a drop\n");
+		ret = 1;
+	}
+	if (ratelimit_check(rl, (struct sockaddr *) &a, T0 + SECOND / RATE)
+			!= RATELIMIT_PASS) {
+		fprintf(stdout, "FAIL no token after one interval\n");
+		ret = 1;
+	}
+
+	/* 1000 requests/s over 10 s, from a fresh bucket */
+	flood(rl, &a, T0 + 100 * SECOND, T0 + 110 * SECOND, SECOND / 1000, count);
+	fprintf(stdout, "flood: %ld answered, %ld KoD, %ld dropped\n",
+			count[RATELIMIT_PASS], count[RATELIMIT_KOD], count[RATELIMIT_DROP]);
+	if (count[RATELIMIT_PASS] < BURST + 10 * RATE - 1 ||
+			count[RATELIMIT_PASS] > BURST + 10 * RATE) {
+		fprintf(stdout, "FAIL expected %.0f answers\n", BURST + 10 * RATE);
+		ret = 1;
+	}
+	if (count[RATELIMIT_KOD] < 10 || count[RATELIMIT_KOD] > 11) {
+		fprintf(stdout, "FAIL expected one KoD per second\n");
+		ret = 1;
+	}
+
+	/* Another client at the rate is never limited, even during the flood */
+	for (i = 0; i < 100; i++) {
+		ratelimit_check(rl, (struct sockaddr *) &a, T0 + 200 * SECOND + i *
+				SECOND / RATE);
+		if (ratelimit_check(rl, (struct sockaddr *) &b, T0 + 200 * SECOND + i *
+				SECOND / RATE) != RATELIMIT_PASS) {
+			fprintf(stdout, "FAIL client at the rate limited\n");
+			ret = 1;
+			break;
+		}
+	}
+	ratelimit_free(rl);
+
+	/* Without KoD, requests over the limit are all dropped */
+	rl = ratelimit_create(RATE, BURST, 0);
+	flood(rl, &a, T0, T0 + 10 * SECOND, SECOND / 1000, count);
+	if (count[RATELIMIT_KOD] != 0 || count[RATELIMIT_PASS] > BURST + 10 * RATE) {
+		fprintf(stdout, "FAIL KoD sent or too many answers with KoD off\n");
+		ret = 1;
+	}
+	ratelimit_free(rl);
+	return (ret);
+}
+
+
+static int
+check_keys(void)
+{
+	struct ratelimit *rl;
+	struct sockaddr_storage a, b, c, m, u;
+	long count[3];
+	int ret;
+
+	ret = 0;
+	rl = ratelimit_create(RATE, BURST, 0);
+
+	/* Two hosts of a /64 share their bucket, the next /64 does not. Right
+	 * after a flood, the bucket of the flooding client is empty. */
+	a = v6("2001:db8:0:1::1");
+	b = v6("2001:db8:0:1:ffff::2");
+	c = v6("2001:db8:0:2::1");
+	flood(rl, &a, T0, T0 + SECOND, SECOND / 1000, count);
+	if (ratelimit_check(rl, (struct sockaddr *) &b, LAST) != RATELIMIT_DROP) {
+		fprintf(stdout, "FAIL IPv6 hosts of a /64 not limited together\n");
+		ret = 1;
+	}
+	if (ratelimit_check(rl, (struct sockaddr *) &c, LAST) != RATELIMIT_PASS) {
+		fprintf(stdout, "FAIL IPv6 /64 limited by another\n");
+		ret = 1;
+	}
+
+	/* IPv4-mapped addresses are the IPv4 client */
+	a = v4("198.51.100.7");
+	m = v6("::ffff:198.51.100.7");
+	flood(rl, &a, T0, T0 + SECOND, SECOND / 1000, count);
+	if (ratelimit_check(rl, (struct sockaddr *) &m, LAST) != RATELIMIT_DROP) {
+		fprintf(stdout, "FAIL IPv4-mapped address not limited as IPv4\n");
+		ret = 1;
+	}
+
+	/* Unknown families are not limited */
+	memset(&u, 0, sizeof(u));
+	u.ss_family = AF_UNIX;
+	flood(rl, &u, T0, T0 + SECOND, SECOND / 1000, count);
+	if (count[RATELIMIT_PASS] != 1000) {
+		fprintf(stdout, "FAIL unknown address family limited\n");
+		ret = 1;
+	}
+	ratelimit_free(rl);
+	return (ret);
+}
+
+
+static int
+check_eviction(void)
+{
+	struct ratelimit *rl;
+	struct sockaddr_storage a, s;
+	struct sockaddr_in *sin;
+	long count[3];
+	uint32_t i, n;
+	uint64_t t;
+	int ret;
+
+	ret = 0;
+	rl = ratelimit_create(RATE, BURST, 0);
+	a = v4("203.0.113.1");
+	flood(rl, &a, T0, T0 + SECOND, SECOND / 1000, count);
+
+	/* Spoofed sources, one request each, four times the table size. They
+	 * evict each other, and not the client in debt. */
+	n = 4 * RATELIMIT_SETS * RATELIMIT_WAYS;
+	s = v4("10.0.0.0");
+	sin = (struct sockaddr_in *) &s;
+	t = LAST;
+	for (i = 0; i < n; i++) {
+		sin->sin_addr.s_addr = htonl(0x0a000000 + i);
+		if (ratelimit_check(rl, (struct sockaddr *) &s, t) != RATELIMIT_PASS) {
+			fprintf(stdout, "FAIL new source limited\n");
+			ret = 1;
+			break;
+		}
+	}
+	fprintf(stdout, "%u new sources, %llu evicted early\n", n,
+			(unsigned long long) ratelimit_evictions(rl));
+	if (ratelimit_evictions(rl) < n - RATELIMIT_SETS * RATELIMIT_WAYS) {
+		fprintf(stdout, "FAIL table holds more clients than its size\n");
+		ret = 1;
+	}
+	if (ratelimit_check(rl, (struct sockaddr *) &a, t) != RATELIMIT_DROP) {
+		fprintf(stdout, "FAIL client in debt evicted by new sources\n");
+		ret = 1;
+	}
+	ratelimit_free(rl);
+	return (ret);
+}
+
+
+struct charger {
+	pthread_t tid;
+	struct ratelimit *rl;
+	long count[3];
+};
+
+/* Requests of one client at the same time, as seen by a server thread */
+static void *
+charge(void *arg)
+{
+	struct charger *c = arg;
+	struct sockaddr_storage a;
+	int i;
+
+	a = v4("203.0.113.1");
+	for (i = 0; i < 100000; i++)
+		c->count[ratelimit_check(c->rl, (struct sockaddr *) &a, T0)]++;
+	return (NULL);
+}
+
+
+static int
+check_threads(void)
+{
+	struct ratelimit *rl;
+	struct charger c[THREADS];
+	long pass, kod;
+	int i;
+
+	rl = ratelimit_create(RATE, BURST, 1);
+	memset(c, 0, sizeof(c));
+	for (i = 0; i < THREADS; i++) {
+		c[i].rl = rl;
+		if (pthread_create(&c[i].tid, NULL, charge, &c[i])) {
+			fprintf(stdout, "FAIL cannot create thread\n");
+			return (1);
+		}
+	}
+	pass = 0;
+	kod = 0;
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(c[i].tid, NULL);
+		pass += c[i].count[RATELIMIT_PASS];
+		kod += c[i].count[RATELIMIT_KOD];
+	}
+	ratelimit_free(rl);
+
+	fprintf(stdout, "%d threads: %ld passed, %ld KoD\n", THREADS, pass, kod);
+	if (pass != BURST || kod != 1) {
+		fprintf(stdout, "FAIL limit not shared between threads\n");
+		return (1);
+	}
+	return (0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int ret;
+
+	if (ratelimit_create(RATE, 0, 1) != NULL ||
+			ratelimit_create(0, BURST, 1) != NULL) {
+		fprintf(stdout, "FAIL invalid rate or burst accepted\n");
+		return (1);
+	}
+
+	ret = check_flood();
+	ret |= check_keys();
+	ret |= check_eviction();
+	ret |= check_threads();
+	if (ret == 0)
+		fprintf(stdout, "PASS\n");
+	return (ret);
+}
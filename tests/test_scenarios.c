@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * End to end scenarios of the synchronization, in virtual time.
+ *
+ * A host polls virtual servers whose paths and clocks follow a scenario file
+ * (see ntp_pathmodel.h), the same models the stand-in server ntp_standin plays
+ * live. Requests and replies are laid out as captured frames, stamped with a
+ * simulated host counter, and handed to update_stamp_queue() in arrival order,
+ * as get_network_stamp() does. Fullstamps are taken out of the queue and run
+ * through RADalgo_bidir(), one algo state per server as in process_stamp().
+ * Everything being simulated, a run is deterministic and takes no longer than
+ * the algo needs, whatever the number of servers and poll period.
+ *
+ * The clock error is measured on each stamp, at Tf, against the true time plus
+ * the bias the model says cannot be seen from the client: half the asymmetry
+ * of the minimum delays, and the server clock error. Checks are made once the
+ * warmup is over and out of the settle time after a level shift or a server
+ * clock step. The scenario checks give bounds on the p99 and max errors, on
+ * the final rate error of the counter period, and on the fraction of requests
+ * making it to the algo.
+ *
+ * Output is one line per scenario, fields separated by spaces, after a '%'
+ * commented header naming them. Errors are in [mus], the rate error in [PPM].
+ *
+ * usage: test_scenarios [scenario files]
+ *   without files, runs all $srcdir/scenarios/ *.scn
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include <dirent.h>
+#include <math.h>
+#include <pcap.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "proto_ntp.h"
+#include "misc.h"
+#include "sync_history.h"
+#include "sync_thetahat.h"
+#include "sync_algo.h"
+#include "create_stamp.h"
+#include "stamp_queue.h"
+#include "rawdata.h"
+#include "config_mgr.h"
+#include "ntp_pathmodel.h"
+
+#define HOST_ADDR		0x0a000001		// 10.0.0.1
+#define SERVER_ADDR		0x0a000101		// 10.0.1.x
+#define EPOCH			1700000000		// UTC of the scenario start [s]
+#define COUNTER_HZ		1e9				// nominal host counter rate
+#define VCOUNT_START	1000000000ULL
+#define MAX_INFLIGHT	1024			// replies on their way, per server
+
+/* Events of the simulation: a request to send, or a reply to deliver */
+struct sim_pkt {
+	int server;
+	int mode;
+	uint64_t id;
+	long double rec;
+	long double xmt;
+};
+
+struct result {
+	long requests;
+	long replies;
+	long fullstamps;
+	long stamps;		// processed by the algo
+	long stale;			// fullstamps out of order, skipped
+	long nerr;
+	double err_p50;
+	double err_p99;
+	double err_max;
+	double phat_err;
+	double stamps_per_s;
+};
+
+
+/* The packet code and the algo log through the daemon verbose(), count warnings */
+static long warnings = 0;
+
+void
+verbose(int facility, const char *format, ...)
+{
+	if (facility == LOG_WARNING || facility == LOG_ERR)
+		warnings++;
+}
+
+int
+get_verbose_level(void)
+{
+	return (0);
+}
+
+
+/* Host counter and true time */
+static vcounter_t
+host_vcount(struct pm_scenario *sc, double t)
+{
+	return (VCOUNT_START + (vcounter_t) llround(t * COUNTER_HZ *
+			(1 + sc->skew * 1e-6)));
+}
+
+static double
+host_time(struct pm_scenario *sc, vcounter_t vcount)
+{
+	return ((double)(vcount - VCOUNT_START) / (COUNTER_HZ * (1 + sc->skew * 1e-6)));
+}
+
+static l_fp
+ntp_time(long double utc)
+{
+	l_fp ts;
+
+	UTCld_to_NTPtime(&utc, &ts);
+	ts.l_int = htonl(ts.l_int);
+	ts.l_fra = htonl(ts.l_fra);
+	return (ts);
+}
+
+
+/* The frame of a request or reply, as captured on the host */
+static void
+make_frame(struct rd_pcap_pkt *rd, struct sim_pkt *p, vcounter_t vcount)
+{
+	struct ether_header *eh;
+	struct ip *iph;
+	struct udphdr *udph;
+	struct ntp_pkt *ntp;
+	size_t len;
+
+	memset(rd, 0, sizeof(struct rd_pcap_pkt));
+	len = sizeof(struct ether_header) + sizeof(struct ip) +
+			sizeof(struct udphdr) + LEN_PKT_NOMAC;
+
+	eh = (struct ether_header *) rd->buf;
+	eh->ether_type = htons(ETHERTYPE_IP);
+
+	iph = (struct ip *) (rd->buf + sizeof(struct ether_header));
+	iph->ip_v = 4;
+	iph->ip_hl = sizeof(struct ip) / 4;
+	iph->ip_len = htons(len - sizeof(struct ether_header));
+	iph->ip_ttl = 64;
+	iph->ip_p = IPPROTO_UDP;
+	if (p->mode == MODE_CLIENT) {
+		iph->ip_src.s_addr = htonl(HOST_ADDR);
+		iph->ip_dst.s_addr = htonl(SERVER_ADDR + p->server);
+	} else {
+		iph->ip_src.s_addr = htonl(SERVER_ADDR + p->server);
+		iph->ip_dst.s_addr = htonl(HOST_ADDR);
+	}
+
+	udph = (struct udphdr *) ((char *)iph + sizeof(struct ip));
+	udph->uh_sport = htons(123);
+	udph->uh_dport = htons(123);
+	udph->uh_ulen = htons(sizeof(struct udphdr) + LEN_PKT_NOMAC);
+
+	ntp = (struct ntp_pkt *) ((char *)udph + sizeof(struct udphdr));
+	ntp->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING, NTP_VERSION, p->mode);
+	if (p->mode == MODE_CLIENT) {
+		ntp->xmt.l_int = htonl(p->id >> 32);
+		ntp->xmt.l_fra = htonl(p->id & 0xffffffff);
+	} else {
+		ntp->stratum = 1;
+		ntp->refid = htonl(0x53494d00);		// "SIM"
+		ntp->org.l_int = htonl(p->id >> 32);
+		ntp->org.l_fra = htonl(p->id & 0xffffffff);
+		ntp->reftime = ntp_time(p->rec - 1);
+		ntp->rec = ntp_time(p->rec);
+		ntp->xmt = ntp_time(p->xmt);
+	}
+
+	rd->vcount = vcount;
+	rd->pcap_hdr.caplen = len;
+	rd->pcap_hdr.len = len;
+}
+
+
+static void
+free_state(struct bidir_algostate *state)
+{
+	history_free(&state->stamp_hist);
+	history_free(&state->Tf_hist);
+	history_free(&state->Df_hist);
+	history_free(&state->Db_hist);
+	history_free(&state->Dfhat_hist);
+	history_free(&state->Dbhat_hist);
+	history_free(&state->Asymhat_hist);
+	history_free(&state->RTT_hist);
+	history_free(&state->RTThat_hist);
+	history_free(&state->thnaive_hist);
+	history_minwin_free(&state->RTT_shift_mw);
+	history_minwin_free(&state->RTT_near_mw);
+	history_minwin_free(&state->RTT_far_mw);
+	history_minwin_free(&state->Df_shift_mw);
+	history_minwin_free(&state->Db_shift_mw);
+	if (state->thwin != NULL) {
+		thwin_free(state->thwin);
+		free(state->thwin);
+	}
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+
+/*
+ * Hand a fullstamp to the algo of its server, as process_stamp() does, and
+ * measure the clock error at Tf.
+ */
+static void
+process(struct radclock_handle *handle, struct pm_scenario *sc,
+		struct bidir_algodata *algodata, struct radclock_data *rad_data,
+		struct radclock_error *rad_error, struct stamp_t *stamp,
+		double *err, struct result *res)
+{
+	struct in_addr addr;
+	long double ca;
+	double t;
+	int s;
+
+	if (inet_pton(AF_INET, stamp->server_ipaddr, &addr) != 1)
+		return;
+	s = ntohl(addr.s_addr) - SERVER_ADDR;
+	if (s < 0 || s >= sc->nservers)
+		return;
+
+	/* Out of order stamps are insane for the algo */
+	if (algodata->output[s].n_stamps > 0 &&
+			BST(stamp)->Ta <= BST(&algodata->laststamp[s])->Ta) {
+		res->stale++;
+		return;
+	}
+	algodata->laststamp[s] = *stamp;
+	RADalgo_bidir(handle, &algodata->state[s], BST(stamp), 0, &rad_data[s],
+			&rad_error[s], &algodata->output[s]);
+	res->stamps++;
+
+	t = host_time(sc, BST(stamp)->Tf);
+	if (t < sc->check.warmup || pm_settling(sc, s, t))
+		return;
+	ca = algodata->output[s].K - (long double)algodata->output[s].thetahat;
+	ca += (long double)(BST(stamp)->Tf * algodata->output[s].phat);
+	err[res->nerr++] = fabs((double)(ca - EPOCH - t) - pm_bias(sc, s, t));
+}
+
+
+static int
+run(struct radclock_handle *handle, struct pm_scenario *sc, struct result *res)
+{
+	struct bidir_algodata algodata;
+	struct radclock_data *rad_data;
+	struct radclock_error *rad_error;
+	struct timeref_stats stats;
+	struct pm_rng rng[PM_MAX_SERVERS];
+	struct pm_exchange ex;
+	struct pm_heap heap;
+	struct rd_pcap_pkt rd;
+	struct sim_pkt *p, *reply;
+	struct stamp_t stamp;
+	radpcap_packet_t view;
+	double t, *err, t0;
+	long maxstamps;
+	int s, k;
+
+	memset(res, 0, sizeof(struct result));
+	memset(&stats, 0, sizeof(stats));
+	memset(&view, 0, sizeof(view));
+	handle->conf->poll_period = sc->poll;
+
+	algodata.laststamp = calloc(sc->nservers, sizeof(struct stamp_t));
+	algodata.state = calloc(sc->nservers, sizeof(struct bidir_algostate));
+	algodata.output = calloc(sc->nservers, sizeof(struct bidir_algooutput));
+	rad_data = calloc(sc->nservers, sizeof(struct radclock_data));
+	rad_error = calloc(sc->nservers, sizeof(struct radclock_error));
+	maxstamps = (long)(sc->duration / sc->poll + 1) * sc->nservers;
+	err = malloc(maxstamps * sizeof(double));
+	if (algodata.laststamp == NULL || algodata.state == NULL ||
+			algodata.output == NULL || rad_data == NULL || rad_error == NULL ||
+			err == NULL || pm_heap_init(&heap, MAX_INFLIGHT * sc->nservers))
+		return (1);
+	init_stamp_queue(&algodata);
+
+	/* First requests spread over the poll period */
+	for (s = 0; s < sc->nservers; s++) {
+		algodata.state[s].stamp_i = -1;
+		pm_rng_init(&rng[s], sc->seed, s);
+		p = calloc(1, sizeof(struct sim_pkt));
+		p->server = s;
+		p->mode = MODE_CLIENT;
+		pm_heap_push(&heap, (double)sc->poll * s / sc->nservers, p);
+	}
+
+	t0 = now();
+	while ((p = pm_heap_pop(&heap, &t)) != NULL) {
+		if (p->mode == MODE_CLIENT) {
+			if (t >= sc->duration) {
+				free(p);
+				continue;
+			}
+			/* The request nonce is the host time, as the NTP client sends */
+			p->id = ((uint64_t)(EPOCH + (uint64_t)t + JAN_1970) << 32) |
+					(uint32_t)((t - floor(t)) * 4294967296.0);
+			res->requests++;
+
+			pm_exchange(sc, p->server, &rng[p->server], t, &ex);
+			for (k = 0; k < ex.nreplies; k++) {
+				reply = malloc(sizeof(struct sim_pkt));
+				reply->server = p->server;
+				reply->mode = MODE_SERVER;
+				reply->id = p->id;
+				reply->rec = EPOCH + (long double)t + ex.fwd + ex.rec_err;
+				reply->xmt = EPOCH + (long double)t + ex.fwd + ex.service +
+						ex.xmt_err;
+				if (pm_heap_push(&heap, t + ex.fwd + ex.service + ex.back[k],
+						reply))
+					free(reply);
+			}
+		} else
+			res->replies++;
+
+		make_frame(&rd, p, host_vcount(sc, t));
+		view.header = &rd.pcap_hdr;
+		view.payload = rd.buf;
+		view.size = rd.pcap_hdr.caplen + sizeof(struct pcap_pkthdr);
+		view.type = DLT_EN10MB;
+		view.live = 1;
+		view.vcount = rd.vcount;
+		((struct sockaddr_in *)&view.ss_if)->sin_family = AF_INET;
+		((struct sockaddr_in *)&view.ss_if)->sin_addr.s_addr = htonl(HOST_ADDR);
+
+		if (update_stamp_queue(algodata.q, &view, &stats) == 0 &&
+				get_fullstamp_from_queue_andclean(algodata.q, &stamp) == 0) {
+			res->fullstamps++;
+			process(handle, sc, &algodata, rad_data, rad_error, &stamp, err, res);
+		}
+
+		if (p->mode == MODE_CLIENT)
+			pm_heap_push(&heap, t + sc->poll, p);
+		else
+			free(p);
+	}
+	res->stamps_per_s = res->stamps / (now() - t0);
+
+	/* Counter period against the true one, worst server */
+	for (s = 0; s < sc->nservers; s++) {
+		t = fabs(algodata.output[s].phat * COUNTER_HZ *
+				(1 + sc->skew * 1e-6) - 1) * 1e6;
+		if (t > res->phat_err)
+			res->phat_err = t;
+	}
+	if (res->nerr > 0) {
+		qsort(err, res->nerr, sizeof(double), cmp_double);
+		res->err_p50 = err[res->nerr / 2];
+		res->err_p99 = err[(res->nerr * 99) / 100];
+		res->err_max = err[res->nerr - 1];
+	}
+
+	for (s = 0; s < sc->nservers; s++)
+		free_state(&algodata.state[s]);
+	destroy_stamp_queue(&algodata);
+	pm_heap_free(&heap);
+	free(algodata.laststamp);
+	free(algodata.state);
+	free(algodata.output);
+	free(rad_data);
+	free(rad_error);
+	free(err);
+	return (0);
+}
+
+
+/* Returns the number of failed checks, printed after the result line */
+static int
+check(struct pm_scenario *sc, struct result *res, char *msg, size_t len)
+{
+	struct pm_check *c;
+	int fail;
+
+	c = &sc->check;
+	fail = 0;
+	msg[0] = '\0';
+	if (c->error > 0 && (res->nerr == 0 || res->err_p99 > c->error)) {
+		snprintf(msg + strlen(msg), len - strlen(msg), " p99 error above %.1f",
+				c->error * 1e6);
+		fail++;
+	}
+	if (c->error_max > 0 && (res->nerr == 0 || res->err_max > c->error_max)) {
+		snprintf(msg + strlen(msg), len - strlen(msg), " max error above %.1f",
+				c->error_max * 1e6);
+		fail++;
+	}
+	if (c->phat > 0 && res->phat_err > c->phat) {
+		snprintf(msg + strlen(msg), len - strlen(msg), " rate error above %g",
+				c->phat);
+		fail++;
+	}
+	if (c->stamps > 0 && res->stamps < c->stamps * res->requests) {
+		snprintf(msg + strlen(msg), len - strlen(msg), " stamps below %g",
+				c->stamps);
+		fail++;
+	}
+	return (fail);
+}
+
+
+static int
+scn_filter(const struct dirent *d)
+{
+	size_t n;
+
+	n = strlen(d->d_name);
+	return (n > 4 && strcmp(d->d_name + n - 4, ".scn") == 0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock_handle *handle;
+	struct radclock_config *conf;
+	struct pm_scenario *sc;
+	struct result res;
+	struct dirent **ent;
+	char dir[1024], path[2048], msg[256];
+	const char *srcdir;
+	int i, n, failed;
+
+	handle = calloc(1, sizeof(struct radclock_handle));
+	conf = calloc(1, sizeof(struct radclock_config));
+	sc = malloc(sizeof(struct pm_scenario));
+	config_init(conf);
+	handle->conf = conf;
+	pthread_mutex_init(&handle->globaldata_mutex, NULL);
+
+	ent = NULL;
+	if (argc > 1)
+		n = argc - 1;
+	else {
+		srcdir = getenv("srcdir");
+		snprintf(dir, sizeof(dir), "%s/scenarios", srcdir ? srcdir : ".");
+		n = scandir(dir, &ent, scn_filter, alphasort);
+		if (n <= 0) {
+			fprintf(stdout, "FAIL no scenario found in %s\n", dir);
+			return (1);
+		}
+	}
+
+	fprintf(stdout, "%% scenario servers poll requests replies fullstamps stamps "
+			"stale warnings err_p50 err_p99 err_max phat_err stamps/s\n");
+	failed = 0;
+	for (i = 0; i < n; i++) {
+		if (ent)
+			snprintf(path, sizeof(path), "%s/%s", dir, ent[i]->d_name);
+		else
+			snprintf(path, sizeof(path), "%s", argv[i + 1]);
+		if (pm_load(path, sc)) {
+			fprintf(stdout, "FAIL cannot load scenario %s\n", path);
+			failed++;
+			continue;
+		}
+
+		warnings = 0;
+		if (run(handle, sc, &res)) {
+			fprintf(stdout, "FAIL %s: out of memory\n", sc->name);
+			return (1);
+		}
+		fprintf(stdout, "%s %d %d %ld %ld %ld %ld %ld %ld %.1f %.1f %.1f %.3f %.0f\n",
+				sc->name, sc->nservers, sc->poll, res.requests, res.replies,
+				res.fullstamps, res.stamps, res.stale, warnings,
+				res.err_p50 * 1e6, res.err_p99 * 1e6, res.err_max * 1e6,
+				res.phat_err, res.stamps_per_s);
+		if (check(sc, &res, msg, sizeof(msg))) {
+			fprintf(stdout, "FAIL %s:%s\n", sc->name, msg);
+			failed++;
+		}
+	}
+
+	if (ent) {
+		for (i = 0; i < n; i++)
+			free(ent[i]);
+		free(ent);
+	}
+	pthread_mutex_destroy(&handle->globaldata_mutex);
+	free(conf->time_server);
+	free(conf);
+	free(handle);
+	free(sc);
+	return (failed > 0);
+}
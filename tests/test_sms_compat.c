@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Compatibility of the SMS with version 1 daemons.
+ *
+ * Creates a segment of the size and layout a version 1 daemon makes, on a
+ * private key, and checks a reader attaches to it through the v1 fallback and
+ * reads the published data. Then checks a writer replaces it with a v2
+ * segment that new readers attach to as v2.
+ */
+
+#include "../config.h"
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+
+
+static int
+check_v1(key_t key)
+{
+	struct radclock clock;
+	struct radclock_sms_v1 *v1;
+	struct radclock_sms_fp fp;
+	struct radclock_data rd;
+	vcounter_t next;
+	double phat;
+	int id, err;
+
+	/* Segment as created and filled by a version 1 daemon */
+	id = shmget(key, sizeof(*v1), IPC_CREAT | IPC_EXCL | 0644);
+	if (id < 0) {
+		fprintf(stderr, "shmget: %s\n", strerror(errno));
+		return (77);
+	}
+	v1 = shmat(id, NULL, 0);
+	if (v1 == (void *) -1) {
+		fprintf(stderr, "shmat: %s\n", strerror(errno));
+		shmctl(id, IPC_RMID, NULL);
+		return (77);
+	}
+	memset(v1, 0, sizeof(*v1));
+	v1->version = 1;
+	v1->data_off = offsetof(struct radclock_sms_v1, bufdata);
+	v1->data_off_old = v1->data_off + sizeof(struct radclock_data);
+	v1->error_off = offsetof(struct radclock_sms_v1, buferr);
+	v1->error_off_old = v1->error_off + sizeof(struct radclock_error);
+	v1->bufdata[0].phat = 1e-9;
+	v1->bufdata[0].last_changed = 1234;
+	v1->buferr[0].error_bound = 5e-6;
+	v1->gen = 1;
+
+	err = 0;
+	memset(&clock, 0, sizeof(clock));
+	if (sms_attach_reader(&clock, key)) {
+		fprintf(stderr, "Cannot attach to a %zu byte v1 segment\n",
+				sizeof(*v1));
+		err = 1;
+	} else {
+		if (clock.ipc_sms_version != 1) {
+			fprintf(stderr, "Attached to v1 segment as version %d\n",
+					clock.ipc_sms_version);
+			err = 1;
+		}
+		sms_read(&clock, &rd, NULL);
+		if (rd.phat != 1e-9 || rd.last_changed != 1234) {
+			fprintf(stderr, "Wrong data read from v1 segment\n");
+			err = 1;
+		}
+		if (sms_read_fp(&clock, &fp, &next, &phat) == 0) {
+			fprintf(stderr, "Fixed-point clock read from v1 segment\n");
+			err = 1;
+		}
+		shmdt(clock.ipc_sms);
+	}
+	shmdt(v1);
+	return (err);
+}
+
+
+static int
+check_replaced(key_t key)
+{
+	struct radclock writer, reader;
+	int err;
+
+	err = 0;
+	memset(&writer, 0, sizeof(writer));
+	memset(&reader, 0, sizeof(reader));
+	if (sms_create_writer(&writer, key)) {
+		fprintf(stderr, "Cannot replace the v1 segment\n");
+		return (1);
+	}
+	if (sms_attach_reader(&reader, key) || reader.ipc_sms_version != 2) {
+		fprintf(stderr, "Reader not on v2 after the segment was replaced\n");
+		err = 1;
+	}
+	if (reader.ipc_sms)
+		shmdt(reader.ipc_sms);
+	shmdt(writer.ipc_sms);
+	shmctl(writer.ipc_sms_id, IPC_RMID, NULL);
+	return (err);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	char path[] = "/tmp/test_sms_compat.XXXXXX";
+	key_t key;
+	int fd, err;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return (77);
+	close(fd);
+	key = ftok(path, 'a');
+	if (key == -1) {
+		unlink(path);
+		return (77);
+	}
+
+	err = check_v1(key);
+	if (err == 0)
+		err = check_replaced(key);
+	else
+		shmctl(shmget(key, 0, 0), IPC_RMID, NULL);
+
+	unlink(path);
+	fprintf(stdout, "SMS v1 segment of %zu bytes: %s\n",
+			sizeof(struct radclock_sms_v1),
+			err == 0 ? "ok" : err == 77 ? "skipped" : "FAILED");
+	return (err);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Stress test of the SMS update protocols (sms_write / sms_read).
+ *
+ * One writer thread publishes clock data where every field is derived from an
+ * update counter k, while reader threads read it back and check all fields of
+ * each copy come from the same k (no torn read) and k never goes backwards.
+ * Each run is on a fresh segment set up on a private key (sms_fixture.h).
+ * Run once through the v2 seqlock and once forcing readers on the v1 protocol.
+ *
+ * Usage: test_sms_seqlock [seconds per protocol] [readers]
+ */
+
+#include "../config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "sms_fixture.h"
+
+#define MAX_READERS	16
+
+struct reader {
+	pthread_t tid;
+	struct radclock *clock;
+	long reads;
+	long torn;
+	long backwards;
+};
+
+static volatile int stop;
+
+
+static void
+fill(uint64_t k, struct radclock_data *rd, struct radclock_error *re)
+{
+	rd->phat				= (double) k;
+	rd->phat_err			= (double) k + 1;
+	rd->phat_local			= (double) k + 2;
+	rd->phat_local_err	= (double) k + 3;
+	rd->ca					= (long double) k + 0.25L;
+	rd->ca_err				= (double) k + 4;
+	rd->status				= (unsigned int) k;
+	rd->last_changed		= k;
+	rd->next_expected		= k + 5;
+	rd->leapsec_expected	= k + 6;
+	rd->leapsec_total		= (int) k;
+	rd->leapsec_next		= (int) (k & 1);
+	re->error_bound		= (double) k + 7;
+	re->error_bound_avg	= (double) k + 8;
+	re->error_bound_std	= (double) k + 9;
+	re->min_RTT				= (double) k + 10;
+}
+
+
+static int
+consistent(struct radclock_data *rd, struct radclock_error *re)
+{
+	struct radclock_data ed;
+	struct radclock_error ee;
+
+	fill(rd->last_changed, &ed, &ee);
+	return (rd->phat == ed.phat && rd->phat_err == ed.phat_err &&
+			rd->phat_local == ed.phat_local && rd->phat_local_err == ed.phat_local_err &&
+			rd->ca == ed.ca && rd->ca_err == ed.ca_err && rd->status == ed.status &&
+			rd->next_expected == ed.next_expected &&
+			rd->leapsec_expected == ed.leapsec_expected &&
+			rd->leapsec_total == ed.leapsec_total && rd->leapsec_next == ed.leapsec_next &&
+			re->error_bound == ee.error_bound && re->error_bound_avg == ee.error_bound_avg &&
+			re->error_bound_std == ee.error_bound_std && re->min_RTT == ee.min_RTT);
+}
+
+
+static void *
+reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	struct radclock_data rd;
+	struct radclock_error re;
+	vcounter_t last = 0;
+
+	while (!stop) {
+		sms_read(r->clock, &rd, &re);
+		r->reads++;
+		if (!consistent(&rd, &re))
+			r->torn++;
+		if (rd.last_changed < last)
+			r->backwards++;
+		last = rd.last_changed;
+	}
+	return (NULL);
+}
+
+
+static int
+run(int version, double duration, int nreaders)
+{
+	struct radclock *clock_w;
+	struct radclock clock_r[MAX_READERS];
+	struct reader readers[MAX_READERS];
+	struct radclock_data rd;
+	struct radclock_error re;
+	long reads = 0, torn = 0, backwards = 0;
+	uint64_t k;
+	double end;
+	int i;
+
+	clock_w = sms_fixture_create();
+	if (clock_w == NULL)
+		return (SMS_FIXTURE_SKIP);
+
+	k = 1;
+	fill(k, &rd, &re);
+	sms_write(clock_w, &rd, &re);
+
+	stop = 0;
+	memset(readers, 0, sizeof(readers));
+	for (i = 0; i < nreaders; i++) {
+		memset(&clock_r[i], 0, sizeof(struct radclock));
+		clock_r[i].ipc_sms = clock_w->ipc_sms;
+		clock_r[i].ipc_sms_version = version;
+		readers[i].clock = &clock_r[i];
+		if (pthread_create(&readers[i].tid, NULL, reader_thread, &readers[i])) {
+			fprintf(stderr, "Cannot create reader thread\n");
+			radclock_destroy(clock_w);
+			return (1);
+		}
+	}
+
+	end = sms_fixture_now() + duration;
+	do {
+		for (i = 0; i < 1024; i++) {
+			fill(++k, &rd, &re);
+			sms_write(clock_w, &rd, &re);
+		}
+	} while (sms_fixture_now() < end);
+	stop = 1;
+
+	for (i = 0; i < nreaders; i++) {
+		pthread_join(readers[i].tid, NULL);
+		reads += readers[i].reads;
+		torn += readers[i].torn;
+		backwards += readers[i].backwards;
+	}
+
+	fprintf(stdout, "SMS v%d: %llu updates, %d readers, %ld reads, %ld torn, "
+			"%ld backwards\n", version, (unsigned long long) k, nreaders, reads,
+			torn, backwards);
+
+	radclock_destroy(clock_w);
+	return (torn || backwards || !reads);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	double duration;
+	int nreaders, err;
+
+	duration = (argc > 1) ? atof(argv[1]) : 1.0;
+	nreaders = (argc > 2) ? atoi(argv[2]) : 3;
+	if (duration <= 0 || nreaders < 1 || nreaders > MAX_READERS) {
+		fprintf(stderr, "Usage: %s [seconds] [readers <= %d]\n", argv[0], MAX_READERS);
+		return (1);
+	}
+
+	err = run(2, duration, nreaders);
+	if (err == SMS_FIXTURE_SKIP)
+		return (err);
+	err |= run(1, duration, nreaders);
+	return (err);
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Check of the clock snapshot API against the radclock_* functions reading
+ * the SMS on each call: absolute time either side of the last update and of
+ * an expected leap second, elapsed and duration with the SKM scale check,
+ * quality and error bound. Also reports the cost of a time, quality and
+ * interval read both ways, in time and counter reads.
+ *
+ * The SMS is set up on a private key (sms_fixture.h) and published with
+ * sms_write, with a counter driven by the test, so no daemon is needed.
+ */
+
+#include "../config.h"
+
+#include <stdio.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "sms_fixture.h"
+
+#define FREQ		SMS_FIXTURE_FREQ
+#define UPDATE		SMS_FIXTURE_UPDATE
+#define LOOPS		1000000
+
+
+/* Compare snapshot and radclock_* reads at counter values around the update,
+ * return number of failures */
+static int
+check(struct radclock *clock)
+{
+	struct radclock_snapshot snap;
+	long double t_snap, t_api, d_snap, d_api;
+	vcounter_t from, till;
+	double bound;
+	int i, q_snap, q_api, err = 0;
+
+	for (i = -5; i < 40; i++) {
+		sms_fixture_counter = UPDATE + (vcounter_t) (i * 0.5 * FREQ);
+		if (radclock_snapshot(clock, &snap)) {
+			fprintf(stdout, "FAIL: snapshot failed\n");
+			return (err + 1);
+		}
+		if (snap.vcount != sms_fixture_counter || snap.last_changed != UPDATE ||
+				!snap.has_error || snap.min_RTT != 2e-4) {
+			fprintf(stdout, "FAIL: snapshot content\n");
+			err++;
+		}
+
+		/* Absolute clock */
+		q_snap = radclock_snapshot_abstime(&snap, NULL, &t_snap);
+		q_api = radclock_vcount_to_abstime(clock, &sms_fixture_counter, &t_api);
+		if (t_snap != t_api || q_snap != q_api) {
+			fprintf(stdout, "FAIL: abstime at %d: %.9Lf (%d) != %.9Lf (%d)\n",
+					i, t_snap, q_snap, t_api, q_api);
+			err++;
+		}
+		if (radclock_snapshot_quality(&snap) != q_api) {
+			fprintf(stdout, "FAIL: quality at %d\n", i);
+			err++;
+		}
+
+		/* Difference clock, 100 ms and out of the SKM scale */
+		from = sms_fixture_counter - (vcounter_t) (0.1 * FREQ);
+		q_snap = radclock_snapshot_elapsed(&snap, &from, &d_snap);
+		q_api = radclock_elapsed(clock, &from, &d_api);
+		if (d_snap != d_api || q_snap != q_api) {
+			fprintf(stdout, "FAIL: elapsed at %d\n", i);
+			err++;
+		}
+		till = from + (vcounter_t) (0.05 * FREQ);
+		q_snap = radclock_snapshot_duration(&snap, &from, &till, &d_snap);
+		q_api = radclock_duration(clock, &from, &till, &d_api);
+		if (d_snap != d_api || q_snap != q_api) {
+			fprintf(stdout, "FAIL: duration at %d\n", i);
+			err++;
+		}
+		from = sms_fixture_counter - (vcounter_t) (2000 * FREQ);
+		if (radclock_snapshot_elapsed(&snap, &from, &d_snap) != 1 ||
+				radclock_elapsed(clock, &from, &d_api) != 1) {
+			fprintf(stdout, "FAIL: SKM scale not checked at %d\n", i);
+			err++;
+		}
+
+		/* Error bound grows with the age of the data */
+		radclock_snapshot_error_bound(&snap, NULL, &bound);
+		if (bound < 1e-5 || bound > 1e-5 + (i < 0 ? -i : i) * 0.5 * 1e-7 * 1.001) {
+			fprintf(stdout, "FAIL: error bound at %d: %g\n", i, bound);
+			err++;
+		}
+	}
+	return (err);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock *clock;
+	struct radclock_data rd;
+	struct radclock_error re;
+	struct radclock_snapshot snap;
+	radclock_local_period_t mode;
+	long double t, d, sink = 0;
+	vcounter_t from;
+	double start, ns_api, ns_snap;
+	long reads_api, reads_snap;
+	int i, err = 0;
+
+	clock = sms_fixture_create();
+	if (clock == NULL)
+		return (SMS_FIXTURE_SKIP);
+	sms_fixture_data(&rd, &re, FREQ, UPDATE, 1.4e9);
+	sms_write(clock, &rd, &re);
+
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+	err += check(clock);
+	mode = RADCLOCK_LOCAL_PERIOD_ON;
+	radclock_set_local_period_mode(clock, &mode);
+	err += check(clock);
+
+	/* Time, quality and interval: API calls against one snapshot */
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+	sms_fixture_counter = UPDATE + (vcounter_t) FREQ;
+	from = sms_fixture_counter - (vcounter_t) (0.1 * FREQ);
+
+	sms_fixture_counter_reads = 0;
+	start = sms_fixture_now();
+	for (i = 0; i < LOOPS; i++) {
+		radclock_gettime(clock, &t);
+		radclock_elapsed(clock, &from, &d);
+		sink += t + d;
+	}
+	ns_api = (sms_fixture_now() - start) * 1e9 / LOOPS;
+	reads_api = sms_fixture_counter_reads;
+
+	sms_fixture_counter_reads = 0;
+	start = sms_fixture_now();
+	for (i = 0; i < LOOPS; i++) {
+		radclock_snapshot(clock, &snap);
+		radclock_snapshot_abstime(&snap, NULL, &t);
+		radclock_snapshot_elapsed(&snap, &from, &d);
+		sink += t + d;
+	}
+	ns_snap = (sms_fixture_now() - start) * 1e9 / LOOPS;
+	reads_snap = sms_fixture_counter_reads;
+
+	fprintf(stdout, "Time and elapsed: radclock_* %.1f [ns] %.1f counter reads, "
+			"snapshot %.1f [ns] %.1f counter reads (sink %d)\n", ns_api,
+			(double) reads_api / LOOPS, ns_snap, (double) reads_snap / LOOPS,
+			sink > 0);
+	if (reads_snap != LOOPS) {
+		fprintf(stdout, "FAIL: snapshot read the counter more than once\n");
+		err++;
+	}
+	fprintf(stdout, "%s\n", err ? "FAILED" : "OK");
+
+	radclock_destroy(clock);
+
+	return (err ? 1 : 0);
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+/*
+ * Check of the ascii stamp parser (radclock/stampinput-ascii.c) against
+ * sscanf(), on the stamp file and on odd lines, split in any number of chunks.
+ * Then check of the binary stamp replay (radclock/stampinput-binary.c) against
+ * the ascii one. Stamps read from the ascii file are stored in a binary stamp
+ * file, which must then replay the very same stamps, down to the last bit of
+ * the long double server timestamps. Parsing and replay rates are given.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <pcap.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "config_mgr.h"
+#include "create_stamp.h"
+#include "outputfmt.h"
+#include "stampinput.h"
+#include "stampinput_int.h"
+
+#define ROUNDS	50		// replays of the whole file timed
+#define MAXTHREADS	7
+
+/* Lines the fast paths don't take, and a few that aren't stamps */
+static const char odd_lines[] =
+	"% comment heading\n"
+	"%% another one\n"
+	"1000 1.5 2.5 2000\n"
+	"1001 1483210800.40107664 1483210800.40112064 1003 1483210817.41698464 "
+		"1483210817.38784264\n"
+	"1002 1483210801.405376196 1483210801.405451775 1004 7 3\n"
+	"\n   \t\n"
+	"1003\t0.000000000000000000000000000123 -12.5 1005 8 1\r\n"
+	"1004 1.5e3 2.5E-3 1006 9\n"
+	"1005 3.14159265358979323846264338 2.71828182845904523536 1007 10 2\n"
+	"18446744073709551615 1 2 18446744073709551616 11 0\n"
+	"1006 +1.25 -0 1008 -5 -1\n"
+	"12.5 3 1009\n"
+	"garbage line\n"
+	"% comment, not a heading\n"
+	"1007 1 2\n"
+	"1008 0x1p3 inf 1010 12 4\n"
+	"1009 5. 00042.0100 1011 13 99999999999\n"
+	"1010 1 2 3 4 5 6 7 8\n"
+	"1011 1 2 3";
+
+
+extern struct stampsource_def ascii_source;
+extern struct stampsource_def binary_source;
+
+/* The sources log through the daemon verbose() */
+void
+verbose(int facility, const char *format, ...)
+{
+}
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+
+/*
+ * Replay all stamps of the source, keeping them if stamps is not NULL.
+ * Returns the number of stamps, -1 on error.
+ */
+static long
+replay(struct radclock_handle *handle, struct stampsource_def *def,
+		struct stamp_t **stamps, uint64_t *ref_count)
+{
+	struct stampsource source;
+	struct stamp_t stamp;
+	long n, size;
+
+	memset(&source, 0, sizeof(source));
+	source.def = def;
+	if (def->init(handle, &source) < 0)
+		return (-1);
+
+	n = 0;
+	size = 0;
+	for (;;) {
+		memset(&stamp, 0, sizeof(stamp));
+		if (def->get_next_stamp(handle, &source, &stamp) < 0)
+			break;
+		if (stamps) {
+			if (n == size) {
+				size = size ? 2 * size : 1024;
+				*stamps = realloc(*stamps, size * sizeof(struct stamp_t));
+				if (*stamps == NULL)
+					return (-1);
+			}
+			(*stamps)[n] = stamp;
+		}
+		n++;
+	}
+	*ref_count = source.ntp_stats.ref_count;
+	def->destroy(handle, &source);
+	return (n);
+}
+
+
+/*
+ * Reference parsing, line by line with sscanf(), after the comment heading.
+ * Returns the number of stamps, -1 on error.
+ */
+static long
+sscanf_parse(const char *buf, size_t len, struct ascii_stamp **stamps,
+		size_t *nbad)
+{
+	struct ascii_stamp st;
+	unsigned long long Ta, Tf, id;
+	char line[1024];
+	const char *p, *end, *eol;
+	long n, size;
+
+	p = buf;
+	end = buf + len;
+	while (p < end && *p == '%') {
+		eol = memchr(p, '\n', end - p);
+		p = eol ? eol + 1 : end;
+	}
+
+	n = 0;
+	size = 0;
+	*nbad = 0;
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		memcpy(line, p, eol - p);
+		line[eol - p] = '\0';
+		memset(&st, 0, sizeof(st));
+		st.ncols = sscanf(line, "%llu %Lf %Lf %llu %llu %d", &Ta, &st.Tb,
+				&st.Te, &Tf, &id, &st.sID);
+		if (st.ncols == EOF)
+			continue;
+		if (st.ncols < 4) {
+			(*nbad)++;
+			continue;
+		}
+		st.Ta = Ta;
+		st.Tf = Tf;
+		st.id = id;
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			*stamps = realloc(*stamps, size * sizeof(struct ascii_stamp));
+			if (*stamps == NULL)
+				return (-1);
+		}
+		(*stamps)[n++] = st;
+	}
+	return (n);
+}
+
+
+/* Parse with 1 to MAXTHREADS threads, all must agree with sscanf() */
+static int
+check_parse(const char *name, const char *buf, size_t len)
+{
+	struct ascii_stamp *ref, *st;
+	size_t nref, n, nbad, nbad_ref, i;
+	long ret;
+	int t;
+
+	ref = NULL;
+	ret = sscanf_parse(buf, len, &ref, &nbad_ref);
+	if (ret < 0)
+		return (1);
+	nref = ret;
+	for (t = 1; t <= MAXTHREADS; t++) {
+		if (ascii_parse(buf, len, t, &st, &n, &nbad)) {
+			fprintf(stdout, "FAIL cannot parse %s\n", name);
+			return (1);
+		}
+		if (n != nref || nbad != nbad_ref) {
+			fprintf(stdout, "FAIL %s in %d chunks: %lu stamps %lu bad, "
+					"sscanf gives %lu stamps %lu bad\n", name, t,
+					(unsigned long)n, (unsigned long)nbad,
+					(unsigned long)nref, (unsigned long)nbad_ref);
+			return (1);
+		}
+		for (i = 0; i < n; i++) {
+			if (st[i].ncols != ref[i].ncols || st[i].Ta != ref[i].Ta ||
+					st[i].Tb != ref[i].Tb || st[i].Te != ref[i].Te ||
+					st[i].Tf != ref[i].Tf || st[i].sID != ref[i].sID ||
+					(st[i].ncols > 4 && st[i].id != ref[i].id)) {
+				fprintf(stdout, "FAIL %s in %d chunks: stamp %lu differs "
+						"from sscanf\n", name, t, (unsigned long)i);
+				return (1);
+			}
+		}
+		free(st);
+	}
+	free(ref);
+	fprintf(stdout, "%s: %lu stamps, %lu bad lines, parsed as sscanf does\n",
+			name, (unsigned long)nref, (unsigned long)nbad_ref);
+	return (0);
+}
+
+
+/* Parsing rate in MB/s of the whole file, by sscanf() if nthreads is 0 */
+static double
+parse_rate(const char *buf, size_t len, int nthreads)
+{
+	struct ascii_stamp *st;
+	size_t n, nbad;
+	double t;
+	int i;
+
+	t = now();
+	for (i = 0; i < ROUNDS; i++) {
+		st = NULL;
+		if (nthreads == 0)
+			sscanf_parse(buf, len, &st, &nbad);
+		else
+			ascii_parse(buf, len, nthreads, &st, &n, &nbad);
+		free(st);
+	}
+	t = now() - t;
+	return (len * ROUNDS / 1e6 / t);
+}
+
+
+static int
+same_stamp(struct stamp_t *a, struct stamp_t *b)
+{
+	return (BST(a)->Ta == BST(b)->Ta && BST(a)->Tb == BST(b)->Tb &&
+			BST(a)->Te == BST(b)->Te && BST(a)->Tf == BST(b)->Tf &&
+			a->id == b->id && a->type == b->type &&
+			strcmp(a->server_ipaddr, b->server_ipaddr) == 0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock_handle *handle;
+	struct radclock_config *conf;
+	struct outfmt_stamp_rec rec;
+	struct stamp_t *ascii, *bin;
+	uint64_t ascii_refs, bin_refs;
+	const char *srcdir;
+	double t_ascii, t_bin;
+	long n, nbin, i;
+	char *text;
+	size_t len;
+	int sID;
+	FILE *fp;
+
+	handle = calloc(1, sizeof(struct radclock_handle));
+	conf = calloc(1, sizeof(struct radclock_config));
+	handle->conf = conf;
+	if (argc > 1)
+		snprintf(conf->sync_in_ascii, MAXLINE, "%s", argv[1]);
+	else {
+		srcdir = getenv("srcdir");
+		snprintf(conf->sync_in_ascii, MAXLINE, "%s/Stratum1Stamps.dat",
+				srcdir ? srcdir : ".");
+	}
+	snprintf(conf->sync_in_bin, MAXLINE, "test_stampinput.%d.bin", (int)getpid());
+
+	/* The whole file, as the source maps it */
+	fp = fopen(conf->sync_in_ascii, "r");
+	if (fp == NULL) {
+		fprintf(stdout, "FAIL cannot open %s\n", conf->sync_in_ascii);
+		return (1);
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	text = malloc(len + 1);
+	if (text == NULL || fread(text, 1, len, fp) != len) {
+		fprintf(stdout, "FAIL cannot read %s\n", conf->sync_in_ascii);
+		return (1);
+	}
+	fclose(fp);
+
+	if (check_parse("odd lines", odd_lines, strlen(odd_lines)) ||
+			check_parse(conf->sync_in_ascii, text, len))
+		return (1);
+	fprintf(stdout, "sscanf parsing:     %6.1f MB/s\n", parse_rate(text, len, 0));
+	fprintf(stdout, "ascii parsing:      %6.1f MB/s\n", parse_rate(text, len, 1));
+	fprintf(stdout, "ascii parsing (x4): %6.1f MB/s\n", parse_rate(text, len, 4));
+	free(text);
+
+	ascii = NULL;
+	n = replay(handle, &ascii_source, &ascii, &ascii_refs);
+	if (n <= 0) {
+		fprintf(stdout, "FAIL cannot replay %s\n", conf->sync_in_ascii);
+		return (1);
+	}
+
+	/* Store them as the daemon -A option does */
+	fp = fopen(conf->sync_in_bin, "w");
+	if (fp == NULL || outfmt_bin_header(fp, OUTFMT_STAMP, 1, "", 0) < 0) {
+		fprintf(stdout, "FAIL cannot create %s\n", conf->sync_in_bin);
+		return (1);
+	}
+	for (i = 0; i < n; i++) {
+		sscanf(ascii[i].server_ipaddr, "10.0.0.%d", &sID);
+		outfmt_stamp_rec(&rec, &ascii[i], sID);
+		if (outfmt_bin_write(fp, OUTFMT_STAMP, &rec) < 0) {
+			fprintf(stdout, "FAIL cannot write %s\n", conf->sync_in_bin);
+			return (1);
+		}
+	}
+	fclose(fp);
+
+	bin = NULL;
+	nbin = replay(handle, &binary_source, &bin, &bin_refs);
+	if (nbin != n || bin_refs != ascii_refs) {
+		fprintf(stdout, "FAIL binary replay gave %ld stamps, %ld expected\n",
+				nbin, n);
+		unlink(conf->sync_in_bin);
+		return (1);
+	}
+	for (i = 0; i < n; i++) {
+		if (!same_stamp(&ascii[i], &bin[i])) {
+			fprintf(stdout, "FAIL stamp %ld differs in binary replay\n", i);
+			unlink(conf->sync_in_bin);
+			return (1);
+		}
+	}
+
+	t_ascii = now();
+	for (i = 0; i < ROUNDS; i++)
+		replay(handle, &ascii_source, NULL, &ascii_refs);
+	t_ascii = now() - t_ascii;
+	t_bin = now();
+	for (i = 0; i < ROUNDS; i++)
+		replay(handle, &binary_source, NULL, &bin_refs);
+	t_bin = now() - t_bin;
+	unlink(conf->sync_in_bin);
+
+	fprintf(stdout, "%ld stamps identical in ascii and binary replay\n", n);
+	fprintf(stdout, "ascii replay:  %10.0f stamps/s\n", n * ROUNDS / t_ascii);
+	fprintf(stdout, "binary replay: %10.0f stamps/s\n", n * ROUNDS / t_bin);
+
+	free(ascii);
+	free(bin);
+	free(conf);
+	free(handle);
+	return (0);
+}
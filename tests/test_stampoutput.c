@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Check of the stamp and clock output writer thread (radclock/stampoutput.c).
+ * When replaying, every stamp pushed must be written out, in order, even when
+ * pushed much faster than the writer. When live, pushing must never wait:
+ * stamps are dropped instead, and every stamp not dropped must be found once
+ * and in order, split across the two files when the output is reopened
+ * midway as on SIGHUP. A few stamps must reach the disk within the flush
+ * interval. The binary outputs must hold the same data as the ascii ones.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <pcap.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "config_mgr.h"
+#include "outputfmt.h"
+#include "stampoutput.h"
+
+#define NREPLAY		(32 * OUTPUT_QUEUE_SIZE)
+#define NBURST		8
+#define BURST		(2 * OUTPUT_QUEUE_SIZE)
+#define FEW			10		// less than a batch, only the flush interval gets them out
+
+
+/* The writer logs through the daemon verbose(), count warnings instead */
+static long warnings = 0;
+
+void
+verbose(int facility, const char *format, ...)
+{
+	if (facility == LOG_WARNING || facility == LOG_ERR)
+		warnings++;
+}
+
+/* Recorded in binary output headers */
+void
+config_write(FILE *fd, struct radclock_config *conf, int ns)
+{
+	fprintf(fd, "# test_stampoutput\n");
+}
+
+
+static uint64_t seq = 0;
+static long pushed = 0;
+static double push_max = 0;
+static double push_total = 0;
+
+static void
+push(struct radclock_handle *handle, int n)
+{
+	struct stamp_t stamp;
+	struct bidir_algooutput output;
+	struct timeval t0, t1;
+	double us;
+	int i;
+
+	memset(&stamp, 0, sizeof(stamp));
+	memset(&output, 0, sizeof(output));
+	stamp.type = STAMP_NTP;
+	output.phat = 1e-9;
+	for (i = 0; i < n; i++) {
+		stamp.id = seq;
+		BST(&stamp)->Ta = 1000 * seq;
+		BST(&stamp)->Tb = 1.5e9L + seq / 3.0L;
+		BST(&stamp)->Te = 1.5e9L + seq / 7.0L;
+		BST(&stamp)->Tf = 1000 * seq + 500;
+		output.n_stamps = seq;
+		output.K = 1.4e9L + seq / 11.0L;
+		output.thetahat = seq * 1e-7;
+		output.RTT = seq % 1000;
+		output.status = seq % 64;
+
+		gettimeofday(&t0, NULL);
+		print_out_files(handle, &stamp, &output, (int)(seq % 2));
+		gettimeofday(&t1, NULL);
+
+		us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+		push_total += us;
+		if (us > push_max)
+			push_max = us;
+		pushed++;
+		seq++;
+	}
+}
+
+
+/*
+ * Read a stamp output file back, checking that stamps come in increasing order
+ * after last and carry their server ID. Returns the number of stamps, -1 on
+ * error.
+ */
+static long
+read_stamps(const char *path, long long *last)
+{
+	char line[256];
+	unsigned long long Ta, Tf, id;
+	double Tb, Te;
+	int sID;
+	FILE *fp;
+	long n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stdout, "FAIL cannot open %s\n", path);
+		return (-1);
+	}
+
+	n = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '%')
+			continue;
+		if (sscanf(line, "%llu %lf %lf %llu %llu %d", &Ta, &Tb, &Te, &Tf, &id,
+				&sID) != 6 || Ta != 1000 * id || Tf != Ta + 500 ||
+				sID != id % 2 || (long long)id <= *last) {
+			fprintf(stdout, "FAIL bad stamp after %lld in %s: %s", *last, path,
+					line);
+			n = -1;
+			break;
+		}
+		*last = id;
+		n++;
+	}
+	fclose(fp);
+	return (n);
+}
+
+/* Number of data lines in the clock output file */
+static long
+count_lines(const char *path)
+{
+	char line[512];
+	FILE *fp;
+	long n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+	n = 0;
+	while (fgets(line, sizeof(line), fp))
+		if (line[0] != '%')
+			n++;
+	fclose(fp);
+	return (n);
+}
+
+/*
+ * Check that binary output binpath, printed in ascii, gives ascii output
+ * asciipath. Returns the number of records, -1 on error.
+ */
+static long
+check_bin(const char *binpath, const char *asciipath)
+{
+	struct outfmt_file f;
+	union {
+		struct outfmt_stamp_rec stamp;
+		struct outfmt_clock_rec clock;
+	} rec;
+	char line[512], expect[512];
+	FILE *fp, *tmp;
+	size_t i;
+
+	if (outfmt_bin_open(binpath, &f) < 0) {
+		fprintf(stdout, "FAIL cannot read %s\n", binpath);
+		return (-1);
+	}
+	fp = fopen(asciipath, "r");
+	tmp = tmpfile();
+	if (fp == NULL || tmp == NULL)
+		return (-1);
+	for (i = 0; i < f.nrec; i++) {
+		outfmt_bin_get(&f, i, &rec);
+		if (f.kind == OUTFMT_STAMP)
+			outfmt_print_stamp(tmp, &rec.stamp, f.nservers);
+		else
+			outfmt_print_clock(tmp, &rec.clock, f.nservers);
+	}
+	rewind(tmp);
+
+	i = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '%')
+			continue;
+		if (fgets(expect, sizeof(expect), tmp) == NULL ||
+				strcmp(line, expect) != 0) {
+			fprintf(stdout, "FAIL record %lu of %s differs from %s\n",
+					(unsigned long) i, binpath, asciipath);
+			i = -1;
+			break;
+		}
+		i++;
+	}
+	if (i != f.nrec) {
+		fprintf(stdout, "FAIL %lu records in %s\n", (unsigned long) f.nrec,
+				binpath);
+		i = -1;
+	}
+	fclose(tmp);
+	fclose(fp);
+	outfmt_bin_close(&f);
+	return (i);
+}
+
+/* Wait up to ms milliseconds for path to hold n stamps */
+static int
+wait_stamps(const char *path, long n, int ms)
+{
+	long long last;
+
+	for (; ms > 0; ms -= 10) {
+		last = -1;
+		if (read_stamps(path, &last) >= n)
+			return (0);
+		usleep(10000);
+	}
+	return (1);
+}
+
+
+static int
+setup(struct radclock_handle *handle, radclock_runmode_t mode)
+{
+	seq = 0;
+	pushed = 0;
+	push_max = 0;
+	push_total = 0;
+	warnings = 0;
+	handle->run_mode = mode;
+	handle->stampout_fd = NULL;
+	handle->matout_fd = NULL;
+	handle->output_writer = NULL;
+	open_output_stamp(handle);
+	open_output_matlab(handle);
+	if (start_output_writer(handle)) {
+		fprintf(stdout, "FAIL cannot start the output writer\n");
+		return (1);
+	}
+	return (0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock_handle *handle;
+	struct radclock_config *conf;
+	char old[MAXLINE + 8];
+	long long last;
+	long n1, n2, nclock, before_reopen;
+	int i;
+
+	handle = calloc(1, sizeof(struct radclock_handle));
+	conf = calloc(1, sizeof(struct radclock_config));
+	handle->conf = conf;
+	handle->nservers = 2;
+	snprintf(conf->sync_out_ascii, MAXLINE, "test_stampoutput.%d.sync",
+			(int)getpid());
+	snprintf(conf->clock_out_ascii, MAXLINE, "test_stampoutput.%d.clock",
+			(int)getpid());
+	snprintf(conf->sync_out_bin, MAXLINE, "test_stampoutput.%d.sync.bin",
+			(int)getpid());
+	snprintf(conf->clock_out_bin, MAXLINE, "test_stampoutput.%d.clock.bin",
+			(int)getpid());
+	snprintf(old, sizeof(old), "%s.old", conf->sync_out_ascii);
+
+	/* Replay: nothing may be lost however fast stamps come */
+	if (setup(handle, RADCLOCK_SYNC_DEAD))
+		return (1);
+	push(handle, NREPLAY);
+	stop_output_writer(handle);
+
+	last = -1;
+	n1 = read_stamps(conf->sync_out_ascii, &last);
+	nclock = count_lines(conf->clock_out_ascii);
+	fprintf(stdout, "replay: %ld stamps pushed, %ld + %ld written, "
+			"%.2f us per push\n", pushed, n1, nclock, push_total / pushed);
+	if (n1 != pushed || nclock != pushed) {
+		fprintf(stdout, "FAIL stamps lost while replaying\n");
+		return (1);
+	}
+	if (check_bin(conf->sync_out_bin, conf->sync_out_ascii) != pushed ||
+			check_bin(conf->clock_out_bin, conf->clock_out_ascii) != pushed)
+		return (1);
+	unlink(conf->sync_out_bin);
+	unlink(conf->clock_out_bin);
+	strcpy(conf->sync_out_bin, "");
+	strcpy(conf->clock_out_bin, "");
+
+	/* Live: a few stamps get out within the flush interval */
+	if (setup(handle, RADCLOCK_SYNC_LIVE))
+		return (1);
+	push(handle, FEW);
+	if (wait_stamps(conf->sync_out_ascii, FEW, 2 * OUTPUT_FLUSH_MS)) {
+		fprintf(stdout, "FAIL stamps not flushed after the flush interval\n");
+		return (1);
+	}
+
+	/* Bursts faster than the writer, PROC must never wait */
+	for (i = 0; i < NBURST / 2; i++) {
+		push(handle, BURST);
+		usleep(1000);
+	}
+
+	/* Reopen under traffic, as on SIGHUP, the first file becomes .old */
+	before_reopen = pushed;
+	close_output_stamp(handle);
+	open_output_stamp(handle);
+	for (i = 0; i < NBURST / 2; i++) {
+		push(handle, BURST);
+		usleep(1000);
+	}
+	stop_output_writer(handle);
+
+	last = -1;
+	n1 = read_stamps(old, &last);
+	n2 = read_stamps(conf->sync_out_ascii, &last);
+	nclock = count_lines(conf->clock_out_ascii);
+	unlink(old);
+	unlink(conf->sync_out_ascii);
+	unlink(conf->clock_out_ascii);
+	snprintf(old, sizeof(old), "%s.old", conf->clock_out_ascii);
+	unlink(old);
+	if (n1 < 0 || n2 < 0)
+		return (1);
+
+	fprintf(stdout, "live: %ld stamps pushed, %ld + %ld written, %ld warnings, "
+			"%.2f us per push, %.0f us max\n", pushed, n1, n2, warnings,
+			push_total / pushed, push_max);
+	if (n1 < FEW || n1 > before_reopen || n1 + n2 > pushed ||
+			nclock > pushed) {
+		fprintf(stdout, "FAIL stamps written out of thin air\n");
+		return (1);
+	}
+	if ((n1 + n2 < pushed) != (warnings > 0)) {
+		fprintf(stdout, "FAIL drops not reported\n");
+		return (1);
+	}
+
+	free(conf);
+	free(handle);
+	return (0);
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Checks the thetahat window kernels against the original thetahat loops of
+ * sync_bidir.c, over every window of the stamps in Stratum1Stamps.dat.
+ *
+ * Tolerances:
+ *  - scalar kernel, libm exp: identical thetahat, wsum, minET and jbest
+ *  - SIMD kernels, libm exp:  |d thetahat| <= 1e-15 [s], relative d wsum <= 1e-12
+ *  - any kernel, fast exp:    |d thetahat| <= 2e-8 * max|thnaive - thetahat| + 1e-15 [s]
+ *                             relative d wsum <= 2e-8
+ *                             windows where wsum < DBL_MIN give wsum = 0
+ *  - minET and jbest, which do not depend on exp, are always identical, as is
+ *    the second best ET of the window.
+ * On the offsets seen in this trace, the fast exp bound is well below 1 ns.
+ * The flushed windows have minET > 26 Eoffset, far outside the quality band of
+ * the algo, and are never used for an update.
+ */
+
+#include "../config.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "radclock.h"
+#include "sync_thetahat.h"
+
+
+#define MAX_STAMPS   100000
+
+struct series {
+	unsigned int n;
+	vcounter_t *Tf;
+	vcounter_t *RTT;
+	vcounter_t *RTThat;    // RTThat as known at each stamp
+	double *thnaive;
+	double phat;
+};
+
+struct ref_result {
+	double thetahat;
+	double wsum;
+	double minET;
+	unsigned int jbest;
+	double Ebound_min;
+};
+
+static int failures = 0;
+
+
+static int
+load_series(const char *path, struct series *s)
+{
+	FILE *fd;
+	vcounter_t Ta, Tf;
+	long double Tb, Te, Tb0 = 0, K;
+	vcounter_t Ta0 = 0;
+	long double *Tb_all, *Te_all;
+	vcounter_t *Ta_all;
+	unsigned int i;
+
+	fd = fopen(path, "r");
+	if (fd == NULL) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return 1;
+	}
+
+	Ta_all = malloc(MAX_STAMPS * sizeof(vcounter_t));
+	Tb_all = malloc(MAX_STAMPS * sizeof(long double));
+	Te_all = malloc(MAX_STAMPS * sizeof(long double));
+	s->Tf      = malloc(MAX_STAMPS * sizeof(vcounter_t));
+	s->RTT     = malloc(MAX_STAMPS * sizeof(vcounter_t));
+	s->RTThat  = malloc(MAX_STAMPS * sizeof(vcounter_t));
+	s->thnaive = malloc(MAX_STAMPS * sizeof(double));
+
+	s->n = 0;
+	while (s->n < MAX_STAMPS &&
+	    fscanf(fd, "%llu %Lf %Lf %llu %*[^\n]", (long long unsigned *)&Ta, &Tb,
+	    &Te, (long long unsigned *)&Tf) == 4) {
+		Ta_all[s->n] = Ta;
+		Tb_all[s->n] = Tb;
+		Te_all[s->n] = Te;
+		s->Tf[s->n]  = Tf;
+		s->n++;
+	}
+	fclose(fd);
+	if (s->n < 2) {
+		fprintf(stderr, "Not enough stamps in %s\n", path);
+		return 1;
+	}
+
+	/* Crude but stable clock, as the algo would have in full mode */
+	Ta0 = Ta_all[0];
+	Tb0 = Tb_all[0];
+	s->phat = (double)((Tb_all[s->n-1] - Tb0) / (long double)(Ta_all[s->n-1] - Ta0));
+	K = Tb0 - (long double)Ta0 * s->phat;
+
+	for (i = 0; i < s->n; i++) {
+		s->RTT[i] = s->Tf[i] - Ta_all[i];
+		s->RTThat[i] = s->RTT[i];
+		if (i > 0 && s->RTThat[i-1] < s->RTThat[i])
+			s->RTThat[i] = s->RTThat[i-1];
+		s->thnaive[i] = (s->phat * ((long double)Ta_all[i] + (long double)s->Tf[i]) +
+		    (2*K - (Tb_all[i] + Te_all[i]))) / 2.0;
+	}
+
+	free(Ta_all);
+	free(Tb_all);
+	free(Te_all);
+	return 0;
+}
+
+
+/* Original thetahat_full loops, without the history lookups */
+static void
+ref_window(const struct series *s, unsigned int si, unsigned int jmin, double rate,
+	double Eoffset, double plocal, int plocal_problem, struct ref_result *ref)
+{
+	double phat = s->phat;
+	double ET, wj, minET = 0, wsum = 0, thetahat = 0, Ebound_min = 0;
+	unsigned int j, jbest = 0;
+	int init = 0;
+
+	for (j = si; j >= jmin; j--) {
+		ET  = phat * ((double)(s->RTT[j]) - s->RTThat[j]);
+		ET += phat * (double) ( s->Tf[si] - s->Tf[j] ) * rate;
+		if ( j == si ) {
+			minET = ET; jbest = j;
+		} else {
+			if (ET < minET) { minET = ET; jbest = j; }
+		}
+		wj = exp(- ET * ET / Eoffset / Eoffset);
+		wsum += wj;
+		if (plocal_problem)
+			thetahat += wj * (s->thnaive[j]);
+		else
+			thetahat += wj * (s->thnaive[j] - (plocal / phat - 1) *
+			    phat * (double) (s->Tf[si] - s->Tf[j]));
+		if (j == 0)
+			break;
+	}
+
+	/* Second best ET in window */
+	for (j = si; j >= jmin; j--) {
+		if (j != jbest) {
+			ET  = phat * ((double)(s->RTT[j]) - s->RTThat[si]);
+			ET += phat * (double)( s->Tf[si] - s->Tf[j] ) * rate;
+			if (!init || ET < Ebound_min)
+				Ebound_min = ET;
+			init = 1;
+		}
+		if (j == 0)
+			break;
+	}
+
+	ref->thetahat   = thetahat / wsum;
+	ref->wsum       = wsum;
+	ref->minET      = minET;
+	ref->jbest      = jbest;
+	ref->Ebound_min = Ebound_min;
+}
+
+
+static void
+check(const char *name, unsigned int si, const struct ref_result *ref,
+	const struct thwin_result *res, double theta_tol, double wsum_tol, double *maxerr)
+{
+	double thetahat, err;
+
+	/* Fast exp flushes weights below exp(-708) */
+	if (wsum_tol > 0 && ref->wsum < DBL_MIN && res->wsum == 0) {
+		if (res->minET != ref->minET || si - res->kbest != ref->jbest ||
+		    res->Ebound_min != ref->Ebound_min)
+			failures++;
+		return;
+	}
+
+	thetahat = res->thsum / res->wsum;
+	err = fabs(thetahat - ref->thetahat);
+	if (err > *maxerr)
+		*maxerr = err;
+
+	if (err > theta_tol ||
+	    fabs(res->wsum - ref->wsum) > wsum_tol * ref->wsum ||
+	    res->minET != ref->minET ||
+	    si - res->kbest != ref->jbest ||
+	    res->Ebound_min != ref->Ebound_min) {
+		if (failures < 10)
+			fprintf(stdout, "FAIL %s i=%u: thetahat %.15g/%.15g wsum %.15g/%.15g "
+			    "minET %g/%g jbest %u/%u Ebound_min %g/%g\n", name, si,
+			    thetahat, ref->thetahat, res->wsum, ref->wsum, res->minET,
+			    ref->minET, si - res->kbest, ref->jbest, res->Ebound_min,
+			    ref->Ebound_min);
+		failures++;
+	}
+}
+
+
+static int
+test_fastexp(void)
+{
+	double x, err, maxerr = 0;
+
+	for (x = -708; x <= 0; x += 0.0001234567) {
+		err = fabs(thwin_fastexp(x) - exp(x)) / exp(x);
+		if (err > maxerr)
+			maxerr = err;
+	}
+	fprintf(stdout, "fast exp: max relative error %.3g on [-708,0] (bound %g)\n",
+	    maxerr, THWIN_FASTEXP_RELERR);
+	if (thwin_fastexp(-709) != 0 || thwin_fastexp(0) != 1)
+		return 1;
+	return (maxerr > THWIN_FASTEXP_RELERR);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct series s;
+	struct thwin_buf buf;
+	struct thwin_window win;
+	struct thwin_result res;
+	struct ref_result ref;
+	char path[1024];
+	const char *srcdir;
+	unsigned int si, jmin, k, w, e, fast;
+	double maxerr[3][2], spread, tol;
+	int have_sse2 = 1, have_avx2 = 1;
+
+	/* Offset windows and quality bands covering narrow and wide weighting */
+	unsigned int wins[] = { 8, 64, 1000 };
+	double Eoffsets[] = { 1e-5, 1e-4 };
+	double rate = 1e-7;
+
+	if (argc > 1)
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	else {
+		srcdir = getenv("srcdir");
+		snprintf(path, sizeof(path), "%s/Stratum1Stamps.dat", srcdir ? srcdir : ".");
+	}
+	if (load_series(path, &s))
+		return 1;
+	fprintf(stdout, "Loaded %u stamps from %s, kernel selected: %s\n", s.n, path,
+	    thwin_kernel_name());
+
+	if (test_fastexp()) {
+		fprintf(stdout, "FAIL fast exp error bound\n");
+		failures++;
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	memset(maxerr, 0, sizeof(maxerr));
+	for (w = 0; w < sizeof(wins)/sizeof(wins[0]); w++)
+	for (e = 0; e < sizeof(Eoffsets)/sizeof(Eoffsets[0]); e++)
+	for (si = 1; si < s.n; si++) {
+		jmin = (si >= wins[w]) ? si - wins[w] + 1 : 1;
+		/* Alternate plocal refinement on and off */
+		ref_window(&s, si, jmin, rate, Eoffsets[e], s.phat * (1 + 1e-7), si % 2, &ref);
+
+		/* Gather as sync_bidir.c does */
+		win.n = si - jmin + 1;
+		if (thwin_reserve(&buf, win.n))
+			return 1;
+		for (k = 0; k < win.n; k++) {
+			buf.RTTerr[k]  = (double)s.RTT[si-k] - s.RTThat[si-k];
+			buf.RTTerr2[k] = (double)s.RTT[si-k] - s.RTThat[si];
+			buf.age[k]     = (double)(s.Tf[si] - s.Tf[si-k]);
+			buf.thnaive[k] = s.thnaive[si-k];
+		}
+		win.RTTerr      = buf.RTTerr;
+		win.RTTerr2     = buf.RTTerr2;
+		win.age         = buf.age;
+		win.thnaive     = buf.thnaive;
+		win.phat        = s.phat;
+		win.skmrate     = rate;
+		win.Eoffset     = Eoffsets[e];
+		win.plocal_coef = (si % 2) ? 0 : ((s.phat * (1 + 1e-7)) / s.phat - 1) * s.phat;
+
+		/* Worst case effect of weight errors on the weighted mean */
+		spread = 0;
+		for (k = 0; k < win.n; k++)
+			spread = fmax(spread, fabs(buf.thnaive[k] - ref.thetahat));
+
+		for (fast = 0; fast < 2; fast++) {
+			win.fastexp = fast;
+			tol = fast ? 2 * THWIN_FASTEXP_RELERR * spread + 1e-15 : 1e-15;
+
+			thwin_scalar(&win, &res);
+			check(fast ? "scalar/fastexp" : "scalar", si, &ref, &res,
+			    fast ? tol : 0, fast ? 2 * THWIN_FASTEXP_RELERR : 0,
+			    &maxerr[0][fast]);
+
+			if (thwin_sse2(&win, &res) == 0)
+				check(fast ? "sse2/fastexp" : "sse2", si, &ref, &res, tol,
+				    fast ? 2 * THWIN_FASTEXP_RELERR : 1e-12, &maxerr[1][fast]);
+			else
+				have_sse2 = 0;
+
+			if (thwin_avx2(&win, &res) == 0)
+				check(fast ? "avx2/fastexp" : "avx2", si, &ref, &res, tol,
+				    fast ? 2 * THWIN_FASTEXP_RELERR : 1e-12, &maxerr[2][fast]);
+			else
+				have_avx2 = 0;
+		}
+	}
+	thwin_free(&buf);
+
+	fprintf(stdout, "scalar: max |d thetahat| %.3g [s], fast exp %.3g [s]\n",
+	    maxerr[0][0], maxerr[0][1]);
+	if (have_sse2)
+		fprintf(stdout, "sse2:   max |d thetahat| %.3g [s], fast exp %.3g [s]\n",
+		    maxerr[1][0], maxerr[1][1]);
+	else
+		fprintf(stdout, "sse2:   not supported, skipped\n");
+	if (have_avx2)
+		fprintf(stdout, "avx2:   max |d thetahat| %.3g [s], fast exp %.3g [s]\n",
+		    maxerr[2][0], maxerr[2][1]);
+	else
+		fprintf(stdout, "avx2:   not supported, skipped\n");
+
+	fprintf(stdout, "%s: %d failures\n", failures ? "FAIL" : "PASS", failures);
+	return (failures != 0);
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Check of the raw output writer thread (radclock/tracedump.c). Packets are
+ * pushed the way PROC does, with bursts larger than the queue. Every packet
+ * not reported dropped must be found in the dump, once and in order, split
+ * across the two files when the output is rotated midway. A flush request must
+ * get the packets on disk before the flush interval, and the flush interval
+ * must do it without a request.
+ */
+
+#include "../config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <pcap.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "radclock_daemon.h"
+#include "sync_history.h"
+#include "sync_algo.h"
+#include "create_stamp.h"
+#include "tracedump.h"
+
+#define NBURST		8
+#define BURST		(2 * TRACEDUMP_QUEUE_SIZE)
+#define FEW			10		// less than a batch, only flushes get them out
+
+
+/* The writer logs through the daemon verbose(), count warnings instead */
+static long warnings = 0;
+
+void
+verbose(int facility, const char *format, ...)
+{
+	if (facility == LOG_WARNING || facility == LOG_ERR)
+		warnings++;
+}
+
+
+static uint32_t seq = 0;
+static long published = 0;
+static long dropped = 0;
+
+static void
+push(struct tracedump *td, int n)
+{
+	struct tracedump_rec *rec;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		rec = tracedump_reserve(td);
+		if (rec == NULL) {
+			dropped++;
+			seq++;
+			continue;
+		}
+		memset(&rec->hdr, 0, sizeof(rec->hdr));
+		rec->hdr.ts.tv_sec = seq;
+		rec->hdr.caplen = sizeof(uint32_t) + seq % BPF_PACKET_SIZE;
+		rec->hdr.len = rec->hdr.caplen;
+		memcpy(rec->frame, &seq, sizeof(uint32_t));
+		tracedump_publish(td);
+		published++;
+		seq++;
+	}
+}
+
+
+/*
+ * Read a dump back, checking the file header and that packets come in
+ * increasing order after last. Returns the number of packets, -1 on error.
+ */
+static long
+read_dump(const char *path, uint32_t *last)
+{
+	uint32_t fh[6], ph[4], s;
+	u_char buf[BPF_PACKET_SIZE + sizeof(linux_sll_header_t)];
+	FILE *fp;
+	long n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+	if (fread(fh, sizeof(fh), 1, fp) != 1 || fh[0] != 0xa1b2c3d4 ||
+			fh[5] != DLT_LINUX_SLL) {
+		fprintf(stdout, "FAIL bad file header in %s\n", path);
+		fclose(fp);
+		return (-1);
+	}
+
+	n = 0;
+	while (fread(ph, sizeof(ph), 1, fp) == 1) {
+		if (ph[2] > sizeof(buf) || fread(buf, ph[2], 1, fp) != 1) {
+			fprintf(stdout, "FAIL truncated packet %ld in %s\n", n, path);
+			n = -1;
+			break;
+		}
+		memcpy(&s, buf, sizeof(uint32_t));
+		if (s != ph[0] || ph[2] != sizeof(uint32_t) + s % BPF_PACKET_SIZE ||
+				(*last != UINT32_MAX && s <= *last)) {
+			fprintf(stdout, "FAIL packet %u after %u in %s\n", s, *last, path);
+			n = -1;
+			break;
+		}
+		*last = s;
+		n++;
+	}
+	fclose(fp);
+	return (n);
+}
+
+
+static off_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return (-1);
+	return (st.st_size);
+}
+
+/* Wait up to ms milliseconds for path to reach size bytes */
+static int
+wait_size(const char *path, off_t size, int ms)
+{
+	for (; ms > 0; ms -= 10) {
+		if (file_size(path) >= size)
+			return (0);
+		usleep(10000);
+	}
+	return (file_size(path) >= size ? 0 : 1);
+}
+
+static off_t
+few_size(void)
+{
+	off_t size;
+	int i;
+
+	size = 24;
+	for (i = 0; i < FEW; i++)
+		size += 16 + sizeof(uint32_t) + i % BPF_PACKET_SIZE;
+	return (size);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct tracedump *td;
+	char path1[64], path2[64];
+	uint32_t last;
+	long n1, n2, before_rotate;
+	int i;
+
+	snprintf(path1, sizeof(path1), "test_tracedump.%d.1.pcap", (int)getpid());
+	snprintf(path2, sizeof(path2), "test_tracedump.%d.2.pcap", (int)getpid());
+
+	td = tracedump_open(path1);
+	if (td == NULL) {
+		fprintf(stdout, "FAIL cannot open %s\n", path1);
+		return (1);
+	}
+
+	/* Less than a batch does not wake the writer, a flush request does */
+	push(td, FEW);
+	tracedump_flush_request(td);
+	if (wait_size(path1, few_size(), TRACEDUMP_FLUSH_MS / 2)) {
+		fprintf(stdout, "FAIL flush request not served\n");
+		return (1);
+	}
+
+	/* Without a request the flush interval gets them out */
+	push(td, FEW);
+	if (wait_size(path1, few_size() + few_size() - 24 + FEW * FEW,
+			TRACEDUMP_FLUSH_MS * 2)) {
+		fprintf(stdout, "FAIL packets not flushed after the flush interval\n");
+		return (1);
+	}
+
+	/* Bursts faster than the writer, PROC must never wait */
+	for (i = 0; i < NBURST / 2; i++) {
+		push(td, BURST);
+		usleep(1000);
+	}
+
+	/* Rotate under traffic */
+	before_rotate = published;
+	if (tracedump_rotate(td, path2)) {
+		fprintf(stdout, "FAIL cannot rotate to %s\n", path2);
+		return (1);
+	}
+	for (i = 0; i < NBURST / 2; i++) {
+		push(td, BURST);
+		usleep(1000);
+	}
+	tracedump_close(td);
+
+	last = UINT32_MAX;
+	n1 = read_dump(path1, &last);
+	n2 = read_dump(path2, &last);
+	unlink(path1);
+	unlink(path2);
+	if (n1 < 0 || n2 < 0)
+		return (1);
+
+	fprintf(stdout, "%ld packets pushed, %ld dropped, %ld + %ld written, "
+			"%ld warnings\n", published + dropped, dropped, n1, n2, warnings);
+	if (n1 + n2 != published || n1 < before_rotate) {
+		fprintf(stdout, "FAIL %ld packets published, %ld before rotation\n",
+				published, before_rotate);
+		return (1);
+	}
+	if ((dropped > 0) != (warnings > 0)) {
+		fprintf(stdout, "FAIL drops not reported\n");
+		return (1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2006 The RADclock Project (see AUTHORS file)
+ *
+ * This file is part of the radclock program.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Check of the batch conversions radclock_vcount_to_abstime_batch,
+ * radclock_vcount_to_abstime_ns_batch and radclock_duration_batch against
+ * the single value API, over counter values either side of the last update
+ * and of an expected leap second, with and without the local period. Also
+ * reports the cost per value of both.
+ *
+ * The SMS is set up on a private key (sms_fixture.h) and published with
+ * sms_write, with a counter driven by the test, so no daemon is needed.
+ *
+ * Usage: test_vcount_batch [values]
+ */
+
+#include "../config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "radclock.h"
+#include "radclock-private.h"
+#include "sms_fixture.h"
+
+#define FREQ		SMS_FIXTURE_FREQ
+#define UPDATE		SMS_FIXTURE_UPDATE
+
+
+static long double
+absdiff(long double a, long double b)
+{
+	return (a > b ? a - b : b - a);
+}
+
+
+/* Compare batch and single conversions, return number of failures */
+static int
+check(struct radclock *clock, vcounter_t *vcount, long double *abstime,
+		int64_t *abstime_ns, long double *duration, int n)
+{
+	long double single, maxdiff = 0, maxdiff_ns = 0, maxdiff_dur = 0;
+	long double above_ns = 0;
+	int i, ret, err = 0;
+
+	/* 250s before the update to 750s after, crossing the leap second. Off the
+	 * ns grid by 0, 1/3 or 2/3 ns to see the rounding. */
+	for (i = 0; i < n; i++)
+		vcount[i] = UPDATE - (vcounter_t) (250 * FREQ) + (vcounter_t) (i * (1000 * FREQ / n))
+			+ (vcounter_t) (i % 3);
+
+	ret = radclock_vcount_to_abstime_batch(clock, vcount, abstime, n);
+	if (ret != 3) {
+		fprintf(stdout, "FAIL: abstime batch returned %d, expected 3\n", ret);
+		err++;
+	}
+	ret = radclock_vcount_to_abstime_ns_batch(clock, vcount, abstime_ns, n);
+	if (ret != 3) {
+		fprintf(stdout, "FAIL: abstime ns batch returned %d, expected 3\n", ret);
+		err++;
+	}
+
+	for (i = 0; i < n; i++) {
+		radclock_vcount_to_abstime(clock, &vcount[i], &single);
+		if (absdiff(abstime[i], single) > maxdiff)
+			maxdiff = absdiff(abstime[i], single);
+		if (absdiff(abstime_ns[i] * 1e-9L, abstime[i]) > maxdiff_ns)
+			maxdiff_ns = absdiff(abstime_ns[i] * 1e-9L, abstime[i]);
+		/* Rounded down, also before last_changed */
+		if (abstime_ns[i] * 1e-9L - abstime[i] > above_ns)
+			above_ns = abstime_ns[i] * 1e-9L - abstime[i];
+	}
+
+	/* Durations to the next value, within the SKM scale of now */
+	sms_fixture_counter = vcount[n - 1];
+	ret = radclock_duration_batch(clock, vcount + n - 101, vcount + n - 100,
+			duration, 100);
+	if (ret == 1) {
+		fprintf(stdout, "FAIL: duration batch returned 1\n");
+		err++;
+	}
+	for (i = 0; i < 100; i++) {
+		radclock_duration(clock, &vcount[n - 101 + i], &vcount[n - 100 + i], &single);
+		if (absdiff(duration[i], single) > maxdiff_dur)
+			maxdiff_dur = absdiff(duration[i], single);
+	}
+	sms_fixture_counter = vcount[0] + (vcounter_t) (1100 * FREQ);
+	if (radclock_duration_batch(clock, vcount, vcount + 1, duration, 1) != 1) {
+		fprintf(stdout, "FAIL: duration batch out of SKM scale not detected\n");
+		err++;
+	}
+
+	fprintf(stdout, "Max difference to single API: abstime %.3Lg [s], ns %.3Lg [s], "
+			"duration %.3Lg [s]\n", maxdiff, maxdiff_ns, maxdiff_dur);
+	if (maxdiff > 1e-9L || maxdiff_ns > 1.01e-9L || maxdiff_dur > 1e-15L) {
+		fprintf(stdout, "FAIL: batch conversion does not match\n");
+		err++;
+	}
+	if (above_ns > 0.5e-9L) {
+		fprintf(stdout, "FAIL: ns batch rounds up by %.3Lg [s]\n", above_ns);
+		err++;
+	}
+	return (err);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct radclock *clock;
+	struct radclock_data rd;
+	struct radclock_error re;
+	radclock_local_period_t mode;
+	vcounter_t *vcount;
+	long double *abstime, single;
+	int64_t *abstime_ns;
+	long double *duration;
+	double t, ns_single, ns_batch;
+	long double sink = 0;
+	int i, n, err = 0;
+
+	n = (argc > 1) ? atoi(argv[1]) : 1000000;
+	if (n < 200) {
+		fprintf(stderr, "Usage: %s [values >= 200]\n", argv[0]);
+		return (1);
+	}
+
+	clock = sms_fixture_create();
+	if (clock == NULL)
+		return (SMS_FIXTURE_SKIP);
+	vcount = malloc(n * sizeof(vcounter_t));
+	abstime = malloc(n * sizeof(long double));
+	abstime_ns = malloc(n * sizeof(int64_t));
+	duration = malloc(n * sizeof(long double));
+	if (!vcount || !abstime || !abstime_ns || !duration)
+		return (1);
+	sms_fixture_data(&rd, &re, FREQ, UPDATE, 1.4e9);
+	sms_write(clock, &rd, &re);
+
+	/* The local period path of the library is noisy on stdout, check it on
+	 * fewer values */
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+	err += check(clock, vcount, abstime, abstime_ns, duration, n);
+	mode = RADCLOCK_LOCAL_PERIOD_ON;
+	radclock_set_local_period_mode(clock, &mode);
+	err += check(clock, vcount, abstime, abstime_ns, duration, 200);
+
+	/* Cost per value */
+	mode = RADCLOCK_LOCAL_PERIOD_OFF;
+	radclock_set_local_period_mode(clock, &mode);
+	t = sms_fixture_now();
+	for (i = 0; i < n; i++) {
+		radclock_vcount_to_abstime(clock, &vcount[i], &single);
+		sink += single;
+	}
+	ns_single = (sms_fixture_now() - t) * 1e9 / n;
+
+	t = sms_fixture_now();
+	radclock_vcount_to_abstime_batch(clock, vcount, abstime, n);
+	ns_batch = (sms_fixture_now() - t) * 1e9 / n;
+	sink += abstime[n - 1];
+
+	t = sms_fixture_now();
+	radclock_vcount_to_abstime_ns_batch(clock, vcount, abstime_ns, n);
+	fprintf(stdout, "Cost per value: single %.1f [ns], batch %.1f [ns], "
+			"batch int64 ns %.1f [ns] (sink %d)\n", ns_single, ns_batch,
+			(sms_fixture_now() - t) * 1e9 / n, sink > 0);
+
+	free(vcount);
+	free(abstime);
+	free(abstime_ns);
+	free(duration);
+	radclock_destroy(clock);
+
+	return (err ? 1 : 0);
+}